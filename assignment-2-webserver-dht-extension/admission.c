@@ -0,0 +1,135 @@
+#include "admission.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "chord_processor.h"
+#include "frame.h"
+#include "sockets_setup.h"
+#include "stream_sock.h"
+#include "timer_wheel.h"
+
+
+void admission_init(struct admission* admission, uint32_t target_ms) {
+    memset(admission, 0, sizeof(*admission));
+    admission->target_us = target_ms * 1000;
+    admission->interval_us = ADMISSION_INTERVAL_MS * 1000;
+}
+
+
+void admission_watch(const struct admission* admission, int sock) {
+    const int enable = 1;
+    if (admission->target_us > 0 && setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt");
+    }
+}
+
+
+/**
+ * How long the oldest data received on `sock` waited, in microseconds.
+ *
+ * Returns false if the data was received before timestamps were enabled, or there is no data but a closed connection.
+ */
+static bool waited(int sock, uint64_t* delay_us) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    if (recvmsg(sock, &message, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+        return false;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+            continue;
+        }
+        struct timespec received, now;
+        memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t delay_ns = (int64_t) (now.tv_sec - received.tv_sec) * 1000000000 + (now.tv_nsec - received.tv_nsec);
+        *delay_us = delay_ns > 0 ? (uint64_t) delay_ns / 1000 : 0;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * The time of the next shedding, sooner the more requests were shed in a row.
+ */
+static uint64_t next_shedding(const struct admission* admission, uint64_t now_us) {
+    return now_us + (uint64_t) (admission->interval_us / sqrt(admission->count));
+}
+
+
+/**
+ * Whether the request delayed by `delay_us` is shed, following the state machine of CoDel.
+ */
+static bool codel(struct admission* admission, uint64_t delay_us, uint64_t now_us) {
+    bool above = false;
+    if (delay_us < admission->target_us) {
+        admission->above_until_us = 0;
+    } else if (admission->above_until_us == 0) {
+        admission->above_until_us = now_us + admission->interval_us;
+    } else if (now_us >= admission->above_until_us) {
+        above = true;
+    }
+
+    if (admission->shedding) {
+        if (!above) {
+            admission->shedding = false;
+        } else if (now_us >= admission->shed_next_us) {
+            admission->count += 1;
+            admission->shed_next_us = next_shedding(admission, now_us);
+            return true;
+        }
+        return false;
+    }
+    if (above) {
+        // Shedding again soon after the last time, continue near the rate it ended with
+        bool recent = admission->count > 2 && now_us - admission->shed_next_us < 8 * (uint64_t) admission->interval_us;
+        admission->count = recent ? admission->count - 2 : 1;
+        admission->shedding = true;
+        admission->shed_next_us = next_shedding(admission, now_us);
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Answer the request at the front of `data` with a 503, in the protocol it is sent in.
+ */
+static void send_shed(struct connection_state* state, const char* data, size_t n, const struct chord_context* ctx) {
+    struct frame_head head;
+    if (n >= FRAME_HEAD_SIZE && frame_decode((const uint8_t*) data, &head)) {
+        uint8_t reply[FRAME_HEAD_SIZE];
+        frame_encode(&(struct frame_head) { .op = head.op, .status = 503, .id = head.id }, reply);
+        connection_write(state, (const char*) reply, sizeof(reply));
+        return;
+    }
+    char unavailable[HTTP_MAX_HEAD_SIZE];
+    int length = format_unavailable(unavailable, sizeof(unavailable), ctx, true);
+    connection_write(state, unavailable, length);
+}
+
+
+bool admission_shed(struct chord_context* ctx, struct connection_state* state) {
+    struct admission* admission = &ctx->admission;
+    // Only new requests are shed: not those partially received, streamed or answered already
+    if (admission->target_us == 0 || state->end != state->buffer || state->upload.active || state->lingering) {
+        return false;
+    }
+    if (!waited(state->sock, &admission->delay_us) || !codel(admission, admission->delay_us, monotonic_us())) {
+        return false;
+    }
+
+    ssize_t n = recv(state->sock, state->buffer, HTTP_MAX_SIZE, 0);
+    if (n > 0) {
+        send_shed(state, state->buffer, n, ctx);
+    }
+    admission->shed += 1;
+    return true;
+}
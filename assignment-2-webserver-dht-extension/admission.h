@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+
+#define ADMISSION_TARGET_MS 5       // default delay of requests before they are handled that is tolerated
+#define ADMISSION_INTERVAL_MS 100   // the delay must stay above the target this long before requests are shed
+
+struct chord_context;
+
+
+/**
+ * Admission control of new requests, after CoDel
+ *
+ * The delay of a request is the time from its arrival, as timestamped by the
+ * kernel, to the moment its connection is read: the time it waited in the
+ * socket and behind the work of the event loop. While the delay stays above
+ * `target_us` for a whole
+ * interval, new requests are shed: one at first, then more often, at
+ * intervals shrinking with the square root of the shed count. Once a request
+ * is handled within the target, shedding stops.
+ *
+ * A shed request is read, but not parsed, and answered with a 503 before its
+ * connection is closed, asking to retry once a lookup is expected to be answered. Requests already started, e.g. uploads, are never
+ * shed.
+ *
+ * `target_us`: tolerated delay, 0 disables admission control
+ * `above_until_us`: when the delay will have been above the target for an interval, 0 while below
+ * `shedding`: in the shedding state, the next request is shed at `shed_next_us`, `count` in this state
+ * `delay_us`: delay of the last request, `shed` requests shed, for the metrics
+ */
+struct admission {
+    uint32_t target_us;
+    uint32_t interval_us;
+    uint64_t above_until_us;
+    bool shedding;
+    uint64_t shed_next_us;
+    uint32_t count;
+    uint64_t delay_us;
+    uint64_t shed;
+};
+
+
+/**
+ * Start admitting every request, shedding once the delay exceeds `target_ms`; 0 disables shedding.
+ */
+void admission_init(struct admission* admission, uint32_t target_ms);
+
+/**
+ * Have the kernel timestamp the data received on the new connection `sock`, so the delay of its requests is known.
+ */
+void admission_watch(const struct admission* admission, int sock);
+
+/**
+ * Decide on the next request on the readable connection `state` and shed it if it is not admitted by `ctx->admission`.
+ *
+ * Returns true if it was shed, the connection has to be ended then, once the 503 is sent.
+ */
+bool admission_shed(struct chord_context* ctx, struct connection_state* state);
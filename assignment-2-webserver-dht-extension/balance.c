@@ -0,0 +1,499 @@
+#include "balance.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bulk.h"
+#include "chord_processor.h"
+#include "data.h"
+#include "successors.h"
+#include "util.h"
+
+
+/**
+ * Pairs handed over to the predecessor in a bulk load
+ *
+ * `from`, `to`: the ring interval handed over
+ * `records`: the encoded pairs, `length` of `capacity` bytes
+ * `keys`: their keys, `n_keys`, deleted here once the predecessor stored them
+ */
+struct handover {
+    struct chord_context* ctx;
+    uint16_t from;
+    uint16_t to;
+    char* records;
+    size_t length;
+    size_t capacity;
+    char** keys;
+    size_t n_keys;
+};
+
+
+static void handover_free(struct handover* handover) {
+    for (size_t i = 0; i < handover->n_keys; i += 1) {
+        free(handover->keys[i]);
+    }
+    free(handover->keys);
+    free(handover->records);
+    free(handover);
+}
+
+
+/**
+ * Add a pair to a handover in the format of a bulk load.
+ */
+static bool handover_add(const struct tuple* tuple, void* arg) {
+    struct handover* handover = arg;
+    struct NetworkNodes node = handover->ctx->own_node;
+    if (is_responsible_hashed(tuple->ring_pos, node.self_id, node.pred.id)) {
+        return true;  // the predecessor moved back meanwhile, e.g. failed over
+    }
+    size_t value_length;
+    const char* value = tuple_value(&handover->ctx->store, tuple, &value_length);
+    size_t key_length = strlen(tuple->key);
+    size_t record_length = BULK_RECORD_HEAD + key_length + value_length;
+    if (!value || key_length > BULK_MAX_KEY) {
+        return true;
+    }
+
+    if (handover->length + record_length > handover->capacity) {
+        size_t capacity = handover->capacity ? handover->capacity : BULK_FORWARD_BATCH;
+        while (capacity < handover->length + record_length) {
+            capacity *= 2;
+        }
+        char* records = realloc(handover->records, capacity);
+        if (!records) {
+            return false;
+        }
+        handover->records = records;
+        handover->capacity = capacity;
+    }
+    char** keys = realloc(handover->keys, (handover->n_keys + 1) * sizeof(char*));
+    if (!keys) {
+        return false;
+    }
+    handover->keys = keys;
+    if (!(handover->keys[handover->n_keys] = strdup(tuple->key))) {
+        return false;
+    }
+    handover->n_keys += 1;
+
+    uint8_t* head = (uint8_t*) handover->records + handover->length;
+    head[0] = key_length >> 8;
+    head[1] = key_length;
+    head[2] = value_length >> 24;
+    head[3] = value_length >> 16;
+    head[4] = value_length >> 8;
+    head[5] = value_length;
+    memcpy(head + BULK_RECORD_HEAD, tuple->key, key_length);
+    memcpy(head + BULK_RECORD_HEAD + key_length, value, value_length);
+    handover->length += record_length;
+    return true;
+}
+
+
+static void hand_over(struct chord_context* ctx, uint16_t from, uint16_t to);
+
+
+/**
+ * HANDOVER RETRY: Hands the keys left behind by failed handovers over again.
+ *
+ * @param arg The chord_context of the node.
+ */
+static void handover_retry(void* arg) {
+    struct chord_context* ctx = arg;
+    ctx->balance.stranded = false;
+    hand_over(ctx, ctx->balance.stranded_from, ctx->balance.stranded_to);
+}
+
+
+/**
+ * Remember that the keys of the interval (`from`, `to`] were not handed over, and try again later.
+ *
+ * Intervals follow each other as the predecessor moves forward, a new one extends the interval still to be handed over.
+ */
+static void strand(struct chord_context* ctx, uint16_t from, uint16_t to) {
+    struct load_balance* balance = &ctx->balance;
+    if (!balance->stranded) {
+        balance->stranded = true;
+        balance->stranded_from = from;
+    }
+    balance->stranded_to = to;
+    if (!timer_pending(&balance->handover_retry)) {
+        timer_schedule(&ctx->wheel, &balance->handover_retry, HANDOVER_RETRY_MS, handover_retry, ctx);
+    }
+}
+
+
+/**
+ * Drop the handed over pairs once the predecessor stored all of them; otherwise they are handed over again later.
+ */
+static void handover_done(void* arg, const struct response* response) {
+    struct handover* handover = arg;
+    struct chord_context* ctx = handover->ctx;
+    const char* report = response && response->status == 200 ? memstr(response->payload, response->payload_length, "failed ") : NULL;
+    if (report && strtoul(report + strlen("failed "), NULL, 10) == 0) {
+        for (size_t i = 0; i < handover->n_keys; i += 1) {
+            delete(&ctx->store, handover->keys[i]);
+        }
+        ctx->balance.migrated += handover->n_keys;
+    } else {
+        fprintf(stderr, "Handover of %zu keys to the predecessor failed\n", handover->n_keys);
+        strand(ctx, handover->from, handover->to);
+    }
+    handover_free(handover);
+}
+
+
+/**
+ * Hand the keys of the interval (`from`, `to`] over to the predecessor, which is responsible for them now.
+ */
+static void hand_over(struct chord_context* ctx, uint16_t from, uint16_t to) {
+    struct handover* handover = calloc(1, sizeof(*handover));
+    if (!handover) {
+        strand(ctx, from, to);
+        return;
+    }
+    handover->ctx = ctx;
+    handover->from = from;
+    handover->to = to;
+    store_range(&ctx->store, from, to, handover_add, handover);
+    if (handover->n_keys == 0) {
+        handover_free(handover);
+        return;
+    }
+
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\n%s: %zu\r\n%s: 1\r\nContent-Length: %zu\r\n\r\n",
+                               BULK_URI, BULK_COUNT_HEADER, handover->n_keys, BULK_HANDOVER_HEADER, handover->length);
+    char* request = malloc(head_length + handover->length);
+    if (!request) {
+        strand(ctx, from, to);
+        handover_free(handover);
+        return;
+    }
+    memcpy(request, head, head_length);
+    memcpy(request + head_length, handover->records, handover->length);
+
+    struct sockaddr_in pred = { .sin_family = AF_INET, .sin_addr = ctx->own_node.pred.ip, .sin_port = htons(ctx->own_node.pred.port) };
+    if (!peer_pool_request(&ctx->peers, pred, request, head_length + handover->length, handover_done, handover)) {
+        fprintf(stderr, "Handover of %zu keys to the predecessor failed\n", handover->n_keys);
+        strand(ctx, from, to);
+        handover_free(handover);
+    }
+}
+
+
+/**
+ * Whether `key_hash` lies in the interval this node moved over and still awaits the keys of.
+ */
+static bool is_taking(const struct load_balance* balance, uint16_t key_hash) {
+    return balance->taking && monotonic_ms() < balance->taking_until &&
+           is_responsible_hashed(key_hash, balance->taking_to, balance->taking_from);
+}
+
+
+/**
+ * Stop awaiting the keys moved over, no handover arrived for `HANDOVER_AWAIT_MS`.
+ */
+static void forget_taken(struct load_balance* balance) {
+    for (size_t i = 0; i < balance->n_deleted; i += 1) {
+        free(balance->deleted[i]);
+    }
+    free(balance->deleted);
+    balance->deleted = NULL;
+    balance->n_deleted = 0;
+    balance->taking = false;
+}
+
+
+/**
+ * Await the keys of the interval (`from`, `to`] this node moved over; it follows an interval still awaited.
+ */
+static void take_over(struct load_balance* balance, uint16_t from, uint16_t to) {
+    if (!balance->taking) {
+        balance->taking = true;
+        balance->taking_from = from;
+    }
+    balance->taking_to = to;
+    balance->taken = false;
+    balance->taking_until = monotonic_ms() + HANDOVER_AWAIT_MS;
+}
+
+
+static bool was_deleted(const struct load_balance* balance, const char* key) {
+    for (size_t i = 0; i < balance->n_deleted; i += 1) {
+        if (strcmp(balance->deleted[i], key) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool balance_awaited(struct chord_context* ctx, const string key) {
+    return !ctx->balance.taken && is_taking(&ctx->balance, hash(key));
+}
+
+
+void balance_deleted(struct chord_context* ctx, const string key) {
+    struct load_balance* balance = &ctx->balance;
+    if (!is_taking(balance, hash(key)) || was_deleted(balance, key)) {
+        return;
+    }
+    char** deleted = realloc(balance->deleted, (balance->n_deleted + 1) * sizeof(char*));
+    if (!deleted) {
+        return;
+    }
+    balance->deleted = deleted;
+    if ((deleted[balance->n_deleted] = strdup(key))) {
+        balance->n_deleted += 1;
+    }
+}
+
+
+bool balance_superseded(struct chord_context* ctx, const string key) {
+    return get_tuple(&ctx->store, key) || (is_taking(&ctx->balance, hash(key)) && was_deleted(&ctx->balance, key));
+}
+
+
+void balance_handover_received(struct chord_context* ctx) {
+    struct load_balance* balance = &ctx->balance;
+    if (balance->taking) {
+        balance->taken = true;
+        balance->taking_until = monotonic_ms() + HANDOVER_AWAIT_MS;
+    }
+}
+
+
+/**
+ * Visitor finding the ring position below which half of the keys lie
+ */
+struct split {
+    size_t remaining;
+    uint16_t position;
+};
+
+static bool find_split(const struct tuple* tuple, void* arg) {
+    struct split* split = arg;
+    split->position = tuple->ring_pos;
+    split->remaining -= 1;
+    return split->remaining > 0;
+}
+
+
+/**
+ * Ask the predecessor to move its ID to `moving_to`.
+ */
+static void send_move(struct chord_context* ctx) {
+    char move[MOVE_SIZE];
+    struct NodeInfo self = node_self(ctx);
+    uint16_t to = htons(ctx->balance.moving_to);
+    move[0] = DHT_MOVE_TYPE;
+    node_encode(move + 1, &self);
+    memcpy(move + 1 + SUCCESSOR_ENTRY_SIZE, &to, 2);
+    node_send(ctx, &ctx->own_node.pred, move, sizeof(move));
+}
+
+
+/**
+ * MOVE RETRY: Asks the predecessor to move again while it did not answer, until the move is given up.
+ *
+ * @param arg The chord_context of the node.
+ */
+static void move_retry(void* arg) {
+    struct chord_context* ctx = arg;
+    struct load_balance* balance = &ctx->balance;
+    if (!balance->moving || monotonic_ms() - balance->moving_since > MIGRATE_TIMEOUT_MS) {
+        balance->moving = false;
+        return;
+    }
+    send_move(ctx);
+    timer_schedule(&ctx->wheel, &balance->move_retry, MOVE_RETRY_MS, move_retry, ctx);
+}
+
+
+/**
+ * Ask the predecessor to move its ID to the middle of this node's keys, if this node is overloaded compared to it.
+ */
+static void consider_move(struct chord_context* ctx, uint64_t now) {
+    struct load_balance* balance = &ctx->balance;
+    struct NetworkNodes node = ctx->own_node;
+    if (balance->moving && now - balance->moving_since > MIGRATE_TIMEOUT_MS) {
+        balance->moving = false;
+    }
+    if (balance->moving || now < balance->cooldown_until || node.pred.port == 0 ||
+            now - balance->pred.heard_at > 2 * LOAD_INTERVAL_MS ||
+            balance->rps < LOAD_MIN_RPS || balance->rps < LOAD_IMBALANCE * (uint64_t) balance->pred.rps) {
+        return;
+    }
+
+    size_t keys = store_range(&ctx->store, node.pred.id, node.self_id, NULL, NULL);
+    if (keys < 2) {
+        return;
+    }
+    struct split split = { .remaining = keys / 2 < MIGRATE_MAX_KEYS ? keys / 2 : MIGRATE_MAX_KEYS };
+    store_range(&ctx->store, node.pred.id, node.self_id, find_split, &split);
+    if (split.position == node.self_id) {
+        return;  // the keys are all at this node's position
+    }
+
+    balance->moving = true;
+    balance->moving_from = node.pred.id;
+    balance->moving_to = split.position;
+    balance->moving_since = now;
+    send_move(ctx);
+    timer_schedule(&ctx->wheel, &balance->move_retry, MOVE_RETRY_MS, move_retry, ctx);
+    fprintf(stderr, "Handling %u requests/s, predecessor %u: asking it to move to %u\n", balance->rps, balance->pred.rps, split.position);
+}
+
+
+/**
+ * LOAD SUMMARY: Sends the load of this node to its successor, and balances it with the predecessor if needed.
+ *
+ * @param arg The chord_context of the node.
+ */
+static void load_summary(void* arg) {
+    struct chord_context* ctx = arg;
+    struct load_balance* balance = &ctx->balance;
+    uint64_t now = monotonic_ms();
+    balance->rps = (ctx->hotkeys.requests - balance->requests) * 1000 / LOAD_INTERVAL_MS;
+    balance->requests = ctx->hotkeys.requests;
+
+    char summary[LOAD_SIZE];
+    struct NodeInfo self = node_self(ctx);
+    uint32_t rps = htonl(balance->rps);
+    uint32_t bytes[2] = { htonl(ctx->store.memory >> 32), htonl(ctx->store.memory) };
+    summary[0] = DHT_LOAD_TYPE;
+    node_encode(summary + 1, &self);
+    memcpy(summary + 1 + SUCCESSOR_ENTRY_SIZE, &rps, 4);
+    memcpy(summary + 1 + SUCCESSOR_ENTRY_SIZE + 4, bytes, 8);
+    if (ctx->own_node.succ.port != 0) {
+        node_send(ctx, &ctx->own_node.succ, summary, sizeof(summary));
+    }
+
+    consider_move(ctx, now);
+    if (balance->taking && now >= balance->taking_until) {
+        forget_taken(balance);
+    }
+    timer_schedule(&ctx->wheel, &balance->summary, LOAD_INTERVAL_MS, load_summary, ctx);
+}
+
+
+void balance_init(struct chord_context* ctx, bool enabled) {
+    struct load_balance* balance = &ctx->balance;
+    memset(balance, 0, sizeof(*balance));
+    balance->enabled = enabled;
+    if (enabled) {
+        timer_schedule(&ctx->wheel, &balance->summary, LOAD_INTERVAL_MS, load_summary, ctx);
+    }
+}
+
+
+bool is_balance_datagram(const char* buffer, size_t length) {
+    uint8_t type = length > 0 ? (uint8_t) buffer[0] : 0;
+    return type == DHT_LOAD_TYPE || type == DHT_MOVE_TYPE || type == DHT_MOVED_TYPE;
+}
+
+
+/**
+ * Tell the successor `sender` that this node moved to `to`.
+ */
+static void send_moved(struct chord_context* ctx, const struct NodeInfo* sender, uint16_t to) {
+    char moved[MOVE_SIZE];
+    struct NodeInfo self = node_self(ctx);
+    uint16_t to_net = htons(to);
+    moved[0] = DHT_MOVED_TYPE;
+    node_encode(moved + 1, &self);
+    memcpy(moved + 1 + SUCCESSOR_ENTRY_SIZE, &to_net, 2);
+    node_send(ctx, sender, moved, sizeof(moved));
+}
+
+
+/**
+ * Move the ID of this node forward as asked by its successor, taking over part of its range.
+ *
+ * A request repeated because the answer was lost is answered again.
+ */
+static bool move_asked(struct chord_context* ctx, const struct NodeInfo* sender, uint16_t to) {
+    struct NetworkNodes* node = &ctx->own_node;
+    if (node_same(sender, &node->succ) && to == node->self_id) {
+        send_moved(ctx, sender, to);
+        return false;
+    }
+    // only the successor can hand over its range, and only forward, between both nodes
+    if (!node_same(sender, &node->succ) || to == node->succ.id || !is_responsible_hashed(to, node->succ.id, node->self_id)) {
+        return false;
+    }
+    fprintf(stderr, "Moving from %u to %u for successor %u\n", node->self_id, to, node->succ.id);
+    take_over(&ctx->balance, node->self_id, to);
+    node->self_id = to;
+    ctx->pending_lookups.own_node.self_id = to;
+    send_moved(ctx, sender, to);
+    return true;
+}
+
+
+void balance_pred_moved(struct chord_context* ctx, uint16_t from, uint16_t to) {
+    struct load_balance* balance = &ctx->balance;
+    struct NetworkNodes* node = &ctx->own_node;
+    node->pred.id = to;
+    ctx->pending_lookups.own_node.pred.id = to;
+    // only a move forward, into this node's range, hands keys over
+    if (to == from || to == node->self_id || !is_responsible_hashed(to, node->self_id, from)) {
+        return;
+    }
+    if (balance->moving && to == balance->moving_to) {
+        balance->moving = false;
+        balance->migrations += 1;
+        balance->cooldown_until = monotonic_ms() + MIGRATE_COOLDOWN_MS;
+        timer_cancel(&balance->move_retry);
+    }
+    hand_over(ctx, from, to);
+}
+
+
+/**
+ * Take the new ID of the predecessor, and hand the keys it took over to it.
+ *
+ * A move learned from a heartbeat before is not handed over twice.
+ */
+static bool moved(struct chord_context* ctx, const struct NodeInfo* sender, uint16_t to) {
+    struct load_balance* balance = &ctx->balance;
+    if (!balance->moving || !node_same(sender, &ctx->own_node.pred) || to != balance->moving_to) {
+        return false;
+    }
+    balance_pred_moved(ctx, balance->moving_from, to);
+    return true;
+}
+
+
+bool balance_datagram(struct chord_context* ctx, const char* buffer, size_t length) {
+    uint8_t type = buffer[0];
+    size_t expected = type == DHT_LOAD_TYPE ? LOAD_SIZE : MOVE_SIZE;
+    if (length != expected || !ctx->balance.enabled) {
+        return false;
+    }
+    struct NodeInfo sender = node_decode(buffer + 1);
+
+    if (type == DHT_LOAD_TYPE) {
+        if (node_same(&sender, &ctx->own_node.pred)) {
+            uint32_t rps, bytes[2];
+            memcpy(&rps, buffer + 1 + SUCCESSOR_ENTRY_SIZE, 4);
+            memcpy(bytes, buffer + 1 + SUCCESSOR_ENTRY_SIZE + 4, 8);
+            ctx->balance.pred = (struct neighbour_load) {
+                .rps = ntohl(rps),
+                .bytes = (uint64_t) ntohl(bytes[0]) << 32 | ntohl(bytes[1]),
+                .heard_at = monotonic_ms(),
+            };
+        }
+        return false;
+    }
+
+    uint16_t to;
+    memcpy(&to, buffer + 1 + SUCCESSOR_ENTRY_SIZE, 2);
+    to = ntohs(to);
+    return type == DHT_MOVE_TYPE ? move_asked(ctx, &sender, to) : moved(ctx, &sender, to);
+}
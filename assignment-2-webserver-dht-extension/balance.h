@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "node.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+#define DHT_LOAD_TYPE 0x40       // first byte of a load summary sent to the successor
+#define DHT_MOVE_TYPE 0x41       // first byte of a request to the predecessor to move its ID forward
+#define DHT_MOVED_TYPE 0x42      // first byte of the answer, once the predecessor moved
+#define LOAD_SIZE 21             // type, sender, requests per second and bytes stored
+#define MOVE_SIZE 11             // type, sender and the new ID
+#define LOAD_INTERVAL_MS 1000    // load summaries are sent this often
+#define LOAD_MIN_RPS 200         // requests per second before a node considers itself overloaded
+#define LOAD_IMBALANCE 2         // ... and only if its predecessor handles this many times fewer
+#define MIGRATE_MAX_KEYS 4096    // keys handed over at once
+#define MIGRATE_TIMEOUT_MS 5000  // a move not answered by then is given up
+#define MOVE_RETRY_MS 200        // a move not answered is asked again this often, datagrams may be lost
+#define HANDOVER_RETRY_MS 1000   // keys the predecessor did not take are handed over again this often
+#define MIGRATE_COOLDOWN_MS 10000  // pause after a handover, so the load summaries catch up before the next one
+#define HANDOVER_AWAIT_MS 30000  // keys taken over by a move are awaited this long after the move or the last handover
+
+struct chord_context;
+
+
+/**
+ * Load of a neighbour, from its last summary
+ */
+struct neighbour_load {
+    uint32_t rps;
+    uint64_t bytes;
+    uint64_t heard_at;
+};
+
+/**
+ * Balancing the load of neighbouring nodes by moving their IDs
+ *
+ * Every node sends a summary of its load to its successor once per
+ * `LOAD_INTERVAL_MS`, the node that may hand over keys to it. A node handling many more requests than its
+ * predecessor asks it to move its ID forward to the middle of this node's
+ * keys. Once it moved, the keys in between are handed over in a bulk load.
+ * The request is repeated until the predecessor answers; if its answer is
+ * lost, the next heartbeat of the predecessor shows its new ID and starts the
+ * handover all the same. Keys the predecessor did not take are handed over
+ * again until it does, so none stay behind at a node not responsible for them.
+ * Keys are the measure, requests per key are not known for every key.
+ *
+ * The predecessor serves its new keys before they are handed over. Until the
+ * first handover arrives, keys it does not have yet are answered with 503.
+ * Handed over values are older than those put or deleted at the predecessor
+ * since the move, so they are only stored for keys it neither holds nor
+ * deleted meanwhile, also when a handover is repeated.
+ *
+ * `enabled`: summaries are sent and IDs are moved; with the heartbeats, unless NO_STABILIZE is set
+ * `requests`: requests counted up to the last summary, `rps` requests per second since the one before
+ * `pred`: load of the predecessor
+ * `moving_to`: the ID the predecessor was asked to move to, `moving_from` its ID before; `moving` while unanswered
+ * `cooldown_until`: no move is requested before
+ * `stranded`: keys of the interval (`stranded_from`, `stranded_to`] are still to be handed over, retried by `handover_retry`
+ * `migrated`: keys handed over to the predecessor, `migrations` handovers, counted for the metrics
+ * `taking`: this node moved over the interval (`taking_from`, `taking_to`] and awaits its keys until `taking_until`;
+ *           `taken` once a handover arrived
+ * `deleted`: keys of that interval deleted here since, `n_deleted` of them
+ */
+struct load_balance {
+    bool enabled;
+    uint64_t requests;
+    uint32_t rps;
+    struct neighbour_load pred;
+    bool moving;
+    uint16_t moving_from;
+    uint16_t moving_to;
+    uint64_t moving_since;
+    uint64_t cooldown_until;
+    bool stranded;
+    uint16_t stranded_from;
+    uint16_t stranded_to;
+    uint64_t migrated;
+    uint64_t migrations;
+    bool taking;
+    bool taken;
+    uint16_t taking_from;
+    uint16_t taking_to;
+    uint64_t taking_until;
+    char** deleted;
+    size_t n_deleted;
+    struct timer summary;
+    struct timer move_retry;
+    struct timer handover_retry;
+};
+
+
+/**
+ * Start sending load summaries if `enabled`.
+ */
+void balance_init(struct chord_context* ctx, bool enabled);
+
+/**
+ * Take the ID the predecessor moved to from `from`, as learned by its heartbeat; the keys it moved over are handed to it.
+ */
+void balance_pred_moved(struct chord_context* ctx, uint16_t from, uint16_t to);
+
+/**
+ * Whether `key` was moved over by this node and may still be handed over to it, as no handover arrived yet.
+ */
+bool balance_awaited(struct chord_context* ctx, const string key);
+
+/**
+ * Remember that `key` was deleted, if it was moved over by this node, so a handover does not bring it back.
+ */
+void balance_deleted(struct chord_context* ctx, const string key);
+
+/**
+ * Whether a handed over value of `key` is older than what this node has: it holds the key, or deleted it since the move.
+ */
+bool balance_superseded(struct chord_context* ctx, const string key);
+
+/**
+ * Note that a handover arrived, the keys moved over are stored then.
+ */
+void balance_handover_received(struct chord_context* ctx);
+
+/**
+ * Whether a datagram of `length` bytes is a load summary or part of a move.
+ */
+bool is_balance_datagram(const char* buffer, size_t length);
+
+/**
+ * Take a load summary, or answer or take part of a move.
+ *
+ * Returns true if the neighbours of this node changed.
+ */
+bool balance_datagram(struct chord_context* ctx, const char* buffer, size_t length);
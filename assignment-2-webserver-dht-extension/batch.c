@@ -0,0 +1,443 @@
+#include "batch.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "data.h"
+#include "node.h"
+#include "peer_pool.h"
+#include "sockets_setup.h"
+#include "stream_sock.h"
+#include "util.h"
+
+
+bool is_batch_request(const struct request* request) {
+    return strcmp(request->method, "POST") == 0 && strcmp(request->uri, BATCH_URI) == 0;
+}
+
+
+/**
+ * Finish a key with `status` and a copy of `value`, or with 503 if the copy cannot be allocated.
+ */
+static void item_done(struct batch* batch, struct batch_item* item, int status, const char* value, size_t value_length) {
+    item->state = ITEM_DONE;
+    item->status = status;
+    if (value) {
+        item->value = malloc(value_length ? value_length : 1);
+        if (item->value) {
+            memcpy(item->value, value, value_length);
+            item->value_length = value_length;
+        } else {
+            item->status = 503;
+        }
+    }
+    batch->n_pending -= 1;
+}
+
+
+/**
+ * Answer a key from the local store.
+ */
+static void item_local(struct batch* batch, struct batch_item* item) {
+    size_t value_length;
+    const char* value = get(&batch->ctx->store, item->key, &value_length);
+    if (value) {
+        item_done(batch, item, 200, value, value_length);
+    } else {
+        item_done(batch, item, balance_awaited(batch->ctx, item->key) ? 503 : 404, NULL, 0);
+    }
+}
+
+
+static void group_free(struct batch_group* group) {
+    free(group->items);
+    free(group);
+}
+
+
+/**
+ * Unlink a group from its batch.
+ */
+static void group_remove(struct batch_group* group) {
+    struct batch_group** link = &group->batch->groups;
+    while (*link != group) {
+        link = &(*link)->next;
+    }
+    *link = group->next;
+}
+
+
+/**
+ * Parse the frame of one key from a batch reply, advancing `pos` behind it.
+ */
+static bool parse_frame(const char** pos, const char* end, struct batch* batch, struct batch_item* item) {
+    const char* line_end = memstr((char*) *pos, end - *pos, "\r\n");
+    if (!line_end) {
+        return false;
+    }
+
+    int status;
+    size_t value_length;
+    int key_offset;
+    if (sscanf(*pos, "%d %zu %n", &status, &value_length, &key_offset) != 2
+            || (size_t) (line_end - *pos - key_offset) != strlen(item->key)
+            || strncmp(*pos + key_offset, item->key, strlen(item->key)) != 0) {
+        return false;
+    }
+    const char* value = line_end + 2;
+    if (value_length > (size_t) (end - value) || (size_t) (end - value) - value_length < 2
+            || memcmp(value + value_length, "\r\n", 2) != 0) {
+        return false;
+    }
+
+    item_done(batch, item, status, status == 200 ? value : NULL, value_length);
+    *pos = value + value_length + 2;
+    return true;
+}
+
+
+static void batch_complete(struct batch* batch);
+
+
+/**
+ * GROUP DONE: Takes the reply of another node to the keys of a group.
+ *
+ * Keys the reply does not answer properly are reported as 502.
+ *
+ * @param arg The batch_group.
+ * @param response The response of the other node, NULL if the request failed.
+ */
+static void group_done(void* arg, const struct response* response) {
+    struct batch_group* group = arg;
+    struct batch* batch = group->batch;
+
+    const char* pos = response ? response->payload : NULL;
+    const char* end = response ? response->payload + response->payload_length : NULL;
+    bool valid = response && response->status == 200;
+    for (size_t i = 0; i < group->n_items; i += 1) {
+        struct batch_item* item = &batch->items[group->items[i]];
+        valid = valid && parse_frame(&pos, end, batch, item);
+        if (!valid) {
+            item_done(batch, item, 502, NULL, 0);
+        }
+    }
+
+    group_remove(group);
+    group_free(group);
+    if (batch->n_pending == 0) {
+        batch_complete(batch);
+    }
+}
+
+
+/**
+ * Build the request of a group, forwarding its keys to the responsible node.
+ */
+static char* group_request(const struct batch_group* group, size_t* request_length) {
+    struct batch* batch = group->batch;
+    size_t payload_length = 0;
+    for (size_t i = 0; i < group->n_items; i += 1) {
+        payload_length += strlen(batch->items[group->items[i]].key) + 1;
+    }
+
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\n%s: 1\r\nContent-Length: %zu\r\n\r\n",
+                               BATCH_URI, BATCH_FORWARDED_HEADER, payload_length);
+
+    char* request = malloc(head_length + payload_length);
+    if (!request) {
+        return NULL;
+    }
+    memcpy(request, head, head_length);
+    char* pos = request + head_length;
+    for (size_t i = 0; i < group->n_items; i += 1) {
+        const string key = batch->items[group->items[i]].key;
+        memcpy(pos, key, strlen(key));
+        pos += strlen(key);
+        *pos++ = '\n';
+    }
+    *request_length = head_length + payload_length;
+    return request;
+}
+
+
+/**
+ * Add a key to the group of its responsible node, creating the group if needed.
+ *
+ * Returns false if memory is exhausted.
+ */
+static bool group_add(struct batch_group** groups, struct batch* batch, struct sockaddr_in owner, size_t index) {
+    struct batch_group* group = *groups;
+    while (group && (group->addr.sin_addr.s_addr != owner.sin_addr.s_addr || group->addr.sin_port != owner.sin_port)) {
+        group = group->next;
+    }
+    if (!group) {
+        group = calloc(1, sizeof(*group));
+        if (!group) {
+            return false;
+        }
+        group->batch = batch;
+        group->addr = owner;
+        group->next = *groups;
+        *groups = group;
+    }
+
+    if (group->n_items == group->capacity) {
+        size_t capacity = group->capacity ? group->capacity * 2 : 16;
+        size_t* items = realloc(group->items, capacity * sizeof(size_t));
+        if (!items) {
+            return false;
+        }
+        group->items = items;
+        group->capacity = capacity;
+    }
+    group->items[group->n_items++] = index;
+    return true;
+}
+
+
+/**
+ * Request all keys with a known responsible node, and look up the others.
+ *
+ * Keys are grouped by node, so every node involved gets a single request.
+ */
+static void batch_dispatch(struct batch* batch) {
+    struct chord_context* ctx = batch->ctx;
+    struct batch_group* groups = NULL;
+
+    for (size_t i = 0; i < batch->n_items; i += 1) {
+        struct batch_item* item = &batch->items[i];
+        if (item->state != ITEM_UNROUTED) {
+            continue;
+        }
+
+        struct sockaddr_in owner;
+        if (!route_key(ctx, item->hash, &owner)) {
+            start_lookup(&ctx->pending_lookups, item->hash);
+        } else if (group_add(&groups, batch, owner, i)) {
+            item->state = ITEM_IN_FLIGHT;
+        } else {
+            item_done(batch, item, 503, NULL, 0);
+        }
+    }
+
+    while (groups) {
+        struct batch_group* group = groups;
+        groups = group->next;
+
+        size_t request_length;
+        char* request = group_request(group, &request_length);
+        if (request && peer_pool_request(&ctx->peers, group->addr, request, request_length, group_done, group)) {
+            group->next = batch->groups;
+            batch->groups = group;
+        } else {
+            // No connection available, the client may retry these keys
+            for (size_t i = 0; i < group->n_items; i += 1) {
+                item_done(batch, &batch->items[group->items[i]], 503, NULL, 0);
+            }
+            group_free(group);
+        }
+    }
+}
+
+
+/**
+ * Send the combined reply of a batch with every key in request order, or 503 if it cannot be allocated.
+ *
+ * Returns false if it could not be sent.
+ */
+static bool batch_respond(struct batch* batch) {
+    size_t payload_length = 0;
+    for (size_t i = 0; i < batch->n_items; i += 1) {
+        const struct batch_item* item = &batch->items[i];
+        payload_length += snprintf(NULL, 0, "%d %zu %s\r\n", item->status, item->value_length, item->key) + item->value_length + 2;
+    }
+
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", payload_length);
+    char* reply = malloc(head_length + payload_length + 1);
+    if (!reply) {
+        const string unavailable = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+        connection_write(batch->conn, unavailable, strlen(unavailable));
+        return false;
+    }
+
+    memcpy(reply, head, head_length);
+    char* pos = reply + head_length;
+    for (size_t i = 0; i < batch->n_items; i += 1) {
+        const struct batch_item* item = &batch->items[i];
+        pos += sprintf(pos, "%d %zu %s\r\n", item->status, item->value_length, item->key);
+        if (item->value_length) {
+            memcpy(pos, item->value, item->value_length);
+            pos += item->value_length;
+        }
+        memcpy(pos, "\r\n", 2);
+        pos += 2;
+    }
+
+    bool sent = connection_write(batch->conn, reply, pos - reply);
+    if (!sent) {
+        perror("send");
+    }
+    free(reply);
+    return sent;
+}
+
+
+static void batch_free(struct batch* batch) {
+    timer_cancel(&batch->deadline);
+    while (batch->groups) {
+        struct batch_group* group = batch->groups;
+        batch->groups = group->next;
+        peer_pool_cancel(&batch->ctx->peers, group);
+        group_free(group);
+    }
+    for (size_t i = 0; i < batch->n_items; i += 1) {
+        free(batch->items[i].value);
+    }
+    free(batch->items);
+    free(batch->keys);
+    free(batch);
+}
+
+
+/**
+ * Answer a batch that waited for other nodes, and continue with the next request of its connection.
+ */
+static void batch_complete(struct batch* batch) {
+    struct connection_state* state = batch->conn;
+    struct chord_context* ctx = batch->ctx;
+    bool keep_alive = batch_respond(batch) && !batch->close_after;
+
+    state->batch = NULL;
+    state->paused = false;
+    batch_free(batch);
+
+    if (keep_alive) {
+        connection_resume(state, ctx);
+    } else {
+        connection_end(state);
+    }
+}
+
+
+/**
+ * BATCH DEADLINE: Answers a batch with the keys received so far.
+ *
+ * Keys whose node is still unknown are reported as 503, keys requested but not answered as 504.
+ *
+ * @param arg The batch.
+ */
+static void batch_deadline(void* arg) {
+    struct batch* batch = arg;
+    for (size_t i = 0; i < batch->n_items; i += 1) {
+        struct batch_item* item = &batch->items[i];
+        if (item->state != ITEM_DONE) {
+            item_done(batch, item, item->state == ITEM_UNROUTED ? 503 : 504, NULL, 0);
+        }
+    }
+    batch_complete(batch);
+}
+
+
+/**
+ * Split the payload of a batch request into its keys, one per line.
+ *
+ * Returns 0, or the status to answer the batch with: 413 if there are too many keys, 503 if they cannot be allocated.
+ */
+static int batch_parse_keys(struct batch* batch, bool forwarded) {
+    struct NetworkNodes node = batch->ctx->own_node;
+    size_t capacity = 16;
+    batch->items = malloc(capacity * sizeof(struct batch_item));
+    if (!batch->items) {
+        return 503;
+    }
+
+    for (char* line = strtok(batch->keys, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        if (batch->n_items == BATCH_MAX_KEYS) {
+            return 413;
+        }
+        if (batch->n_items == capacity) {
+            struct batch_item* items = realloc(batch->items, capacity * 2 * sizeof(struct batch_item));
+            if (!items) {
+                return 503;
+            }
+            batch->items = items;
+            capacity *= 2;
+        }
+        struct batch_item* item = &batch->items[batch->n_items++];
+        *item = (struct batch_item) {
+            .key = line,
+            .hash = hash(line),
+            .state = ITEM_UNROUTED,
+        };
+        batch->n_pending += 1;
+
+        if (is_responsible_hashed(item->hash, node.self_id, node.pred.id)) {
+            item_local(batch, item);
+        } else if (forwarded) {
+            // Forwarded batches are never forwarded again, this prevents loops on stale routes
+            item_done(batch, item, 503, NULL, 0);
+        }
+    }
+    return 0;
+}
+
+
+bool batch_start(struct connection_state* state, const char* keys, size_t length, bool forwarded, bool close_after, struct chord_context* ctx) {
+    const string unavailable = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+    struct batch* batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        return connection_write(state, unavailable, strlen(unavailable)) && !close_after;
+    }
+    batch->conn = state;
+    batch->ctx = ctx;
+    batch->close_after = close_after;
+    batch->keys = malloc(length + 1);
+    int failed = batch->keys ? 0 : 503;
+    if (batch->keys) {
+        memcpy(batch->keys, keys, length);
+        batch->keys[length] = '\0';
+        failed = batch_parse_keys(batch, forwarded);
+    }
+
+    if (failed) {
+        const string too_large = "HTTP/1.1 413 Content Too Large\r\nContent-Length: 0\r\n\r\n";
+        const string reply = failed == 413 ? too_large : unavailable;
+        bool sent = connection_write(state, reply, strlen(reply));
+        batch_free(batch);
+        return sent && !close_after;
+    }
+
+    batch_dispatch(batch);
+    if (batch->n_pending == 0) {
+        bool keep_alive = batch_respond(batch) && !close_after;
+        batch_free(batch);
+        return keep_alive;
+    }
+
+    state->batch = batch;
+    state->paused = true;
+    timer_schedule(&ctx->wheel, &batch->deadline, BATCH_DEADLINE_MS, batch_deadline, batch);
+    return true;
+}
+
+
+void batch_routes_changed(struct chord_context* ctx) {
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        struct batch* batch = ctx->connections[i].batch;
+        if (batch && ctx->connections[i].sock != -1) {
+            batch_dispatch(batch);
+            if (batch->n_pending == 0) {
+                batch_complete(batch);
+            }
+        }
+    }
+}
+
+
+void batch_cancel(struct batch* batch) {
+    batch_free(batch);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chord_processor.h"
+#include "http.h"
+#include "timer_wheel.h"
+
+#define BATCH_URI "/batch"
+#define BATCH_FORWARDED_HEADER "X-Batch-Forwarded"  // set on batches between nodes, answered from the local store only
+#define BATCH_MAX_KEYS 1024
+#define BATCH_MAX_PAYLOAD (64 * 1024)
+#define BATCH_DEADLINE_MS 2000  // keys not answered by then are reported as failed
+
+
+/**
+ * Progress of a single key of a batch
+ */
+enum batch_item_state {
+    ITEM_UNROUTED,   // responsible node unknown, waiting for a lookup reply
+    ITEM_IN_FLIGHT,  // requested from the responsible node
+    ITEM_DONE,       // `status` and `value` are set
+};
+
+/**
+ * A key of a batch and its outcome
+ *
+ * `status`: HTTP status of the key, 200 if `value` is set
+ * `value`: copy of the value, `value_length` bytes
+ */
+struct batch_item {
+    string key;
+    uint16_t hash;
+    enum batch_item_state state;
+    int status;
+    char* value;
+    size_t value_length;
+};
+
+/**
+ * The keys of a batch requested from one other node at once
+ *
+ * `items`: indices of the keys in the batch, `n_items` in request order
+ */
+struct batch_group {
+    struct batch* batch;
+    struct sockaddr_in addr;
+    size_t* items;
+    size_t n_items;
+    size_t capacity;
+    struct batch_group* next;
+};
+
+/**
+ * A batch request waiting for other nodes
+ *
+ * `keys`: copy of the payload, the keys of `items` point into it
+ * `n_pending`: number of items not yet done
+ * `groups`: requests to other nodes in flight
+ * `close_after`: the client asked to close the connection after the reply
+ * `deadline`: answers the batch with whatever arrived when it fires
+ */
+struct batch {
+    struct connection_state* conn;
+    struct chord_context* ctx;
+    char* keys;
+    struct batch_item* items;
+    size_t n_items;
+    size_t n_pending;
+    struct batch_group* groups;
+    bool close_after;
+    struct timer deadline;
+};
+
+
+/**
+ * Whether `request` asks for a batch of keys.
+ */
+bool is_batch_request(const struct request* request);
+
+/**
+ * Answer a batch request: its payload `keys` lists one key per line.
+ *
+ * Keys this node is responsible for are answered from the store, all others
+ * are grouped by their responsible node and fetched in parallel over pooled
+ * connections. Keys of unknown nodes are looked up first. The reply lists
+ * every key in request order as `<status> <length> <key>\r\n<value>\r\n`.
+ * A `forwarded` batch comes from another node and is answered from the
+ * local store only. A batch that cannot be allocated is answered with 503.
+ *
+ * If other nodes are involved, the batch is attached to `state` and answered
+ * from the event loop later. Returns false if the connection has to be closed.
+ */
+bool batch_start(struct connection_state* state, const char* keys, size_t length, bool forwarded, bool close_after, struct chord_context* ctx);
+
+/**
+ * Route the keys of all waiting batches whose lookups were answered meanwhile.
+ */
+void batch_routes_changed(struct chord_context* ctx);
+
+/**
+ * Abandon a batch without answering it, e.g. when its connection is closed.
+ */
+void batch_cancel(struct batch* batch);
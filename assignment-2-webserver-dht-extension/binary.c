@@ -0,0 +1,259 @@
+#include "binary.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "data.h"
+#include "hotkeys.h"
+#include "near.h"
+#include "node.h"
+#include "ring.h"
+#include "sockets_setup.h"
+#include "upload.h"
+
+
+bool is_frame(const char* buffer, size_t n) {
+    return n > 0 && (uint8_t) buffer[0] == FRAME_MAGIC;
+}
+
+
+/**
+ * Send a response frame, key and value are sent from where they are.
+ *
+ * A value of `tuple` in `store` is lent from the store if the socket does not take it right away.
+ * Returns false if the connection failed.
+ */
+static bool send_value_frame(struct connection_state* state, uint8_t op, uint16_t status, uint32_t id, const char* key, size_t key_length,
+                             const char* value, size_t value_length, struct store* store, const struct tuple* tuple) {
+    uint8_t head[FRAME_HEAD_SIZE];
+    frame_encode(&(struct frame_head) {
+        .op = op,
+        .status = status,
+        .id = id,
+        .key_length = key_length,
+        .value_length = value_length,
+    }, head);
+
+    struct iovec iov[3] = {
+        { .iov_base = head, .iov_len = sizeof(head) },
+        { .iov_base = (char*) key, .iov_len = key_length },
+        { .iov_base = (char*) value, .iov_len = value_length },
+    };
+    if (!connection_send_value(state, iov, 3, store, tuple)) {
+        perror("send");
+        return false;
+    }
+    return true;
+}
+
+
+static bool send_frame(struct connection_state* state, uint8_t op, uint16_t status, uint32_t id, const char* key, size_t key_length, const char* value, size_t value_length) {
+    return send_value_frame(state, op, status, id, key, key_length, value, value_length, NULL, NULL);
+}
+
+
+/**
+ * Whether this node is responsible for the hashed key.
+ */
+static bool owns(const struct chord_context* ctx, uint16_t key_hash) {
+    return is_responsible_hashed(key_hash, ctx->own_node.self_id, ctx->own_node.pred.id);
+}
+
+
+/**
+ * Answer a key of another node with the address of the responsible node, or with 503 while it is looked up.
+ *
+ * `key` is echoed in the response if `key_length` is not 0.
+ */
+static bool send_elsewhere(struct connection_state* state, uint8_t op, uint32_t id, const char* key, size_t key_length, uint16_t key_hash, struct chord_context* ctx) {
+    struct sockaddr_in owner;
+    if (route_key(ctx, key_hash, &owner)) {
+        char address[INET_ADDRSTRLEN + sizeof(":65535")];
+        int address_length = snprintf(address, sizeof(address), "%s:%u", inet_ntoa(owner.sin_addr), ntohs(owner.sin_port));
+        return send_frame(state, op, 303, id, key, key_length, address, address_length);
+    }
+    start_lookup(&ctx->pending_lookups, key_hash);
+    return send_frame(state, op, 503, id, key, key_length, NULL, 0);
+}
+
+
+/**
+ * Answer a GET of `key`, echoing the key if `echo_key` is set (for the items of a batch).
+ */
+static bool frame_get(struct connection_state* state, uint8_t op, uint32_t id, const string key, bool echo_key, struct chord_context* ctx) {
+    size_t key_length = echo_key ? strlen(key) : 0;
+    uint16_t key_hash = hash(key);
+    if (!owns(ctx, key_hash)) {
+        return send_elsewhere(state, op, id, key, key_length, key_hash, ctx);
+    }
+
+    const struct tuple* tuple = get_tuple(&ctx->store, key);
+    if (!tuple) {
+        return send_frame(state, op, balance_awaited(ctx, key) ? 503 : 404, id, key, key_length, NULL, 0);
+    }
+    size_t value_length;
+    const char* value = tuple_value(&ctx->store, tuple, &value_length);
+    if (!value || value_length > UINT32_MAX) {
+        return send_frame(state, op, 500, id, key, key_length, NULL, 0);
+    }
+    return send_value_frame(state, op, 200, id, key, key_length, value, value_length, &ctx->store, tuple);
+}
+
+
+/**
+ * Answer a batch, its `keys` list one key per line.
+ *
+ * Every key is answered by a frame echoing it, a frame without key ends the batch.
+ */
+static bool frame_batch(struct connection_state* state, uint8_t op, uint32_t id, const char* keys, size_t length, struct chord_context* ctx) {
+    const char* end = keys + length;
+    const char* pos = keys;
+    while (pos < end) {
+        const char* line_end = memchr(pos, '\n', end - pos);
+        line_end = line_end ? line_end : end;
+        size_t key_length = line_end - pos;
+
+        char key[FRAME_MAX_KEY + 1];
+        if (key_length > FRAME_MAX_KEY || memchr(pos, '\0', key_length)) {
+            if (!send_frame(state, op, 400, id, pos, key_length, NULL, 0)) {
+                return false;
+            }
+        } else if (key_length > 0) {
+            memcpy(key, pos, key_length);
+            key[key_length] = '\0';
+            if (!frame_get(state, op, id, key, true, ctx)) {
+                return false;
+            }
+        }
+        pos = line_end + 1;
+    }
+    return send_frame(state, op, 200, id, NULL, 0, NULL, 0);
+}
+
+
+void frame_store(struct connection_state* state, uint8_t op, uint32_t id, const string key, char* value, size_t value_length, struct chord_context* ctx) {
+    near_changed(ctx, key);
+    enum store_result result = set_owned(&ctx->store, key, value, value_length);
+    uint16_t status = result == STORE_REJECTED ? 507 : result == STORE_OVERWRITTEN ? 204 : 201;
+    send_frame(state, op, status, id, NULL, 0, NULL, 0);
+}
+
+
+/**
+ * Start receiving the value of a PUT frame into value storage, like the payload of an HTTP upload.
+ *
+ * Values that are not stored here are answered right away and only read to keep the connection in sync.
+ */
+static bool frame_upload(struct connection_state* state, const struct frame_head* head, const string key, struct chord_context* ctx) {
+    uint16_t key_hash = hash(key);
+    bool store = owns(ctx, key_hash);
+    bool fits = store_fits(&ctx->store, head->key_length, head->value_length);
+
+    if (!store) {
+        send_elsewhere(state, head->op, head->id, NULL, 0, key_hash, ctx);
+    } else if (!fits) {
+        send_frame(state, head->op, 413, head->id, NULL, 0, NULL, 0);
+    }
+    if (!upload_start(&state->upload, key, false, head->value_length, !store || !fits)) {
+        return false;
+    }
+    state->upload.frame_op = head->op;
+    state->upload.frame_id = head->id;
+    return true;
+}
+
+
+ssize_t process_frame(struct connection_state* state, char* buffer, size_t n, struct chord_context* ctx) {
+    if (n < FRAME_HEAD_SIZE) {
+        return 0;
+    }
+    struct frame_head head;
+    frame_decode((const uint8_t*) buffer, &head);
+    uint8_t op = head.op;
+    size_t head_length = FRAME_HEAD_SIZE + head.key_length;
+    size_t frame_length = head_length + head.value_length;
+
+    // Frames other than PUT are answered once they are received completely, into the buffer of the connection
+    bool fits_buffer = frame_length <= HTTP_MAX_SIZE;
+    if (op < FRAME_GET || op > FRAME_RING) {
+        if (fits_buffer && n < frame_length) {
+            return 0;
+        }
+        send_frame(state, head.op, 501, head.id, NULL, 0, NULL, 0);
+        return fits_buffer ? (ssize_t) frame_length : -1;
+    }
+    bool keyless = op == FRAME_BATCH || op == FRAME_RING;
+    if (keyless != (head.key_length == 0) || head.key_length > FRAME_MAX_KEY) {
+        send_frame(state, head.op, 400, head.id, NULL, 0, NULL, 0);
+        return -1;
+    }
+    if (n < head_length) {
+        return 0;
+    }
+
+    // Keys are C strings in the store
+    char key[FRAME_MAX_KEY + 1];
+    memcpy(key, buffer + FRAME_HEAD_SIZE, head.key_length);
+    key[head.key_length] = '\0';
+    if (strlen(key) != head.key_length) {
+        send_frame(state, head.op, 400, head.id, NULL, 0, NULL, 0);
+        return -1;
+    }
+    if (!keyless) {
+        hotkeys_record(&ctx->hotkeys, key, head.key_length);
+    }
+
+    if (op == FRAME_PUT && n < frame_length) {
+        return frame_upload(state, &head, key, ctx) ? (ssize_t) head_length : -1;
+    }
+    if (n < frame_length) {
+        if (!fits_buffer) {
+            send_frame(state, head.op, 413, head.id, NULL, 0, NULL, 0);
+            return -1;
+        }
+        return 0;
+    }
+
+    char* value = buffer + head_length;
+    bool sent = false;
+    switch (op) {
+    case FRAME_GET:
+        sent = frame_get(state, head.op, head.id, key, false, ctx);
+        break;
+    case FRAME_PUT:
+        if (!owns(ctx, hash(key))) {
+            sent = send_elsewhere(state, head.op, head.id, NULL, 0, hash(key), ctx);
+        } else {
+            char* copy = malloc(head.value_length ? head.value_length : 1);
+            if (!copy) {
+                return -1;
+            }
+            memcpy(copy, value, head.value_length);
+            frame_store(state, head.op, head.id, key, copy, head.value_length, ctx);
+            sent = true;
+        }
+        break;
+    case FRAME_DELETE:
+        if (!owns(ctx, hash(key))) {
+            sent = send_elsewhere(state, head.op, head.id, NULL, 0, hash(key), ctx);
+        } else {
+            near_changed(ctx, key);
+            bool awaited = balance_awaited(ctx, key);
+            balance_deleted(ctx, key);
+            sent = send_frame(state, head.op, delete(&ctx->store, key) || awaited ? 204 : 404, head.id, NULL, 0, NULL, 0);
+        }
+        break;
+    case FRAME_BATCH:
+        sent = frame_batch(state, head.op, head.id, value, head.value_length, ctx);
+        break;
+    case FRAME_RING: {
+        char ring[RING_MAX_SIZE];
+        size_t ring_length = ring_format(ctx, ring, sizeof(ring));
+        sent = send_frame(state, head.op, 200, head.id, NULL, 0, ring, ring_length);
+        break;
+    }
+    }
+    return sent ? (ssize_t) frame_length : -1;
+}
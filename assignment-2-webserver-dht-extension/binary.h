@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chord_processor.h"
+#include "frame.h"
+#include "http.h"
+
+
+/**
+ * Whether the bytes at `buffer` start a binary frame instead of an HTTP request.
+ */
+bool is_frame(const char* buffer, size_t n);
+
+/**
+ * Answer the binary request frame at the front of `buffer`, see `frame.h`.
+ *
+ * A PUT whose value is not received completely starts an upload of the value,
+ * completed by `frame_store()`. Returns the number of bytes processed, 0 if
+ * the frame is incomplete, or -1 if the connection has to be closed.
+ */
+ssize_t process_frame(struct connection_state* state, char* buffer, size_t n, struct chord_context* ctx);
+
+/**
+ * Store a value uploaded for a PUT frame and send its response.
+ *
+ * Ownership of `value` is taken.
+ */
+void frame_store(struct connection_state* state, uint8_t op, uint32_t id, const string key, char* value, size_t value_length, struct chord_context* ctx);
@@ -0,0 +1,391 @@
+#include "bulk.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "data.h"
+#include "near.h"
+#include "node.h"
+#include "peer_pool.h"
+#include "sockets_setup.h"
+#include "stream_sock.h"
+#include "util.h"
+
+
+bool is_bulk_request(const struct request* request) {
+    return strcmp(request->method, "POST") == 0 && strcmp(request->uri, BULK_URI) == 0;
+}
+
+
+struct bulk* bulk_start(struct connection_state* state, struct request* request, struct chord_context* ctx) {
+    struct bulk* bulk = calloc(1, sizeof(*bulk));
+    if (!bulk) {
+        return NULL;
+    }
+    bulk->conn = state;
+    bulk->ctx = ctx;
+
+    const string hops = get_header(request, BULK_HOPS_HEADER);
+    bulk->hops = hops ? strtoul(hops, NULL, 10) : 0;
+    bulk->handover = get_header(request, BULK_HANDOVER_HEADER) != NULL;
+    const string connection_header = get_header(request, "Connection");
+    bulk->close_after = connection_header && strcasecmp(connection_header, "close") == 0;
+
+    // Size the store for the announced pairs at once instead of growing it step by step
+    const string count = get_header(request, BULK_COUNT_HEADER);
+    if (count) {
+        size_t n_records = strtoul(count, NULL, 10);
+        store_reserve(&ctx->store, ctx->store.count + (n_records < BULK_MAX_RESERVE ? n_records : BULK_MAX_RESERVE));
+    }
+
+    state->bulk = bulk;
+    return bulk;
+}
+
+
+/**
+ * Keep the timeout running while forwards are in flight, restarting it on every progress.
+ */
+static void bulk_watch(struct bulk* bulk);
+
+
+/**
+ * Send the pairs collected for a node as a bulk load of its own.
+ *
+ * At most one request per node is in flight, so pairs arriving meanwhile are sent with the next one.
+ */
+static void destination_send(struct bulk_destination* destination);
+
+
+/**
+ * Send the reply with the numbers of pairs stored, forwarded and failed.
+ *
+ * Returns false if it could not be sent.
+ */
+static bool bulk_respond(struct bulk* bulk) {
+    char payload[128];
+    int payload_length = snprintf(payload, sizeof(payload), "stored %zu\r\nforwarded %zu\r\nfailed %zu\r\n",
+                                  bulk->stored, bulk->forwarded, bulk->failed);
+    char reply[HTTP_MAX_HEAD_SIZE];
+    int reply_length = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s", payload_length, payload);
+
+    if (!connection_write(bulk->conn, reply, reply_length)) {
+        perror("send");
+        return false;
+    }
+    return true;
+}
+
+
+static void bulk_free(struct bulk* bulk) {
+    timer_cancel(&bulk->timeout);
+    while (bulk->destinations) {
+        struct bulk_destination* destination = bulk->destinations;
+        bulk->destinations = destination->next;
+        peer_pool_cancel(&bulk->ctx->peers, destination);
+        free(destination->records);
+        free(destination);
+    }
+    free(bulk);
+}
+
+
+/**
+ * Whether a request of any destination is in flight.
+ */
+static bool bulk_in_flight(const struct bulk* bulk) {
+    for (const struct bulk_destination* destination = bulk->destinations; destination; destination = destination->next) {
+        if (destination->in_flight) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Answer a bulk load whose last forward was answered, and continue with the next request of its connection.
+ */
+static void bulk_complete(struct bulk* bulk) {
+    struct connection_state* state = bulk->conn;
+    struct chord_context* ctx = bulk->ctx;
+    bool keep_alive = bulk_respond(bulk) && !bulk->close_after;
+
+    state->bulk = NULL;
+    state->paused = false;
+    bulk_free(bulk);
+
+    if (keep_alive) {
+        connection_resume(state, ctx);
+    } else {
+        connection_end(state);
+    }
+}
+
+
+/**
+ * Continue after forwards were answered or given up: send what accumulated meanwhile, resume reading once few bytes are
+ * waiting, and answer the client once everything is forwarded.
+ */
+static void bulk_progress(struct bulk* bulk) {
+    connection_touch(bulk->conn, &bulk->ctx->wheel);  // progress keeps a paused connection from idling out
+    for (struct bulk_destination* destination = bulk->destinations; destination; destination = destination->next) {
+        if (!destination->in_flight && (destination->length >= BULK_FORWARD_BATCH || (bulk->finished && destination->length > 0))) {
+            destination_send(destination);
+        }
+    }
+    bulk_watch(bulk);
+
+    if (bulk->finished) {
+        if (!bulk_in_flight(bulk)) {
+            bulk_complete(bulk);
+        }
+    } else if (bulk->buffered <= BULK_MAX_BUFFERED / 2) {
+        bulk->conn->paused = false;
+    }
+}
+
+
+/**
+ * DESTINATION DONE: Takes the reply of another node to forwarded pairs.
+ *
+ * The other node reports how many of them it could not store or forward itself.
+ *
+ * @param arg The bulk_destination.
+ * @param response The response of the other node, NULL if the request failed.
+ */
+static void destination_done(void* arg, const struct response* response) {
+    struct bulk_destination* destination = arg;
+    struct bulk* bulk = destination->bulk;
+
+    size_t failed = destination->in_flight;
+    if (response && response->status == 200) {
+        const char* report = memstr(response->payload, response->payload_length, "failed ");
+        failed = report ? strtoul(report + strlen("failed "), NULL, 10) : 0;
+        failed = failed < destination->in_flight ? failed : destination->in_flight;
+    }
+    bulk->forwarded += destination->in_flight - failed;
+    bulk->failed += failed;
+    bulk->buffered -= destination->in_flight_length;
+    destination->in_flight = 0;
+    destination->in_flight_length = 0;
+
+    bulk_progress(bulk);
+}
+
+
+/**
+ * BULK TIMEOUT: Gives up forwards that were not answered in time, their pairs are counted as failed.
+ *
+ * @param arg The bulk.
+ */
+static void bulk_timeout(void* arg) {
+    struct bulk* bulk = arg;
+    for (struct bulk_destination* destination = bulk->destinations; destination; destination = destination->next) {
+        if (destination->in_flight) {
+            peer_pool_cancel(&bulk->ctx->peers, destination);
+            bulk->failed += destination->in_flight;
+            bulk->buffered -= destination->in_flight_length;
+            destination->in_flight = 0;
+            destination->in_flight_length = 0;
+        }
+    }
+    bulk_progress(bulk);
+}
+
+
+static void bulk_watch(struct bulk* bulk) {
+    if (bulk_in_flight(bulk)) {
+        timer_schedule(&bulk->ctx->wheel, &bulk->timeout, BULK_FORWARD_TIMEOUT_MS, bulk_timeout, bulk);
+    } else {
+        timer_cancel(&bulk->timeout);
+    }
+}
+
+
+static void destination_send(struct bulk_destination* destination) {
+    struct bulk* bulk = destination->bulk;
+
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\n%s: %u\r\n%s: %zu\r\n%sContent-Length: %zu\r\n\r\n",
+                               BULK_URI, BULK_HOPS_HEADER, bulk->hops + 1, BULK_COUNT_HEADER, destination->n_records,
+                               bulk->handover ? BULK_HANDOVER_HEADER ": 1\r\n" : "", destination->length);
+    char* request = malloc(head_length + destination->length);
+    if (request) {
+        memcpy(request, head, head_length);
+        memcpy(request + head_length, destination->records, destination->length);
+    }
+
+    if (request && peer_pool_request(&bulk->ctx->peers, destination->addr, request, head_length + destination->length, destination_done, destination)) {
+        destination->in_flight = destination->n_records;
+        destination->in_flight_length = destination->length;
+    } else {
+        // No connection available, the client may load these pairs again
+        bulk->failed += destination->n_records;
+        bulk->buffered -= destination->length;
+    }
+    destination->length = 0;
+    destination->n_records = 0;
+    bulk_watch(bulk);
+}
+
+
+/**
+ * Find the collected pairs for the node at `addr`, creating them if needed.
+ */
+static struct bulk_destination* bulk_destination(struct bulk* bulk, struct sockaddr_in addr) {
+    struct bulk_destination* destination = bulk->destinations;
+    while (destination && (destination->addr.sin_addr.s_addr != addr.sin_addr.s_addr || destination->addr.sin_port != addr.sin_port)) {
+        destination = destination->next;
+    }
+    if (!destination) {
+        destination = calloc(1, sizeof(*destination));
+        if (!destination) {
+            return NULL;
+        }
+        destination->bulk = bulk;
+        destination->addr = addr;
+        destination->next = bulk->destinations;
+        bulk->destinations = destination;
+    }
+    return destination;
+}
+
+
+/**
+ * Collect an encoded pair for the node responsible for `key`, or the successor if that node is unknown.
+ *
+ * Returns false if memory is exhausted.
+ */
+static bool bulk_forward(struct bulk* bulk, uint16_t key, const char* record, size_t record_length) {
+    struct NetworkNodes node = bulk->ctx->own_node;
+    struct sockaddr_in owner;
+    if (!route_key(bulk->ctx, key, &owner)) {
+        // Each node forwards towards the responsible one, so the pair arrives in at most one hop per node
+        owner.sin_addr = node.succ.ip;
+        owner.sin_port = htons(node.succ.port);
+    }
+
+    struct bulk_destination* destination = bulk_destination(bulk, owner);
+    if (!destination) {
+        return false;
+    }
+    if (destination->length + record_length > destination->capacity) {
+        size_t capacity = destination->capacity ? destination->capacity : BULK_FORWARD_BATCH;
+        while (capacity < destination->length + record_length) {
+            capacity *= 2;
+        }
+        char* records = realloc(destination->records, capacity);
+        if (!records) {
+            return false;
+        }
+        destination->records = records;
+        destination->capacity = capacity;
+    }
+    memcpy(destination->records + destination->length, record, record_length);
+    destination->length += record_length;
+    destination->n_records += 1;
+    bulk->buffered += record_length;
+
+    if (!destination->in_flight && destination->length >= BULK_FORWARD_BATCH) {
+        destination_send(destination);
+    }
+    return true;
+}
+
+
+/**
+ * The longest value of a pair with a key of `key_length` bytes accepted, no longer than the store accepts.
+ */
+static size_t bulk_max_value(const struct store* store, size_t key_length) {
+    size_t max_value = store_max_value(store, key_length);
+    return max_value < BULK_MAX_VALUE ? max_value : BULK_MAX_VALUE;
+}
+
+
+size_t bulk_max_pending(const struct chord_context* ctx) {
+    return BULK_RECORD_HEAD + BULK_MAX_KEY + bulk_max_value(&ctx->store, 0);
+}
+
+
+ssize_t bulk_consume(struct bulk* bulk, const char* data, size_t n) {
+    struct NetworkNodes node = bulk->ctx->own_node;
+    const char* end = data + n;
+    const char* pos = data;
+
+    while ((size_t) (end - pos) >= BULK_RECORD_HEAD) {
+        const uint8_t* head = (const uint8_t*) pos;
+        size_t key_length = (size_t) head[0] << 8 | head[1];
+        size_t value_length = (size_t) head[2] << 24 | (size_t) head[3] << 16 | (size_t) head[4] << 8 | head[5];
+        if (key_length == 0 || key_length > BULK_MAX_KEY || memchr(pos + BULK_RECORD_HEAD, '\0', key_length < (size_t) (end - pos) - BULK_RECORD_HEAD ? key_length : (size_t) (end - pos) - BULK_RECORD_HEAD)) {
+            return -1;
+        }
+        // Refused as soon as the head arrives, the pair would be buffered until received completely
+        if (value_length > bulk_max_value(&bulk->ctx->store, key_length)) {
+            bulk->too_large = true;
+            return -1;
+        }
+        size_t record_length = BULK_RECORD_HEAD + key_length + value_length;
+        if ((size_t) (end - pos) < record_length) {
+            break;  // pair not received completely yet
+        }
+
+        char key[BULK_MAX_KEY + 1];
+        memcpy(key, pos + BULK_RECORD_HEAD, key_length);
+        key[key_length] = '\0';
+        char* value = (char*) pos + BULK_RECORD_HEAD + key_length;
+        uint16_t key_hash = hash(key);
+
+        if (is_responsible_hashed(key_hash, node.self_id, node.pred.id)) {
+            if (bulk->handover && balance_superseded(bulk->ctx, key)) {
+                bulk->stored += 1;  // put or deleted here since the move, the handed over value is older
+            } else {
+                near_changed(bulk->ctx, key);
+                if (set(&bulk->ctx->store, key, value, value_length) == STORE_REJECTED) {
+                    bulk->failed += 1;
+                } else {
+                    bulk->stored += 1;
+                }
+            }
+        } else if (bulk->hops >= BULK_MAX_HOPS || !bulk_forward(bulk, key_hash, pos, record_length)) {
+            bulk->failed += 1;
+        }
+        pos += record_length;
+    }
+
+    if (bulk->buffered > BULK_MAX_BUFFERED) {
+        bulk->conn->paused = true;  // resumed by `bulk_progress()` once forwards are answered
+    }
+    return pos - data;
+}
+
+
+bool bulk_finish(struct bulk* bulk) {
+    bulk->finished = true;
+    if (bulk->handover) {
+        balance_handover_received(bulk->ctx);
+    }
+    for (struct bulk_destination* destination = bulk->destinations; destination; destination = destination->next) {
+        if (!destination->in_flight && destination->length > 0) {
+            destination_send(destination);
+        }
+    }
+
+    if (bulk_in_flight(bulk)) {
+        bulk->conn->paused = true;
+        return true;
+    }
+
+    bool keep_alive = bulk_respond(bulk) && !bulk->close_after;
+    bulk->conn->bulk = NULL;
+    bulk->conn->paused = false;
+    bulk_free(bulk);
+    return keep_alive;
+}
+
+
+void bulk_cancel(struct bulk* bulk) {
+    bulk_free(bulk);
+}
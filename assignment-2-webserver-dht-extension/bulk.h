@@ -0,0 +1,117 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chord_processor.h"
+#include "http.h"
+#include "timer_wheel.h"
+
+#define BULK_URI "/bulk"
+#define BULK_COUNT_HEADER "X-Bulk-Count"  // optional number of pairs, the store is sized for them up front
+#define BULK_HOPS_HEADER "X-Bulk-Hops"    // set on bulk loads forwarded between nodes
+#define BULK_HANDOVER_HEADER "X-Bulk-Handover"  // set on keys handed over after a move, they do not replace newer ones
+#define BULK_MAX_HOPS 32                  // pairs forwarded more often are dropped, the ring is inconsistent then
+#define BULK_MAX_KEY 1024                 // longest key accepted
+#define BULK_MAX_VALUE (64 * 1024 * 1024) // longest value accepted, also without a memory budget
+#define BULK_MAX_RESERVE (1 << 20)        // upper bound for the count hint
+#define BULK_RECORD_HEAD 6                // 2 bytes key length, 4 bytes value length, network byte order
+#define BULK_FORWARD_BATCH (64 * 1024)    // bytes of pairs collected for a node before they are forwarded
+#define BULK_MAX_BUFFERED (1024 * 1024)   // reading pauses while more bytes wait to be forwarded
+#define BULK_FORWARD_TIMEOUT_MS 5000      // forwards not answered by then are counted as failed
+
+
+/**
+ * Pairs of a bulk load collected for one other node
+ *
+ * `records`: the encoded pairs not yet sent, `length` bytes, `n_records` pairs
+ * `in_flight`: pairs of the request sent and not answered yet, 0 if none
+ * `in_flight_length`: bytes of that request's pairs
+ */
+struct bulk_destination {
+    struct bulk* bulk;
+    struct sockaddr_in addr;
+    char* records;
+    size_t length;
+    size_t capacity;
+    size_t n_records;
+    size_t in_flight;
+    size_t in_flight_length;
+    struct bulk_destination* next;
+};
+
+/**
+ * A bulk load of key-value pairs
+ *
+ * `hops`: how often the pairs were forwarded before
+ * `handover`: the pairs are handed over after a move, see `balance_superseded()`
+ * `finished`: the payload is received completely, only forwards are awaited
+ * `stored`, `forwarded`, `failed`: number of pairs, reported to the client
+ * `too_large`: a pair announced a value longer than accepted, the load is refused
+ * `buffered`: bytes of pairs waiting for or being forwarded
+ * `timeout`: running while forwards are in flight
+ */
+struct bulk {
+    struct connection_state* conn;
+    struct chord_context* ctx;
+    unsigned hops;
+    bool handover;
+    bool finished;
+    bool close_after;
+    size_t stored;
+    size_t forwarded;
+    size_t failed;
+    bool too_large;
+    size_t buffered;
+    struct bulk_destination* destinations;
+    struct timer timeout;
+};
+
+
+/**
+ * Whether `request` is a bulk load.
+ */
+bool is_bulk_request(const struct request* request);
+
+/**
+ * Start a bulk load whose payload is streamed on the connection `state`.
+ *
+ * The payload is a sequence of pairs, each a `BULK_RECORD_HEAD` giving the
+ * lengths of key and value, followed by the key and the value. Returns NULL
+ * if memory is exhausted.
+ */
+struct bulk* bulk_start(struct connection_state* state, struct request* request, struct chord_context* ctx);
+
+/**
+ * The most bytes of a pair not received completely a bulk load of `ctx` buffers:
+ * the head, the longest key and the longest value accepted.
+ */
+size_t bulk_max_pending(const struct chord_context* ctx);
+
+/**
+ * Store or forward the complete pairs at the front of `data`.
+ *
+ * Pairs this node is responsible for are stored right away, all others are
+ * collected per responsible node (or the successor, if it is unknown) and
+ * forwarded in batches. Handed over pairs are not stored over newer ones, but
+ * counted as stored. Reading pauses while too many bytes are waiting to be
+ * forwarded. Returns the number of bytes consumed, or -1 if a pair is malformed
+ * or announces a value longer than the store accepts, setting `too_large`.
+ */
+ssize_t bulk_consume(struct bulk* bulk, const char* data, size_t n);
+
+/**
+ * Complete a bulk load once its payload is received.
+ *
+ * The remaining pairs are forwarded, and the client is answered with the
+ * number of pairs stored, forwarded and failed once all forwards are
+ * answered. Returns false if the connection has to be closed.
+ */
+bool bulk_finish(struct bulk* bulk);
+
+/**
+ * Abandon a bulk load without answering it, e.g. when its connection is closed.
+ */
+void bulk_cancel(struct bulk* bulk);
@@ -13,7 +13,12 @@
 #include <unistd.h>
 
 
+#include "admission.h"
+#include "balance.h"
+#include "batch.h"
 #include "data.h"
+#include "fetch.h"
+#include "successors.h"
 #include "http.h"
 #include "util.h"
 #include "node.h"
@@ -23,6 +28,248 @@
 
 #include <stdbool.h>
 
+/**
+ * SWEEP ROUTES: Periodically drops expired lookup replies from the routing cache.
+ *
+ * @param arg The chord_context of the node.
+ */
+static void sweep_routes(void* arg) {
+    struct chord_context* ctx = arg;
+    expireDHTreplies(ctx->lookupMessages, &ctx->nextFreeIndex, monotonic_ms());
+    timer_schedule(&ctx->wheel, &ctx->route_sweep, ROUTE_SWEEP_INTERVAL_MS, sweep_routes, ctx);
+}
+
+/**
+ * SWEEP STORE: Removes expired tuples from the store in small batches, as long as any tuple has a TTL.
+ *
+ * @param arg The chord_context of the node.
+ */
+static void sweep_store(void* arg) {
+    struct chord_context* ctx = arg;
+    store_sweep(&ctx->store, monotonic_ms(), STORE_SWEEP_BATCH);
+    if (ctx->store.n_expiring > 0) {
+        timer_schedule(&ctx->wheel, &ctx->store_sweep, STORE_SWEEP_INTERVAL_MS, sweep_store, ctx);
+    }
+}
+
+/**
+ * SCHEDULE STORE SWEEP: Starts the background expiry of the store after a TTL was set, unless it is running already.
+ *
+ * @param ctx The chord_context of the node.
+ */
+void schedule_store_sweep(struct chord_context* ctx) {
+    if (!timer_pending(&ctx->store_sweep)) {
+        timer_schedule(&ctx->wheel, &ctx->store_sweep, STORE_SWEEP_INTERVAL_MS, sweep_store, ctx);
+    }
+}
+
+/**
+ * ROUTE KEY: Determines the node responsible for a key other than this node from the successor and the cached lookup replies.
+ *
+ * @param ctx The chord_context of the node.
+ * @param key The hashed key.
+ * @param owner Set to the address of the responsible node.
+ * @return false if the responsible node is unknown.
+ */
+bool route_key(const struct chord_context* ctx, uint16_t key, struct sockaddr_in* owner) {
+    struct NetworkNodes node = ctx->own_node;
+    memset(owner, 0, sizeof(*owner));
+    owner->sin_family = AF_INET;
+
+    if (is_responsible_hashed(key, node.succ.id, node.self_id)) {
+        owner->sin_addr = node.succ.ip;
+        owner->sin_port = htons(node.succ.port);
+        return true;
+    }
+    const DHTLookupMessage* reply = peekDHTreply(ctx->lookupMessages, key, ctx->nextFreeIndex);
+    if (reply) {
+        owner->sin_addr = reply->originNodeIP;
+        owner->sin_port = htons(reply->originNodePort);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * HANDLE DHT MESSAGE: Answers, forwards or takes a lookup message of another node.
+ *
+ * A lookup is answered if this node or its successor is responsible, and forwarded to the successor otherwise. A reply is
+ * cached as route and completes the lookups in flight it answers. Messages are queued in the outbox.
+ *
+ * @param ctx The chord_context of the node.
+ * @param lookup_msg The received message.
+ * @return true if the message was a reply, i.e. new routes are known.
+ */
+static bool handle_dht_message(struct chord_context* ctx, DHTLookupMessage* lookup_msg) {
+    struct NetworkNodes own_node = ctx->own_node;
+
+    if (lookup_msg->messageType == 0) {
+        /* -------------------- PROCESS INCOMING LOOKUP MESSAGE -------------------- */
+        struct sockaddr_in origin_addr;
+        memset(&origin_addr, 0, sizeof(origin_addr));
+        // construct origin_addr as destination for a reply
+        origin_addr.sin_family = AF_INET;
+        origin_addr.sin_addr = lookup_msg->originNodeIP;
+        origin_addr.sin_port = htons(lookup_msg->originNodePort);
+
+        if (is_responsible_hashed(lookup_msg->key, own_node.self_id, own_node.pred.id)) {
+            /* -------------------- LOOKUP REPLY TO NODE ORIGIN -------------------- */
+            lookup_msg->messageType = 1;
+            lookup_msg->key = own_node.pred.id; // Hash ID: ID of the predecessor of the replying node
+            lookup_msg->originNodeID = own_node.self_id;
+            lookup_msg->originNodeIP = ctx->addr.sin_addr;
+            lookup_msg->originNodePort = ntohs(ctx->addr.sin_port);
+            outbox_queue(&ctx->outbox, origin_addr, lookup_msg);
+
+        } else if (is_responsible_hashed(lookup_msg->key, own_node.succ.id, own_node.self_id)) { // successor responsible?
+            /* -------------------- LOOKUP REPLY TO NODE ORIGIN FOR SUCCESSOR -------------------- */
+            lookup_msg->messageType = 1;
+            lookup_msg->key = own_node.self_id;
+            lookup_msg->originNodeID = own_node.succ.id;
+            lookup_msg->originNodeIP = own_node.succ.ip;
+            lookup_msg->originNodePort = own_node.succ.port;
+            outbox_queue(&ctx->outbox, origin_addr, lookup_msg);
+
+        } else {
+            /* -------------------- FORWARD LOOKUP TO SUCCESSOR -------------------- */
+            struct sockaddr_in successor_addr;
+            memset(&successor_addr, 0, sizeof(successor_addr));
+            successor_addr.sin_family = AF_INET;
+            successor_addr.sin_addr = own_node.succ.ip;
+            successor_addr.sin_port = htons(own_node.succ.port);
+            outbox_queue(&ctx->outbox, successor_addr, lookup_msg);
+        }
+        return false;
+    }
+
+    if (lookup_msg->messageType == 1) {
+        /* -------------------- PROCESS LOOKUP REPLY MESSAGE -------------------- */
+        // put the msg to the lookup msgs' array (save msg)
+        lookup_msg->receivedAt = monotonic_ms();
+        addOrUpdateMessage(ctx->lookupMessages, &ctx->nextFreeIndex, *lookup_msg);
+
+        // the reply answers our lookups, stop retransmitting them
+        complete_lookups(&ctx->pending_lookups, lookup_msg);
+        return true;
+    }
+
+    if (lookup_msg->messageType == DHT_INVALIDATE_TYPE) {
+        // the owner of a key whose value may be cached here tells it changed
+        near_invalidate(&ctx->near, lookup_msg->key);
+    }
+    return false;
+}
+
+/**
+ * Positions in the pollfd array of the event loop. The listening socket comes last, so a connection accepted in an iteration
+ * can never pick up the events polled for a socket closed in the same iteration.
+ */
+enum {
+    POLL_DATAGRAM = 0,
+    POLL_PEERS = 1,
+    POLL_CONNECTIONS = POLL_PEERS + PEER_POOL_SIZE,
+    POLL_RESTART = POLL_CONNECTIONS + MAX_CONNECTIONS,
+    POLL_STREAM = POLL_RESTART + 1,
+    POLL_COUNT,
+};
+
+/**
+ * WATCH SOCKETS: Fills the pollfd array for the next iteration of the event loop.
+ *
+ * Connections are opened and closed by the handlers and by timers, so the array is rebuilt every time. Client connections
+ * paused for other nodes are not polled. Connections with replies queued are only polled for writing. New connections are
+ * only accepted while a connection slot is free and the node is not handed over to a new process.
+ *
+ * @param sockets The pollfd array of the event loop, POLL_COUNT entries.
+ * @param generations Set to the generation of each connection to another node, to detect sockets replaced meanwhile.
+ * @param ctx The chord_context of the node.
+ * @return Whether a client connection has requests deferred by the scheduler, the event loop must not block then.
+ */
+static bool watch_sockets(struct pollfd sockets[], unsigned generations[], const struct chord_context* ctx) {
+    bool accepting = false;
+    bool backlog = false;
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        const struct connection_state* state = &ctx->connections[i];
+        // Connections with replies queued wait for the client to take them, before they are read from again
+        bool pending = state->sock != -1 && connection_pending(state);
+        bool watched = state->sock != -1 && !state->paused;
+        sockets[POLL_CONNECTIONS + i] = (struct pollfd) { .fd = watched || pending ? state->sock : -1, .events = pending ? POLLOUT : POLLIN };
+        accepting = accepting || state->sock == -1;
+        backlog = backlog || (watched && state->deferred);
+    }
+    for (size_t i = 0; i < PEER_POOL_SIZE; i += 1) {
+        const struct peer_conn* conn = &ctx->peers.conns[i];
+        sockets[POLL_PEERS + i] = (struct pollfd) { .fd = conn->sock, .events = peer_events(conn) };
+        generations[i] = conn->generation;
+    }
+    sockets[POLL_DATAGRAM] = (struct pollfd) { .fd = ctx->datagram_socket, .events = POLLIN };
+    sockets[POLL_RESTART] = (struct pollfd) { .fd = ctx->restart.listener, .events = POLLIN };
+    sockets[POLL_STREAM].events = accepting && !restart_draining(&ctx->restart) ? POLLIN : 0;
+    return backlog;
+}
+
+/**
+ * RECEIVE DATAGRAMS: Handles a burst of datagrams of other nodes, so the messages they cause share datagrams in the outbox.
+ *
+ * While requests are shed, a larger burst is handled: the ring's control traffic goes before new client work, but a flood of
+ * datagrams still cannot starve the clients.
+ *
+ * @param ctx The chord_context of the node.
+ */
+static void receive_datagrams(struct chord_context* ctx) {
+    char recv_buffer[HTTP_MAX_SIZE+1];
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    DHTLookupMessage messages[DHT_BATCH_MAX]; // messages of a received datagram
+
+    bool routes_changed = false;
+    for (int burst = 0; burst < (ctx->admission.shedding ? DHT_SHED_BURST : DHT_RECV_BURST); burst++) {
+        int received_bytes = recvfrom(ctx->datagram_socket, recv_buffer, sizeof(recv_buffer), 0, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (received_bytes == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvfrom failed");
+            }
+            break;
+        }
+
+        if (is_heartbeat_datagram(recv_buffer, received_bytes)) {
+            routes_changed = heartbeat_datagram(ctx, recv_buffer, received_bytes) || routes_changed;
+            continue;
+        }
+        if (is_balance_datagram(recv_buffer, received_bytes)) {
+            routes_changed = balance_datagram(ctx, recv_buffer, received_bytes) || routes_changed;
+            continue;
+        }
+        if (is_fetch_datagram(recv_buffer, received_bytes)) {
+            routes_changed = fetch_datagram(ctx, recv_buffer, received_bytes) || routes_changed;
+            continue;
+        }
+        int count = parse_dht_lookup_message(messages, recv_buffer, received_bytes);
+        for (int m = 0; m < count; m++) {
+            routes_changed = handle_dht_message(ctx, &messages[m]) || routes_changed;
+        }
+    }
+
+    if (routes_changed) {
+        // batches waiting for the route can fetch their keys now
+        batch_routes_changed(ctx);
+    }
+}
+
+/**
+ * FREE CONNECTION: Finds an unused client connection.
+ *
+ * @param ctx The chord_context of the node.
+ * @return The connection_state of the unused connection, or NULL if all are in use.
+ */
+static struct connection_state* free_connection(struct chord_context* ctx) {
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        if (ctx->connections[i].sock == -1) {
+            return &ctx->connections[i];
+        }
+    }
+    return NULL;
+}
         
 /**
  * NODE CHORD PROCESSOR: processes incoming connection and invokes nessessary functions depending on incoming request (client request or DHT CHORD lookups)
@@ -36,41 +283,79 @@
  * 
  * @param own_node represents CHORD Node
  * 
+ * @param restart_conn connection to the node restarted, its store is loaded from it; -1 if started anew
+ * 
  */
-void chord_processor(struct sockaddr_in addr, int stream_socket, int datagram_socket, struct NetworkNodes own_node) {
+void chord_processor(struct sockaddr_in addr, int stream_socket, int datagram_socket, struct NetworkNodes own_node, int restart_conn) {
 
     /* -------------------- DECLARATION & INITITALIZATION OF VARIABLES -------------------- */
     int connection;
     // Create an array of pollfd structures to monitor sockets.
-    struct pollfd sockets[3] = {
-        { .fd = stream_socket, .events = POLLIN }, // include TCP (stream socket)
-        { .fd = datagram_socket, .events = POLLIN}, // include UDP (dgram socket)
-        // for the third socket for existing TCP connection
-    };
-
-    DHTLookupMessage lookupMessages[MAX_LOOKUP_MESSAGES] = {0}; // declaration/initialization of an array for stroing dht lookup messages
-    int nextFreeIndex = 0; // Keep track of the next free index
-
-
-    char send_buffer[HTTP_MAX_SIZE+1];
-    char recv_buffer[HTTP_MAX_SIZE+1];
-    // reset the entire buffer
-    memset(send_buffer, 0, sizeof(send_buffer));
-    memset(recv_buffer, 0, sizeof(recv_buffer));
-
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+    // UDP (dgram socket), connections to other nodes, client connections and TCP (stream socket)
+    struct pollfd sockets[POLL_COUNT];
+    sockets[POLL_STREAM] = (struct pollfd) { .fd = stream_socket, .events = POLLIN };
+    unsigned peer_generations[PEER_POOL_SIZE];
+
+    // node state shared with the request handlers, too large for the stack once connections are added
+    static struct chord_context ctx;
+    ctx.addr = addr;
+    ctx.datagram_socket = datagram_socket;
+    ctx.own_node = own_node;
+    ctx.nextFreeIndex = 0; // Keep track of the next free index
+    timer_wheel_init(&ctx.wheel, monotonic_ms());
+    outbox_init(&ctx.outbox, datagram_socket);
+    pending_lookups_init(&ctx.pending_lookups, &ctx.outbox, addr, own_node, &ctx.wheel);
+    timer_schedule(&ctx.wheel, &ctx.route_sweep, ROUTE_SWEEP_INTERVAL_MS, sweep_routes, &ctx);
+
+    // Store bounded by the memory budget in bytes from the environment, unlimited if unset
+    const char* budget = getenv("STORE_MEMORY_BUDGET");
+    store_init(&ctx.store, budget ? strtoull(budget, NULL, 10) : 0);
+    // Smallest value compressed, 0 disables compression; only effective if built with STORE_COMPRESSION
+    const char* compress_threshold = getenv("STORE_COMPRESS_THRESHOLD");
+    if (compress_threshold) {
+        ctx.store.compress_threshold = strtoull(compress_threshold, NULL, 10);
+    }
+    // Keys holding identical values share a single copy if set
+    const char* dedup = getenv("STORE_DEDUP");
+    ctx.store.dedup = dedup && strcmp(dedup, "0") != 0;
+    set(&ctx.store, "/static/foo", "Foo", sizeof "Foo" - 1);
+    set(&ctx.store, "/static/bar", "Bar", sizeof "Bar" - 1);
+    set(&ctx.store, "/static/baz", "Baz", sizeof "Baz" - 1);
+    if (restart_conn != -1) {
+        fprintf(stderr, "Hot restart: loaded %zu keys\n", restart_load(restart_conn, &ctx));
+    }
 
-    DHTLookupMessage lookup_msg;
-    memset(&lookup_msg, 0, sizeof(lookup_msg)); // temp lookup message , send and forget
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        ctx.connections[i].sock = -1;
+    }
+    peer_pool_init(&ctx.peers, &ctx.wheel);
+    hotkeys_init(&ctx.hotkeys, &ctx.wheel);
+    // Near cache of hot values of other nodes, bounded by its budget in bytes, disabled if unset
+    const char* near_budget = getenv("NEAR_CACHE_BUDGET");
+    near_init(&ctx.near, near_budget ? strtoull(near_budget, NULL, 10) : 0);
+    // Values of other nodes fetched over UDP if set; every node of the ring has to understand fetch datagrams
+    const char* udp_values = getenv("UDP_VALUES");
+    ctx.udp_values = udp_values && strcmp(udp_values, "0") != 0;
+    ctx.next_fetch_id = 0;
+    // Heartbeats to the successor and failover to the next one, unless the neighbours are static
+    const char* no_stabilize = getenv("NO_STABILIZE");
+    successors_init(&ctx, !no_stabilize || strcmp(no_stabilize, "0") == 0);
+    balance_init(&ctx, ctx.successors.enabled);
+    // Delay of requests in the event loop tolerated before new ones are shed, 0 disables shedding
+    const char* admission_target = getenv("ADMISSION_TARGET_MS");
+    admission_init(&ctx.admission, admission_target ? strtoul(admission_target, NULL, 10) : ADMISSION_TARGET_MS);
+    ctx.scheduler = (struct scheduler) { .slice_start_us = monotonic_us() };
+    // Hot restarts are handed over through this Unix socket if set
+    restart_init(&ctx.restart, getenv("HOT_RESTART_SOCKET"));
 
-    struct connection_state state = {0};
 
     /* -------------------- MAIN LOOP -------------------- */
     while (true) {
+        bool backlog = watch_sockets(sockets, peer_generations, &ctx);
 
-        // Use poll() to wait for events on the monitored sockets.
-        int ready = poll(sockets, sizeof(sockets) / sizeof(sockets[0]), -1);
+        // Use poll() to wait for events on the monitored sockets, but wake up for the next timer; requests deferred by the
+        // scheduler only check for new events.
+        int ready = poll(sockets, sizeof(sockets) / sizeof(sockets[0]), backlog ? 0 : timer_wheel_timeout(&ctx.wheel, monotonic_ms()));
         if (ready == -1) {
             if (errno == EINTR) {
                 continue; // Retry poll
@@ -81,144 +366,91 @@ void chord_processor(struct sockaddr_in addr, int stream_socket, int datagram_so
             }
         }
 
-        // Process events on the monitored sockets.
-        for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i += 1) {
-            if (sockets[i].revents != POLLIN) {
-                // If there are no POLLIN events on the socket, continue to the next iteration.
+        // Run expired timers: lookup retransmits, cache expiry and connection deadlines
+        timer_wheel_advance(&ctx.wheel, monotonic_ms());
+
+        /* -------------------- CONTROL TRAFFIC: DATAGRAMS AND CONNECTIONS TO OTHER NODES -------------------- */
+        uint64_t started_us = monotonic_us();
+        if (sockets[POLL_DATAGRAM].revents & POLLIN) {
+            receive_datagrams(&ctx);
+        }
+        for (size_t i = 0; i < PEER_POOL_SIZE; i += 1) {
+            struct peer_conn* conn = &ctx.peers.conns[i];
+            if ((sockets[POLL_PEERS + i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))
+                && sockets[POLL_PEERS + i].fd == conn->sock && conn->generation == peer_generations[i]) {  // not replaced by a handler meanwhile
+                peer_handle(conn, sockets[POLL_PEERS + i].revents);
+            }
+        }
+        outbox_flush(&ctx.outbox);
+        uint64_t now_us = scheduler_control_done(&ctx.scheduler, started_us);
+
+        /* -------------------- CLIENT REQUESTS: EXISTING (CLIENT) TCP CONNECTIONS, ROUND ROBIN -------------------- */
+        for (size_t n = 0; n < MAX_CONNECTIONS; n += 1) {
+            size_t i = (ctx.scheduler.first + n) % MAX_CONNECTIONS;
+            struct connection_state* state = &ctx.connections[i];
+            short revents = sockets[POLL_CONNECTIONS + i].fd == state->sock ? sockets[POLL_CONNECTIONS + i].revents : 0;
+            if (state->sock != -1 && (revents & (POLLOUT | POLLHUP | POLLERR)) && connection_pending(state)) {
+                // The client takes the replies queued, and the requests received meanwhile are handled
+                if (!handle_writable(state, &ctx)) {
+                    connection_end(state);
+                }
                 continue;
             }
-            int s = sockets[i].fd;
-
+            bool readable = revents & (POLLIN | POLLHUP | POLLERR);
+            if (state->sock == -1 || state->paused || connection_pending(state) || !(readable || state->deferred)) {
+                continue;  // closed by a timer, paused or replied to by a handler meanwhile, or nothing to do
+            }
 
-        /* -------------------- HANDLING NEW TCP CONNECTION -------------------- */
-            if (s == stream_socket) {
-
-                // If the event is on the stream_socket, accept a new connection from a client.
-                connection = accept(stream_socket, NULL, NULL);
-                if (connection == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                    close(stream_socket);
-                    perror("accept");
-                    exit(EXIT_FAILURE);
-                } else {
-                    connection_setup(&state, connection);
-
-                    // limit to one connection at a time
-                    sockets[0].events = 0;
-                    sockets[2].fd = connection;
-                    sockets[2].events = POLLIN;
-                }
-        /* -------------------- HANDLING TCP CONNECTION -------------------- */
-            } else if (s == datagram_socket) {
-                
-                /* to handle EWOULDBLOCK/EAGAIN errors in your recvfrom and sendto calls.*/
-                int received_bytes = recvfrom(datagram_socket, (char *)recv_buffer, sizeof(recv_buffer), MSG_WAITALL, (struct sockaddr *)&client_addr, &client_addr_len); // later take care of the client address
-                if (received_bytes == -1) {
-                    perror("recvfrom failed");
-                    // Handle the error
+            // Datagrams of other nodes are not kept waiting for longer than a slice
+            if (scheduler_control_due(&ctx.scheduler, now_us)) {
+                receive_datagrams(&ctx);
+                outbox_flush(&ctx.outbox);
+                ctx.scheduler.slices += 1;
+                now_us = scheduler_control_done(&ctx.scheduler, now_us);
+                if (state->sock == -1 || state->paused) {
+                    continue;
                 }
+            }
 
-                
-
-                parse_dht_lookup_message(&lookup_msg, recv_buffer);
-
-                if (lookup_msg.messageType == 0) {
-                    /* -------------------- PROCESS INCOMING LOOKUP MESSAGE -------------------- */
-
-                  
-
-                    if (is_responsible_hashed(lookup_msg.key, own_node.self_id, own_node.pred.id)) {
-
-                        /* -------------------- LOOKUP REPLY TO NODE ORIGIN -------------------- */
-                        //TODO: isolate this later
-                        // Reply to the origin
-                        struct sockaddr_in origin_addr;
-                        memset(&origin_addr, 0, sizeof(origin_addr));
-                        // construct origin_addr as destination for a reply
-                        origin_addr.sin_family = AF_INET;
-                        origin_addr.sin_addr = lookup_msg.originNodeIP;
-                        origin_addr.sin_port = htons(lookup_msg.originNodePort);
-                        // construct reply msg struct
-                        lookup_msg.messageType = 1;
-                        lookup_msg.key = own_node.pred.id; // --> why in the Aufgabenstellung  Hash ID: ID des Vorgängers der antwortenden Node
-                        lookup_msg.originNodeID = own_node.self_id;
-                        lookup_msg.originNodeIP = addr.sin_addr;
-                        lookup_msg.originNodePort = ntohs(addr.sin_port);
-
-                        int lookup_size = construct_dht_lookup_message(&lookup_msg, send_buffer);
-                        int sent_bytes = sendto(datagram_socket, send_buffer, lookup_size, 0, (struct sockaddr *)&origin_addr, sizeof(origin_addr));                       
-                        if (sent_bytes == -1) {
-                            perror("sendto failed");
-                            // Handle the error
-                        }
-                        // } 
-                 
-                    } else if (is_responsible_hashed(lookup_msg.key, own_node.succ.id, own_node.self_id)) { // successor responsible? 
-                        /* -------------------- LOOKUP REPLY TO NODE ORIGIN FOR SUCCESSOR -------------------- */
-                        //TODO: isolate this later
-                        struct sockaddr_in origin_addr;
-                        memset(&origin_addr, 0, sizeof(origin_addr));
-
-                        // construct origin_addr as destination for a reply
-                        origin_addr.sin_family = AF_INET;
-                        origin_addr.sin_addr = lookup_msg.originNodeIP;
-                        origin_addr.sin_port = htons(lookup_msg.originNodePort);
-                        
-                        memset(&send_buffer, 0, sizeof(send_buffer));
-                        // construct reply msg struct
-                        lookup_msg.messageType = 1;
-                        lookup_msg.key = own_node.self_id; // --> why in the Aufgabenstellung  Hash ID: ID des Vorgängers der antwortenden Node
-                        lookup_msg.originNodeID = own_node.succ.id;
-                        lookup_msg.originNodeIP = own_node.succ.ip;
-                        lookup_msg.originNodePort = own_node.succ.port;
-
-                        int lookup_size = construct_dht_lookup_message(&lookup_msg, send_buffer);
-                        int sent_bytes = sendto(datagram_socket, send_buffer, lookup_size, 0, (struct sockaddr *)&origin_addr, sizeof(origin_addr));                       
-                        if (sent_bytes == -1) {
-                            perror("sendto failed");
-                            // Handle the error
-                        }
-                        // } 
-                    } else {
-
-                        /* -------------------- FORWARD LOOKUP TO SUCCESSOR -------------------- */
-
-                        //TODO: isolate this later
-                        struct sockaddr_in successor_addr;
-                        memset(&successor_addr, 0, sizeof(successor_addr));
-                        successor_addr.sin_family = AF_INET;
-                        successor_addr.sin_addr = own_node.succ.ip;
-                        successor_addr.sin_port = htons(own_node.succ.port);
-
-                        int lookup_size = construct_dht_lookup_message(&lookup_msg, send_buffer);
-
-                        int sent_bytes = sendto(datagram_socket, send_buffer, lookup_size, 0, (struct sockaddr *)&successor_addr, sizeof(successor_addr));                       
-                        if (sent_bytes == -1) {
-                            perror("sendto failed");
-                            // Handle the error
-                        }
-                    }
-
-                /* -------------------- PROCESS LOOKUP REPLY MESSAGE -------------------- */
-                } else if (lookup_msg.messageType == 1) {
-
-                    // put the msg to the lookup msgs' array (save msg)
-                    addOrUpdateMessage(lookupMessages, &nextFreeIndex, lookup_msg);
-
-                }
-            } else {
+            if (admission_shed(&ctx, state)) {
+                connection_end(state);
+            } else if (!handle_connection(state, &ctx)) {  // get ready for a new connection, once the final reply is sent
+                connection_end(state);
+            }
+            now_us = scheduler_data_done(&ctx.scheduler, now_us);
+        }
+        ctx.scheduler.first = (ctx.scheduler.first + 1) % MAX_CONNECTIONS;
 
-            /* -------------------- HANDLING EXISTING (CLIENT) TCP CONNECTION -------------------- */
-                assert(s == state.sock);
+        /* -------------------- HOT RESTART -------------------- */
+        if (sockets[POLL_RESTART].revents & POLLIN) {
+            restart_accept(&ctx);
+        }
+        if (restart_draining(&ctx.restart) && restart_drain(&ctx)) {
+            restart_handoff(&ctx, stream_socket);  // exits, unless the new process is gone
+        }
 
-                // Call the 'handle_connection' function to process the incoming data on the socket.
-                bool cont = handle_connection(&state, own_node, datagram_socket, &lookup_msg, lookupMessages, &nextFreeIndex);
-                if (!cont) {  // get ready for a new connection
-                    sockets[0].events = POLLIN;
-                    sockets[2].fd = -1;
-                    sockets[2].events = 0;
+        /* -------------------- HANDLING NEW TCP CONNECTION -------------------- */
+        if ((sockets[POLL_STREAM].revents & POLLIN) && !restart_draining(&ctx.restart)) {
+            // Accept a new connection from a client; last, so it never picks up the events of a connection closed above
+            connection = accept(stream_socket, NULL, NULL);
+            if (connection == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(stream_socket);
+                perror("accept");
+                exit(EXIT_FAILURE);
+            } else if (connection != -1) {
+                // only polled while a connection slot is free
+                // Non-blocking, replies the client does not take right away are queued instead
+                if (fcntl(connection, F_SETFL, O_NONBLOCK) == -1) {
+                    perror("fcntl");
                 }
+                struct connection_state* state = free_connection(&ctx);
+                connection_setup(state, connection);
+                admission_watch(&ctx.admission, connection);
+                connection_touch(state, &ctx.wheel);
             }
         }
 
+        // Send the messages to other nodes of this iteration, those for the same node packed together
+        outbox_flush(&ctx.outbox);
     }
 }
@@ -1,9 +1,81 @@
-#ifndef NODE_H
-#define NODE_H
+#ifndef CHORD_PROCESSOR_H
+#define CHORD_PROCESSOR_H
 
+#include "admission.h"
+#include "balance.h"
+#include "data.h"
+#include "hotkeys.h"
+#include "http.h"
+#include "near.h"
 #include "node.h"
+#include "peer_pool.h"
+#include "restart.h"
+#include "scheduler.h"
+#include "successors.h"
+#include "timer_wheel.h"
 #include <poll.h>
 
-void chord_processor(struct sockaddr_in addr, int stream_socket, int dram_socket, struct NetworkNodes own_node) ;
+#define ROUTE_SWEEP_INTERVAL_MS 1000 // How often expired lookup replies are dropped
+#define MAX_CONNECTIONS 16 // Client connections served at the same time
+#define DHT_RECV_BURST 32 // Datagrams received at a time, before client requests are served again
+#define DHT_SHED_BURST 256 // ... while client requests are shed
 
-#endif
\ No newline at end of file
+
+/**
+ * State of a node shared between the event loop and the request handlers
+ *
+ * `addr`: the address the TCP and UDP sockets are bound to
+ * `datagram_socket`: UDP socket of the Chord protocol
+ * `own_node`: this node and its neighbours in the ring
+ * `lookupMessages`: lookup replies received, used as routing cache
+ * `nextFreeIndex`: next free index in `lookupMessages`
+ * `outbox`: messages to other nodes, sent at the end of each iteration of the event loop
+ * `pending_lookups`: lookups sent, but not answered yet
+ * `wheel`: all timers of the node
+ * `route_sweep`: periodic expiry of `lookupMessages`
+ * `store`: the key-value pairs this node is responsible for
+ * `store_sweep`: background expiry of the store, pending while tuples have a TTL
+ * `connections`: client connections, unused ones have no socket (-1)
+ * `peers`: connections to other nodes, for requests forwarded on behalf of clients
+ * `hotkeys`: requests per key, to find the hottest keys
+ * `near`: values of hot keys other nodes are responsible for, and the nodes caching values of this one
+ * `successors`: the next nodes on the ring, watched by heartbeats
+ * `balance`: load of this node and its predecessor, and the ID moves balancing them
+ * `admission`: sheds new requests while they wait too long in the event loop
+ * `scheduler`: shares the event loop between control traffic of other nodes and client requests
+ * `restart`: hands the node over to a new process on a hot restart
+ * `udp_values`: GETs of keys of other nodes are answered with the value fetched over UDP instead of a redirect
+ * `next_fetch_id`: id of the last fetch over UDP
+ */
+struct chord_context {
+    struct sockaddr_in addr;
+    int datagram_socket;
+    struct NetworkNodes own_node;
+    DHTLookupMessage lookupMessages[MAX_LOOKUP_MESSAGES];
+    int nextFreeIndex;
+    struct dht_outbox outbox;
+    struct pending_lookups pending_lookups;
+    struct timer_wheel wheel;
+    struct timer route_sweep;
+    struct store store;
+    struct timer store_sweep;
+    struct connection_state connections[MAX_CONNECTIONS];
+    struct peer_pool peers;
+    struct hotkeys hotkeys;
+    struct near_cache near;
+    struct successor_list successors;
+    struct load_balance balance;
+    struct admission admission;
+    struct scheduler scheduler;
+    struct hot_restart restart;
+    bool udp_values;
+    uint32_t next_fetch_id;
+};
+
+void schedule_store_sweep(struct chord_context* ctx);
+
+bool route_key(const struct chord_context* ctx, uint16_t key, struct sockaddr_in* owner);
+
+void chord_processor(struct sockaddr_in addr, int stream_socket, int dram_socket, struct NetworkNodes own_node, int restart_conn) ;
+
+#endif
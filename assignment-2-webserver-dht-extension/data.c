@@ -1,67 +1,798 @@
 #include "data.h"
 
+#include <stdio.h>
 #include <string.h>
+#ifdef STORE_COMPRESSION
+#include <limits.h>
+#include <zlib.h>
+#endif
 
+#include "timer_wheel.h"
 
-struct tuple* find(string key, struct tuple* tuples, size_t n_tuples) {
-    for (size_t i = 0; i < n_tuples; i += 1) {
+#define NO_TUPLE 0  // terminates bucket chains and the free list, tuples are referenced as index + 1
+
+
+/**
+ * FNV-1a hash of a key, selects its bucket.
+ */
+static uint32_t key_hash(const string key) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = key; *c; c += 1) {
+        hash ^= (uint8_t) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * Position of a key on the ring, the same as `hash()` of node.h.
+ */
+static uint16_t ring_position(const string key) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t*) key, strlen(key), digest);
+    return (uint16_t) (digest[0] << 8 | digest[1]);
+}
+
+
+/**
+ * Memory accounted for a tuple.
+ */
+static size_t tuple_memory(size_t key_length, size_t value_length) {
+    return sizeof(struct tuple) + key_length + 1 + value_length;
+}
+
+
+static void* checked_realloc(void* ptr, size_t size) {
+    void* result = realloc(ptr, size);
+    if (!result) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+
+/**
+ * Counter of the key filter for the `i`th hash of a key, by double hashing.
+ */
+static size_t filter_slot(const struct store* store, uint32_t hash, unsigned i) {
+    // The murmur3 finalizer derives a second hash, odd so the steps cover all counters
+    uint32_t step = hash;
+    step ^= step >> 16;
+    step *= 0x85ebca6bu;
+    step ^= step >> 13;
+    step *= 0xc2b2ae35u;
+    step ^= step >> 16;
+    return (hash + i * (step | 1)) & (store->n_filter - 1);
+}
+
+
+static void filter_add(struct store* store, uint32_t hash) {
+    for (unsigned i = 0; i < STORE_FILTER_HASHES; i += 1) {
+        uint8_t* counter = &store->filter[filter_slot(store, hash, i)];
+        if (*counter < UINT8_MAX) {
+            *counter += 1;
+        }
+    }
+}
+
+
+static void filter_remove(struct store* store, uint32_t hash) {
+    for (unsigned i = 0; i < STORE_FILTER_HASHES; i += 1) {
+        uint8_t* counter = &store->filter[filter_slot(store, hash, i)];
+        // A saturated counter may count more keys than it can tell
+        if (*counter < UINT8_MAX) {
+            *counter -= 1;
+        }
+    }
+}
+
+
+/**
+ * Whether a key of the hash may be stored, false only if it is not.
+ */
+static bool filter_contains(const struct store* store, uint32_t hash) {
+    for (unsigned i = 0; i < STORE_FILTER_HASHES; i += 1) {
+        if (!store->filter[filter_slot(store, hash, i)]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Rebuild the hash table with `n_buckets` buckets (a power of two), and the key filter sized for them.
+ */
+static void rehash(struct store* store, size_t n_buckets) {
+    free(store->buckets);
+    store->buckets = calloc(n_buckets, sizeof(uint32_t));
+    if (!store->buckets) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    store->n_buckets = n_buckets;
+
+    free(store->filter);
+    store->n_filter = n_buckets * STORE_FILTER_COUNTERS;
+    store->filter = calloc(store->n_filter, sizeof(uint8_t));
+    if (!store->filter) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < store->capacity; i += 1) {
+        struct tuple* tuple = &store->tuples[i];
+        if (tuple->key) {
+            uint32_t* head = &store->buckets[tuple->key_hash & (n_buckets - 1)];
+            tuple->next = *head;
+            *head = i + 1;
+            filter_add(store, tuple->key_hash);
+        }
+    }
+}
+
+
+/**
+ * Grow the tuple array to `capacity` slots, adding the new slots to the free list.
+ */
+static void grow(struct store* store, size_t capacity) {
+    if (capacity <= store->capacity) {
+        return;
+    }
+    store->tuples = checked_realloc(store->tuples, capacity * sizeof(struct tuple));
+    memset(&store->tuples[store->capacity], 0, (capacity - store->capacity) * sizeof(struct tuple));
+
+    for (size_t i = capacity; i > store->capacity; i -= 1) {
+        store->tuples[i - 1].next = store->free_list;
+        store->free_list = i;
+    }
+    store->capacity = capacity;
+
+    // Keep the load factor at or below one
+    size_t n_buckets = store->n_buckets ? store->n_buckets : 1;
+    while (n_buckets < capacity) {
+        n_buckets *= 2;
+    }
+    if (n_buckets != store->n_buckets) {
+        rehash(store, n_buckets);
+    }
+}
+
+
+/**
+ * Find the tuple of the key. Misses of reads, `counted`, are counted for the metrics of the filter; writes and deletes look
+ * up keys they do not expect to exist.
+ */
+static struct tuple* find(struct store* store, const string key, bool counted) {
+    uint32_t hash = key_hash(key);
+    if (!filter_contains(store, hash)) {
+        store->filter_negatives += counted;
+        return NULL;
+    }
+    for (uint32_t i = store->buckets[hash & (store->n_buckets - 1)]; i != NO_TUPLE; i = store->tuples[i - 1].next) {
+        struct tuple* tuple = &store->tuples[i - 1];
         // compare keys with 'strcmp'
-        if (tuples[i].key && strcmp(key, tuples[i].key) == 0) {
-            return &(tuples[i]);
+        if (tuple->key_hash == hash && strcmp(key, tuple->key) == 0) {
+            return tuple;
         }
     }
+    store->filter_false_positives += counted;
     return NULL;
 }
 
 
-const char* get(const string key, struct tuple* tuples, size_t n_tuples, size_t* value_length) {
-    struct tuple* tuple = find(key, tuples, n_tuples);
-    if (tuple) {
+/**
+ * Whether an index entry comes before the tuple at `ring_pos`, ties are ordered by tuple.
+ */
+static bool index_before(const struct index_entry* entry, uint16_t ring_pos, uint32_t tuple) {
+    return entry->ring_pos < ring_pos || (entry->ring_pos == ring_pos && entry->tuple < tuple);
+}
+
+
+/**
+ * Find the last entry before the tuple at `ring_pos` on every level of the index.
+ */
+static void index_search(const struct store* store, uint16_t ring_pos, uint32_t tuple, struct index_entry** before) {
+    struct index_entry* entry = store->index;
+    for (int level = STORE_INDEX_LEVELS - 1; level >= 0; level -= 1) {
+        while (entry->next[level] && index_before(entry->next[level], ring_pos, tuple)) {
+            entry = entry->next[level];
+        }
+        before[level] = entry;
+    }
+}
+
+
+static void index_add(struct store* store, uint16_t ring_pos, uint32_t tuple) {
+    struct index_entry* before[STORE_INDEX_LEVELS];
+    index_search(store, ring_pos, tuple, before);
+
+    // xorshift32, two bits per level
+    uint32_t random = store->index_seed;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    store->index_seed = random;
+    int levels = 1;
+    while (levels < STORE_INDEX_LEVELS && (random & 3) == 0) {
+        levels += 1;
+        random >>= 2;
+    }
+
+    struct index_entry* entry = malloc(sizeof(struct index_entry) + levels * sizeof(struct index_entry*));
+    if (!entry) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    entry->ring_pos = ring_pos;
+    entry->tuple = tuple;
+    for (int level = 0; level < levels; level += 1) {
+        entry->next[level] = before[level]->next[level];
+        before[level]->next[level] = entry;
+    }
+}
+
+
+static void index_remove(struct store* store, uint16_t ring_pos, uint32_t tuple) {
+    struct index_entry* before[STORE_INDEX_LEVELS];
+    index_search(store, ring_pos, tuple, before);
+
+    struct index_entry* entry = before[0]->next[0];
+    for (int level = 0; level < STORE_INDEX_LEVELS && before[level]->next[level] == entry; level += 1) {
+        before[level]->next[level] = entry->next[level];
+    }
+    free(entry);
+}
+
+
+uint64_t tuple_fingerprint(const struct tuple* tuple) {
+    // FNV-1a over the key, its terminator and the digest of the value
+    uint64_t hash = 14695981039346656037u;
+    for (const char* c = tuple->key; ; c += 1) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211u;
+        if (!*c) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; i += 1) {
+        hash ^= tuple->digest[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+
+/**
+ * Add or remove a tuple's fingerprint on the path from its leaf to the root of the hash tree.
+ */
+static void tree_toggle(struct store* store, const struct tuple* tuple) {
+    uint64_t fingerprint = tuple_fingerprint(tuple);
+    for (uint32_t node = STORE_TREE_LEAVES + (tuple->ring_pos >> STORE_TREE_SHIFT); node >= 1; node /= 2) {
+        store->tree[node] ^= fingerprint;
+    }
+}
+
+
+/**
+ * Free a value removed from the store, unless it is lent out: then it is freed once returned, and stays accounted for.
+ */
+static void free_value(struct store* store, char* value, size_t value_length) {
+    for (size_t i = 0; i < store->n_loans; i += 1) {
+        if (store->loans[i].value == value) {
+            store->loans[i].orphaned = true;
+            store->loans[i].value_length = value_length;
+            store->memory += value_length;
+            return;
+        }
+    }
+    free(value);
+}
+
+
+/**
+ * Memory accounted for a blob, its tuples only account for their keys.
+ */
+static size_t blob_memory(size_t value_length) {
+    return sizeof(struct blob) + value_length;
+}
+
+
+static struct blob** blob_bucket(struct blob** buckets, size_t n_buckets, const uint8_t* digest) {
+    uint32_t hash;
+    memcpy(&hash, digest, sizeof(hash));  // the digest is uniformly distributed already
+    return &buckets[hash & (n_buckets - 1)];
+}
+
+
+static struct blob* find_blob(struct store* store, const uint8_t* digest) {
+    if (!store->n_blob_buckets) {
+        return NULL;
+    }
+    struct blob* blob = *blob_bucket(store->blobs, store->n_blob_buckets, digest);
+    while (blob && memcmp(blob->digest, digest, SHA256_DIGEST_LENGTH) != 0) {
+        blob = blob->next;
+    }
+    return blob;
+}
+
+
+/**
+ * Add a blob owning `value`, referenced once.
+ */
+static struct blob* add_blob(struct store* store, const uint8_t* digest, char* value, size_t value_length, bool compressed, size_t raw_length) {
+    // Keep the load factor at or below one
+    if (store->n_blobs >= store->n_blob_buckets) {
+        size_t n_buckets = store->n_blob_buckets ? store->n_blob_buckets * 2 : STORE_INITIAL_CAPACITY;
+        struct blob** buckets = calloc(n_buckets, sizeof(struct blob*));
+        if (!buckets) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < store->n_blob_buckets; i += 1) {
+            while (store->blobs[i]) {
+                struct blob* blob = store->blobs[i];
+                store->blobs[i] = blob->next;
+                struct blob** head = blob_bucket(buckets, n_buckets, blob->digest);
+                blob->next = *head;
+                *head = blob;
+            }
+        }
+        free(store->blobs);
+        store->blobs = buckets;
+        store->n_blob_buckets = n_buckets;
+    }
+
+    struct blob* blob = malloc(sizeof(struct blob));
+    if (!blob) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *blob = (struct blob) {
+        .value = value,
+        .value_length = value_length,
+        .compressed = compressed,
+        .raw_length = raw_length,
+        .refs = 1,
+    };
+    memcpy(blob->digest, digest, SHA256_DIGEST_LENGTH);
+
+    struct blob** head = blob_bucket(store->blobs, store->n_blob_buckets, digest);
+    blob->next = *head;
+    *head = blob;
+    store->n_blobs += 1;
+    store->memory += blob_memory(value_length);
+    return blob;
+}
+
+
+/**
+ * Drop a reference to a blob, freeing it with the last one.
+ */
+static void release_blob(struct store* store, struct blob* blob) {
+    blob->refs -= 1;
+    if (blob->refs > 0) {
+        return;
+    }
+    struct blob** link = blob_bucket(store->blobs, store->n_blob_buckets, blob->digest);
+    while (*link != blob) {
+        link = &(*link)->next;
+    }
+    *link = blob->next;
+
+    store->n_blobs -= 1;
+    store->memory -= blob_memory(blob->value_length);
+    free_value(store, blob->value, blob->value_length);
+    free(blob);
+}
+
+
+/**
+ * Unlink a tuple from its bucket, free its memory and return its slot to the free list.
+ */
+static void remove_tuple(struct store* store, struct tuple* tuple) {
+    uint32_t index = (tuple - store->tuples) + 1;
+    uint32_t* link = &store->buckets[tuple->key_hash & (store->n_buckets - 1)];
+    while (*link != index) {
+        link = &store->tuples[*link - 1].next;
+    }
+    *link = tuple->next;
+    filter_remove(store, tuple->key_hash);
+    index_remove(store, tuple->ring_pos, index);
+    tree_toggle(store, tuple);
+
+    store->memory -= tuple_memory(strlen(tuple->key), tuple->blob ? 0 : tuple->value_length);
+    if (tuple->expires_at) {
+        store->n_expiring -= 1;
+    }
+    store->count -= 1;
+
+    free(tuple->key);
+    if (tuple->blob) {
+        release_blob(store, tuple->blob);
+    } else {
+        free_value(store, tuple->value, tuple->value_length);
+    }
+    *tuple = (struct tuple) { .next = store->free_list };
+    store->free_list = index;
+}
+
+
+/**
+ * Whether a tuple has expired by `now_ms`.
+ */
+static bool expired(const struct tuple* tuple, uint64_t now_ms) {
+    return tuple->expires_at && tuple->expires_at <= now_ms;
+}
+
+
+/**
+ * Evict tuples in CLOCK order until `needed` more bytes fit into the budget.
+ *
+ * Expired tuples are taken first, referenced tuples get a second chance.
+ */
+static void make_room(struct store* store, size_t needed) {
+    if (!store->budget) {
+        return;
+    }
+    uint64_t now_ms = monotonic_ms();
+
+    while (store->count > 0 && store->memory + needed > store->budget) {
+        struct tuple* tuple = &store->tuples[store->clock_hand];
+        store->clock_hand = (store->clock_hand + 1) % store->capacity;
+
+        if (!tuple->key) {
+            continue;
+        }
+        if (expired(tuple, now_ms)) {
+            store->expirations += 1;
+        } else if (tuple->referenced) {
+            tuple->referenced = false;
+            continue;
+        } else {
+            store->evictions += 1;
+        }
+        remove_tuple(store, tuple);
+    }
+}
+
+
+#ifdef STORE_COMPRESSION
+/**
+ * Replace `*value` by its gzip compression if that saves at least an eighth of its `*value_length` bytes.
+ *
+ * Returns whether the value was replaced. The gzip format lets the compressed bytes be sent to clients as they are.
+ */
+static bool compress_value(const struct store* store, char** value, size_t* value_length) {
+    size_t length = *value_length;
+    if (!store->compress_threshold || length < store->compress_threshold || length > UINT_MAX) {
+        return false;
+    }
+
+    z_stream stream = {0};
+    // window bits above 15 select the gzip wrapper, the fastest level keeps the event loop responsive
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    size_t bound = deflateBound(&stream, length);
+    char* compressed = malloc(bound);
+    if (!compressed) {
+        deflateEnd(&stream);
+        return false;
+    }
+    stream.next_in = (Bytef*) *value;
+    stream.avail_in = length;
+    stream.next_out = (Bytef*) compressed;
+    stream.avail_out = bound;
+    bool done = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+    size_t compressed_length = stream.total_out;
+    deflateEnd(&stream);
+
+    if (!done || compressed_length > length - length / 8) {
+        free(compressed);
+        return false;
+    }
+    char* shrunk = realloc(compressed, compressed_length);
+    free(*value);
+    *value = shrunk ? shrunk : compressed;
+    *value_length = compressed_length;
+    return true;
+}
+#endif
+
+
+const char* tuple_value(struct store* store, const struct tuple* tuple, size_t* value_length) {
+    if (!tuple->compressed) {
         *value_length = tuple->value_length;
         return tuple->value;
-    } else {
+    }
+#ifdef STORE_COMPRESSION
+    if (tuple->raw_length > store->scratch_capacity) {
+        char* scratch = realloc(store->scratch, tuple->raw_length);
+        if (!scratch) {
+            return NULL;
+        }
+        store->scratch = scratch;
+        store->scratch_capacity = tuple->raw_length;
+    }
+
+    z_stream stream = {0};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) {
         return NULL;
     }
+    stream.next_in = (Bytef*) tuple->value;
+    stream.avail_in = tuple->value_length;
+    stream.next_out = (Bytef*) store->scratch;
+    stream.avail_out = tuple->raw_length;
+    bool done = inflate(&stream, Z_FINISH) == Z_STREAM_END;
+    inflateEnd(&stream);
+    if (done) {
+        *value_length = tuple->raw_length;
+        return store->scratch;
+    }
+#else
+    (void) store;
+#endif
+    return NULL;
 }
 
 
-bool set(const string key, char* value, size_t value_length, struct tuple* tuples, size_t n_tuples) {
-    // check if tuple already exists
-    struct tuple* tuple = find(key, tuples, n_tuples);
+void store_init(struct store* store, size_t budget) {
+    *store = (struct store) { .budget = budget, .index_seed = 2463534242u };
+    store->index = calloc(1, sizeof(struct index_entry) + STORE_INDEX_LEVELS * sizeof(struct index_entry*));
+    if (!store->index) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+#ifdef STORE_COMPRESSION
+    store->compress_threshold = STORE_COMPRESS_THRESHOLD;
+#endif
+    grow(store, STORE_INITIAL_CAPACITY);
+}
 
-    if (tuple) {  // overwrite existing value
-        free(tuple->value);
-        tuple->value = (char*) malloc(value_length * sizeof(char));
-        strcpy(tuple->value, value);
-        tuple->value_length = value_length;
-        return true;
-    } else {  // add tuple
-        for (size_t i = 0; i < n_tuples; i += 1) {
-            if (tuples[i].key == NULL) {
-                tuples[i].key = (char*) malloc((strlen(key) + 1) * sizeof(char));
-                strcpy(tuples[i].key, key);
-                tuples[i].value = (char*) malloc(value_length * sizeof(char));
-                memcpy(tuples[i].value, value, value_length);
-                tuples[i].value_length = value_length;
-                return false;
-            }
+
+void store_reserve(struct store* store, size_t n_tuples) {
+    size_t capacity = store->capacity;
+    while (capacity < n_tuples) {
+        capacity *= 2;
+    }
+    grow(store, capacity);
+}
+
+
+bool store_fits(const struct store* store, size_t key_length, size_t value_length) {
+    return !store->budget || tuple_memory(key_length, value_length) <= store->budget;
+}
+
+
+size_t store_max_value(const struct store* store, size_t key_length) {
+    if (!store->budget) {
+        return SIZE_MAX;
+    }
+    size_t overhead = tuple_memory(key_length, 0);
+    return store->budget > overhead ? store->budget - overhead : 0;
+}
+
+
+const struct tuple* get_tuple(struct store* store, const string key) {
+    struct tuple* tuple = find(store, key, true);
+    if (tuple && expired(tuple, monotonic_ms())) {
+        store->expirations += 1;
+        remove_tuple(store, tuple);
+        tuple = NULL;
+    }
+
+    if (tuple) {
+        tuple->referenced = true;
+    }
+    return tuple;
+}
+
+
+const char* store_lend(struct store* store, const struct tuple* tuple) {
+    for (size_t i = 0; i < store->n_loans; i += 1) {
+        if (store->loans[i].value == tuple->value) {
+            store->loans[i].count += 1;
+            return tuple->value;
         }
     }
-    return false;  // fail silently if no space for a new tuple is available 
+    if (store->n_loans == store->loans_capacity) {
+        size_t capacity = store->loans_capacity ? store->loans_capacity * 2 : 8;
+        struct loan* loans = realloc(store->loans, capacity * sizeof(struct loan));
+        if (!loans) {
+            return NULL;
+        }
+        store->loans = loans;
+        store->loans_capacity = capacity;
+    }
+    store->loans[store->n_loans] = (struct loan) { .value = tuple->value, .count = 1 };
+    store->n_loans += 1;
+    return tuple->value;
+}
+
+
+void store_return(struct store* store, const char* value) {
+    for (size_t i = 0; i < store->n_loans; i += 1) {
+        struct loan* loan = &store->loans[i];
+        if (loan->value != value) {
+            continue;
+        }
+        loan->count -= 1;
+        if (loan->count > 0) {
+            return;
+        }
+        if (loan->orphaned) {
+            store->memory -= loan->value_length;
+            free((char*) loan->value);
+        }
+        store->n_loans -= 1;
+        *loan = store->loans[store->n_loans];
+        return;
+    }
+}
+
+
+const char* get(struct store* store, const string key, size_t* value_length) {
+    const struct tuple* tuple = get_tuple(store, key);
+    return tuple ? tuple_value(store, tuple, value_length) : NULL;
 }
 
 
-bool delete(const string key, struct tuple* tuples, size_t n_tuples) {
-    struct tuple* tuple = find(key, tuples, n_tuples);
+enum store_result set_owned(struct store* store, const string key, char* value, size_t value_length) {
+    // validates conditional requests without rehashing
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t*) value, value_length, digest);
+
+    size_t key_length = strlen(key);
+
+    // A value held by other keys already is shared instead of being compressed and stored again
+    struct blob* blob = store->dedup ? find_blob(store, digest) : NULL;
+    struct blob unshared;  // describes the value if it is not deduplicated
+    if (blob) {
+        free(value);
+        blob->refs += 1;  // taken before making room, so the blob can not be evicted meanwhile
+    } else {
+        size_t raw_length = value_length;
+        bool compressed = false;
+#ifdef STORE_COMPRESSION
+        compressed = compress_value(store, &value, &value_length);
+#endif
+        if (!store_fits(store, key_length, value_length)) {
+            free(value);
+            return STORE_REJECTED;
+        }
+        if (store->dedup) {
+            blob = add_blob(store, digest, value, value_length, compressed, raw_length);
+        } else {
+            unshared = (struct blob) { .value = value, .value_length = value_length, .compressed = compressed, .raw_length = raw_length };
+            blob = &unshared;
+        }
+    }
+    // the memory of a shared value is accounted for by its blob
+    size_t owned_length = store->dedup ? 0 : blob->value_length;
 
+    // an existing tuple is replaced as a whole, so it can not be evicted while making room
+    struct tuple* tuple = find(store, key, false);
+    enum store_result result = tuple ? STORE_OVERWRITTEN : STORE_CREATED;
     if (tuple) {
-        free(tuple->key);
-        tuple->key = NULL;
-        free(tuple->value);
-        tuple->value = NULL;
-        tuple->value_length = 0;
+        remove_tuple(store, tuple);
+    }
+    make_room(store, tuple_memory(key_length, owned_length));
+
+    if (store->free_list == NO_TUPLE) {
+        grow(store, store->capacity * 2);
+    }
+    uint32_t index = store->free_list;
+    tuple = &store->tuples[index - 1];
+    store->free_list = tuple->next;
+
+    *tuple = (struct tuple) {
+        .key = (char*) malloc((key_length + 1) * sizeof(char)),
+        .value = blob->value,
+        .value_length = blob->value_length,
+        .key_hash = key_hash(key),
+        .compressed = blob->compressed,
+        .raw_length = blob->raw_length,
+        .blob = store->dedup ? blob : NULL,
+    };
+    strcpy(tuple->key, key);
+    memcpy(tuple->digest, digest, sizeof(digest));
+
+    uint32_t* head = &store->buckets[tuple->key_hash & (store->n_buckets - 1)];
+    tuple->next = *head;
+    *head = index;
+    filter_add(store, tuple->key_hash);
+    tuple->ring_pos = ring_position(key);
+    index_add(store, tuple->ring_pos, index);
+    tree_toggle(store, tuple);
+
+    store->memory += tuple_memory(key_length, owned_length);
+    store->count += 1;
+    return result;
+}
+
+
+enum store_result set(struct store* store, const string key, char* value, size_t value_length) {
+    char* copy = (char*) malloc((value_length ? value_length : 1) * sizeof(char));
+    memcpy(copy, value, value_length);
+    return set_owned(store, key, copy, value_length);
+}
+
+
+bool expire(struct store* store, const string key, uint64_t now_ms, uint64_t ttl_ms) {
+    struct tuple* tuple = find(store, key, false);
+    if (!tuple) {
+        return false;
+    }
+    if (!tuple->expires_at) {
+        store->n_expiring += 1;
+    }
+    tuple->expires_at = now_ms + ttl_ms;
+    return true;
+}
+
+
+bool delete(struct store* store, const string key) {
+    struct tuple* tuple = find(store, key, false);
+
+    if (tuple) {
+        remove_tuple(store, tuple);
         return true;
     } else {
         return false;
     }
 }
+
+
+size_t store_sweep(struct store* store, uint64_t now_ms, size_t max_slots) {
+    size_t removed = 0;
+    for (size_t i = 0; i < max_slots && i < store->capacity && store->n_expiring > 0; i += 1) {
+        struct tuple* tuple = &store->tuples[store->sweep_hand];
+        store->sweep_hand = (store->sweep_hand + 1) % store->capacity;
+
+        if (tuple->key && expired(tuple, now_ms)) {
+            store->expirations += 1;
+            remove_tuple(store, tuple);
+            removed += 1;
+        }
+    }
+    return removed;
+}
+
+
+/**
+ * Visit the tuples from ring position `first` through `last`, until `visit` returns false.
+ *
+ * Returns false if stopped by `visit`.
+ */
+static bool index_scan(const struct store* store, uint16_t first, uint16_t last, uint64_t now_ms, store_visitor visit, void* arg, size_t* visited) {
+    struct index_entry* before[STORE_INDEX_LEVELS];
+    index_search(store, first, NO_TUPLE, before);
+
+    for (const struct index_entry* entry = before[0]->next[0]; entry && entry->ring_pos <= last; entry = entry->next[0]) {
+        const struct tuple* tuple = &store->tuples[entry->tuple - 1];
+        if (expired(tuple, now_ms)) {
+            continue;
+        }
+        *visited += 1;
+        if (visit && !visit(tuple, arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+size_t store_range(const struct store* store, uint16_t from, uint16_t to, store_visitor visit, void* arg) {
+    uint64_t now_ms = monotonic_ms();
+    size_t visited = 0;
+    // An interval wrapping around zero is scanned in two parts
+    if (from < to) {
+        index_scan(store, from + 1, to, now_ms, visit, arg, &visited);
+    } else if (from == UINT16_MAX || index_scan(store, from + 1, UINT16_MAX, now_ms, visit, arg, &visited)) {
+        index_scan(store, 0, to, now_ms, visit, arg, &visited);
+    }
+    return visited;
+}
@@ -1,40 +1,291 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <openssl/sha.h>
 
 #include "util.h"
 
+#define STORE_INITIAL_CAPACITY 64  // tuples allocated up front, grows by doubling
+#define STORE_SWEEP_INTERVAL_MS 100  // period of the background expiry while tuples have a TTL
+#define STORE_SWEEP_BATCH 128  // slots examined per background expiry run
+#define STORE_COMPRESS_THRESHOLD 1024  // smallest value compressed by default, if built with STORE_COMPRESSION
+#define STORE_FILTER_COUNTERS 8  // counters of the key filter per hash bucket
+#define STORE_FILTER_HASHES 4  // counters a key is counted in
+#define STORE_INDEX_LEVELS 16  // levels of the ring order index, each taken with probability 1/4
+#define STORE_TREE_DEPTH 10  // levels of the hash tree below its root
+#define STORE_TREE_LEAVES (1 << STORE_TREE_DEPTH)
+#define STORE_TREE_SHIFT (16 - STORE_TREE_DEPTH)  // a leaf covers 2^shift ring positions
+
+/**
+ * A value shared by all keys holding the same bytes
+ *
+ * `digest`: SHA-256 of the uncompressed value, identifies the blob
+ * `refs`: number of tuples sharing the value, freed with the last one
+ * `next`: next blob of the same bucket
+ */
+struct blob {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    char* value;
+    size_t value_length;
+    bool compressed;
+    size_t raw_length;
+    uint32_t refs;
+    struct blob* next;
+};
+
+/**
+ * A value lent out of the store, see `store_lend()`
+ *
+ * `count`: loans of the value not returned yet
+ * `orphaned`: the value was removed from the store meanwhile and is freed once
+ *             returned; its `value_length` bytes stay accounted for until then
+ */
+struct loan {
+    const char* value;
+    size_t value_length;
+    uint32_t count;
+    bool orphaned;
+};
+
+/**
+ * Entry of the ring order index, a skip list of the tuples by `ring_pos`
+ *
+ * `tuple`: index + 1 of the tuple, stable while the tuple array grows
+ * `next`: next entry on each level of the entry
+ */
+struct index_entry {
+    uint16_t ring_pos;
+    uint32_t tuple;
+    struct index_entry* next[];
+};
+
 /**
  * A simple key-value entry
  *
- * Provides a simple, inefficient, key-value when combined with `get()`,
- * `set()`, and `delete()`.
+ * Provides a key-value store when combined with `get()`, `set()`, and
+ * `delete()`.
+ *
+ * `key_hash`: hash of the key, selects the bucket
+ * `next`: next tuple of the same bucket (index + 1), or of the free list
+ * `referenced`: set on access, cleared by the CLOCK hand before eviction
+ * `expires_at`: monotonic time in ms the tuple expires at, 0 for never
+ * `digest`: SHA-256 of the value, computed once when it is set
+ * `compressed`: `value` holds the value in gzip format, `raw_length` bytes once
+ *               decompressed; `value_length` is the compressed length then
+ * `blob`: owner of `value` if values are deduplicated, NULL if the tuple owns it
+ * `ring_pos`: position of the key on the ring, as hashed by `hash()` of node.h
  */
 struct tuple {
     string key;
     char* value;
     size_t value_length;
+    uint32_t key_hash;
+    uint32_t next;
+    bool referenced;
+    uint64_t expires_at;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    bool compressed;
+    size_t raw_length;
+    struct blob* blob;
+    uint16_t ring_pos;
 };
 
 /**
- * Get the value matching the key in an array of tuples
+ * Key-value store bounded by a memory budget
+ *
+ * Tuples live in a growable array, indexed by a chained hash table. Once
+ * keys, values and tuples exceed `budget` bytes, tuples are evicted in CLOCK
+ * order: the hand passes over the array, sparing recently accessed tuples
+ * once. Expired tuples are removed on access and by `store_sweep()`.
+ * If built with STORE_COMPRESSION, values of at least `compress_threshold`
+ * bytes are kept gzip-compressed when that saves memory. If `dedup` is set,
+ * keys holding identical values share a single reference-counted blob.
+ * A counting Bloom filter over the keys answers most lookups of missing keys
+ * without walking a bucket chain; counters are not decremented once saturated.
+ * A skip list orders the tuples by their ring position, so the keys of a ring
+ * interval are found without hashing every key, see `store_range()`.
+ * A hash tree over the ring positions summarizes the tuples, so two stores are
+ * compared by walking down only the subtrees whose hashes differ. A node's
+ * hash is the XOR of the fingerprints of all tuples below it, updated along
+ * the path to the root whenever a tuple is added or removed.
+ *
+ * `tuples`: `capacity` slots, unused slots have no key and are chained from `free_list`
+ * `buckets`: `n_buckets` heads of tuple chains (index + 1, 0 for empty)
+ * `clock_hand`: next slot inspected for eviction
+ * `sweep_hand`: next slot inspected for expiry
+ * `memory`: bytes used by keys, values and tuples
+ * `budget`: upper bound for `memory`, 0 for unlimited
+ * `n_expiring`: number of tuples with a TTL
+ * `compress_threshold`: smallest value compressed, 0 to disable compression
+ * `scratch`: `scratch_capacity` bytes holding the last value decompressed
+ * `blobs`: `n_blob_buckets` chains of blobs by digest, `n_blobs` in total
+ * `filter`: `n_filter` counters of the key filter, rebuilt with the hash table
+ * `filter_negatives`: reads of missing keys answered by the filter alone
+ * `filter_false_positives`: reads of missing keys the filter let through
+ * `index`: head of the ring order index, `index_seed` draws the levels of entries
+ * `loans`: `n_loans` values lent out, `loans_capacity` allocated
+ * `tree`: the hash tree, node 1 is the root and node n has the children 2n and
+ *         2n + 1; leaf l is node `STORE_TREE_LEAVES` + l and covers the ring
+ *         positions starting at l << `STORE_TREE_SHIFT`
+ */
+struct store {
+    struct tuple* tuples;
+    size_t capacity;
+    size_t count;
+    uint32_t free_list;
+    uint32_t* buckets;
+    size_t n_buckets;
+    size_t clock_hand;
+    size_t sweep_hand;
+    size_t memory;
+    size_t budget;
+    size_t n_expiring;
+    uint64_t evictions;
+    uint64_t expirations;
+    size_t compress_threshold;
+    char* scratch;
+    size_t scratch_capacity;
+    bool dedup;
+    struct blob** blobs;
+    size_t n_blob_buckets;
+    size_t n_blobs;
+    uint8_t* filter;
+    size_t n_filter;
+    uint64_t filter_negatives;
+    uint64_t filter_false_positives;
+    struct index_entry* index;
+    uint32_t index_seed;
+    struct loan* loans;
+    size_t n_loans;
+    size_t loans_capacity;
+    uint64_t tree[2 * STORE_TREE_LEAVES];
+};
+
+/**
+ * Outcome of storing a value
+ */
+enum store_result {
+    STORE_CREATED,
+    STORE_OVERWRITTEN,
+    STORE_REJECTED,  // the tuple alone exceeds the memory budget
+};
+
+
+/**
+ * Called for the tuples of a ring interval, returns false to stop
+ */
+typedef bool (*store_visitor)(const struct tuple* tuple, void* arg);
+
+
+/**
+ * Initialize an empty store limited to `budget` bytes (0 for unlimited).
+ */
+void store_init(struct store* store, size_t budget);
+
+/**
+ * Make room for at least `n_tuples` tuples without further reallocation.
+ */
+void store_reserve(struct store* store, size_t n_tuples);
+
+/**
+ * Whether a tuple with a key of `key_length` and a value of `value_length`
+ * bytes fits into the memory budget at all.
+ */
+bool store_fits(const struct store* store, size_t key_length, size_t value_length);
+
+/**
+ * The longest value with a key of `key_length` bytes that fits into the memory
+ * budget, SIZE_MAX without a budget.
+ */
+size_t store_max_value(const struct store* store, size_t key_length);
+
+/**
+ * Get the tuple of the key, or NULL if it does not exist
+ *
+ * The tuple is valid until the store is modified. Its value may be
+ * compressed, see `tuple_value()`.
+ */
+const struct tuple* get_tuple(struct store* store, const string key);
+
+/**
+ * Get the uncompressed value of a tuple
+ *
+ * A compressed value is decompressed into storage of the store, valid until
+ * the next value is decompressed. Returns NULL if memory is exhausted.
+ */
+const char* tuple_value(struct store* store, const struct tuple* tuple, size_t* value_length);
+
+/**
+ * Lend the value of a tuple out, as it is stored, possibly compressed
+ *
+ * The value is not freed until it is returned with `store_return()`, also if
+ * its tuple is replaced or removed meanwhile. Returns NULL if memory is exhausted.
+ */
+const char* store_lend(struct store* store, const struct tuple* tuple);
+
+/**
+ * Return a value lent out by `store_lend()`.
+ */
+void store_return(struct store* store, const char* value);
+
+/**
+ * Get the value matching the key
+ *
+ * Returns a pointer to the begin of the value, stores its length in
+ * `value_length`. Like `tuple_value()`, the pointer is only valid until the
+ * next value is decompressed.
+ */
+const char* get(struct store* store, const string key, size_t* value_length);
+
+/**
+ * Set the value for the key, evicting other tuples if the budget requires
  *
- * Returns a pointer to the begin of the value, stores its length in `value_length`.
+ * Any TTL of a previous value is cleared.
  */
-const char* get(const string key, struct tuple* tuples, size_t n_tuples, size_t* value_length);
+enum store_result set(struct store* store, const string key, char* value, size_t value_length);
 
 /**
- * Set the value for the key in an array of tuples
+ * Set the value for the key, taking ownership of `value`
  *
- * Returns true if a value was overwritten, false if it was created.
+ * Like `set()`, but `value` must be allocated with `malloc()` and is stored
+ * as is instead of being copied. If it is rejected, `value` is freed.
  */
-bool set(const string key, char* value, size_t value_length, struct tuple* tuples, size_t n_tuples);
+enum store_result set_owned(struct store* store, const string key, char* value, size_t value_length);
 
+/**
+ * Let the tuple of the key expire `ttl_ms` after `now_ms`.
+ *
+ * Returns whether the key exists.
+ */
+bool expire(struct store* store, const string key, uint64_t now_ms, uint64_t ttl_ms);
 
 /**
- * Deletes the key in the array of tuples.
+ * Deletes the key.
  *
  * Returns true if it existed.
  */
-bool delete(const string key, struct tuple* tuples, size_t n_tuples);
+bool delete(struct store* store, const string key);
+
+/**
+ * Remove expired tuples, examining at most `max_slots` slots.
+ *
+ * Continues where the previous sweep stopped. Returns the number of tuples removed.
+ */
+size_t store_sweep(struct store* store, uint64_t now_ms, size_t max_slots);
+
+/**
+ * Fingerprint of a tuple in the hash tree, covering its key and value.
+ */
+uint64_t tuple_fingerprint(const struct tuple* tuple);
+
+/**
+ * Visit the tuples whose keys lie after `from` up to `to` on the ring, in ring
+ * order, until `visit` returns false; `from == to` covers the whole ring.
+ *
+ * Takes O(log n) plus the tuples visited. `visit` may be NULL to count the
+ * tuples, it must not modify the store. Expired tuples are skipped. Returns
+ * the number of tuples visited.
+ */
+size_t store_range(const struct store* store, uint16_t from, uint16_t to, store_visitor visit, void* arg);
@@ -0,0 +1,385 @@
+#include "dht_client.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define DHT_CLIENT_MIN_CAPACITY 4096
+
+
+bool dht_client_connect(struct dht_client* client, const char* host, uint16_t port) {
+    *client = (struct dht_client) { .sock = -1, .next_id = 1 };
+
+    char service[sizeof("65535")];
+    snprintf(service, sizeof(service), "%u", port);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return false;
+    }
+
+    for (struct addrinfo* address = addresses; address && client->sock == -1; address = address->ai_next) {
+        client->sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (client->sock != -1 && connect(client->sock, address->ai_addr, address->ai_addrlen) == -1) {
+            close(client->sock);
+            client->sock = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return client->sock != -1;
+}
+
+
+void dht_client_close(struct dht_client* client) {
+    if (client->sock != -1) {
+        close(client->sock);
+    }
+    free(client->buffer);
+    *client = (struct dht_client) { .sock = -1 };
+}
+
+
+uint32_t dht_client_send(struct dht_client* client, uint8_t op, const char* key, const char* value, size_t value_length) {
+    size_t key_length = key ? strlen(key) : 0;
+    if (key_length > FRAME_MAX_KEY || value_length > UINT32_MAX) {
+        return 0;
+    }
+    uint32_t id = client->next_id;
+    client->next_id = client->next_id == UINT32_MAX ? 1 : client->next_id + 1;
+
+    uint8_t head[FRAME_HEAD_SIZE];
+    frame_encode(&(struct frame_head) {
+        .op = op,
+        .id = id,
+        .key_length = key_length,
+        .value_length = value_length,
+    }, head);
+
+    struct iovec iov[3] = {
+        { .iov_base = head, .iov_len = sizeof(head) },
+        { .iov_base = (char*) key, .iov_len = key_length },
+        { .iov_base = (char*) value, .iov_len = value_length },
+    };
+    return send_iov(client->sock, iov, 3) ? id : 0;
+}
+
+
+/**
+ * Receive until at least `needed` bytes are buffered.
+ */
+static bool fill(struct dht_client* client, size_t needed) {
+    if (needed > client->capacity) {
+        size_t capacity = client->capacity ? client->capacity : DHT_CLIENT_MIN_CAPACITY;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char* buffer = realloc(client->buffer, capacity);
+        if (!buffer) {
+            return false;
+        }
+        client->buffer = buffer;
+        client->capacity = capacity;
+    }
+
+    while (client->length < needed) {
+        ssize_t received = recv(client->sock, client->buffer + client->length, client->capacity - client->length, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        client->length += received;
+    }
+    return true;
+}
+
+
+bool dht_client_receive(struct dht_client* client, struct dht_reply* reply) {
+    // Drop the reply returned last
+    if (client->consumed) {
+        memmove(client->buffer, client->buffer + client->consumed, client->length - client->consumed);
+        client->length -= client->consumed;
+        client->consumed = 0;
+    }
+
+    struct frame_head head;
+    if (!fill(client, FRAME_HEAD_SIZE) || !frame_decode((const uint8_t*) client->buffer, &head)) {
+        return false;
+    }
+    size_t frame_length = FRAME_HEAD_SIZE + head.key_length + head.value_length;
+    if (!fill(client, frame_length)) {
+        return false;
+    }
+
+    *reply = (struct dht_reply) {
+        .op = head.op,
+        .status = head.status,
+        .id = head.id,
+        .key = client->buffer + FRAME_HEAD_SIZE,
+        .key_length = head.key_length,
+        .value = client->buffer + FRAME_HEAD_SIZE + head.key_length,
+        .value_length = head.value_length,
+    };
+    client->consumed = frame_length;
+    return true;
+}
+
+
+/**
+ * Send a request and wait for its reply.
+ */
+static bool request(struct dht_client* client, uint8_t op, const char* key, const char* value, size_t value_length, struct dht_reply* reply) {
+    uint32_t id = dht_client_send(client, op, key, value, value_length);
+    return id != 0 && dht_client_receive(client, reply) && reply->id == id;
+}
+
+
+int dht_get(struct dht_client* client, const char* key, char** value, size_t* value_length) {
+    struct dht_reply reply;
+    if (!request(client, FRAME_GET, key, NULL, 0, &reply)) {
+        return -1;
+    }
+    if (reply.status == 200) {
+        *value = malloc(reply.value_length ? reply.value_length : 1);
+        if (!*value) {
+            return -1;
+        }
+        memcpy(*value, reply.value, reply.value_length);
+        *value_length = reply.value_length;
+    }
+    return reply.status;
+}
+
+
+int dht_put(struct dht_client* client, const char* key, const char* value, size_t value_length) {
+    struct dht_reply reply;
+    return request(client, FRAME_PUT, key, value, value_length, &reply) ? reply.status : -1;
+}
+
+
+int dht_delete(struct dht_client* client, const char* key) {
+    struct dht_reply reply;
+    return request(client, FRAME_DELETE, key, NULL, 0, &reply) ? reply.status : -1;
+}
+
+
+/**
+ * Hash a key like the nodes do: the first two bytes of its SHA-256 digest.
+ */
+static uint16_t hash_key(const char* key) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t*) key, strlen(key), digest);
+    return (uint16_t) (digest[0] << 8 | digest[1]);
+}
+
+
+/**
+ * Whether the hashed key lies after `pred_id` up to `id`; a node that is its own predecessor holds the whole ring.
+ */
+static bool in_range(uint16_t key, uint16_t pred_id, uint16_t id) {
+    if (pred_id < id) {
+        return key > pred_id && key <= id;
+    }
+    if (pred_id > id) {
+        return key > pred_id || key <= id;
+    }
+    return true;
+}
+
+
+/**
+ * Find the node at an address, adding it without range if it is unknown.
+ *
+ * If the ring is full, a node without range is replaced. Returns NULL if there is none.
+ */
+static struct dht_node* ring_node(struct dht_ring* ring, const char* host, uint16_t port) {
+    struct dht_node* spare = NULL;
+    for (size_t i = 0; i < ring->n_nodes; i += 1) {
+        struct dht_node* node = &ring->nodes[i];
+        if (node->port == port && strcmp(node->host, host) == 0) {
+            return node;
+        }
+        if (!node->has_range && !spare) {
+            spare = node;
+        }
+    }
+
+    struct dht_node* node = ring->n_nodes < DHT_RING_MAX_NODES ? &ring->nodes[ring->n_nodes++] : spare;
+    if (!node) {
+        return NULL;
+    }
+    if (node == spare) {
+        dht_client_close(&node->client);
+    }
+    *node = (struct dht_node) { .port = port, .client = { .sock = -1 } };
+    snprintf(node->host, sizeof(node->host), "%s", host);
+    return node;
+}
+
+
+/**
+ * The node responsible for a hashed key, the seed if its range is unknown.
+ */
+static struct dht_node* ring_route(struct dht_ring* ring, uint16_t key_hash) {
+    for (size_t i = 0; i < ring->n_nodes; i += 1) {
+        struct dht_node* node = &ring->nodes[i];
+        if (node->has_range && in_range(key_hash, node->pred_id, node->id)) {
+            return node;
+        }
+    }
+    return ring_node(ring, ring->seed_host, ring->seed_port);
+}
+
+
+/**
+ * Send a request to a node and wait for its reply, connecting first if needed.
+ *
+ * The connection is closed if it failed, to be opened again by the next request.
+ */
+static bool node_request(struct dht_node* node, uint8_t op, const char* key, const char* value, size_t value_length, struct dht_reply* reply) {
+    if (node->client.sock == -1 && !dht_client_connect(&node->client, node->host, node->port)) {
+        return false;
+    }
+    if (!request(&node->client, op, key, value, value_length, reply)) {
+        dht_client_close(&node->client);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Merge a line of a topology, "<predecessor id> <id> <ip> <port>".
+ *
+ * Nodes whose ranges overlap the new range lose theirs, they left the ring or handed keys over.
+ */
+static void ring_merge(struct dht_ring* ring, const char* line) {
+    unsigned pred_id, id, port;
+    char host[INET_ADDRSTRLEN];
+    if (sscanf(line, "%u %u %15s %u", &pred_id, &id, host, &port) != 4 || pred_id > UINT16_MAX || id > UINT16_MAX || port > UINT16_MAX) {
+        return;
+    }
+
+    struct dht_node* updated = ring_node(ring, host, port);
+    if (!updated) {
+        return;
+    }
+    for (size_t i = 0; i < ring->n_nodes; i += 1) {
+        struct dht_node* node = &ring->nodes[i];
+        if (node != updated && node->has_range && (in_range(id, node->pred_id, node->id) || in_range(node->id, pred_id, id))) {
+            node->has_range = false;
+        }
+    }
+    updated->has_range = true;
+    updated->pred_id = pred_id;
+    updated->id = id;
+}
+
+
+bool dht_ring_refresh(struct dht_ring* ring, const char* host, uint16_t port) {
+    struct dht_node* node = ring_node(ring, host, port);
+    struct dht_reply reply;
+    if (!node || !node_request(node, FRAME_RING, NULL, NULL, 0, &reply) || reply.status != 200) {
+        return false;
+    }
+
+    // Merging may replace the node and its buffer
+    char* topology = malloc(reply.value_length + 1);
+    if (!topology) {
+        return false;
+    }
+    memcpy(topology, reply.value, reply.value_length);
+    topology[reply.value_length] = '\0';
+
+    for (char* line = topology; *line; ) {
+        char* line_end = strchr(line, '\n');
+        if (line_end) {
+            *line_end = '\0';
+        }
+        ring_merge(ring, line);
+        line = line_end ? line_end + 1 : line + strlen(line);
+    }
+    free(topology);
+    return true;
+}
+
+
+bool dht_ring_open(struct dht_ring* ring, const char* host, uint16_t port) {
+    ring->n_nodes = 0;
+    snprintf(ring->seed_host, sizeof(ring->seed_host), "%s", host);
+    ring->seed_port = port;
+    return dht_ring_refresh(ring, host, port);
+}
+
+
+void dht_ring_close(struct dht_ring* ring) {
+    for (size_t i = 0; i < ring->n_nodes; i += 1) {
+        dht_client_close(&ring->nodes[i].client);
+    }
+    ring->n_nodes = 0;
+}
+
+
+/**
+ * Send a request to the node responsible for `key`, following redirects.
+ *
+ * Returns the status of the reply, or -1 if a node could not be reached.
+ */
+static int ring_request(struct dht_ring* ring, uint8_t op, const char* key, const char* value, size_t value_length, struct dht_reply* reply) {
+    struct dht_node* node = ring_route(ring, hash_key(key));
+    for (int redirects = 0; node; redirects += 1) {
+        if (!node_request(node, op, key, value, value_length, reply)) {
+            return -1;
+        }
+        if (reply->status != 303 || redirects == DHT_RING_MAX_REDIRECTS) {
+            return reply->status;
+        }
+
+        // The topology is outdated: learn it from the node named in the redirect, then ask that node
+        char address[INET_ADDRSTRLEN + sizeof(":65535")];
+        char host[INET_ADDRSTRLEN];
+        unsigned port;
+        snprintf(address, sizeof(address), "%.*s", (int) reply->value_length, reply->value);
+        if (sscanf(address, "%15[^:]:%u", host, &port) != 2 || port > UINT16_MAX) {
+            return reply->status;
+        }
+        dht_ring_refresh(ring, host, port);
+        node = ring_node(ring, host, port);
+    }
+    return -1;
+}
+
+
+int dht_ring_get(struct dht_ring* ring, const char* key, char** value, size_t* value_length) {
+    struct dht_reply reply;
+    int status = ring_request(ring, FRAME_GET, key, NULL, 0, &reply);
+    if (status == 200) {
+        *value = malloc(reply.value_length ? reply.value_length : 1);
+        if (!*value) {
+            return -1;
+        }
+        memcpy(*value, reply.value, reply.value_length);
+        *value_length = reply.value_length;
+    }
+    return status;
+}
+
+
+int dht_ring_put(struct dht_ring* ring, const char* key, const char* value, size_t value_length) {
+    struct dht_reply reply;
+    return ring_request(ring, FRAME_PUT, key, value, value_length, &reply);
+}
+
+
+int dht_ring_delete(struct dht_ring* ring, const char* key) {
+    struct dht_reply reply;
+    return ring_request(ring, FRAME_DELETE, key, NULL, 0, &reply);
+}
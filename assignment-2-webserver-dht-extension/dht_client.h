@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "frame.h"
+
+/*
+ * Client of the binary protocol of the nodes, see `frame.h`
+ *
+ * Requests may be pipelined: send several with `dht_client_send()`, then
+ * collect their replies in order with `dht_client_receive()`. The blocking
+ * helpers `dht_get()`, `dht_put()` and `dht_delete()` send a single request
+ * and wait for its reply, no other request may be outstanding then.
+ *
+ * A `dht_ring` keeps the ring topology learned from the nodes and sends
+ * requests straight to the node responsible for a key, with a connection per
+ * node. A 303 means the topology is outdated: it is refreshed from the node
+ * named in the redirect and the request is sent there.
+ */
+
+
+/**
+ * Connection to a node
+ *
+ * `buffer`: received bytes, `length` of `capacity`
+ * `consumed`: bytes of the reply returned last, dropped on the next receive
+ */
+struct dht_client {
+    int sock;
+    uint32_t next_id;
+    char* buffer;
+    size_t length;
+    size_t capacity;
+    size_t consumed;
+};
+
+/**
+ * A reply frame, key and value point into the buffer of the client
+ */
+struct dht_reply {
+    uint8_t op;
+    uint16_t status;
+    uint32_t id;
+    const char* key;
+    size_t key_length;
+    const char* value;
+    size_t value_length;
+};
+
+
+#define DHT_RING_MAX_NODES 64
+#define DHT_RING_MAX_REDIRECTS 4  // redirects followed per request
+
+
+/**
+ * A node of the ring
+ *
+ * `has_range`: the node is responsible for the hashed keys after `pred_id` up
+ *              to `id`; unset while the range is unknown or was taken over
+ * `client`: connection to the node, opened on first use
+ */
+struct dht_node {
+    char host[INET_ADDRSTRLEN];
+    uint16_t port;
+    bool has_range;
+    uint16_t pred_id;
+    uint16_t id;
+    struct dht_client client;
+};
+
+/**
+ * Ring topology known to a client
+ *
+ * `seed`: node asked for keys of unknown ranges
+ */
+struct dht_ring {
+    struct dht_node nodes[DHT_RING_MAX_NODES];
+    size_t n_nodes;
+    char seed_host[INET_ADDRSTRLEN];
+    uint16_t seed_port;
+};
+
+
+/**
+ * Connect to the node at `host` and `port`.
+ *
+ * Returns false if the connection failed.
+ */
+bool dht_client_connect(struct dht_client* client, const char* host, uint16_t port);
+
+/**
+ * Close the connection and free the buffer.
+ */
+void dht_client_close(struct dht_client* client);
+
+/**
+ * Send a request without waiting for its reply.
+ *
+ * `op` is an `enum frame_op`. Returns the id of the request, or 0 if sending
+ * failed.
+ */
+uint32_t dht_client_send(struct dht_client* client, uint8_t op, const char* key, const char* value, size_t value_length);
+
+/**
+ * Wait for the next reply.
+ *
+ * The reply is valid until the next call. Returns false if the connection
+ * failed or a malformed frame was received.
+ */
+bool dht_client_receive(struct dht_client* client, struct dht_reply* reply);
+
+/**
+ * Get the value of `key`.
+ *
+ * On 200, `value` is set to a copy allocated with `malloc()`. Returns the
+ * status of the reply, or -1 if the connection failed.
+ */
+int dht_get(struct dht_client* client, const char* key, char** value, size_t* value_length);
+
+/**
+ * Store `value` under `key`.
+ *
+ * Returns the status of the reply, or -1 if the connection failed.
+ */
+int dht_put(struct dht_client* client, const char* key, const char* value, size_t value_length);
+
+/**
+ * Delete `key`.
+ *
+ * Returns the status of the reply, or -1 if the connection failed.
+ */
+int dht_delete(struct dht_client* client, const char* key);
+
+/**
+ * Learn the ring topology from the node at `host` and `port`, an IPv4 address.
+ *
+ * Returns false if the node could not be reached.
+ */
+bool dht_ring_open(struct dht_ring* ring, const char* host, uint16_t port);
+
+/**
+ * Close the connections to all nodes.
+ */
+void dht_ring_close(struct dht_ring* ring);
+
+/**
+ * Merge the topology known to the node at `host` and `port` into the ring.
+ *
+ * Returns false if the node could not be reached.
+ */
+bool dht_ring_refresh(struct dht_ring* ring, const char* host, uint16_t port);
+
+/**
+ * Like `dht_get()`, sent to the node responsible for `key`.
+ */
+int dht_ring_get(struct dht_ring* ring, const char* key, char** value, size_t* value_length);
+
+/**
+ * Like `dht_put()`, sent to the node responsible for `key`.
+ */
+int dht_ring_put(struct dht_ring* ring, const char* key, const char* value, size_t value_length);
+
+/**
+ * Like `dht_delete()`, sent to the node responsible for `key`.
+ */
+int dht_ring_delete(struct dht_ring* ring, const char* key);
@@ -0,0 +1,295 @@
+#include "fetch.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "data.h"
+#include "near.h"
+#include "node.h"
+#include "sockets_setup.h"
+#include "stream_sock.h"
+#include "successors.h"
+#include "util.h"
+
+
+bool fetch_applies(const struct request* request, const struct chord_context* ctx) {
+    struct NetworkNodes node = ctx->own_node;
+    // Fetch replies carry no digest, conditional and partial GETs are left to the owner
+    bool plain = !get_header(request, "Range") && !get_header(request, "If-None-Match");
+    return ctx->udp_values && strcmp(request->method, "GET") == 0 && plain && strlen(request->uri) <= FETCH_MAX_KEY &&
+           !is_responsible_hashed(hash(request->uri), node.self_id, node.pred.id);
+}
+
+
+/**
+ * Send a datagram to `addr` right away, it does not fit into the outbox.
+ */
+static void send_datagram(const struct chord_context* ctx, struct sockaddr_in addr, const char* buffer, size_t length) {
+    if (sendto(ctx->datagram_socket, buffer, length, 0, (const struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("sendto");
+    }
+}
+
+
+/**
+ * The next node on the way to the node responsible for `key`: the responsible node if known, the successor otherwise.
+ */
+static struct sockaddr_in next_hop(const struct chord_context* ctx, uint16_t key) {
+    struct sockaddr_in next;
+    if (!route_key(ctx, key, &next)) {
+        next.sin_addr = ctx->own_node.succ.ip;
+        next.sin_port = htons(ctx->own_node.succ.port);
+    }
+    return next;
+}
+
+
+static void fetch_free(struct fetch* fetch) {
+    timer_cancel(&fetch->deadline);
+    free(fetch->key);
+    free(fetch);
+}
+
+
+/**
+ * Answer the client of a fetch, and continue with the next request of its connection.
+ */
+static void fetch_complete(struct fetch* fetch, const char* head, const char* value, size_t value_length) {
+    struct connection_state* state = fetch->conn;
+    struct chord_context* ctx = fetch->ctx;
+    struct iovec iov[2] = {
+        { .iov_base = (char*) head, .iov_len = strlen(head) },
+        { .iov_base = (char*) value, .iov_len = value_length },
+    };
+    bool sent = connection_send(state, iov, 2);
+    if (!sent) {
+        perror("send");
+    }
+    bool keep_alive = sent && !fetch->close_after;
+
+    state->fetch = NULL;
+    state->paused = false;
+    fetch_free(fetch);
+
+    if (keep_alive) {
+        connection_resume(state, ctx);
+    } else {
+        connection_end(state);
+    }
+}
+
+
+/**
+ * FETCH DEADLINE: Answers a fetch that got no reply like a GET whose node is unknown, and looks the key up the usual way.
+ *
+ * @param arg The fetch.
+ */
+static void fetch_deadline(void* arg) {
+    struct fetch* fetch = arg;
+    char unavailable[HTTP_MAX_HEAD_SIZE];
+    format_unavailable(unavailable, sizeof(unavailable), fetch->ctx, false);
+    start_lookup(&fetch->ctx->pending_lookups, hash(fetch->key));
+    fetch_complete(fetch, unavailable, NULL, 0);
+}
+
+
+bool fetch_start(struct connection_state* state, const string key, bool close_after, struct chord_context* ctx) {
+    struct fetch* fetch = calloc(1, sizeof(*fetch));
+    if (!fetch || !(fetch->key = strdup(key))) {
+        free(fetch);
+        return false;
+    }
+    fetch->conn = state;
+    fetch->ctx = ctx;
+    fetch->id = ++ctx->next_fetch_id;
+    fetch->close_after = close_after;
+
+    uint16_t key_hash = hash(key);
+    struct sockaddr_in owner;
+    if (route_key(ctx, key_hash, &owner)) {
+        // values of hot keys are still cached here, if enabled
+        near_consider(ctx, key, owner);
+    }
+
+    size_t key_length = strlen(key);
+    char datagram[FETCH_HEAD_SIZE + FETCH_MAX_KEY];
+    uint32_t id = htonl(fetch->id);
+    uint16_t origin_port = ctx->addr.sin_port;
+    uint16_t key_length_net = htons(key_length);
+    datagram[0] = DHT_FETCH_TYPE;
+    memcpy(datagram + 1, &id, 4);
+    memcpy(datagram + 5, &ctx->addr.sin_addr, 4);
+    memcpy(datagram + 9, &origin_port, 2);
+    datagram[11] = 0;
+    memcpy(datagram + 12, &key_length_net, 2);
+    memcpy(datagram + FETCH_HEAD_SIZE, key, key_length);
+    send_datagram(ctx, next_hop(ctx, key_hash), datagram, FETCH_HEAD_SIZE + key_length);
+
+    state->fetch = fetch;
+    state->paused = true;
+    timer_schedule(&ctx->wheel, &fetch->deadline, FETCH_TIMEOUT_MS, fetch_deadline, fetch);
+    return true;
+}
+
+
+bool is_fetch_datagram(const char* buffer, size_t length) {
+    return length > 0 && ((uint8_t) buffer[0] == DHT_FETCH_TYPE || (uint8_t) buffer[0] == DHT_FETCHED_TYPE);
+}
+
+
+/**
+ * Whether `origin` is a node of the ring known to this node: its predecessor, a successor or a node of the route cache.
+ */
+static bool known_node(const struct chord_context* ctx, struct sockaddr_in origin) {
+    struct NodeInfo node = { .ip = origin.sin_addr, .port = ntohs(origin.sin_port) };
+    if (node_same(&node, &ctx->own_node.pred) || node_same(&node, &ctx->own_node.succ)) {
+        return true;
+    }
+    for (size_t i = 0; i < ctx->successors.n_nodes; i += 1) {
+        if (node_same(&node, &ctx->successors.nodes[i])) {
+            return true;
+        }
+    }
+    for (int i = 0; i < ctx->nextFreeIndex; i += 1) {
+        const DHTLookupMessage* route = &ctx->lookupMessages[i];
+        if (route->originNodeIP.s_addr == node.ip.s_addr && route->originNodePort == node.port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Answer a fetch of `request_length` bytes for a key this node is responsible for, with the value if it fits into the reply.
+ *
+ * The origin written in the fetch is not authenticated. Unless it is a known node of the ring, the reply is no larger than
+ * the fetch, so it cannot be used to amplify traffic towards another address: the value is left out, pointing the origin
+ * to this node instead, and no reply is sent at all if even that is larger.
+ */
+static void fetch_answer(struct chord_context* ctx, const char* request, size_t request_length, const string key, struct sockaddr_in origin) {
+    size_t value_length = 0;
+    const char* value = get(&ctx->store, key, &value_length);
+    bool known = known_node(ctx, origin);
+    if (!known && FETCH_REPLY_HEAD_SIZE > request_length) {
+        return;
+    }
+    bool fits = value_length <= FETCH_MAX_VALUE && (known || FETCH_REPLY_HEAD_SIZE + value_length <= request_length);
+    uint16_t status = !value ? 404 : !fits ? 303 : 200;
+    if (status != 200) {
+        value_length = 0;
+    }
+
+    char reply[FETCH_REPLY_HEAD_SIZE + FETCH_MAX_VALUE];
+    uint16_t fields[] = { htons(status), htons(ctx->own_node.pred.id), htons(ctx->own_node.self_id) };
+    uint16_t port = ctx->addr.sin_port;
+    uint16_t value_length_net = htons(value_length);
+    reply[0] = DHT_FETCHED_TYPE;
+    memcpy(reply + 1, request + 1, 4);  // id of the fetch
+    memcpy(reply + 5, fields, sizeof(fields));
+    memcpy(reply + 11, &ctx->addr.sin_addr, 4);
+    memcpy(reply + 15, &port, 2);
+    memcpy(reply + 17, &value_length_net, 2);
+    memcpy(reply + FETCH_REPLY_HEAD_SIZE, value, value_length);
+    send_datagram(ctx, origin, reply, FETCH_REPLY_HEAD_SIZE + value_length);
+}
+
+
+/**
+ * Answer the client of the fetch a reply is for, and remember the responsible node as route.
+ */
+static void fetch_reply(struct chord_context* ctx, const char* buffer, size_t length) {
+    uint32_t id;
+    uint16_t status, pred_id, owner_id, owner_port, value_length;
+    struct in_addr owner_ip;
+    memcpy(&id, buffer + 1, 4);
+    memcpy(&status, buffer + 5, 2);
+    memcpy(&pred_id, buffer + 7, 2);
+    memcpy(&owner_id, buffer + 9, 2);
+    memcpy(&owner_ip, buffer + 11, 4);
+    memcpy(&owner_port, buffer + 15, 2);
+    memcpy(&value_length, buffer + 17, 2);
+    id = ntohl(id);
+    status = ntohs(status);
+    owner_port = ntohs(owner_port);
+    value_length = ntohs(value_length);
+    if (FETCH_REPLY_HEAD_SIZE + (size_t) value_length > length) {
+        return;
+    }
+
+    DHTLookupMessage route = {
+        .messageType = 1,
+        .key = ntohs(pred_id),
+        .originNodeID = ntohs(owner_id),
+        .originNodeIP = owner_ip,
+        .originNodePort = owner_port,
+        .receivedAt = monotonic_ms(),
+    };
+    addOrUpdateMessage(ctx->lookupMessages, &ctx->nextFreeIndex, route);
+
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        struct fetch* fetch = ctx->connections[i].fetch;
+        if (!fetch || ctx->connections[i].sock == -1 || fetch->id != id) {
+            continue;
+        }
+        char head[HTTP_MAX_HEAD_SIZE + FETCH_MAX_KEY];
+        if (status == 200) {
+            snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n\r\n", value_length);
+        } else if (status == 404) {
+            snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        } else {
+            snprintf(head, sizeof(head), "HTTP/1.1 303 See Other\r\nLocation: http://%s:%d%s\r\nContent-Length: 0\r\n\r\n",
+                     inet_ntoa(owner_ip), owner_port, fetch->key);
+        }
+        fetch_complete(fetch, head, buffer + FETCH_REPLY_HEAD_SIZE, status == 200 ? value_length : 0);
+        return;
+    }
+}
+
+
+bool fetch_datagram(struct chord_context* ctx, const char* buffer, size_t length) {
+    if ((uint8_t) buffer[0] == DHT_FETCHED_TYPE) {
+        if (length < FETCH_REPLY_HEAD_SIZE) {
+            return false;
+        }
+        fetch_reply(ctx, buffer, length);
+        return true;
+    }
+
+    if (length < FETCH_HEAD_SIZE) {
+        return false;
+    }
+    uint16_t key_length;
+    memcpy(&key_length, buffer + 12, 2);
+    key_length = ntohs(key_length);
+    if (key_length > FETCH_MAX_KEY || length != FETCH_HEAD_SIZE + (size_t) key_length) {
+        return false;
+    }
+    char key[FETCH_MAX_KEY + 1];
+    memcpy(key, buffer + FETCH_HEAD_SIZE, key_length);
+    key[key_length] = '\0';
+    uint16_t key_hash = hash(key);
+
+    struct NetworkNodes node = ctx->own_node;
+    if (is_responsible_hashed(key_hash, node.self_id, node.pred.id)) {
+        struct sockaddr_in origin = { .sin_family = AF_INET };
+        memcpy(&origin.sin_addr, buffer + 5, 4);
+        memcpy(&origin.sin_port, buffer + 9, 2);
+        fetch_answer(ctx, buffer, length, key, origin);
+    } else if ((uint8_t) buffer[11] < FETCH_MAX_HOPS) {
+        char forward[FETCH_HEAD_SIZE + FETCH_MAX_KEY];
+        memcpy(forward, buffer, length);
+        forward[11] = buffer[11] + 1;
+        send_datagram(ctx, next_hop(ctx, key_hash), forward, length);
+    }
+    return false;
+}
+
+
+void fetch_cancel(struct fetch* fetch) {
+    fetch_free(fetch);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chord_processor.h"
+#include "http.h"
+#include "timer_wheel.h"
+
+#define DHT_FETCH_TYPE 0x20      // first byte of a datagram looking up a key and its value
+#define DHT_FETCHED_TYPE 0x21    // first byte of the reply of the responsible node
+#define FETCH_HEAD_SIZE 14       // type, id, origin ip and port, hops and key length
+#define FETCH_REPLY_HEAD_SIZE 19 // type, id, status, predecessor and owner id, owner ip and port, value length
+#define FETCH_MAX_KEY 1024
+#define FETCH_MAX_VALUE 1024     // longer values are not sent, the client is pointed to the owner instead
+#define FETCH_MAX_HOPS 32        // forwards before a fetch is dropped, against loops on stale routes
+#define FETCH_TIMEOUT_MS 500     // fetches not answered by then are answered with 503 and a lookup
+
+
+/**
+ * A GET of a key another node is responsible for, answered over UDP
+ *
+ * The key is looked up like in a lookup message, but the reply of the
+ * responsible node carries the value if it fits into the datagram. The
+ * client's connection is paused until the reply arrives.
+ *
+ * `id`: tells the reply of this fetch from those of others
+ * `close_after`: the client asked to close the connection after the reply
+ */
+struct fetch {
+    struct connection_state* conn;
+    struct chord_context* ctx;
+    uint32_t id;
+    char* key;
+    bool close_after;
+    struct timer deadline;
+};
+
+
+/**
+ * Whether a GET of `key` is fetched over UDP: fetches are enabled, another node is responsible, and it has neither
+ * `Range` nor `If-None-Match`, which only the owner answers.
+ */
+bool fetch_applies(const struct request* request, const struct chord_context* ctx);
+
+/**
+ * Fetch the value of `key` over UDP, pausing the connection until it is answered.
+ *
+ * Returns false if the connection has to be closed.
+ */
+bool fetch_start(struct connection_state* state, const string key, bool close_after, struct chord_context* ctx);
+
+/**
+ * Whether a datagram of `length` bytes is a fetch or its reply.
+ */
+bool is_fetch_datagram(const char* buffer, size_t length);
+
+/**
+ * Answer, forward or take a fetch datagram of another node.
+ *
+ * Returns true if it was a reply, i.e. a new route is known.
+ */
+bool fetch_datagram(struct chord_context* ctx, const char* buffer, size_t length);
+
+/**
+ * Abandon a fetch without answering it, e.g. when its connection is closed.
+ */
+void fetch_cancel(struct fetch* fetch);
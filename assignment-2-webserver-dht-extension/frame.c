@@ -0,0 +1,34 @@
+#include "frame.h"
+
+
+void frame_encode(const struct frame_head* head, uint8_t* out) {
+    out[0] = FRAME_MAGIC;
+    out[1] = head->op;
+    out[2] = head->status >> 8;
+    out[3] = head->status;
+    out[4] = head->id >> 24;
+    out[5] = head->id >> 16;
+    out[6] = head->id >> 8;
+    out[7] = head->id;
+    out[8] = head->key_length >> 8;
+    out[9] = head->key_length;
+    out[10] = head->value_length >> 24;
+    out[11] = head->value_length >> 16;
+    out[12] = head->value_length >> 8;
+    out[13] = head->value_length;
+}
+
+
+bool frame_decode(const uint8_t* data, struct frame_head* head) {
+    if (data[0] != FRAME_MAGIC) {
+        return false;
+    }
+    *head = (struct frame_head) {
+        .op = data[1],
+        .status = (uint16_t) (data[2] << 8 | data[3]),
+        .id = (uint32_t) data[4] << 24 | (uint32_t) data[5] << 16 | (uint32_t) data[6] << 8 | data[7],
+        .key_length = (uint16_t) (data[8] << 8 | data[9]),
+        .value_length = (uint32_t) data[10] << 24 | (uint32_t) data[11] << 16 | (uint32_t) data[12] << 8 | data[13],
+    };
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary protocol of the nodes for clients, served on the HTTP port
+ *
+ * Every request and response is a frame: a `FRAME_HEAD_SIZE` byte head,
+ * followed by `key_length` bytes of key and `value_length` bytes of value.
+ * All numbers are in network byte order:
+ *
+ *   magic u8 | op u8 | status u16 | id u32 | key_length u16 | value_length u32
+ *
+ * The magic byte is not ASCII, so frames are told apart from HTTP requests
+ * by their first byte. Responses echo `op` and the `id` chosen by the client
+ * and carry an HTTP status code. Requests may be pipelined, their responses
+ * are sent in order. Nodes still talk HTTP among themselves.
+ */
+
+#define FRAME_MAGIC 0xB1
+#define FRAME_HEAD_SIZE 14
+#define FRAME_MAX_KEY 1024  // longest key accepted
+
+/**
+ * Operations of a request frame
+ *
+ * `FRAME_GET`: responds 200 with the value, or 404
+ * `FRAME_PUT`: stores the value, responds 201, 204, 413 or 507
+ * `FRAME_DELETE`: responds 204 or 404
+ * `FRAME_BATCH`: the value lists keys, one per line; responds with one frame
+ *                per key carrying the key, then a frame without key ending the batch
+ * `FRAME_RING`: responds 200 with the ring topology known to the node, see
+ *               `ring_format()`
+ *
+ * Keys of other nodes are answered with 303 and the address of the
+ * responsible node ("ip:port") as value, or 503 while it is looked up.
+ */
+enum frame_op {
+    FRAME_GET = 1,
+    FRAME_PUT = 2,
+    FRAME_DELETE = 3,
+    FRAME_BATCH = 4,
+    FRAME_RING = 5,
+};
+
+/**
+ * Head of a frame
+ */
+struct frame_head {
+    uint8_t op;
+    uint16_t status;
+    uint32_t id;
+    uint16_t key_length;
+    uint32_t value_length;
+};
+
+
+/**
+ * Encode a frame head into `FRAME_HEAD_SIZE` bytes at `out`.
+ */
+void frame_encode(const struct frame_head* head, uint8_t* out);
+
+/**
+ * Decode the frame head at the front of `data`, `FRAME_HEAD_SIZE` bytes.
+ *
+ * Returns false if it does not start with the magic byte.
+ */
+bool frame_decode(const uint8_t* data, struct frame_head* head);
@@ -0,0 +1,177 @@
+#include "hotkeys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sockets_setup.h"
+#include "util.h"
+
+
+/**
+ * HOTKEYS DECAY: Halves all counts, so keys that cooled down leave the ranking.
+ *
+ * @param arg The hotkeys.
+ */
+static void hotkeys_decay(void* arg) {
+    struct hotkeys* hotkeys = arg;
+    for (size_t row = 0; row < HOTKEYS_DEPTH; row += 1) {
+        for (size_t i = 0; i < HOTKEYS_WIDTH; i += 1) {
+            hotkeys->sketch[row][i] /= 2;
+        }
+    }
+    for (size_t i = 0; i < hotkeys->n_top; i += 1) {
+        hotkeys->top[i].count /= 2;
+    }
+    timer_schedule(hotkeys->wheel, &hotkeys->decay, HOTKEYS_DECAY_MS, hotkeys_decay, hotkeys);
+}
+
+
+void hotkeys_init(struct hotkeys* hotkeys, struct timer_wheel* wheel) {
+    memset(hotkeys->sketch, 0, sizeof(hotkeys->sketch));
+    hotkeys->n_top = 0;
+    hotkeys->requests = 0;
+    hotkeys->wheel = wheel;
+    timer_schedule(wheel, &hotkeys->decay, HOTKEYS_DECAY_MS, hotkeys_decay, hotkeys);
+}
+
+
+/**
+ * The counter of a key in every row of the sketch.
+ */
+static void sketch_columns(const char* key, size_t key_length, uint32_t columns[HOTKEYS_DEPTH]) {
+    // FNV-1a, its halves combined into one index per row by double hashing
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < key_length; i += 1) {
+        hash ^= (uint8_t) key[i];
+        hash *= 1099511628211u;
+    }
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+    for (uint32_t row = 0; row < HOTKEYS_DEPTH; row += 1) {
+        columns[row] = (h1 + row * h2) % HOTKEYS_WIDTH;
+    }
+}
+
+
+/**
+ * Count a key in the sketch and return its estimate.
+ *
+ * Only the smallest counters are incremented (conservative update), which keeps estimates of cold keys
+ * that share counters with hot ones low.
+ */
+static uint32_t sketch_add(struct hotkeys* hotkeys, const char* key, size_t key_length) {
+    uint32_t columns[HOTKEYS_DEPTH];
+    sketch_columns(key, key_length, columns);
+
+    uint32_t* counters[HOTKEYS_DEPTH];
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < HOTKEYS_DEPTH; row += 1) {
+        counters[row] = &hotkeys->sketch[row][columns[row]];
+        estimate = *counters[row] < estimate ? *counters[row] : estimate;
+    }
+    if (estimate < UINT32_MAX) {
+        estimate += 1;
+    }
+    for (size_t row = 0; row < HOTKEYS_DEPTH; row += 1) {
+        if (*counters[row] < estimate) {
+            *counters[row] = estimate;
+        }
+    }
+    return estimate;
+}
+
+
+void hotkeys_record(struct hotkeys* hotkeys, const char* key, size_t key_length) {
+    hotkeys->requests += 1;
+    uint32_t estimate = sketch_add(hotkeys, key, key_length);
+
+    struct hot_key* coldest = NULL;
+    for (size_t i = 0; i < hotkeys->n_top; i += 1) {
+        struct hot_key* hot = &hotkeys->top[i];
+        if (strlen(hot->key) == key_length && memcmp(hot->key, key, key_length) == 0) {
+            hot->count = estimate;
+            return;
+        }
+        if (!coldest || hot->count < coldest->count) {
+            coldest = hot;
+        }
+    }
+
+    struct hot_key* slot = NULL;
+    if (hotkeys->n_top < HOTKEYS_TOP) {
+        slot = &hotkeys->top[hotkeys->n_top++];
+    } else if (estimate > coldest->count) {
+        free(coldest->key);
+        slot = coldest;
+    }
+    if (slot) {
+        *slot = (struct hot_key) { .key = strndup(key, key_length), .count = estimate };
+        if (!slot->key) {
+            *slot = hotkeys->top[--hotkeys->n_top];
+        }
+    }
+}
+
+
+uint32_t hotkeys_estimate(const struct hotkeys* hotkeys, const char* key, size_t key_length) {
+    uint32_t columns[HOTKEYS_DEPTH];
+    sketch_columns(key, key_length, columns);
+
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < HOTKEYS_DEPTH; row += 1) {
+        uint32_t counter = hotkeys->sketch[row][columns[row]];
+        estimate = counter < estimate ? counter : estimate;
+    }
+    return estimate;
+}
+
+
+uint32_t hotkeys_hottest(const struct hotkeys* hotkeys) {
+    uint32_t hottest = 0;
+    for (size_t i = 0; i < hotkeys->n_top; i += 1) {
+        hottest = hotkeys->top[i].count > hottest ? hotkeys->top[i].count : hottest;
+    }
+    return hottest;
+}
+
+
+bool is_hotkeys_request(const struct request* request) {
+    return strcmp(request->method, "GET") == 0 && strcmp(request->uri, HOTKEYS_URI) == 0;
+}
+
+
+static int hotter(const void* a, const void* b) {
+    const struct hot_key* first = a;
+    const struct hot_key* second = b;
+    return (first->count < second->count) - (first->count > second->count);
+}
+
+
+bool send_hotkeys(struct connection_state* state, const struct hotkeys* hotkeys) {
+    struct hot_key ranking[HOTKEYS_TOP];
+    memcpy(ranking, hotkeys->top, hotkeys->n_top * sizeof(struct hot_key));
+    qsort(ranking, hotkeys->n_top, sizeof(struct hot_key), hotter);
+
+    size_t payload_length = 0;
+    for (size_t i = 0; i < hotkeys->n_top; i += 1) {
+        payload_length += snprintf(NULL, 0, "%u %s\r\n", ranking[i].count, ranking[i].key);
+    }
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", payload_length);
+    char* reply = malloc(head_length + payload_length + 1);
+    if (!reply) {
+        return false;
+    }
+
+    memcpy(reply, head, head_length);
+    char* pos = reply + head_length;
+    for (size_t i = 0; i < hotkeys->n_top; i += 1) {
+        pos += sprintf(pos, "%u %s\r\n", ranking[i].count, ranking[i].key);
+    }
+    bool sent = connection_write(state, reply, pos - reply);
+    if (!sent) {
+        perror("send");
+    }
+    free(reply);
+    return sent;
+}
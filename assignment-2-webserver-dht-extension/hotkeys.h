@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "timer_wheel.h"
+
+#define HOTKEYS_URI "/hotkeys"
+#define HOTKEYS_DEPTH 4        // rows of the count-min sketch, each with its own hash
+#define HOTKEYS_WIDTH 2048     // counters per row
+#define HOTKEYS_TOP 16         // hottest keys tracked
+#define HOTKEYS_DECAY_MS 10000 // all counts are halved this often, so the ranking follows the current load
+
+
+/**
+ * A key among the hottest, `count` is the estimate of the sketch
+ */
+struct hot_key {
+    char* key;
+    uint32_t count;
+};
+
+/**
+ * Requests per key, estimated in constant memory
+ *
+ * The count-min sketch counts every key in one counter per row and estimates
+ * a key's requests by the smallest of its counters, never below the true
+ * count. The hottest keys are kept in `top`, unordered: a key whose estimate
+ * exceeds the coldest tracked key replaces it.
+ *
+ * `requests`: requests counted since the start, not decayed
+ * `decay`: halves all counts periodically
+ */
+struct hotkeys {
+    uint32_t sketch[HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+    struct hot_key top[HOTKEYS_TOP];
+    size_t n_top;
+    uint64_t requests;
+    struct timer decay;
+    struct timer_wheel* wheel;
+};
+
+
+/**
+ * Start counting with an empty sketch, decayed by timers of `wheel`.
+ */
+void hotkeys_init(struct hotkeys* hotkeys, struct timer_wheel* wheel);
+
+/**
+ * Count a request for `key`.
+ */
+void hotkeys_record(struct hotkeys* hotkeys, const char* key, size_t key_length);
+
+/**
+ * The estimated requests for `key`, never fewer than counted.
+ */
+uint32_t hotkeys_estimate(const struct hotkeys* hotkeys, const char* key, size_t key_length);
+
+/**
+ * The estimated requests of the hottest key, 0 if none was requested.
+ */
+uint32_t hotkeys_hottest(const struct hotkeys* hotkeys);
+
+/**
+ * Whether the request asks for the hottest keys.
+ */
+bool is_hotkeys_request(const struct request* request);
+
+/**
+ * Answer a hot keys request with the tracked keys, hottest first, one
+ * "<count> <key>\r\n" line each.
+ *
+ * Returns false if the connection failed.
+ */
+bool send_hotkeys(struct connection_state* state, const struct hotkeys* hotkeys);
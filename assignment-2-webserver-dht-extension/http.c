@@ -6,8 +6,10 @@
 
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 
 /**
@@ -65,16 +67,45 @@ static bool parse_header(char* buffer, size_t n, struct non_string* key, struct
         .start = buffer,
         .n = field_name_end - buffer
     };
+    // Strip optional whitespace around the field value
+    char* value_start = field_name_end + 1;
+    char* value_end = buffer + n;
+    while (value_start < value_end && (*value_start == ' ' || *value_start == '\t')) {
+        value_start += 1;
+    }
+    while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end -= 1;
+    }
     *value = (struct non_string) {
-        .start = field_name_end + 1,
-        .n = (buffer + n) - (field_name_end + 1)
+        .start = value_start,
+        .n = value_end - value_start
     };
 
     return true;
 }
 
 
-ssize_t parse_request(char* buffer, size_t n, struct request* request) {
+/**
+ * Request line and headers of a request, not yet null-terminated
+ */
+struct raw_head {
+    struct non_string method;
+    struct non_string uri;
+    struct {
+        struct non_string key;
+        struct non_string value;
+    } headers[HTTP_MAX_HEADERS];
+    size_t header_count;
+};
+
+
+/**
+ * Parse the request line and headers of an HTTP request
+ *
+ * Returns the length of the head including the empty line, zero if it is not
+ * received completely yet, or -1 if it is malformed. `buffer` is not modified.
+ */
+static ssize_t parse_head(char* buffer, size_t n, struct raw_head* head) {
     char* line_separator = "\r\n";
 
     const char* end = buffer + n;
@@ -85,47 +116,102 @@ ssize_t parse_request(char* buffer, size_t n, struct request* request) {
     if (!(line_end = memstr(pos, end - pos, line_separator))) {
         return 0; // Request line not received yet
     }
-    struct non_string method = {0};
-    struct non_string uri = {0};
-    if (!parse_request_line(pos, line_end - pos, &method, &uri)) {
+    if (!parse_request_line(pos, line_end - pos, &head->method, &head->uri)) {
         return -1; // Error parsing request line
     }
 
     pos = line_end + strlen(line_separator);  // Skip line separator
 
     // Parse headers
-    struct {
-        struct non_string key;
-        struct non_string value;
-    } headers[HTTP_MAX_HEADERS] = {0};
-    size_t header_count = 0;
-
     while ((line_end = memstr(pos, end - pos, line_separator)) != pos) {
-        if (header_count > HTTP_MAX_HEADERS) {
-            fprintf(stderr, "Exceeded max header count.\n");
-            exit(EXIT_FAILURE);
-        }
         if (!line_end) {
             return 0; // Header not fully received
         }
-        if (!parse_header(pos, line_end - pos, &(headers[header_count].key), &(headers[header_count].value))) {
+        if (head->header_count >= HTTP_MAX_HEADERS) {
+            fprintf(stderr, "Exceeded max header count.\n");
+            return -1;
+        }
+        if (!parse_header(pos, line_end - pos, &(head->headers[head->header_count].key), &(head->headers[head->header_count].value))) {
             return -1; // Error parsing header
         }
         pos = line_end + strlen(line_separator);  // Skip line separator
-        header_count += 1;
+        head->header_count += 1;
     }
 
     pos = line_end + strlen(line_separator);  // Skip empty line
+    return pos - buffer;
+}
 
-    // Parse payload length from headers
-    for (size_t i = 0; i < header_count; i += 1) {
-        if (strncmp(headers[i].key.start, "Content-Length", headers[i].key.n) == 0) {
-            request->payload_length = strtoul(headers[i].value.start, NULL, 10);
-            break;
+
+/**
+ * Whether the non-null-terminated string `s` equals `literal`, ignoring case.
+ */
+static bool non_string_equals(struct non_string s, const char* literal) {
+    return s.n == strlen(literal) && strncasecmp(s.start, literal, s.n) == 0;
+}
+
+
+/**
+ * Determine how the payload of a request is framed: by `Content-Length`
+ * (`payload_length`, -1 if missing), or by chunked transfer coding.
+ */
+static void parse_payload_framing(const struct raw_head* head, struct request* request) {
+    const char* chunked = "chunked";
+    for (size_t i = 0; i < head->header_count; i += 1) {
+        struct non_string value = head->headers[i].value;
+        if (non_string_equals(head->headers[i].key, "Content-Length")) {
+            request->payload_length = strtoul(value.start, NULL, 10);
+        } else if (non_string_equals(head->headers[i].key, "Transfer-Encoding")
+                   && value.n >= strlen(chunked)
+                   && strncasecmp(value.start + value.n - strlen(chunked), chunked, strlen(chunked)) == 0) {
+            request->chunked = true;
         }
     }
+}
+
+
+/**
+ * Populate `request` with the method, URI and headers of `head`.
+ *
+ * Bytes of the head will be discarded after sending the reply, so we can
+ * reuse `buffer` here to avoid dynamic memory allocation. All relevant
+ * strings are followed by at least one byte, so we can overwrite these with
+ * null-characters, yielding proper strings.
+ */
+static void terminate_head(struct raw_head* head, struct request* request) {
+    head->method.start[head->method.n] = '\0';
+    request->method = head->method.start;
+
+    head->uri.start[head->uri.n] = '\0';
+    request->uri = head->uri.start;
+
+    for (size_t i = 0; i < head->header_count; i += 1) {
+        head->headers[i].key.start[head->headers[i].key.n] = '\0';
+        request->headers[i].key = head->headers[i].key.start;
+
+        head->headers[i].value.start[head->headers[i].value.n] = '\0';
+        request->headers[i].value = head->headers[i].value.start;
+    }
+}
+
+
+ssize_t parse_request(char* buffer, size_t n, struct request* request) {
+    struct raw_head head = {0};
+    ssize_t head_length = parse_head(buffer, n, &head);
+    if (head_length <= 0) {
+        return head_length;
+    }
+
+    const char* end = buffer + n;
+    char* pos = buffer + head_length;
+
+    // Parse payload length from headers
+    parse_payload_framing(&head, request);
+    if (request->chunked) {
+        return 0;  // Chunked payloads are never complete here, they are streamed via `parse_request_head()`
+    }
     if (request->payload_length < 0) {
-        if (request->method && strncmp(request->method, "PUT", strlen("PUT")) == 0) {
+        if (non_string_equals(head.method, "PUT")) {
             return -1; // Content-Length non-optional on PUT-requests
         }
         request->payload_length = 0;
@@ -135,35 +221,182 @@ ssize_t parse_request(char* buffer, size_t n, struct request* request) {
         return 0;  // Payload not yet received completely, try again.
     }
 
-    // Request is valid: Bytes will be discarded after sending the reply,
-    // so we can reuse `buffer` here to avoid dynamic memory allocation.
-    // All relevant strings are followed by at least one byte, so we can
-    // overwrite these with null-characters, yielding proper strings.
+    // Request is valid
+    terminate_head(&head, request);
 
-    method.start[method.n] = '\0';
-    request->method = method.start;
+    return (pos + request->payload_length) - buffer;  // Parsed until `pos`
+}
 
-    uri.start[uri.n] = '\0';
-    request->uri = uri.start;
 
-    for (size_t i = 0; i < header_count; i += 1) {
-        headers[i].key.start[headers[i].key.n] = '\0';
-        request->headers[i].key = headers[i].key.start;
+ssize_t parse_request_head(char* buffer, size_t n, struct request* request) {
+    struct raw_head head = {0};
+    ssize_t head_length = parse_head(buffer, n, &head);
+    if (head_length <= 0) {
+        return head_length;
+    }
+
+    parse_payload_framing(&head, request);
+    terminate_head(&head, request);
+    request->payload = buffer + head_length;
+
+    return head_length;
+}
+
 
-        headers[i].value.start[headers[i].value.n] = '\0';
-        request->headers[i].value = headers[i].value.start;
+ssize_t parse_response(char* buffer, size_t n, struct response* response) {
+    // The status line splits like a request line: version, status code, reason
+    struct raw_head head = {0};
+    ssize_t head_length = parse_head(buffer, n, &head);
+    if (head_length <= 0) {
+        return head_length;
     }
 
-    return (pos + request->payload_length) - buffer;  // Parsed until `pos`
+    struct request framing = { .payload_length = -1 };
+    parse_payload_framing(&head, &framing);
+    if (framing.chunked || head.uri.n != 3 || !isdigit((unsigned char) head.uri.start[0])) {
+        return -1;
+    }
+    response->status = strtol(head.uri.start, NULL, 10);
+    response->payload = buffer + head_length;
+    response->payload_length = framing.payload_length < 0 ? 0 : framing.payload_length;
+
+    if (response->payload_length > n - head_length) {
+        return 0;  // Payload not yet received completely
+    }
+    return head_length + response->payload_length;
 }
 
 
 string get_header(const struct request* request, const string name) {
     for (size_t i = 0; i < HTTP_MAX_HEADERS; i += 1) {
-        if (request->headers[i].key && strcmp(request->headers[i].key, name) == 0) {
+        if (request->headers[i].key && strcasecmp(request->headers[i].key, name) == 0) {
             return request->headers[i].value;
         }
     }
     return NULL; // Header not found
 }
 
+
+/**
+ * Parse a non-negative decimal number, advancing `pos` behind it.
+ *
+ * Returns whether at least one digit was read. A number that does not fit
+ * into a `size_t` is not read at all, `pos` is left at its first digit.
+ */
+static bool parse_decimal(const char** pos, size_t* value) {
+    const char* start = *pos;
+    *value = 0;
+    while (isdigit((unsigned char) **pos)) {
+        size_t digit = (size_t) (**pos - '0');
+        if (*value > (SIZE_MAX - digit) / 10) {
+            *pos = start;
+            return false;
+        }
+        *value = *value * 10 + digit;
+        *pos += 1;
+    }
+    return *pos != start;
+}
+
+
+enum range_result parse_range(const string header, size_t length, size_t* first, size_t* last) {
+    const char* unit = "bytes=";
+    if (strncmp(header, unit, strlen(unit)) != 0 || strchr(header, ',')) {
+        return RANGE_NONE;
+    }
+    const char* pos = header + strlen(unit);
+
+    size_t start = 0, end = 0;
+    bool has_start = parse_decimal(&pos, &start);
+    if (*pos != '-') {
+        return RANGE_NONE;
+    }
+    pos += 1;
+    bool has_end = parse_decimal(&pos, &end);
+    if (*pos != '\0' || (!has_start && !has_end) || (has_start && has_end && end < start)) {
+        return RANGE_NONE;
+    }
+
+    if (!has_start) {  // suffix range: the last `end` bytes
+        if (end == 0 || length == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *first = end < length ? length - end : 0;
+        *last = length - 1;
+        return RANGE_SATISFIABLE;
+    }
+
+    if (start >= length) {
+        return RANGE_UNSATISFIABLE;
+    }
+    *first = start;
+    *last = (has_end && end < length) ? end : length - 1;
+    return RANGE_SATISFIABLE;
+}
+
+
+bool etag_matches(const string header, const string etag) {
+    size_t etag_length = strlen(etag);
+    const char* pos = header;
+    while (*pos) {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos += 1;
+        }
+        if (*pos == '*') {
+            return true;
+        }
+        if (strncmp(pos, "W/", 2) == 0) {
+            pos += 2;
+        }
+
+        const char* end = pos;
+        while (*end && *end != ',' && *end != ' ' && *end != '\t') {
+            end += 1;
+        }
+        if ((size_t) (end - pos) == etag_length && strncmp(pos, etag, etag_length) == 0) {
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+
+bool accepts_encoding(const string header, const string coding) {
+    size_t coding_length = strlen(coding);
+    bool wildcard = false;
+    const char* pos = header;
+    while (*pos) {
+        while (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos += 1;
+        }
+        const char* name = pos;
+        while (*pos && *pos != ',' && *pos != ';' && *pos != ' ' && *pos != '\t') {
+            pos += 1;
+        }
+        size_t name_length = pos - name;
+
+        // A weight of zero ("q=0", "q=0.000") marks the coding as not acceptable
+        bool acceptable = true;
+        const char* weight = pos;
+        while (*pos && *pos != ',') {
+            pos += 1;
+        }
+        const char* q = memchr(weight, '=', pos - weight);
+        if (q) {
+            q += 1;
+            while (q < pos && (*q == '0' || *q == '.')) {
+                q += 1;
+            }
+            acceptable = q < pos && isdigit((unsigned char) *q);
+        }
+
+        if (name_length == coding_length && strncasecmp(name, coding, coding_length) == 0) {
+            return acceptable;
+        }
+        if (name_length == 1 && *name == '*') {
+            wildcard = acceptable;
+        }
+    }
+    return wildcard;
+}
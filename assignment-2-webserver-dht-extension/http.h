@@ -1,11 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include "timer_wheel.h"
+#include "upload.h"
 #include "util.h"
 
 #define HTTP_MAX_SIZE 8192
+#define HTTP_MAX_HEAD_SIZE 512  // status line and headers of a reply
 #define HTTP_MAX_HEADERS 40
+#define CONNECTION_OUT_MIN_CAPACITY 4096  // initial storage of the reply bytes queued on a connection
 
 
 /**
@@ -26,9 +31,26 @@ struct request {
     struct header headers[HTTP_MAX_HEADERS];
     char* payload;
     ssize_t payload_length;
+    bool chunked;  // payload uses chunked transfer coding, `payload_length` is meaningless
 };
 
 
+/**
+ * Representation of a HTTP response, as received from another node
+ */
+struct response {
+    int status;
+    char* payload;
+    size_t payload_length;
+};
+
+
+struct batch;
+struct bulk;
+struct repair;
+struct fetch;
+struct store;
+
 /**
  * The state of an ongoing HTTP connection
  *
@@ -37,12 +59,47 @@ struct request {
  * `end`: end of unprocessed data in `buffer`
  * `current_request`: current, complete request, not yet answered to. Reuses
  *                    memory of `buffer`.
+ * `idle_timer`: closes the connection when the client stays silent too long
+ * `deadline_timer`: running while a request is only partially received
+ * `upload`: payload of the current request, streamed past `buffer`
+ * `lingering`: the final reply is sent and the sending side shut down,
+ *              input is drained until the client closes
+ * `batch`: batch request waiting for other nodes
+ * `bulk`: bulk load in progress, or waiting for its keys forwarded to other nodes
+ * `repair`: repair session waiting for another node
+ * `fetch`: GET waiting for the value from another node over UDP
+ * `paused`: the connection is not read from until a batch, bulk load, repair or fetch lets
+ *           it resume, later requests are answered after it
+ * `deferred`: requests in `buffer` are left over for the next iteration of the event loop,
+ *             the connection used up its budget
+ * `out`: reply bytes the client did not take yet, `out_sent` of `out_length` are sent;
+ *        the connection waits until they are, before it handles further requests
+ * `lent`: the rest of a stored value the client did not take yet, `lent_length` bytes
+ *         sent after `out`; not copied but lent from `lender`, as `loan`
  */
 struct connection_state {
     int sock;
     char buffer[HTTP_MAX_SIZE];
     char* end;
     struct request current_request;
+    struct timer idle_timer;
+    struct timer deadline_timer;
+    struct upload upload;
+    bool lingering;
+    struct batch* batch;
+    struct bulk* bulk;
+    struct repair* repair;
+    struct fetch* fetch;
+    bool paused;
+    bool deferred;
+    char* out;
+    size_t out_length;
+    size_t out_sent;
+    size_t out_capacity;
+    struct store* lender;
+    const char* loan;
+    const char* lent;
+    size_t lent_length;
 };
 
 /**
@@ -55,7 +112,64 @@ struct connection_state {
  */
 ssize_t parse_request(char* buffer, size_t n, struct request* request);
 
+/**
+ * Parse the request line and headers of an HTTP request into the given structure.
+ *
+ * Unlike `parse_request()`, the payload is not waited for: once the head is
+ * complete, `request` is populated, `payload` points behind the head, and the
+ * length of the head is returned. The head is null-terminated in place then,
+ * so its bytes must be consumed. Otherwise, zero (incomplete) or -1 (malformed)
+ * is returned. Used for payloads that are chunked or do not fit into the buffer.
+ */
+ssize_t parse_request_head(char* buffer, size_t n, struct request* request);
+
+/**
+ * Parse an HTTP response into the given structure.
+ *
+ * Returns the length of the complete response, zero if it is not received
+ * completely yet, or -1 if it is malformed. `payload` points into `buffer`,
+ * which is not modified. Responses without `Content-Length` are taken to
+ * have no payload, chunked responses are not supported.
+ */
+ssize_t parse_response(char* buffer, size_t n, struct response* response);
+
 /**
  * Get value of header in request if set, or NULL.
  */
 string get_header(const struct request* request, const string name);
+
+
+/**
+ * Outcome of parsing a `Range` header
+ */
+enum range_result {
+    RANGE_NONE,           // no usable range, the full representation is sent
+    RANGE_SATISFIABLE,    // `first` and `last` denote the requested bytes
+    RANGE_UNSATISFIABLE,  // the range lies outside of the representation
+};
+
+/**
+ * Parse the value of a `Range` header for a representation of `length` bytes.
+ *
+ * Only a single range of the `bytes` unit is supported (`a-b`, `a-`, `-n`).
+ * Malformed headers and multiple ranges are ignored, as permitted by
+ * RFC 9110. On a satisfiable range, `first` and `last` are set to the
+ * inclusive bounds of the requested bytes.
+ */
+enum range_result parse_range(const string header, size_t length, size_t* first, size_t* last);
+
+/**
+ * Whether the value of an `If-None-Match` header matches the entity tag `etag` (including its quotes).
+ *
+ * The header is `*` or a comma-separated list of entity tags, compared
+ * weakly as required by RFC 9110: a `W/` prefix is ignored.
+ */
+bool etag_matches(const string header, const string etag);
+
+/**
+ * Whether the value of an `Accept-Encoding` header accepts the content coding `coding`.
+ *
+ * The coding has to be listed, by name or as `*`, without a weight of zero.
+ */
+bool accepts_encoding(const string header, const string coding);
+
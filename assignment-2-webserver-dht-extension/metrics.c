@@ -0,0 +1,67 @@
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "data.h"
+#include "sockets_setup.h"
+
+
+bool is_metrics_request(const struct request* request) {
+    return strcmp(request->method, "GET") == 0 && strcmp(request->uri, METRICS_URI) == 0;
+}
+
+
+bool send_metrics(struct connection_state* state, const struct chord_context* ctx) {
+    const struct store* store = &ctx->store;
+    char payload[METRICS_MAX_SIZE];
+    int payload_length = snprintf(payload, sizeof(payload),
+        "store_keys %zu\n"
+        "store_keys_owned %zu\n"
+        "store_memory_bytes %zu\n"
+        "store_evictions_total %" PRIu64 "\n"
+        "store_expirations_total %" PRIu64 "\n"
+        "store_filter_negatives_total %" PRIu64 "\n"
+        "store_filter_false_positives_total %" PRIu64 "\n"
+        "hotkeys_requests_total %" PRIu64 "\n"
+        "hotkeys_tracked %zu\n"
+        "hotkeys_hottest_requests %" PRIu32 "\n"
+        "near_cache_keys %zu\n"
+        "near_cache_hits_total %" PRIu64 "\n"
+        "near_cache_invalidations_total %" PRIu64 "\n"
+        "successor_list_size %zu\n"
+        "successor_failovers_total %" PRIu64 "\n"
+        "load_requests_per_second %" PRIu32 "\n"
+        "load_pred_requests_per_second %" PRIu32 "\n"
+        "load_pred_bytes %" PRIu64 "\n"
+        "balance_migrations_total %" PRIu64 "\n"
+        "balance_keys_migrated_total %" PRIu64 "\n"
+        "lookup_rtt_smoothed_us %" PRIu32 "\n"
+        "lookup_rtt_variation_us %" PRIu32 "\n"
+        "admission_delay_us %" PRIu64 "\n"
+        "admission_shedding %d\n"
+        "admission_shed_total %" PRIu64 "\n"
+        "scheduler_control_us_total %" PRIu64 "\n"
+        "scheduler_data_us_total %" PRIu64 "\n"
+        "scheduler_control_slices_total %" PRIu64 "\n"
+        "scheduler_deferred_total %" PRIu64 "\n",
+        store->count, store_range(store, ctx->own_node.pred.id, ctx->own_node.self_id, NULL, NULL), store->memory, store->evictions, store->expirations,
+        store->filter_negatives, store->filter_false_positives,
+        ctx->hotkeys.requests, ctx->hotkeys.n_top, hotkeys_hottest(&ctx->hotkeys),
+        ctx->near.store.count, ctx->near.hits, ctx->near.invalidations,
+        ctx->successors.n_nodes, ctx->successors.failovers,
+        ctx->balance.rps, ctx->balance.pred.rps, ctx->balance.pred.bytes, ctx->balance.migrations, ctx->balance.migrated,
+        ctx->pending_lookups.srtt_us, ctx->pending_lookups.rttvar_us,
+        ctx->admission.delay_us, ctx->admission.shedding, ctx->admission.shed,
+        ctx->scheduler.control_us, ctx->scheduler.data_us, ctx->scheduler.slices, ctx->scheduler.deferred);
+
+    char reply[HTTP_MAX_HEAD_SIZE + METRICS_MAX_SIZE];
+    int reply_length = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n%s",
+                                payload_length, payload);
+    if (!connection_write(state, reply, reply_length)) {
+        perror("send");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "chord_processor.h"
+#include "http.h"
+
+#define METRICS_URI "/metrics"
+#define METRICS_MAX_SIZE 2048  // longest list of metrics
+
+
+/**
+ * Whether the request asks for the metrics of this node.
+ */
+bool is_metrics_request(const struct request* request);
+
+/**
+ * Answer a metrics request with the counters of this node as payload, one
+ * "<name> <value>" line each, in the text format read by Prometheus.
+ *
+ * Returns false if the connection failed.
+ */
+bool send_metrics(struct connection_state* state, const struct chord_context* ctx);
@@ -0,0 +1,170 @@
+#include "near.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chord_processor.h"
+
+
+void near_init(struct near_cache* near, size_t budget) {
+    memset(near, 0, sizeof(*near));
+    near->enabled = budget > 0;
+    store_init(&near->store, budget);
+}
+
+
+const struct tuple* near_get(struct near_cache* near, const string key) {
+    const struct tuple* tuple = near->enabled ? get_tuple(&near->store, key) : NULL;
+    if (tuple) {
+        near->hits += 1;
+    }
+    return tuple;
+}
+
+
+/**
+ * Cache the value of a completed fetch.
+ */
+static void fetch_done(void* arg, const struct response* response) {
+    struct near_fetch* fetch = arg;
+    struct near_cache* near = fetch->near;
+    if (response && response->status == 200 && !fetch->stale &&
+            set(&near->store, fetch->key, response->payload, response->payload_length) != STORE_REJECTED) {
+        expire(&near->store, fetch->key, monotonic_ms(), NEAR_TTL_MS);
+    }
+    free(fetch->key);
+    fetch->key = NULL;
+}
+
+
+void near_consider(struct chord_context* ctx, const string key, struct sockaddr_in owner) {
+    struct near_cache* near = &ctx->near;
+    if (!near->enabled || hotkeys_estimate(&ctx->hotkeys, key, strlen(key)) < NEAR_HOT_THRESHOLD) {
+        return;
+    }
+    struct near_fetch* free_slot = NULL;
+    for (size_t i = 0; i < NEAR_MAX_FETCHES; i += 1) {
+        struct near_fetch* fetch = &near->fetches[i];
+        if (!fetch->key) {
+            free_slot = free_slot ? free_slot : fetch;
+        } else if (strcmp(fetch->key, key) == 0) {
+            return;
+        }
+    }
+    if (!free_slot) {
+        return;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &ctx->addr.sin_addr, ip, sizeof(ip));
+    int request_length = snprintf(NULL, 0, "GET %s HTTP/1.1\r\n" NEAR_HEADER ": %s:%d\r\nContent-Length: 0\r\n\r\n",
+                                  key, ip, ntohs(ctx->addr.sin_port));
+    char* request = malloc(request_length + 1);
+    free_slot->key = strdup(key);
+    if (!request || !free_slot->key) {
+        free(request);
+        free(free_slot->key);
+        free_slot->key = NULL;
+        return;
+    }
+    snprintf(request, request_length + 1, "GET %s HTTP/1.1\r\n" NEAR_HEADER ": %s:%d\r\nContent-Length: 0\r\n\r\n",
+             key, ip, ntohs(ctx->addr.sin_port));
+    free_slot->near = near;
+    free_slot->stale = false;
+    if (!peer_pool_request(&ctx->peers, owner, request, request_length, fetch_done, free_slot)) {
+        free(free_slot->key);
+        free_slot->key = NULL;
+    }
+}
+
+
+void near_lend(struct chord_context* ctx, const struct request* request) {
+    struct near_cache* near = &ctx->near;
+    const string holder = get_header(request, NEAR_HEADER);
+    if (!holder) {
+        return;
+    }
+    char ip[INET_ADDRSTRLEN];
+    unsigned port;
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    if (sscanf(holder, "%15[0-9.]:%u", ip, &port) != 2 || port > UINT16_MAX || inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        return;
+    }
+    addr.sin_port = htons(port);
+
+    uint16_t position = hash(request->uri);
+    near->lent[position / 8] |= 1 << position % 8;
+    for (size_t i = 0; i < near->n_holders; i += 1) {
+        if (near->holders[i].sin_addr.s_addr == addr.sin_addr.s_addr && near->holders[i].sin_port == addr.sin_port) {
+            return;
+        }
+    }
+    if (near->n_holders < NEAR_MAX_HOLDERS) {
+        near->holders[near->n_holders++] = addr;
+    } else {
+        near->holders[near->next_holder] = addr;
+        near->next_holder = (near->next_holder + 1) % NEAR_MAX_HOLDERS;
+    }
+}
+
+
+void near_changed(struct chord_context* ctx, const string key) {
+    struct near_cache* near = &ctx->near;
+    uint16_t position = hash(key);
+    if (!(near->lent[position / 8] & 1 << position % 8)) {
+        return;
+    }
+    near->lent[position / 8] &= ~(1 << position % 8);
+
+    DHTLookupMessage invalidate = {
+        .messageType = DHT_INVALIDATE_TYPE,
+        .key = position,
+        .originNodeID = ctx->own_node.self_id,
+        .originNodeIP = ctx->addr.sin_addr,
+        .originNodePort = ntohs(ctx->addr.sin_port),
+    };
+    for (size_t i = 0; i < near->n_holders; i += 1) {
+        outbox_queue(&ctx->outbox, near->holders[i], &invalidate);
+    }
+}
+
+
+/**
+ * Keys of the cached values to drop
+ */
+struct near_keys {
+    char** keys;
+    size_t n_keys;
+};
+
+static bool collect_key(const struct tuple* tuple, void* arg) {
+    struct near_keys* collected = arg;
+    char** keys = realloc(collected->keys, (collected->n_keys + 1) * sizeof(char*));
+    if (!keys) {
+        return false;
+    }
+    collected->keys = keys;
+    collected->keys[collected->n_keys] = strdup(tuple->key);
+    collected->n_keys += collected->keys[collected->n_keys] != NULL;
+    return true;
+}
+
+
+void near_invalidate(struct near_cache* near, uint16_t position) {
+    near->invalidations += 1;
+    for (size_t i = 0; i < NEAR_MAX_FETCHES; i += 1) {
+        if (near->fetches[i].key && hash(near->fetches[i].key) == position) {
+            near->fetches[i].stale = true;
+        }
+    }
+
+    struct near_keys collected = { .keys = NULL, .n_keys = 0 };
+    store_range(&near->store, position - 1, position, collect_key, &collected);
+    for (size_t i = 0; i < collected.n_keys; i += 1) {
+        delete(&near->store, collected.keys[i]);
+        free(collected.keys[i]);
+    }
+    free(collected.keys);
+}
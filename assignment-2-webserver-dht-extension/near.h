@@ -0,0 +1,87 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "data.h"
+#include "http.h"
+
+#define NEAR_HEADER "X-Near-Cache"  // on fetches of a near cache, "<ip>:<port>" of the fetching node for invalidations
+#define NEAR_HOT_THRESHOLD 16       // estimated requests before a key of another node is cached
+#define NEAR_TTL_MS 2000            // lifetime of a cached value, bounds staleness if an invalidation is lost
+#define NEAR_MAX_FETCHES 8          // fetches from owners in flight
+#define NEAR_MAX_HOLDERS 16         // nodes told about changes of values they fetched
+
+struct chord_context;
+
+
+/**
+ * A value fetched from its owner for the near cache
+ *
+ * `key`: the key fetched, NULL if the slot is unused
+ * `stale`: the value changed since the fetch was sent, the response is dropped
+ */
+struct near_fetch {
+    struct near_cache* near;
+    char* key;
+    bool stale;
+};
+
+/**
+ * Values of hot keys other nodes are responsible for, served here instead of
+ * pointing clients to the owner
+ *
+ * Once a key this node is not responsible for is hot, its value is fetched
+ * from the owner and kept for `NEAR_TTL_MS`. The owner remembers which nodes
+ * fetched values, and which keys it handed out: when such a key changes, it
+ * tells every such node to drop it.
+ *
+ * `enabled`: values are cached, the cache has a memory budget
+ * `store`: the cached values, bounded by the budget
+ * `holders`: nodes that fetched values from this node, `n_holders`, replaced round-robin from `next_holder` when full
+ * `lent`: bit per ring position of which keys were fetched since they last changed
+ * `hits`, `invalidations`: counted for the metrics
+ */
+struct near_cache {
+    bool enabled;
+    struct store store;
+    struct near_fetch fetches[NEAR_MAX_FETCHES];
+    struct sockaddr_in holders[NEAR_MAX_HOLDERS];
+    size_t n_holders;
+    size_t next_holder;
+    uint8_t lent[(UINT16_MAX + 1) / 8];
+    uint64_t hits;
+    uint64_t invalidations;
+};
+
+
+/**
+ * Start with an empty cache of `budget` bytes, disabled if 0.
+ */
+void near_init(struct near_cache* near, size_t budget);
+
+/**
+ * The cached tuple of `key`, or NULL.
+ */
+const struct tuple* near_get(struct near_cache* near, const string key);
+
+/**
+ * Fetch the value of `key` from its owner at `owner` if the key is hot and not cached or fetched yet.
+ */
+void near_consider(struct chord_context* ctx, const string key, struct sockaddr_in owner);
+
+/**
+ * Remember the node fetching with `request`, if any, to tell it when the value of the requested key changes.
+ */
+void near_lend(struct chord_context* ctx, const struct request* request);
+
+/**
+ * Tell the nodes that may have cached the value of `key` that it changed.
+ */
+void near_changed(struct chord_context* ctx, const string key);
+
+/**
+ * Drop the cached values of all keys at ring position `position`.
+ */
+void near_invalidate(struct near_cache* near, uint16_t position);
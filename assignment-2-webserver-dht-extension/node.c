@@ -60,7 +60,7 @@ void addOrUpdateMessage(DHTLookupMessage lookupMessages[], int *nextFreeIndex, D
     // Search for existing message
  
     int foundIndex = -1;
-    for (int i = 0; i < MAX_LOOKUP_MESSAGES; i++) {
+    for (int i = 0; i < *nextFreeIndex; i++) {  // slots behind may hold stale copies of removed replies
         if (messagesAreEqual(lookupMessages[i], newMessage)) {
             foundIndex = i;
             break;
@@ -126,6 +126,66 @@ DHTLookupMessage* findDHTreply(DHTLookupMessage lookupMessages[], uint16_t key,
     return NULL;
 }
 
+/**
+ * PEEK DHT REPLY: Searches for a DHTLookupMessage in the lookupMessages array based on a given key, leaving it in the array.
+ *
+ * Unlike findDHTreply, the cached reply stays available for further keys of the same node, so many keys can be routed by a
+ * single reply.
+ *
+ * @param lookupMessages[] The array of DHTLookupMessage to be searched.
+ * @param key The key to be used for finding the DHTLookupMessage.
+ * @param nextFreeIndex The next free index in the lookupMessages array.
+ * @return A pointer to the found DHTLookupMessage within the array, or NULL if no matching message is found.
+ */
+const DHTLookupMessage* peekDHTreply(const DHTLookupMessage lookupMessages[], uint16_t key, int nextFreeIndex) {
+    for (int i = 0; i < nextFreeIndex; i++) {
+        if (lookupMessages[i].messageType == 1 && is_responsible_hashed(key, lookupMessages[i].originNodeID, lookupMessages[i].key)) {
+            return &lookupMessages[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * EXPIRE DHT REPLIES: Removes cached lookup replies older than `ROUTE_CACHE_TTL_MS` from the lookupMessages array.
+ *
+ * Replies are only valid for as long as the ring does not change, so unused replies must not be kept forever. The
+ * remaining messages keep their order.
+ *
+ * @param lookupMessages[] The array of DHTLookupMessage to be cleaned up.
+ * @param nextFreeIndex A pointer to an integer that tracks the next free index in the lookupMessages array.
+ * @param now_ms The current monotonic time in milliseconds.
+ */
+void expireDHTreplies(DHTLookupMessage lookupMessages[], int *nextFreeIndex, uint64_t now_ms) {
+    int kept = 0;
+    for (int i = 0; i < *nextFreeIndex; i++) {
+        if (now_ms - lookupMessages[i].receivedAt < ROUTE_CACHE_TTL_MS) {
+            lookupMessages[kept++] = lookupMessages[i];
+        }
+    }
+    memset(&lookupMessages[kept], 0, (*nextFreeIndex - kept) * sizeof(DHTLookupMessage));
+    *nextFreeIndex = kept;
+}
+
+/**
+ * FORGET DHT REPLIES: Removes the lookup replies naming a given node from the lookupMessages array, e.g. once it failed.
+ *
+ * @param lookupMessages The array of DHTLookupMessage structures.
+ * @param nextFreeIndex A pointer to the index of the next free slot, updated to the number of replies kept.
+ * @param ip The IP address of the node.
+ * @param port The port of the node.
+ */
+void forgetDHTreplies(DHTLookupMessage lookupMessages[], int *nextFreeIndex, struct in_addr ip, uint16_t port) {
+    int kept = 0;
+    for (int i = 0; i < *nextFreeIndex; i++) {
+        if (lookupMessages[i].originNodeIP.s_addr != ip.s_addr || lookupMessages[i].originNodePort != port) {
+            lookupMessages[kept++] = lookupMessages[i];
+        }
+    }
+    memset(&lookupMessages[kept], 0, (*nextFreeIndex - kept) * sizeof(DHTLookupMessage));
+    *nextFreeIndex = kept;
+}
+
 /**
  * PRINT BUFFER AS HEX: Prints the contents of a buffer in hexadecimal and ASCII format.
  *
@@ -256,137 +316,333 @@ struct NetworkNodes derive_nodes_data(const char* nodeId) {
 }
 
 /**
- * CONSTRUCT DHT LOOKUP MESSAGE: Serializes a DHTLookupMessage into a binary format for network transmission.
+ * ENCODE MESSAGE: Serializes a single DHTLookupMessage into `DHT_MESSAGE_SIZE` bytes at `buffer`.
  *
- * This function converts the DHTLookupMessage fields into network byte order and packs them into the provided buffer.
- * It assumes that the originNodeIP is already in network byte order. The function returns the size of the serialized data.
- *
- * @param lookup_msg A pointer to the DHTLookupMessage to be serialized.
- * @param buffer The buffer where the serialized message is stored.
- * @return The size of the serialized message in bytes.
+ * The originNodeIP is already in network byte order, all other fields are converted.
  */
-int construct_dht_lookup_message(const DHTLookupMessage *lookup_msg, char *buffer) {
-    char ipStr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &lookup_msg->originNodeIP, ipStr, sizeof(ipStr));
-
-    //TODO: error handling for constructor, if there is no data passed
-    // Serialize fields into binary format
+static void encode_message(const DHTLookupMessage *lookup_msg, char *buffer) {
     buffer[0] = lookup_msg->messageType;
 
     uint16_t keyNet = htons(lookup_msg->key);
     memcpy(buffer + 1, &keyNet, sizeof(keyNet));
-    
+
     uint16_t originNodeIDNet = htons(lookup_msg->originNodeID);
     memcpy(buffer + 3, &originNodeIDNet, sizeof(originNodeIDNet));
-    
-    // Assuming originNodeIP is already in network byte order
+
     memcpy(buffer + 5, &lookup_msg->originNodeIP, sizeof(lookup_msg->originNodeIP));
-    
+
     uint16_t originNodePortNet = htons(lookup_msg->originNodePort);
     memcpy(buffer + 9, &originNodePortNet, sizeof(originNodePortNet));
-  
-
-    // print_buffer_as_hex(buffer, 11);     // Print the buffer content as hexadecimal 
-
-
-    return 11;
 }
 
 /**
- * PARSE DHT LOOKUP MESSAGE: Deserializes a binary format message into a DHTLookupMessage structure.
- *
- * This function extracts and converts the fields from the network byte order to the host byte order and populates
- * the DHTLookupMessage structure. It handles the conversion of message type, key, originNodeID, and originNodePort from
- * the buffer to the DHTLookupMessage.
- *
- * @param lookup_msg A pointer to the DHTLookupMessage where the deserialized data will be stored.
- * @param buffer The buffer containing the serialized message.
+ * DECODE MESSAGE: Deserializes `DHT_MESSAGE_SIZE` bytes at `buffer` into a DHTLookupMessage.
  */
-void parse_dht_lookup_message(DHTLookupMessage *lookup_msg, char *buffer) {
-    uint8_t messageTypeNet = 0; 
-    uint16_t keyNet = 0, originNodeIDNet = 0, originNodePortNet = 0;
+static void decode_message(DHTLookupMessage *lookup_msg, const char *buffer) {
+    uint16_t keyNet, originNodeIDNet, originNodePortNet;
 
-    // Convert from network byte order to host byte order
-    messageTypeNet = buffer[0];
-    lookup_msg->messageType = messageTypeNet;
+    lookup_msg->messageType = buffer[0];
 
-    memcpy(&keyNet, buffer + 1, 2); // parse two bytes
+    memcpy(&keyNet, buffer + 1, 2);
     lookup_msg->key = ntohs(keyNet);
 
-    memcpy(&originNodeIDNet, buffer + 3, 2);  // parse two bytes
-    lookup_msg->originNodeID  = ntohs(originNodeIDNet);
+    memcpy(&originNodeIDNet, buffer + 3, 2);
+    lookup_msg->originNodeID = ntohs(originNodeIDNet);
 
-    //  originNodeIP is already in network byte order
     memcpy(&lookup_msg->originNodeIP, buffer + 5, 4);
 
-    
-    memcpy(&originNodePortNet, buffer + 9, 2);  
-    
+    memcpy(&originNodePortNet, buffer + 9, 2);
     lookup_msg->originNodePort = ntohs(originNodePortNet);
+}
 
+/**
+ * CONSTRUCT DHT LOOKUP MESSAGE: Serializes DHTLookupMessages into one datagram for network transmission.
+ *
+ * A single message is sent in the plain format every node understands. Several messages are packed into a batch: a head of
+ * `DHT_BATCH_TYPE`, `DHT_BATCH_VERSION` and the number of messages, followed by the messages in the plain format.
+ *
+ * @param messages The DHTLookupMessages to be serialized.
+ * @param count The number of messages, 1 to `DHT_BATCH_MAX`.
+ * @param buffer The buffer where the serialized datagram is stored, `DHT_DATAGRAM_MAX` bytes.
+ * @return The size of the serialized datagram in bytes.
+ */
+int construct_dht_lookup_message(const DHTLookupMessage messages[], int count, char *buffer) {
+    if (count == 1) {
+        encode_message(&messages[0], buffer);
+        return DHT_MESSAGE_SIZE;
+    }
 
+    buffer[0] = (char) DHT_BATCH_TYPE;
+    buffer[1] = DHT_BATCH_VERSION;
+    buffer[2] = count;
+    for (int i = 0; i < count; i++) {
+        encode_message(&messages[i], buffer + DHT_BATCH_HEAD_SIZE + i * DHT_MESSAGE_SIZE);
+    }
+    return DHT_BATCH_HEAD_SIZE + count * DHT_MESSAGE_SIZE;
+}
 
+/**
+ * PARSE DHT LOOKUP MESSAGE: Deserializes the DHTLookupMessages of a received datagram.
+ *
+ * This function extracts and converts the fields from the network byte order to the host byte order, for a plain message as
+ * well as for all messages of a batch.
+ *
+ * @param messages The DHTLookupMessages where the deserialized data will be stored, `DHT_BATCH_MAX` entries.
+ * @param buffer The buffer containing the datagram.
+ * @param length The size of the datagram in bytes.
+ * @return The number of messages parsed, 0 if the datagram is malformed or of an unknown batch version.
+ */
+int parse_dht_lookup_message(DHTLookupMessage messages[], const char *buffer, int length) {
+    if ((uint8_t) buffer[0] != DHT_BATCH_TYPE) {
+        if (length < DHT_MESSAGE_SIZE) {
+            return 0;
+        }
+        decode_message(&messages[0], buffer);
+        return 1;
+    }
 
+    int count = length >= DHT_BATCH_HEAD_SIZE ? (uint8_t) buffer[2] : 0;
+    if (buffer[1] != DHT_BATCH_VERSION || count > DHT_BATCH_MAX || length != DHT_BATCH_HEAD_SIZE + count * DHT_MESSAGE_SIZE) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        decode_message(&messages[i], buffer + DHT_BATCH_HEAD_SIZE + i * DHT_MESSAGE_SIZE);
+    }
+    return count;
 }
 
 
 /**
- * LOOKUP DHT: Performs a DHT lookup operation using the given socket and network node information.
+ * OUTBOX INIT: Prepares an empty outbox.
  *
- * This function prepares a DHTLookupMessage with the provided hashed key and network node information. It constructs
- * the DHT lookup message and sends it to the successor node. The function handles the retrieval of the local socket's IP
- * and port, populates the lookup message, constructs the message, and sends it to the successor node.
- *
- * @param socket The socket used for sending the DHT lookup message.
- * @param own_node The NetworkNodes structure containing information about the current node.
- * @param hashed_key The hashed key for which the responsible node is being looked up.
- * @param lookup_msg A pointer to the DHTLookupMessage to be sent.
+ * @param outbox The outbox to be initialized.
+ * @param socket The UDP socket messages are sent from.
  */
-void lookup_dht(int socket, struct NetworkNodes own_node, uint16_t hashed_key, DHTLookupMessage *lookup_msg) {
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    // Create a buffer to hold the HTTP reply
-    char send_buffer[HTTP_MAX_SIZE+1];
-
+void outbox_init(struct dht_outbox* outbox, int socket) {
+    outbox->socket = socket;
+    outbox->count = 0;
+}
 
-    // Use getsockname to get the socket's local IP and port
-    if (getsockname(socket, (struct sockaddr *)&addr, &addr_len) < 0) {
-        perror("getsockname failed");
-        exit(EXIT_FAILURE);
+/**
+ * OUTBOX QUEUE: Queues a message to be sent with the next flush of the outbox.
+ *
+ * @param outbox The outbox of the node.
+ * @param addr The node the message is sent to.
+ * @param message The message, copied.
+ */
+void outbox_queue(struct dht_outbox* outbox, struct sockaddr_in addr, const DHTLookupMessage* message) {
+    if (outbox->count == DHT_OUTBOX_SIZE) {
+        outbox_flush(outbox);
     }
+    outbox->addrs[outbox->count] = addr;
+    outbox->messages[outbox->count] = *message;
+    outbox->count++;
+}
 
-    uint16_t port = ntohs(addr.sin_port);
-
+/**
+ * OUTBOX FLUSH: Sends all queued messages, those for the same node packed into as few datagrams as possible.
+ *
+ * Messages keep their order per node.
+ *
+ * @param outbox The outbox of the node.
+ */
+void outbox_flush(struct dht_outbox* outbox) {
+    bool sent[DHT_OUTBOX_SIZE] = {false};
+    DHTLookupMessage group[DHT_BATCH_MAX];
+    char buffer[DHT_DATAGRAM_MAX];
+
+    for (int first = 0; first < outbox->count; first++) {
+        if (sent[first]) {
+            continue;
+        }
+        struct sockaddr_in addr = outbox->addrs[first];
+
+        // Group the messages for the node by scanning the rest of the outbox once per datagram
+        int i = first;
+        while (i < outbox->count) {
+            int count = 0;
+            for (; i < outbox->count && count < DHT_BATCH_MAX; i++) {
+                if (!sent[i] && outbox->addrs[i].sin_addr.s_addr == addr.sin_addr.s_addr && outbox->addrs[i].sin_port == addr.sin_port) {
+                    group[count++] = outbox->messages[i];
+                    sent[i] = true;
+                }
+            }
+            if (count == 0) {
+                break;
+            }
+            int size = construct_dht_lookup_message(group, count, buffer);
+            if (sendto(outbox->socket, buffer, size, 0, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                perror("sendto failed");
+            }
+        }
+    }
+    outbox->count = 0;
+}
 
-    // lookup msg muss befuellt werden
-    lookup_msg->key = hashed_key;
-    lookup_msg->originNodeID = own_node.self_id;
-    lookup_msg->originNodeIP = addr.sin_addr;
-    lookup_msg->originNodePort = port;
 
+/**
+ * LOOKUP DHT: Queues a lookup of a key to the successor.
+ *
+ * The lookup names this node as its origin, so the responsible node replies directly.
+ *
+ * @param table The lookups of the node, holding its outbox and address.
+ * @param hashed_key The hashed key for which the responsible node is being looked up.
+ */
+static void lookup_dht(const struct pending_lookups* table, uint16_t hashed_key) {
+    DHTLookupMessage lookup_msg = {
+        .messageType = 0,
+        .key = hashed_key,
+        .originNodeID = table->own_node.self_id,
+        .originNodeIP = table->addr.sin_addr,
+        .originNodePort = ntohs(table->addr.sin_port),
+    };
 
     struct sockaddr_in successor_addr;
     memset(&successor_addr, 0, sizeof(successor_addr));
     successor_addr.sin_family = AF_INET;
-    successor_addr.sin_addr = own_node.succ.ip;
-    successor_addr.sin_port = htons(own_node.succ.port);
-
-    memset(&send_buffer, 0, sizeof(send_buffer));
-
-    char ipStr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &lookup_msg->originNodeIP, ipStr, sizeof(ipStr));
-    // construct msg
-    int lookup_size = construct_dht_lookup_message(lookup_msg, send_buffer);
-
-    // sendto msg
-    int sent_bytes = sendto(socket, send_buffer, lookup_size, 0, (struct sockaddr *)&successor_addr, sizeof(successor_addr));
-                 
-    if (sent_bytes == -1) {
-        perror("sendto failed");
-        // Handle the error
+    successor_addr.sin_addr = table->own_node.succ.ip;
+    successor_addr.sin_port = htons(table->own_node.succ.port);
+
+    outbox_queue(table->outbox, successor_addr, &lookup_msg);
+}
+
+
+/**
+ * PENDING LOOKUPS INIT: Prepares an empty table of lookups in flight.
+ *
+ * @param table The table to be initialized.
+ * @param outbox The outbox lookups are sent through.
+ * @param addr The address of this node, named as origin of its lookups.
+ * @param own_node The NetworkNodes structure containing information about the current node.
+ * @param wheel The timer wheel driving the retransmits.
+ */
+void pending_lookups_init(struct pending_lookups* table, struct dht_outbox* outbox, struct sockaddr_in addr, struct NetworkNodes own_node, struct timer_wheel* wheel) {
+    memset(table, 0, sizeof(*table));
+    table->outbox = outbox;
+    table->addr = addr;
+    table->own_node = own_node;
+    table->wheel = wheel;
+}
+
+/**
+ * LOOKUP TIMEOUT: Retransmits a lookup whose reply did not arrive in time.
+ *
+ * The timeout is doubled on every attempt (exponential backoff). After `LOOKUP_MAX_ATTEMPTS` the lookup is given up,
+ * a later client request for the key starts a new one.
+ *
+ * @param arg The pending_lookup that timed out.
+ */
+static void lookup_timeout(void* arg) {
+    struct pending_lookup* lookup = arg;
+
+    if (lookup->attempts >= LOOKUP_MAX_ATTEMPTS) {
+        lookup->in_use = false;
+        return;
     }
 
+    lookup_dht(lookup->table, lookup->key);
+    lookup->attempts++;
+    lookup->timeout_ms *= 2;
+    timer_schedule(lookup->table->wheel, &lookup->timer, lookup->timeout_ms, lookup_timeout, lookup);
 }
 
+/**
+ * START LOOKUP: Sends a lookup for a hashed key and keeps track of it until it is answered.
+ *
+ * A lookup for a key that is already in flight is not sent again, its retransmit timer takes care of lost messages.
+ * If the table is full, the lookup is sent without being tracked. The outbox is flushed right away, so the lookup is on
+ * its way before the client is told to retry.
+ *
+ * @param table The table of lookups in flight.
+ * @param key The hashed key for which the responsible node is being looked up.
+ */
+void start_lookup(struct pending_lookups* table, uint16_t key) {
+    struct pending_lookup* free_entry = NULL;
+    for (int i = 0; i < MAX_PENDING_LOOKUPS; i++) {
+        if (table->entries[i].in_use && table->entries[i].key == key) {
+            return;
+        }
+        if (!table->entries[i].in_use && free_entry == NULL) {
+            free_entry = &table->entries[i];
+        }
+    }
+
+    lookup_dht(table, key);
+    outbox_flush(table->outbox);
+
+    if (free_entry != NULL) {
+        free_entry->in_use = true;
+        free_entry->key = key;
+        free_entry->attempts = 1;
+        free_entry->sent_at_us = monotonic_us();
+        if (table->measured) {
+            uint32_t rto_ms = lookup_estimate_ms(table);
+            free_entry->timeout_ms = rto_ms < LOOKUP_MIN_TIMEOUT_MS ? LOOKUP_MIN_TIMEOUT_MS : rto_ms > LOOKUP_MAX_TIMEOUT_MS ? LOOKUP_MAX_TIMEOUT_MS : rto_ms;
+        } else {
+            free_entry->timeout_ms = LOOKUP_INITIAL_TIMEOUT_MS;
+        }
+        free_entry->table = table;
+        timer_schedule(table->wheel, &free_entry->timer, free_entry->timeout_ms, lookup_timeout, free_entry);
+    }
+}
+
+/**
+ * MEASURE ROUND TRIP: Updates the smoothed round trip time of lookups and its variation with a new sample.
+ *
+ * @param table The table of lookups in flight.
+ * @param rtt_us The round trip time of a lookup answered on its first attempt.
+ */
+static void measure_round_trip(struct pending_lookups* table, uint32_t rtt_us) {
+    if (!table->measured) {
+        table->srtt_us = rtt_us;
+        table->rttvar_us = rtt_us / 2;
+        table->measured = true;
+        return;
+    }
+    uint32_t deviation = table->srtt_us > rtt_us ? table->srtt_us - rtt_us : rtt_us - table->srtt_us;
+    table->rttvar_us = (3 * (uint64_t) table->rttvar_us + deviation) / 4;
+    table->srtt_us = (7 * (uint64_t) table->srtt_us + rtt_us) / 8;
+}
 
+/**
+ * LOOKUP ESTIMATE: Estimates how long a lookup takes, rounded up to milliseconds: the smoothed round trip time plus four
+ * times its variation, at least 1ms. Without measurements, the initial retransmit timeout.
+ *
+ * @param table The table of lookups in flight.
+ * @return The estimate in milliseconds.
+ */
+uint32_t lookup_estimate_ms(const struct pending_lookups* table) {
+    if (!table->measured) {
+        return LOOKUP_INITIAL_TIMEOUT_MS;
+    }
+    uint64_t estimate_us = table->srtt_us + 4 * (uint64_t) table->rttvar_us;
+    uint64_t estimate_ms = (estimate_us + 999) / 1000;
+    return estimate_ms ? estimate_ms : 1;
+}
 
+/**
+ * COMPLETE LOOKUPS: Stops retransmitting all lookups answered by a reply.
+ *
+ * A reply names a node and its predecessor, so it answers every pending lookup whose key lies in between. Only the oldest of
+ * them is taken as the lookup the reply was sent for: one sample per reply, as lookups sent shortly before would measure far
+ * too short a round trip. It is not measured if retransmitted, as it cannot tell which attempt was answered.
+ *
+ * @param table The table of lookups in flight.
+ * @param reply The received lookup reply.
+ */
+void complete_lookups(struct pending_lookups* table, const DHTLookupMessage* reply) {
+    const struct pending_lookup* oldest = NULL;
+    for (int i = 0; i < MAX_PENDING_LOOKUPS; i++) {
+        struct pending_lookup* lookup = &table->entries[i];
+        if (lookup->in_use && is_responsible_hashed(lookup->key, reply->originNodeID, reply->key)) {
+            if (!oldest || lookup->sent_at_us < oldest->sent_at_us) {
+                oldest = lookup;
+            }
+            timer_cancel(&lookup->timer);
+            lookup->in_use = false;
+        }
+    }
+    if (oldest && oldest->attempts == 1) {
+        measure_round_trip(table, monotonic_us() - oldest->sent_at_us);
+    }
+}
@@ -5,7 +5,25 @@
 #include <netinet/in.h> // For in_addr
 #include <stdbool.h>
 
+#include "timer_wheel.h"
+
 #define MAX_LOOKUP_MESSAGES 10 // Define the maximum number of messages
+#define ROUTE_CACHE_TTL_MS 30000 // Lifetime of a cached lookup reply
+
+#define MAX_PENDING_LOOKUPS 32 // Lookups awaiting a reply at the same time
+#define LOOKUP_INITIAL_TIMEOUT_MS 250 // Retransmit timeout of the first attempt until round trips were measured, doubled on every retry
+#define LOOKUP_MIN_TIMEOUT_MS 20 // Bounds of the retransmit timeout derived from measured round trips
+#define LOOKUP_MAX_TIMEOUT_MS 4000
+#define LOOKUP_MAX_ATTEMPTS 4 // Attempts before a lookup is given up
+
+#define DHT_MESSAGE_SIZE 11 // Size of a single message on the wire
+#define DHT_BATCH_TYPE 0xB2 // First byte of a datagram packing several messages
+#define DHT_INVALIDATE_TYPE 0x10 // Message telling a node to drop cached values of the keys at ring position `key`
+#define DHT_BATCH_VERSION 1
+#define DHT_BATCH_HEAD_SIZE 3 // type, version and number of messages
+#define DHT_BATCH_MAX 128 // Messages per datagram, keeps it within an Ethernet MTU
+#define DHT_DATAGRAM_MAX (DHT_BATCH_HEAD_SIZE + DHT_BATCH_MAX * DHT_MESSAGE_SIZE)
+#define DHT_OUTBOX_SIZE 256 // Messages queued before the outbox is flushed early
 
 
 struct NodeInfo {
@@ -27,9 +45,60 @@ typedef struct _DHTLookupMessage {
     uint16_t originNodeID;       // 2 bytes
     struct in_addr originNodeIP; // 4 bytes for IPv4
     uint16_t originNodePort;     // 2 bytes
+    uint64_t receivedAt;         // local only, not serialized: arrival time of a reply
 } DHTLookupMessage;
 
 
+/**
+ * A lookup sent to the ring but not yet answered
+ *
+ * `key`: the hashed key looked up
+ * `attempts`: number of times the lookup has been sent
+ * `timeout_ms`: retransmit timeout of the current attempt
+ * `timer`: fires when the current attempt is considered lost
+ * `sent_at_us`: when the first attempt was sent, to measure the round trip
+ */
+struct pending_lookup {
+    bool in_use;
+    uint16_t key;
+    uint8_t attempts;
+    uint32_t timeout_ms;
+    uint64_t sent_at_us;
+    struct timer timer;
+    struct pending_lookups* table;
+};
+
+/**
+ * Messages to other nodes queued during an iteration of the event loop
+ *
+ * Flushed once per iteration, so that messages for the same node share datagrams.
+ */
+struct dht_outbox {
+    int socket;
+    struct sockaddr_in addrs[DHT_OUTBOX_SIZE];
+    DHTLookupMessage messages[DHT_OUTBOX_SIZE];
+    int count;
+};
+
+/**
+ * All lookups in flight of a node, and what is needed to retransmit them.
+ *
+ * `srtt_us`, `rttvar_us`: smoothed round trip time of lookups and its variation, as for TCP (RFC 6298);
+ *                         only lookups answered on their first attempt are measured
+ * `measured`: a round trip was measured, the estimate is valid
+ */
+struct pending_lookups {
+    struct pending_lookup entries[MAX_PENDING_LOOKUPS];
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    bool measured;
+    struct dht_outbox* outbox;
+    struct sockaddr_in addr;
+    struct NetworkNodes own_node;
+    struct timer_wheel* wheel;
+};
+
+
 
 struct NetworkNodes derive_nodes_data(const char* nodeId);
 
@@ -37,11 +106,23 @@ void addOrUpdateMessage(DHTLookupMessage lookupMessages[], int *nextFreeIndex, D
 
 DHTLookupMessage* findDHTreply(DHTLookupMessage lookupMessages[], uint16_t key, int *nextFreeIndex);
 
-int construct_dht_lookup_message(const DHTLookupMessage *lookup_msg, char *buffer);
+const DHTLookupMessage* peekDHTreply(const DHTLookupMessage lookupMessages[], uint16_t key, int nextFreeIndex);
+
+void expireDHTreplies(DHTLookupMessage lookupMessages[], int *nextFreeIndex, uint64_t now_ms);
+
+void forgetDHTreplies(DHTLookupMessage lookupMessages[], int *nextFreeIndex, struct in_addr ip, uint16_t port);
+
+int construct_dht_lookup_message(const DHTLookupMessage messages[], int count, char *buffer);
+int parse_dht_lookup_message(DHTLookupMessage messages[], const char *buffer, int length);
 
+void outbox_init(struct dht_outbox* outbox, int socket);
+void outbox_queue(struct dht_outbox* outbox, struct sockaddr_in addr, const DHTLookupMessage* message);
+void outbox_flush(struct dht_outbox* outbox);
 
-void parse_dht_lookup_message(DHTLookupMessage *lookup_msg, char *buffer);
-void lookup_dht(int socket, struct NetworkNodes own_node, u_int16_t key, DHTLookupMessage *lookup_msg);
+void pending_lookups_init(struct pending_lookups* table, struct dht_outbox* outbox, struct sockaddr_in addr, struct NetworkNodes own_node, struct timer_wheel* wheel);
+void start_lookup(struct pending_lookups* table, uint16_t key);
+void complete_lookups(struct pending_lookups* table, const DHTLookupMessage* reply);
+uint32_t lookup_estimate_ms(const struct pending_lookups* table);
 
 
 uint16_t hash(const char* str);
@@ -0,0 +1,282 @@
+#include "peer_pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PEER_MIN_RESPONSE_CAPACITY 4096
+
+
+static void peer_close(struct peer_conn* conn) {
+    timer_cancel(&conn->idle_timer);
+    timer_cancel(&conn->request_timer);
+    if (conn->sock != -1) {
+        close(conn->sock);
+        conn->sock = -1;
+    }
+    free(conn->request);
+    free(conn->response);
+    conn->request = NULL;
+    conn->response = NULL;
+    conn->response_capacity = 0;
+    conn->callback = NULL;
+    conn->arg = NULL;
+    conn->state = PEER_FREE;
+}
+
+
+static void peer_idle(void* arg) {
+    peer_close((struct peer_conn*) arg);
+}
+
+
+/**
+ * Start a non-blocking connect for the request of `conn`.
+ */
+static bool peer_connect(struct peer_conn* conn) {
+    conn->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    conn->generation += 1;
+    if (conn->sock == -1) {
+        perror("socket");
+        return false;
+    }
+    if (connect(conn->sock, (struct sockaddr*) &conn->addr, sizeof(conn->addr)) == -1) {
+        if (errno != EINPROGRESS) {
+            perror("connect");
+            close(conn->sock);
+            conn->sock = -1;
+            return false;
+        }
+        conn->state = PEER_CONNECTING;
+    } else {
+        conn->state = PEER_SENDING;
+    }
+    conn->reused = false;
+    return true;
+}
+
+
+/**
+ * Hand the outcome of a request to its callback, after the connection is made ready for the next one.
+ *
+ * The callback may start new requests, so the connection must not be touched afterwards.
+ */
+static void peer_finish(struct peer_conn* conn, const struct response* response, bool keep) {
+    peer_callback callback = conn->callback;
+    void* arg = conn->arg;
+    conn->callback = NULL;
+    conn->arg = NULL;
+
+    // The response is handed out of the buffer, which is released after the callback
+    char* response_buffer = conn->response;
+    conn->response = NULL;
+    conn->response_capacity = 0;
+    free(conn->request);
+    conn->request = NULL;
+    timer_cancel(&conn->request_timer);
+
+    if (keep) {
+        conn->state = PEER_IDLE;
+        timer_schedule(conn->wheel, &conn->idle_timer, PEER_IDLE_TIMEOUT_MS, peer_idle, conn);
+    } else {
+        peer_close(conn);
+    }
+
+    if (callback) {
+        callback(arg, response);
+    }
+    free(response_buffer);
+}
+
+
+/**
+ * REQUEST TIMEOUT: Fails a request the other node did not make progress on, without retrying it.
+ *
+ * @param arg The peer_conn of the request.
+ */
+static void peer_request_timeout(void* arg) {
+    struct peer_conn* conn = arg;
+    fprintf(stderr, "Request to another node timed out\n");
+    peer_finish(conn, NULL, false);
+}
+
+
+/**
+ * Restart the timeout of the request of `conn`, it made progress.
+ */
+static void peer_progress(struct peer_conn* conn) {
+    timer_schedule(conn->wheel, &conn->request_timer, PEER_REQUEST_TIMEOUT_MS, peer_request_timeout, conn);
+}
+
+
+/**
+ * Fail the request of `conn`, retrying once on a new connection if an idle one was reused.
+ */
+static void peer_fail(struct peer_conn* conn) {
+    if (conn->reused && conn->response_length == 0) {
+        close(conn->sock);
+        conn->sock = -1;
+        conn->sent = 0;
+        if (peer_connect(conn)) {
+            return;
+        }
+    }
+    peer_finish(conn, NULL, false);
+}
+
+
+void peer_pool_init(struct peer_pool* pool, struct timer_wheel* wheel) {
+    memset(pool, 0, sizeof(*pool));
+    for (size_t i = 0; i < PEER_POOL_SIZE; i += 1) {
+        pool->conns[i].sock = -1;
+        pool->conns[i].wheel = wheel;
+    }
+}
+
+
+bool peer_pool_request(struct peer_pool* pool, struct sockaddr_in addr, char* request, size_t request_length, peer_callback callback, void* arg) {
+    struct peer_conn* conn = NULL;
+    struct peer_conn* free_conn = NULL;
+    struct peer_conn* idle_conn = NULL;
+
+    for (size_t i = 0; i < PEER_POOL_SIZE && !conn; i += 1) {
+        struct peer_conn* candidate = &pool->conns[i];
+        if (candidate->state == PEER_IDLE && candidate->addr.sin_addr.s_addr == addr.sin_addr.s_addr
+                && candidate->addr.sin_port == addr.sin_port) {
+            conn = candidate;
+        } else if (candidate->state == PEER_FREE && !free_conn) {
+            free_conn = candidate;
+        } else if (candidate->state == PEER_IDLE && !idle_conn) {
+            idle_conn = candidate;
+        }
+    }
+    if (!conn && !free_conn && idle_conn) {
+        peer_close(idle_conn);  // make room by dropping a connection to another node
+        free_conn = idle_conn;
+    }
+
+    if (conn) {
+        timer_cancel(&conn->idle_timer);
+        conn->state = PEER_SENDING;
+        conn->reused = true;
+    } else if (free_conn) {
+        conn = free_conn;
+        conn->addr = addr;
+        if (!peer_connect(conn)) {
+            free(request);
+            return false;
+        }
+    } else {
+        free(request);
+        return false;
+    }
+
+    conn->request = request;
+    conn->request_length = request_length;
+    conn->sent = 0;
+    conn->response_length = 0;
+    conn->callback = callback;
+    conn->arg = arg;
+    peer_progress(conn);
+    return true;
+}
+
+
+void peer_pool_cancel(struct peer_pool* pool, void* arg) {
+    for (size_t i = 0; i < PEER_POOL_SIZE; i += 1) {
+        struct peer_conn* conn = &pool->conns[i];
+        if (conn->state != PEER_FREE && conn->state != PEER_IDLE && conn->arg == arg) {
+            // A late response would be mistaken for the next one, the connection cannot be reused
+            peer_close(conn);
+        }
+    }
+}
+
+
+short peer_events(const struct peer_conn* conn) {
+    switch (conn->state) {
+    case PEER_CONNECTING:
+    case PEER_SENDING:
+        return POLLOUT;
+    case PEER_RECEIVING:
+    case PEER_IDLE:
+        return POLLIN;  // an idle connection is readable once the other node closes it
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * Receive response bytes, growing the buffer as needed.
+ */
+static void peer_receive(struct peer_conn* conn) {
+    if (conn->response_length == conn->response_capacity) {
+        size_t capacity = conn->response_capacity ? conn->response_capacity * 2 : PEER_MIN_RESPONSE_CAPACITY;
+        char* response = realloc(conn->response, capacity);
+        if (!response) {
+            peer_finish(conn, NULL, false);
+            return;
+        }
+        conn->response = response;
+        conn->response_capacity = capacity;
+    }
+
+    ssize_t bytes_read = recv(conn->sock, conn->response + conn->response_length, conn->response_capacity - conn->response_length, 0);
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    } else if (bytes_read <= 0) {
+        peer_fail(conn);
+        return;
+    }
+    conn->response_length += bytes_read;
+    peer_progress(conn);
+
+    struct response response;
+    ssize_t response_length = parse_response(conn->response, conn->response_length, &response);
+    if (response_length == -1) {
+        peer_finish(conn, NULL, false);
+    } else if (response_length > 0) {
+        // Bytes behind the response were never asked for, the connection is out of sync then
+        peer_finish(conn, &response, (size_t) response_length == conn->response_length);
+    }
+}
+
+
+void peer_handle(struct peer_conn* conn, short revents) {
+    if (conn->state == PEER_IDLE) {
+        peer_close(conn);  // closed by the other node, or sent something unasked
+        return;
+    }
+
+    if (conn->state == PEER_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            peer_fail(conn);
+            return;
+        }
+        conn->state = PEER_SENDING;
+    }
+
+    if (conn->state == PEER_SENDING && (revents & POLLOUT)) {
+        ssize_t bytes_sent = send(conn->sock, conn->request + conn->sent, conn->request_length - conn->sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                peer_fail(conn);
+            }
+            return;
+        }
+        conn->sent += bytes_sent;
+        peer_progress(conn);
+        if (conn->sent == conn->request_length) {
+            conn->state = PEER_RECEIVING;
+        }
+    } else if (conn->state == PEER_SENDING) {
+        peer_fail(conn);  // hang up or error before the request is sent
+    } else if (conn->state == PEER_RECEIVING) {
+        peer_receive(conn);
+    }
+}
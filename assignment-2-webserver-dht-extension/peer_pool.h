@@ -0,0 +1,100 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "http.h"
+#include "timer_wheel.h"
+
+#define PEER_POOL_SIZE 16  // connections to other nodes, in use or idle
+#define PEER_IDLE_TIMEOUT_MS 5000  // idle connections are closed before the other node's idle timeout hits
+#define PEER_REQUEST_TIMEOUT_MS 5000  // requests making no progress for this long fail, the other node may be gone
+
+
+/**
+ * Called once the response to a request is received, or the request failed.
+ *
+ * `response` is only valid during the call, NULL if the request failed.
+ */
+typedef void (*peer_callback)(void* arg, const struct response* response);
+
+/**
+ * Lifecycle of a connection to another node
+ */
+enum peer_state {
+    PEER_FREE,        // slot unused, no socket
+    PEER_IDLE,        // connected, kept open for the next request
+    PEER_CONNECTING,  // waiting for the non-blocking connect
+    PEER_SENDING,     // sending the request
+    PEER_RECEIVING,   // waiting for the complete response
+};
+
+/**
+ * A connection to another node over which one request at a time is sent
+ *
+ * `request`: the request, `sent` of `request_length` bytes are sent
+ * `response`: bytes of the response received so far
+ * `reused`: the request is sent over a connection that served an earlier one;
+ *           if it fails before any response arrives, it is retried once on a
+ *           new connection, as the other node may just have closed it
+ * `request_timer`: running from connecting until the response, restarted
+ *                  whenever bytes are sent or received
+ * `wheel`: the timer wheel running `idle_timer` and `request_timer`
+ * `generation`: counts the sockets opened, tells a new socket from a closed one with the same descriptor
+ */
+struct peer_conn {
+    enum peer_state state;
+    int sock;
+    struct sockaddr_in addr;
+    char* request;
+    size_t request_length;
+    size_t sent;
+    char* response;
+    size_t response_length;
+    size_t response_capacity;
+    bool reused;
+    peer_callback callback;
+    void* arg;
+    struct timer idle_timer;
+    struct timer request_timer;
+    struct timer_wheel* wheel;
+    unsigned generation;
+};
+
+/**
+ * Connections to other nodes, reused for requests to the same node
+ */
+struct peer_pool {
+    struct peer_conn conns[PEER_POOL_SIZE];
+};
+
+
+void peer_pool_init(struct peer_pool* pool, struct timer_wheel* wheel);
+
+/**
+ * Send a request to the node at `addr` without blocking, preferring an idle connection to it.
+ *
+ * Takes ownership of `request`, which must be allocated with `malloc()`.
+ * `callback` is invoked with `arg` once the response is received or the
+ * request failed, also if it made no progress for `PEER_REQUEST_TIMEOUT_MS`,
+ * but never from within this function. Returns false if no connection is
+ * available, `callback` is not invoked then.
+ */
+bool peer_pool_request(struct peer_pool* pool, struct sockaddr_in addr, char* request, size_t request_length, peer_callback callback, void* arg);
+
+/**
+ * Abandon all requests started with `arg`, their callbacks are not invoked.
+ */
+void peer_pool_cancel(struct peer_pool* pool, void* arg);
+
+/**
+ * The events to poll for on a connection, 0 if it has no socket.
+ */
+short peer_events(const struct peer_conn* conn);
+
+/**
+ * Advance a connection after `revents` were polled on its socket.
+ */
+void peer_handle(struct peer_conn* conn, short revents);
@@ -0,0 +1,547 @@
+#include "repair.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bulk.h"
+#include "data.h"
+#include "near.h"
+#include "node.h"
+#include "peer_pool.h"
+#include "sockets_setup.h"
+#include "stream_sock.h"
+#include "util.h"
+
+
+bool is_repair_request(const struct request* request) {
+    return strcmp(request->method, "POST") == 0 &&
+           (strcmp(request->uri, REPAIR_URI) == 0 || strcmp(request->uri, REPAIR_TREE_URI) == 0 ||
+            strcmp(request->uri, REPAIR_KEYS_URI) == 0 || strcmp(request->uri, REPAIR_VALUES_URI) == 0);
+}
+
+
+/**
+ * Ring positions covered by a node of the hash tree, from `first` through `last`.
+ */
+static void tree_span(uint32_t node, uint32_t* first, uint32_t* last) {
+    int depth = 0;
+    while ((node >> (depth + 1)) != 0) {
+        depth += 1;
+    }
+    uint32_t width = (uint32_t) 1 << (16 - depth);
+    *first = (node - ((uint32_t) 1 << depth)) * width;
+    *last = *first + width - 1;
+}
+
+
+/**
+ * Whether the ring positions `first` through `last` overlap the interval after `from` up to `to`.
+ */
+static bool span_overlaps(uint32_t first, uint32_t last, uint16_t from, uint16_t to) {
+    if (from == to) {
+        return true;
+    }
+    if (from < to) {
+        return first <= to && last > from;
+    }
+    return last > from || first <= to;  // the interval wraps around zero
+}
+
+
+/**
+ * Growable buffer a reply is collected in
+ */
+struct listing {
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+};
+
+
+static void listing_append(struct listing* listing, const void* bytes, size_t n) {
+    if (listing->failed) {
+        return;
+    }
+    if (listing->length + n > listing->capacity) {
+        size_t capacity = listing->capacity ? listing->capacity : 4096;
+        while (capacity < listing->length + n) {
+            capacity *= 2;
+        }
+        char* data = realloc(listing->data, capacity);
+        if (!data) {
+            listing->failed = true;
+            return;
+        }
+        listing->data = data;
+        listing->capacity = capacity;
+    }
+    memcpy(listing->data + listing->length, bytes, n);
+    listing->length += n;
+}
+
+
+/**
+ * The keys of a leaf listed for another node, limited to the interval repaired
+ */
+struct key_listing {
+    struct listing* listing;
+    uint16_t from;
+    uint16_t to;
+};
+
+
+static bool list_key(const struct tuple* tuple, void* arg) {
+    struct key_listing* keys = arg;
+    if (is_responsible_hashed(tuple->ring_pos, keys->to, keys->from)) {
+        char fingerprint[sizeof("0123456789abcdef ")];
+        snprintf(fingerprint, sizeof(fingerprint), "%016" PRIx64 " ", tuple_fingerprint(tuple));
+        listing_append(keys->listing, fingerprint, strlen(fingerprint));
+        listing_append(keys->listing, tuple->key, strlen(tuple->key));
+        listing_append(keys->listing, "\n", 1);
+    }
+    return true;
+}
+
+
+static bool repair_serve(struct connection_state* state, const string uri, const char* payload, size_t length, struct chord_context* ctx) {
+    struct store* store = &ctx->store;
+    struct listing listing = { 0 };
+
+    char* lines = malloc(length + 1);
+    if (!lines) {
+        return false;
+    }
+    memcpy(lines, payload, length);
+    lines[length] = '\0';
+
+    char* save;
+    char* line = strtok_r(lines, "\n", &save);
+    if (strcmp(uri, REPAIR_TREE_URI) == 0) {
+        for (; line; line = strtok_r(NULL, "\n", &save)) {
+            unsigned long node = strtoul(line, NULL, 10);
+            if (node >= 1 && node < 2 * STORE_TREE_LEAVES) {
+                char entry[sizeof("4294967295 0123456789abcdef\n")];
+                int entry_length = snprintf(entry, sizeof(entry), "%lu %016" PRIx64 "\n", node, store->tree[node]);
+                listing_append(&listing, entry, entry_length);
+            }
+        }
+    } else if (strcmp(uri, REPAIR_KEYS_URI) == 0) {
+        unsigned from = 0, to = 0;
+        if (line && sscanf(line, "%u %u", &from, &to) == 2 && from <= UINT16_MAX && to <= UINT16_MAX) {
+            struct key_listing keys = { .listing = &listing, .from = from, .to = to };
+            for (line = strtok_r(NULL, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+                unsigned long leaf = strtoul(line, NULL, 10);
+                if (leaf < STORE_TREE_LEAVES) {
+                    uint16_t first = leaf << STORE_TREE_SHIFT;
+                    uint16_t last = first + ((1 << STORE_TREE_SHIFT) - 1);
+                    store_range(store, first - 1, last, list_key, &keys);
+                }
+            }
+        }
+    } else {
+        for (; line; line = strtok_r(NULL, "\n", &save)) {
+            const struct tuple* tuple = get_tuple(store, line);
+            size_t value_length;
+            const char* value = tuple ? tuple_value(store, tuple, &value_length) : NULL;
+            size_t key_length = strlen(line);
+            if (!value || key_length > UINT16_MAX || value_length > UINT32_MAX) {
+                continue;
+            }
+            uint8_t record[BULK_RECORD_HEAD] = {
+                key_length >> 8, key_length,
+                value_length >> 24, value_length >> 16, value_length >> 8, value_length,
+            };
+            listing_append(&listing, record, sizeof(record));
+            listing_append(&listing, line, key_length);
+            listing_append(&listing, value, value_length);
+        }
+    }
+    free(lines);
+
+    if (listing.failed) {
+        free(listing.data);
+        const string unavailable = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+        return connection_write(state, unavailable, strlen(unavailable));
+    }
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", listing.length);
+    struct iovec iov[2] = {
+        { .iov_base = head, .iov_len = head_length },
+        { .iov_base = listing.data, .iov_len = listing.length },
+    };
+    bool sent = connection_send(state, iov, 2);
+    if (!sent) {
+        perror("send");
+    }
+    free(listing.data);
+    return sent;
+}
+
+
+static void repair_free(struct repair* repair) {
+    timer_cancel(&repair->deadline);
+    peer_pool_cancel(&repair->ctx->peers, repair);
+    for (size_t i = 0; i < repair->n_keys; i += 1) {
+        free(repair->keys[i]);
+    }
+    free(repair->keys);
+    free(repair->work);
+    free(repair->next);
+    free(repair->leaves);
+    free(repair);
+}
+
+
+/**
+ * Report a session to its client, and continue with the next request of its connection.
+ *
+ * `status` is 200 if the session is done, 502 if the other node failed, or 504 if it took too long.
+ */
+static void repair_complete(struct repair* repair, int status) {
+    struct connection_state* state = repair->conn;
+    struct chord_context* ctx = repair->ctx;
+
+    char reply[HTTP_MAX_HEAD_SIZE];
+    int reply_length;
+    if (status == 200) {
+        char payload[HTTP_MAX_HEAD_SIZE / 2];
+        int payload_length = snprintf(payload, sizeof(payload), "compared %zu\r\ndiffering %zu\r\nrepaired %zu\r\nfailed %zu\r\n",
+                                      repair->compared, repair->n_leaves, repair->repaired, repair->failed);
+        reply_length = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s", payload_length, payload);
+    } else {
+        reply_length = snprintf(reply, sizeof(reply), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n",
+                                status, status == 502 ? "Bad Gateway" : "Gateway Timeout");
+    }
+    bool keep_alive = connection_write(state, reply, reply_length) && !repair->close_after;
+
+    state->repair = NULL;
+    state->paused = false;
+    repair_free(repair);
+
+    if (keep_alive) {
+        connection_resume(state, ctx);
+    } else {
+        connection_end(state);
+    }
+}
+
+
+/**
+ * Append a tree node or leaf to a list of `n` items, growing it by doubling.
+ *
+ * Returns false if memory is exhausted.
+ */
+static bool append_node(uint32_t** list, size_t* n, uint32_t node) {
+    if ((*n & (*n - 1)) == 0) {
+        uint32_t* grown = realloc(*list, (*n ? *n * 2 : 1) * sizeof(uint32_t));
+        if (!grown) {
+            return false;
+        }
+        *list = grown;
+    }
+    (*list)[(*n)++] = node;
+    return true;
+}
+
+
+/**
+ * Build the next request of the session.
+ *
+ * Returns NULL if memory is exhausted.
+ */
+static char* repair_next_request(struct repair* repair, size_t* request_length) {
+    struct listing payload = { 0 };
+    const char* uri;
+    repair->in_flight = 0;
+
+    if (repair->phase == REPAIR_VALUES) {
+        uri = REPAIR_VALUES_URI;
+        while (repair->fetched + repair->in_flight < repair->n_keys &&
+               (repair->in_flight == 0 || payload.length < REPAIR_MAX_PAYLOAD)) {
+            const string key = repair->keys[repair->fetched + repair->in_flight];
+            listing_append(&payload, key, strlen(key));
+            listing_append(&payload, "\n", 1);
+            repair->in_flight += 1;
+        }
+    } else {
+        uri = repair->phase == REPAIR_TREE ? REPAIR_TREE_URI : REPAIR_KEYS_URI;
+        char line[sizeof("65535 65535\n")];
+        if (repair->phase == REPAIR_KEYS) {
+            listing_append(&payload, line, snprintf(line, sizeof(line), "%u %u\n", repair->from, repair->to));
+        }
+        while (repair->done + repair->in_flight < repair->n_work && repair->in_flight < REPAIR_MAX_NODES) {
+            uint32_t node = repair->work[repair->done + repair->in_flight];
+            uint32_t item = repair->phase == REPAIR_TREE ? node : node - STORE_TREE_LEAVES;
+            listing_append(&payload, line, snprintf(line, sizeof(line), "%" PRIu32 "\n", item));
+            repair->in_flight += 1;
+        }
+    }
+
+    char head[HTTP_MAX_HEAD_SIZE];
+    int head_length = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\nContent-Length: %zu\r\n\r\n", uri, payload.length);
+    char* request = malloc(head_length + payload.length);
+    if (payload.failed || !request) {
+        free(payload.data);
+        free(request);
+        return NULL;
+    }
+    memcpy(request, head, head_length);
+    memcpy(request + head_length, payload.data, payload.length);
+    free(payload.data);
+    *request_length = head_length + payload.length;
+    return request;
+}
+
+
+/**
+ * Move on to the next phase once the current one is done.
+ *
+ * Returns false if the session is done.
+ */
+static bool repair_advance(struct repair* repair) {
+    // A round of the tree phase is done: compare the children of differing nodes, or the keys of differing leaves
+    while (repair->phase == REPAIR_TREE && repair->done == repair->n_work) {
+        free(repair->work);
+        repair->work = repair->next;
+        repair->n_work = repair->n_next;
+        repair->next = NULL;
+        repair->n_next = 0;
+        repair->done = 0;
+        if (repair->n_work == 0) {
+            free(repair->work);
+            repair->work = repair->leaves;  // `n_leaves` is kept for the report
+            repair->n_work = repair->n_leaves;
+            repair->leaves = NULL;
+            repair->phase = REPAIR_KEYS;
+        }
+    }
+    if (repair->phase == REPAIR_KEYS && repair->done == repair->n_work) {
+        repair->phase = REPAIR_VALUES;
+    }
+    return repair->phase != REPAIR_VALUES || repair->fetched < repair->n_keys;
+}
+
+
+static void repair_done(void* arg, const struct response* response);
+
+
+/**
+ * Send the next request of the session.
+ *
+ * Returns false if it could not be sent.
+ */
+static bool repair_send(struct repair* repair) {
+    size_t request_length;
+    char* request = repair_next_request(repair, &request_length);
+    return request && peer_pool_request(&repair->ctx->peers, repair->peer, request, request_length, repair_done, repair);
+}
+
+
+/**
+ * Continue with the next request of the session, or report it once nothing is left.
+ */
+static void repair_progress(struct repair* repair) {
+    if (!repair_advance(repair)) {
+        repair_complete(repair, 200);
+    } else if (!repair_send(repair)) {
+        repair_complete(repair, 502);
+    }
+}
+
+
+/**
+ * Compare the hashes of tree nodes the other node answered with, queuing the children or leaves that differ.
+ */
+static bool compare_nodes(struct repair* repair, char* lines) {
+    const struct store* store = &repair->ctx->store;
+    char* save;
+    for (char* line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        unsigned long node;
+        uint64_t hash;
+        if (sscanf(line, "%lu %" SCNx64, &node, &hash) != 2 || node < 1 || node >= 2 * STORE_TREE_LEAVES) {
+            continue;
+        }
+        repair->compared += 1;
+        if (store->tree[node] == hash) {
+            continue;
+        }
+        if (node >= STORE_TREE_LEAVES) {
+            if (!append_node(&repair->leaves, &repair->n_leaves, node)) {
+                return false;
+            }
+            continue;
+        }
+        for (uint32_t child = 2 * node; child <= 2 * node + 1; child += 1) {
+            uint32_t first, last;
+            tree_span(child, &first, &last);
+            if (span_overlaps(first, last, repair->from, repair->to) && !append_node(&repair->next, &repair->n_next, child)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Compare the fingerprints of keys the other node answered with, queuing keys missing or differing here.
+ */
+static bool compare_keys(struct repair* repair, char* lines) {
+    struct store* store = &repair->ctx->store;
+    char* save;
+    for (char* line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char* key = strchr(line, ' ');
+        if (!key) {
+            continue;
+        }
+        *key++ = '\0';
+        uint64_t fingerprint = strtoull(line, NULL, 16);
+        const struct tuple* tuple = get_tuple(store, key);
+        if (tuple && tuple_fingerprint(tuple) == fingerprint) {
+            continue;
+        }
+
+        if ((repair->n_keys & (repair->n_keys - 1)) == 0) {
+            char** keys = realloc(repair->keys, (repair->n_keys ? repair->n_keys * 2 : 1) * sizeof(char*));
+            if (!keys) {
+                return false;
+            }
+            repair->keys = keys;
+        }
+        repair->keys[repair->n_keys] = strdup(key);
+        if (!repair->keys[repair->n_keys]) {
+            return false;
+        }
+        repair->n_keys += 1;
+    }
+    return true;
+}
+
+
+/**
+ * Store the values the other node answered with, keys it no longer holds are counted as failed.
+ */
+static void store_values(struct repair* repair, const char* records, size_t length) {
+    size_t received = 0;
+    size_t pos = 0;
+    while (length - pos >= BULK_RECORD_HEAD) {
+        const uint8_t* head = (const uint8_t*) records + pos;
+        size_t key_length = (size_t) head[0] << 8 | head[1];
+        size_t value_length = (size_t) head[2] << 24 | (size_t) head[3] << 16 | (size_t) head[4] << 8 | head[5];
+        if (length - pos - BULK_RECORD_HEAD < key_length + value_length) {
+            break;
+        }
+        char* key = malloc(key_length + 1);
+        if (!key) {
+            break;
+        }
+        memcpy(key, records + pos + BULK_RECORD_HEAD, key_length);
+        key[key_length] = '\0';
+        near_changed(repair->ctx, key);
+        if (set(&repair->ctx->store, key, (char*) records + pos + BULK_RECORD_HEAD + key_length, value_length) != STORE_REJECTED) {
+            repair->repaired += 1;
+        } else {
+            repair->failed += 1;
+        }
+        free(key);
+        received += 1;
+        pos += BULK_RECORD_HEAD + key_length + value_length;
+    }
+    repair->failed += repair->in_flight - (received < repair->in_flight ? received : repair->in_flight);
+}
+
+
+static void repair_done(void* arg, const struct response* response) {
+    struct repair* repair = arg;
+    if (!response || response->status != 200) {
+        repair_complete(repair, 502);
+        return;
+    }
+
+    bool compared = true;
+    if (repair->phase == REPAIR_VALUES) {
+        store_values(repair, response->payload, response->payload_length);
+        repair->fetched += repair->in_flight;
+    } else {
+        char* lines = malloc(response->payload_length + 1);
+        if (!lines) {
+            repair_complete(repair, 502);
+            return;
+        }
+        memcpy(lines, response->payload, response->payload_length);
+        lines[response->payload_length] = '\0';
+        compared = repair->phase == REPAIR_TREE ? compare_nodes(repair, lines) : compare_keys(repair, lines);
+        free(lines);
+        repair->done += repair->in_flight;
+    }
+    if (!compared) {
+        repair_complete(repair, 502);
+        return;
+    }
+    repair_progress(repair);
+}
+
+
+/**
+ * REPAIR DEADLINE: Gives up a session that took too long.
+ *
+ * @param arg The repair session.
+ */
+static void repair_deadline(void* arg) {
+    repair_complete(arg, 504);
+}
+
+
+static bool repair_start(struct connection_state* state, const char* payload, size_t length, bool close_after, struct chord_context* ctx) {
+    char peer[sizeof("255.255.255.255:65535 65535 65535")];
+    snprintf(peer, sizeof(peer), "%.*s", (int) (length < sizeof(peer) ? length : sizeof(peer) - 1), payload);
+
+    char ip[INET_ADDRSTRLEN];
+    unsigned port, from = ctx->own_node.pred.id, to = ctx->own_node.self_id;
+    int fields = sscanf(peer, "%15[0-9.]:%u %u %u", ip, &port, &from, &to);
+    struct repair* repair = calloc(1, sizeof(*repair));
+    if (!repair || (fields != 2 && fields != 4) || port > UINT16_MAX || from > UINT16_MAX || to > UINT16_MAX ||
+            inet_pton(AF_INET, ip, &repair->peer.sin_addr) != 1) {
+        free(repair);
+        const string bad_request = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        connection_write(state, bad_request, strlen(bad_request));
+        return !close_after;
+    }
+    repair->peer.sin_family = AF_INET;
+    repair->peer.sin_port = htons(port);
+    repair->conn = state;
+    repair->ctx = ctx;
+    repair->from = from;
+    repair->to = to;
+    repair->close_after = close_after;
+    repair->phase = REPAIR_TREE;
+
+    // The root covers every interval
+    if (!append_node(&repair->work, &repair->n_work, 1) || !repair_send(repair)) {
+        repair_free(repair);
+        const string bad_gateway = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+        connection_write(state, bad_gateway, strlen(bad_gateway));
+        return !close_after;
+    }
+    state->repair = repair;
+    state->paused = true;
+    timer_schedule(&ctx->wheel, &repair->deadline, REPAIR_TIMEOUT_MS, repair_deadline, repair);
+    return true;
+}
+
+
+bool repair_request(struct connection_state* state, const string uri, const char* payload, size_t length, bool close_after, struct chord_context* ctx) {
+    if (strcmp(uri, REPAIR_URI) == 0) {
+        return repair_start(state, payload, length, close_after, ctx);
+    }
+    return repair_serve(state, uri, payload, length, ctx) && !close_after;
+}
+
+
+void repair_cancel(struct repair* repair) {
+    repair_free(repair);
+}
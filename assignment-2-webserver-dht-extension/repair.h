@@ -0,0 +1,105 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chord_processor.h"
+#include "http.h"
+#include "timer_wheel.h"
+
+#define REPAIR_URI "/repair"
+#define REPAIR_TREE_URI "/repair/tree"      // hashes of tree nodes, one node per line
+#define REPAIR_KEYS_URI "/repair/keys"      // fingerprints of the keys of leaves
+#define REPAIR_VALUES_URI "/repair/values"  // values of keys, one key per line
+#define REPAIR_MAX_NODES 512                // tree nodes or leaves per request
+#define REPAIR_MAX_PAYLOAD 4096             // bytes of keys per request, so requests fit into the other node's buffer
+#define REPAIR_MAX_REQUEST (64 * 1024)      // longest payload of a repair request accepted
+#define REPAIR_TIMEOUT_MS 10000             // sessions not done by then are answered with 504
+
+
+/**
+ * Phase of a repair session
+ */
+enum repair_phase {
+    REPAIR_TREE,    // comparing hashes of tree nodes, one level per round
+    REPAIR_KEYS,    // comparing the keys of differing leaves
+    REPAIR_VALUES,  // fetching the values of missing and differing keys
+};
+
+/**
+ * A repair session, bringing a ring interval of the local store in line with
+ * the copy of another node
+ *
+ * Both hash trees are compared from the root down, descending only into
+ * nodes whose hashes differ. The keys of differing leaves are compared by
+ * fingerprint, and keys missing or differing here are fetched. Keys only held
+ * here are kept. Every exchange is a request to the other node, sent one
+ * after the other.
+ *
+ * `from`, `to`: the ring interval repaired
+ * `work`: tree nodes or leaves of the phase, `n_work`, of which `done` are answered
+ * `next`: children to compare in the next round of the tree phase
+ * `leaves`: differing leaves found in the tree phase
+ * `keys`: keys to fetch, `n_keys`, of which `fetched` are requested
+ * `in_flight`: work items or keys of the request in flight
+ * `compared`, `repaired`, `failed`: counted for the report
+ * `close_after`: the client asked to close the connection after the report
+ */
+struct repair {
+    struct connection_state* conn;
+    struct chord_context* ctx;
+    struct sockaddr_in peer;
+    uint16_t from;
+    uint16_t to;
+    enum repair_phase phase;
+    uint32_t* work;
+    size_t n_work;
+    size_t done;
+    uint32_t* next;
+    size_t n_next;
+    uint32_t* leaves;
+    size_t n_leaves;
+    char** keys;
+    size_t n_keys;
+    size_t fetched;
+    size_t in_flight;
+    size_t compared;
+    size_t repaired;
+    size_t failed;
+    bool close_after;
+    struct timer deadline;
+};
+
+
+/**
+ * Whether `request` starts a repair session or is an exchange of another node's session.
+ */
+bool is_repair_request(const struct request* request);
+
+/**
+ * Answer a repair request with its `payload` of `length` bytes.
+ *
+ * A request to `REPAIR_URI` starts a session, its payload is "<ip>:<port>" of
+ * the other node, optionally followed by " <from> <to>", the ring interval
+ * repaired; by default, this node's own range is repaired. The connection is
+ * paused until the session is done, it is answered with "compared",
+ * "differing", "repaired" and "failed" counts then.
+ *
+ * Exchanges of another node's session are answered from the local store right
+ * away, one line per item ending with "\n":
+ *
+ * - tree: the hash of every requested node as "<node> <hash>", in hex
+ * - keys: the payload starts with "<from> <to>"; every key of the requested
+ *   leaves in that interval as "<fingerprint> <key>", the fingerprint in hex
+ * - values: every requested key that is stored, as pairs in the format of a
+ *   bulk load instead of lines
+ *
+ * Returns false if the connection has to be closed.
+ */
+bool repair_request(struct connection_state* state, const string uri, const char* payload, size_t length, bool close_after, struct chord_context* ctx);
+
+/**
+ * Abandon a session without answering it, e.g. when its connection is closed.
+ */
+void repair_cancel(struct repair* repair);
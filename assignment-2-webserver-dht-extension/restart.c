@@ -0,0 +1,347 @@
+#include "restart.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "chord_processor.h"
+#include "sockets_setup.h"
+#include "successors.h"
+
+
+/**
+ * The address of the Unix socket at `path`; false if the path is too long.
+ */
+static bool unix_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "HOT_RESTART_SOCKET is too long\n");
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+
+int restart_connect(const char* path) {
+    struct sockaddr_un addr;
+    if (!unix_address(path, &addr)) {
+        return -1;
+    }
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(conn, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror("connect");
+        }
+        close(conn);
+        return -1;  // no node running, started for the first time
+    }
+    return conn;
+}
+
+
+bool restart_adopt(int conn, int* stream_socket, int* datagram_socket, struct NetworkNodes* own_node) {
+    char head[HOT_RESTART_HEAD];
+    int fds[2];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = head, .iov_len = sizeof(head) };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(conn, &message, MSG_WAITALL);
+    if (n == -1) {
+        perror("recvmsg");
+        return false;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return false;  // the node exited without handing over
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (n != HOT_RESTART_HEAD || memcmp(head, HOT_RESTART_MAGIC, strlen(HOT_RESTART_MAGIC)) != 0) {
+        fprintf(stderr, "Hot restart from an incompatible version\n");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    *stream_socket = fds[0];
+    *datagram_socket = fds[1];
+    own_node->self_id = (uint16_t) ((uint8_t) head[4] << 8 | (uint8_t) head[5]);
+    own_node->pred = node_decode(head + 6);
+    own_node->succ = node_decode(head + 6 + SUCCESSOR_ENTRY_SIZE);
+    return true;
+}
+
+
+size_t restart_load(int conn, struct chord_context* ctx) {
+    FILE* in = fdopen(conn, "r");
+    if (!in) {
+        perror("fdopen");
+        close(conn);
+        return 0;
+    }
+
+    size_t loaded = 0;
+    uint8_t head[SNAPSHOT_RECORD_HEAD];
+    while (fread(head, 1, sizeof(head), in) == sizeof(head)) {
+        size_t key_length = (size_t) head[0] << 8 | head[1];
+        size_t value_length = (size_t) head[2] << 24 | (size_t) head[3] << 16 | (size_t) head[4] << 8 | head[5];
+        uint32_t ttl_ms = (uint32_t) head[6] << 24 | (uint32_t) head[7] << 16 | (uint32_t) head[8] << 8 | head[9];
+
+        char* key = malloc(key_length + 1);
+        char* value = malloc(value_length ? value_length : 1);
+        if (!key || !value || fread(key, 1, key_length, in) != key_length || fread(value, 1, value_length, in) != value_length) {
+            free(key);
+            free(value);
+            break;  // the old process exited while writing
+        }
+        key[key_length] = '\0';
+
+        if (set_owned(&ctx->store, key, value, value_length) != STORE_REJECTED) {
+            loaded += 1;
+            if (ttl_ms > 0) {
+                expire(&ctx->store, key, monotonic_ms(), ttl_ms);
+                schedule_store_sweep(ctx);
+            }
+        }
+        free(key);
+    }
+    fclose(in);
+    return loaded;
+}
+
+
+void restart_init(struct hot_restart* restart, const char* path) {
+    restart->path = path;
+    restart->listener = -1;
+    restart->conn = -1;
+    restart->overdue = false;
+
+    struct sockaddr_un addr;
+    if (!path || !unix_address(path, &addr)) {
+        return;
+    }
+    // A node running there has handed over already, or is gone
+    unlink(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1) {
+        perror("socket");
+        return;
+    }
+    if (fcntl(listener, F_SETFL, O_NONBLOCK) == -1 || bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(listener, 1) == -1) {
+        perror("hot restart socket");
+        close(listener);
+        return;
+    }
+    restart->listener = listener;
+}
+
+
+/**
+ * Close the connections still busy, the drain took too long.
+ */
+static void drain_overdue(void* arg) {
+    struct hot_restart* restart = arg;
+    restart->overdue = true;
+}
+
+
+void restart_accept(struct chord_context* ctx) {
+    struct hot_restart* restart = &ctx->restart;
+    int conn = accept(restart->listener, NULL, NULL);
+    if (conn == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+        return;
+    }
+    // One new process takes over, the next one connects to it
+    close(restart->listener);
+    restart->listener = -1;
+    restart->conn = conn;
+    timer_schedule(&ctx->wheel, &restart->deadline, HOT_RESTART_DRAIN_MS, drain_overdue, restart);
+    fprintf(stderr, "Hot restart: draining\n");
+}
+
+
+bool restart_draining(const struct hot_restart* restart) {
+    return restart->conn != -1;
+}
+
+
+/**
+ * Whether the client connection `state` has no request in progress, nor one waiting to be read.
+ */
+static bool connection_done(const struct connection_state* state) {
+    if (connection_pending(state)) {
+        return false;  // the client did not take all replies yet
+    }
+    if (state->lingering) {
+        return true;
+    }
+    if (state->end != state->buffer || state->upload.active || state->paused || state->deferred) {
+        return false;
+    }
+    char byte;
+    ssize_t n = recv(state->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+
+bool restart_drain(struct chord_context* ctx) {
+    bool drained = true;
+    for (size_t i = 0; i < MAX_CONNECTIONS; i += 1) {
+        struct connection_state* state = &ctx->connections[i];
+        if (state->sock == -1) {
+            continue;
+        }
+        if (ctx->restart.overdue || connection_done(state)) {
+            connection_close(state);
+        } else {
+            drained = false;
+        }
+    }
+    return drained;
+}
+
+
+/**
+ * A snapshot of the store being written to the new process
+ */
+struct snapshot {
+    struct chord_context* ctx;
+    int conn;
+    uint64_t now_ms;
+    char buffer[SNAPSHOT_BATCH];
+    size_t length;
+    size_t keys;
+    bool failed;
+};
+
+
+/**
+ * Send all `n` bytes of `data`, or fail the snapshot.
+ */
+static void snapshot_send(struct snapshot* snapshot, const char* data, size_t n) {
+    while (n > 0 && !snapshot->failed) {
+        ssize_t sent = send(snapshot->conn, data, n, MSG_NOSIGNAL);
+        if (sent == -1 && errno != EINTR) {
+            perror("send");
+            snapshot->failed = true;
+        } else if (sent > 0) {
+            data += sent;
+            n -= sent;
+        }
+    }
+}
+
+
+/**
+ * Send the buffered records.
+ */
+static void snapshot_flush(struct snapshot* snapshot) {
+    snapshot_send(snapshot, snapshot->buffer, snapshot->length);
+    snapshot->length = 0;
+}
+
+
+/**
+ * Add the bytes `data` of a record to the snapshot, sending the buffer whenever it is full.
+ */
+static void snapshot_write(struct snapshot* snapshot, const char* data, size_t n) {
+    if (snapshot->length + n > SNAPSHOT_BATCH) {
+        snapshot_flush(snapshot);
+    }
+    if (n > SNAPSHOT_BATCH) {
+        snapshot_send(snapshot, data, n);  // large values are not copied
+        return;
+    }
+    memcpy(snapshot->buffer + snapshot->length, data, n);
+    snapshot->length += n;
+}
+
+
+/**
+ * Add a tuple to the snapshot, with the time it has left to live.
+ */
+static bool snapshot_add(const struct tuple* tuple, void* arg) {
+    struct snapshot* snapshot = arg;
+    size_t value_length;
+    const char* value = tuple_value(&snapshot->ctx->store, tuple, &value_length);
+    size_t key_length = strlen(tuple->key);
+    if (!value || key_length > UINT16_MAX || value_length > UINT32_MAX) {
+        return true;
+    }
+    uint64_t ttl_ms = 0;
+    if (tuple->expires_at) {
+        ttl_ms = tuple->expires_at > snapshot->now_ms ? tuple->expires_at - snapshot->now_ms : 1;
+        ttl_ms = ttl_ms > UINT32_MAX ? UINT32_MAX : ttl_ms;
+    }
+
+    uint8_t head[SNAPSHOT_RECORD_HEAD] = {
+        key_length >> 8, key_length,
+        value_length >> 24, value_length >> 16, value_length >> 8, value_length,
+        ttl_ms >> 24, ttl_ms >> 16, ttl_ms >> 8, ttl_ms,
+    };
+    snapshot_write(snapshot, (const char*) head, sizeof(head));
+    snapshot_write(snapshot, tuple->key, key_length);
+    snapshot_write(snapshot, value, value_length);
+    snapshot->keys += 1;
+    return !snapshot->failed;
+}
+
+
+void restart_handoff(struct chord_context* ctx, int stream_socket) {
+    struct hot_restart* restart = &ctx->restart;
+    timer_cancel(&restart->deadline);
+    // Messages of this iteration are sent before the socket is handed over
+    outbox_flush(&ctx->outbox);
+
+    char head[HOT_RESTART_HEAD];
+    memcpy(head, HOT_RESTART_MAGIC, strlen(HOT_RESTART_MAGIC));
+    head[4] = ctx->own_node.self_id >> 8;
+    head[5] = ctx->own_node.self_id;
+    node_encode(head + 6, &ctx->own_node.pred);
+    node_encode(head + 6 + SUCCESSOR_ENTRY_SIZE, &ctx->own_node.succ);
+
+    int fds[2] = { stream_socket, ctx->datagram_socket };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = head, .iov_len = sizeof(head) };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    static struct snapshot snapshot;  // too large for the stack
+    snapshot = (struct snapshot) { .ctx = ctx, .conn = restart->conn, .now_ms = monotonic_ms() };
+    if (sendmsg(restart->conn, &message, MSG_NOSIGNAL) != HOT_RESTART_HEAD) {
+        perror("sendmsg");
+        snapshot.failed = true;
+    } else {
+        store_range(&ctx->store, 0, 0, snapshot_add, &snapshot);
+        snapshot_flush(&snapshot);
+    }
+    close(restart->conn);
+    restart->conn = -1;
+
+    if (!snapshot.failed) {
+        fprintf(stderr, "Hot restart: handed over %zu keys\n", snapshot.keys);
+        exit(EXIT_SUCCESS);
+    }
+    // The new process is gone, this one goes on serving
+    fprintf(stderr, "Hot restart failed\n");
+    restart_init(restart, restart->path);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "node.h"
+#include "timer_wheel.h"
+
+#define HOT_RESTART_MAGIC "HOT1"     // first bytes of a handoff, changed with its format
+#define HOT_RESTART_HEAD 22          // magic, the node's ID, its predecessor and its successor
+#define SNAPSHOT_RECORD_HEAD 10      // 2 bytes key length, 4 bytes value length, 4 bytes TTL left in ms, network byte order
+#define SNAPSHOT_BATCH (64 * 1024)   // bytes of records written at once
+#define HOT_RESTART_DRAIN_MS 5000    // client connections still busy by then are closed
+
+struct chord_context;
+
+
+/**
+ * Hot restart: handing a node over to a new process without closing its sockets
+ *
+ * A node started with `HOT_RESTART_SOCKET` listens on that Unix socket. A new
+ * process started with the same path connects to it first. The running node
+ * stops accepting connections and drains: idle client connections are closed,
+ * busy ones once their requests are answered, at the latest after
+ * `HOT_RESTART_DRAIN_MS`. Datagrams are still handled meanwhile, so lookups of
+ * the requests drained are answered. Then the node passes its TCP and UDP
+ * sockets with `SCM_RIGHTS`, along with its place on the ring, followed by a
+ * snapshot of its store, and exits. Connections arriving meanwhile wait in the
+ * listening socket's backlog, the ring never sees the node leave.
+ *
+ * Draining comes first, so no request handled by the old process is missing
+ * from the snapshot.
+ *
+ * `path`: the Unix socket listened on, NULL if hot restarts are disabled
+ * `listener`: the listening Unix socket, -1 once a new process connected
+ * `conn`: connection to the new process while draining, -1 otherwise
+ * `overdue`: the drain took too long, busy connections are closed as well
+ */
+struct hot_restart {
+    const char* path;
+    int listener;
+    int conn;
+    bool overdue;
+    struct timer deadline;
+};
+
+
+/**
+ * Connect to the running node listening on `path`, if any.
+ *
+ * Returns the connection, or -1 if no node is running there.
+ */
+int restart_connect(const char* path);
+
+/**
+ * Take over the sockets and the place on the ring of the node connected to by `restart_connect()`.
+ *
+ * Blocks until the node is drained. Returns false if the handoff failed, the
+ * sockets have to be set up anew then.
+ */
+bool restart_adopt(int conn, int* stream_socket, int* datagram_socket, struct NetworkNodes* own_node);
+
+/**
+ * Read the snapshot of the store following the sockets into the store of `ctx`, up to the end of `conn`.
+ *
+ * Returns the number of keys loaded.
+ */
+size_t restart_load(int conn, struct chord_context* ctx);
+
+/**
+ * Listen for hot restarts on `path`; NULL disables them.
+ */
+void restart_init(struct hot_restart* restart, const char* path);
+
+/**
+ * Accept a new process connecting to the listener, and start draining.
+ */
+void restart_accept(struct chord_context* ctx);
+
+/**
+ * Whether a new process takes over, so no connections are accepted anymore.
+ */
+bool restart_draining(const struct hot_restart* restart);
+
+/**
+ * Close the client connections that are done while draining.
+ *
+ * Returns true once none is left.
+ */
+bool restart_drain(struct chord_context* ctx);
+
+/**
+ * Hand the sockets, the place on the ring and the store over to the new process, and exit.
+ */
+void restart_handoff(struct chord_context* ctx, int stream_socket);
@@ -0,0 +1,66 @@
+#include "ring.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "node.h"
+#include "sockets_setup.h"
+
+
+bool is_ring_request(const struct request* request) {
+    return strcmp(request->method, "GET") == 0 && strcmp(request->uri, RING_URI) == 0;
+}
+
+
+/**
+ * Append the line of a node, unless it is listed already or the buffer is full.
+ */
+static void append_node(char* buffer, size_t size, size_t* length, uint16_t pred_id, uint16_t id, struct in_addr ip, uint16_t port) {
+    char line[sizeof("65535 65535 255.255.255.255 65535\r\n")];
+    int line_length = snprintf(line, sizeof(line), "%u %u %s %u\r\n", pred_id, id, inet_ntoa(ip), port);
+    if (*length + line_length >= size) {
+        return;
+    }
+    // Every node is listed once, the same reply may be cached for several keys
+    for (const char* pos = buffer; pos < buffer + *length; pos = strchr(pos, '\n') + 1) {
+        if (strncmp(pos, line, line_length) == 0) {
+            return;
+        }
+    }
+    memcpy(buffer + *length, line, line_length + 1);
+    *length += line_length;
+}
+
+
+size_t ring_format(const struct chord_context* ctx, char* buffer, size_t size) {
+    struct NetworkNodes node = ctx->own_node;
+    size_t length = 0;
+    buffer[0] = '\0';
+
+    append_node(buffer, size, &length, node.pred.id, node.self_id, ctx->addr.sin_addr, ntohs(ctx->addr.sin_port));
+    if (node.succ.id != node.self_id) {
+        append_node(buffer, size, &length, node.self_id, node.succ.id, node.succ.ip, node.succ.port);
+    }
+    for (int i = 0; i < ctx->nextFreeIndex; i += 1) {
+        const DHTLookupMessage* reply = &ctx->lookupMessages[i];
+        if (reply->messageType == 1) {
+            append_node(buffer, size, &length, reply->key, reply->originNodeID, reply->originNodeIP, reply->originNodePort);
+        }
+    }
+    return length;
+}
+
+
+bool send_ring(struct connection_state* state, const struct chord_context* ctx) {
+    char payload[RING_MAX_SIZE];
+    size_t payload_length = ring_format(ctx, payload, sizeof(payload));
+
+    char reply[HTTP_MAX_HEAD_SIZE + RING_MAX_SIZE];
+    int reply_length = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n%s", payload_length, payload);
+    if (!connection_write(state, reply, reply_length)) {
+        perror("send");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chord_processor.h"
+#include "http.h"
+
+#define RING_URI "/ring"
+#define RING_MAX_SIZE 1024  // longest topology, one line per known node
+
+
+/**
+ * Whether the request asks for the ring topology known to this node.
+ */
+bool is_ring_request(const struct request* request);
+
+/**
+ * Write the ring topology known to this node into `buffer`: this node, its
+ * successor and the nodes of cached lookup replies, one line each:
+ *
+ *   <predecessor id> <id> <ip> <port>\r\n
+ *
+ * The node is responsible for the hashed keys after its predecessor's id up to
+ * its own id. Returns the length of the topology.
+ */
+size_t ring_format(const struct chord_context* ctx, char* buffer, size_t size);
+
+/**
+ * Answer a ring request with the topology as payload.
+ *
+ * Returns false if the connection failed.
+ */
+bool send_ring(struct connection_state* state, const struct chord_context* ctx);
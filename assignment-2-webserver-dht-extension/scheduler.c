@@ -0,0 +1,23 @@
+#include "scheduler.h"
+
+#include "timer_wheel.h"
+
+
+uint64_t scheduler_control_done(struct scheduler* scheduler, uint64_t started_us) {
+    uint64_t now_us = monotonic_us();
+    scheduler->control_us += now_us - started_us;
+    scheduler->slice_start_us = now_us;
+    return now_us;
+}
+
+
+uint64_t scheduler_data_done(struct scheduler* scheduler, uint64_t started_us) {
+    uint64_t now_us = monotonic_us();
+    scheduler->data_us += now_us - started_us;
+    return now_us;
+}
+
+
+bool scheduler_control_due(const struct scheduler* scheduler, uint64_t now_us) {
+    return now_us - scheduler->slice_start_us >= SCHED_CONTROL_SLICE_US;
+}
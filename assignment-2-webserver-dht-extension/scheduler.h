@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCHED_REQUEST_BUDGET 8       // requests of a client connection handled per iteration of the event loop
+#define SCHED_CONTROL_SLICE_US 1000  // work on client requests before datagrams of other nodes are received again
+
+
+/**
+ * Scheduling of the event loop between control traffic and client requests
+ *
+ * Every iteration serves control traffic first: datagrams of other nodes, at
+ * most `DHT_RECV_BURST` at a time, and the connections to other nodes. Client
+ * connections follow in round-robin order, each with at most
+ * `SCHED_REQUEST_BUDGET` requests; requests left over are deferred to the next
+ * iteration. Whenever client requests took `SCHED_CONTROL_SLICE_US`, datagrams
+ * are received again in between, so lookups forwarded through this node do not
+ * wait behind its clients.
+ *
+ * `first`: client connection served first in this iteration, rotating
+ * `slice_start_us`: when control traffic was served last
+ * `control_us`, `data_us`: time spent on control traffic and on client requests
+ * `slices`: times control traffic was served in between client requests
+ * `deferred`: connections that had requests deferred to the next iteration
+ */
+struct scheduler {
+    size_t first;
+    uint64_t slice_start_us;
+    uint64_t control_us;
+    uint64_t data_us;
+    uint64_t slices;
+    uint64_t deferred;
+};
+
+
+/**
+ * Account the control traffic served since `started_us`, the next slice of client requests starts now.
+ *
+ * Returns the current time.
+ */
+uint64_t scheduler_control_done(struct scheduler* scheduler, uint64_t started_us);
+
+/**
+ * Account the client requests served since `started_us`.
+ *
+ * Returns the current time.
+ */
+uint64_t scheduler_data_done(struct scheduler* scheduler, uint64_t started_us);
+
+/**
+ * Whether client requests took up their slice at `now_us`, control traffic is served next.
+ */
+bool scheduler_control_due(const struct scheduler* scheduler, uint64_t now_us);
@@ -4,13 +4,19 @@
 #include <stdbool.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <arpa/inet.h>	
 #include <openssl/sha.h>
 #include <unistd.h>
 #include <netdb.h>
+#include "batch.h"
+#include "data.h"
+#include "fetch.h"
+#include "bulk.h"
 #include "http.h"
+#include "repair.h"
 #include "sockets_setup.h"
 
 
@@ -153,9 +159,311 @@ void connection_setup(struct connection_state* state, int sock) {
     // Set the socket descriptor for the new connection in the connection_state structure.
     state->sock = sock;
 
+    // A new connection is read from, not drained.
+    state->lingering = false;
+    state->batch = NULL;
+    state->bulk = NULL;
+    state->repair = NULL;
+    state->fetch = NULL;
+    state->paused = false;
+    state->deferred = false;
+
+    // Nothing is queued to be sent yet.
+    state->out = NULL;
+    state->out_length = 0;
+    state->out_sent = 0;
+    state->out_capacity = 0;
+    state->lender = NULL;
+    state->loan = NULL;
+    state->lent = NULL;
+    state->lent_length = 0;
+
     // Set the 'end' pointer of the state to the beginning of the buffer.
     state->end = state->buffer;
 
     // Clear the buffer by filling it with zeros to avoid any stale data.
     memset(state->buffer, 0, HTTP_MAX_SIZE);
 }
+
+/**
+ * Releases the requests in progress on a connection: its upload, and whatever it waits for.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ */
+static void connection_release(struct connection_state* state) {
+    timer_cancel(&state->deadline_timer);
+    upload_reset(&state->upload);
+    if (state->batch) {
+        batch_cancel(state->batch);
+        state->batch = NULL;
+    }
+    if (state->bulk) {
+        bulk_cancel(state->bulk);
+        state->bulk = NULL;
+    }
+    if (state->repair) {
+        repair_cancel(state->repair);
+        state->repair = NULL;
+    }
+    if (state->fetch) {
+        fetch_cancel(state->fetch);
+        state->fetch = NULL;
+    }
+    state->paused = false;
+    state->deferred = false;
+}
+
+/**
+ * Returns the value lent to a connection to its store, sent or not.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ */
+static void connection_return(struct connection_state* state) {
+    if (state->lender) {
+        store_return(state->lender, state->loan);
+    }
+    state->lender = NULL;
+    state->loan = NULL;
+    state->lent = NULL;
+    state->lent_length = 0;
+}
+
+/**
+ * Drops the bytes queued on a connection, sent or not, and releases their storage.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ */
+static void connection_drop(struct connection_state* state) {
+    free(state->out);
+    state->out = NULL;
+    state->out_length = 0;
+    state->out_sent = 0;
+    state->out_capacity = 0;
+    connection_return(state);
+}
+
+/**
+ * Closes the connection of a connection state and stops its timers, dropping what is still queued to be sent.
+ *
+ * @param state A pointer to the connection_state structure of the connection. Its socket is set to -1.
+ *
+ */
+void connection_close(struct connection_state* state) {
+    timer_cancel(&state->idle_timer);
+    connection_release(state);
+    connection_drop(state);
+
+    if (state->sock != -1) {
+        close(state->sock);
+        state->sock = -1;
+    }
+}
+
+/**
+ * Ends a connection after its final reply: it is closed right away if the reply is sent, otherwise it lingers until the
+ * client took it. The idle timer keeps running, so a client that does not read is closed on all the same.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ */
+void connection_end(struct connection_state* state) {
+    if (!connection_pending(state)) {
+        connection_close(state);
+        return;
+    }
+    connection_release(state);
+    state->lingering = true;
+    state->end = state->buffer;
+}
+
+/**
+ * Shuts down the sending side of a connection after its final reply, once the reply is sent.
+ *
+ * The client sees the end of the connection, everything it still sends is drained until it closes.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ */
+void connection_linger(struct connection_state* state) {
+    if (!connection_pending(state)) {
+        shutdown(state->sock, SHUT_WR);
+    }
+    state->lingering = true;
+}
+
+/**
+ * Whether bytes sent on a connection are still queued, waiting for the client to take them.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ */
+bool connection_pending(const struct connection_state* state) {
+    return state->out_sent < state->out_length || state->lent_length > 0;
+}
+
+/**
+ * Appends bytes to the queue of a connection, growing it if needed.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param data The bytes to queue.
+ * @param n The number of bytes.
+ *
+ * @return false if the queue could not grow.
+ */
+static bool connection_queue(struct connection_state* state, const char* data, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+    if (state->lent_length > 0) {
+        // Bytes queued behind a lent value: the value is copied after all, to keep the order
+        const char* lent = state->lent;
+        size_t lent_length = state->lent_length;
+        state->lent_length = 0;
+        bool queued = connection_queue(state, lent, lent_length);
+        connection_return(state);
+        if (!queued) {
+            return false;
+        }
+    }
+    if (state->out_length + n > state->out_capacity) {
+        // The sent front is dropped first
+        memmove(state->out, state->out + state->out_sent, state->out_length - state->out_sent);
+        state->out_length -= state->out_sent;
+        state->out_sent = 0;
+    }
+    if (state->out_length + n > state->out_capacity) {
+        size_t capacity = state->out_capacity ? state->out_capacity : CONNECTION_OUT_MIN_CAPACITY;
+        while (capacity < state->out_length + n) {
+            capacity *= 2;
+        }
+        char* out = realloc(state->out, capacity);
+        if (!out) {
+            return false;
+        }
+        state->out = out;
+        state->out_capacity = capacity;
+    }
+    memcpy(state->out + state->out_length, data, n);
+    state->out_length += n;
+    return true;
+}
+
+/**
+ * Sends the bytes of `iov` to the client without blocking, the last buffer possibly part of the value of a tuple.
+ *
+ * What the socket does not take right away is queued, and sent by `connection_flush()` once the socket is writable. Bytes
+ * are sent in order, behind those still queued. The rest of a value as stored is not copied, but lent from its store.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param iov The buffers to send.
+ * @param iovcnt The number of buffers.
+ * @param store The store holding `tuple`, or NULL.
+ * @param tuple The tuple whose value the last buffer may point into, or NULL.
+ *
+ * @return false if the connection failed, or the bytes could not be queued. Nothing is queued anymore then.
+ */
+bool connection_send_value(struct connection_state* state, const struct iovec* iov, int iovcnt, struct store* store, const struct tuple* tuple) {
+    size_t sent = 0;
+    if (!connection_pending(state)) {
+        struct msghdr message = { .msg_iov = (struct iovec*) iov, .msg_iovlen = iovcnt };
+        ssize_t n;
+        do {
+            n = sendmsg(state->sock, &message, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            connection_drop(state);
+            return false;
+        }
+        sent = n > 0 ? n : 0;
+    }
+
+    for (int i = 0; i < iovcnt; i += 1) {
+        size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+        sent -= skip;
+        const char* rest = (const char*) iov[i].iov_base + skip;
+        size_t rest_length = iov[i].iov_len - skip;
+
+        // A decompressed value lies elsewhere and is copied
+        bool stored = tuple && i == iovcnt - 1 && rest_length > 0 && state->lent_length == 0 &&
+                      rest >= tuple->value && rest + rest_length <= tuple->value + tuple->value_length;
+        if (stored && (state->loan = store_lend(store, tuple))) {
+            state->lender = store;
+            state->lent = rest;
+            state->lent_length = rest_length;
+        } else if (!connection_queue(state, rest, rest_length)) {
+            connection_drop(state);  // a reply cut off would desynchronize the client
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends the bytes of `iov` to the client without blocking, like `connection_send_value()` without a value to lend.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param iov The buffers to send.
+ * @param iovcnt The number of buffers.
+ *
+ * @return false if the connection failed, or the bytes could not be queued.
+ */
+bool connection_send(struct connection_state* state, const struct iovec* iov, int iovcnt) {
+    return connection_send_value(state, iov, iovcnt, NULL, NULL);
+}
+
+/**
+ * Sends `n` bytes of `data` to the client without blocking, like `connection_send()`.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param data The bytes to send.
+ * @param n The number of bytes.
+ *
+ * @return false if the connection failed, or the bytes could not be queued.
+ */
+bool connection_write(struct connection_state* state, const char* data, size_t n) {
+    struct iovec iov = { .iov_base = (char*) data, .iov_len = n };
+    return connection_send(state, &iov, 1);
+}
+
+/**
+ * Sends as much of the queue of a connection as the socket takes, the bytes queued and then the value lent.
+ *
+ * Once the queue is sent, its storage is released and the value returned, and a lingering connection shuts down its
+ * sending side.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ *
+ * @return false if the connection failed, the queue is dropped then.
+ */
+bool connection_flush(struct connection_state* state) {
+    while (connection_pending(state)) {
+        struct iovec iov[2] = {
+            { .iov_base = state->out + state->out_sent, .iov_len = state->out_length - state->out_sent },
+            { .iov_base = (char*) state->lent, .iov_len = state->lent_length },
+        };
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = 2 };
+        ssize_t n = sendmsg(state->sock, &message, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            connection_drop(state);
+            return false;
+        }
+        size_t queued = (size_t) n < iov[0].iov_len ? (size_t) n : iov[0].iov_len;
+        state->out_sent += queued;
+        state->lent += n - queued;
+        state->lent_length -= n - queued;
+    }
+
+    connection_drop(state);
+    if (state->lingering) {
+        shutdown(state->sock, SHUT_WR);
+    }
+    return true;
+}
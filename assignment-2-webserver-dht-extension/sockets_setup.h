@@ -6,8 +6,10 @@
 #include <string.h>
 #include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <openssl/sha.h>
+#include "data.h"
 #include "http.h"
 
 struct sockaddr_in derive_sockaddr(const char* host, const char* port);
@@ -18,5 +20,21 @@ int setup_datagram_socket(struct sockaddr_in addr);
 
 void connection_setup(struct connection_state* state, int sock);
 
+void connection_close(struct connection_state* state);
 
-#endif
\ No newline at end of file
+void connection_end(struct connection_state* state);
+
+void connection_linger(struct connection_state* state);
+
+bool connection_pending(const struct connection_state* state);
+
+bool connection_send(struct connection_state* state, const struct iovec* iov, int iovcnt);
+
+bool connection_send_value(struct connection_state* state, const struct iovec* iov, int iovcnt, struct store* store, const struct tuple* tuple);
+
+bool connection_write(struct connection_state* state, const char* data, size_t n);
+
+bool connection_flush(struct connection_state* state);
+
+
+#endif
\ No newline at end of file
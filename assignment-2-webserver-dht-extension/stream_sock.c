@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include "data.h"
 #include "http.h"
 #include "util.h"
@@ -15,54 +16,193 @@
 #include <poll.h>
 #include <stdint.h>
 
+#include "batch.h"
+#include "binary.h"
+#include "bulk.h"
 #include "chord_processor.h"
+#include "fetch.h"
+#include "hotkeys.h"
+#include "metrics.h"
+#include "near.h"
+#include "repair.h"
+#include "ring.h"
+#include "sockets_setup.h"
+#include "stream_sock.h"
 
-#define MAX_RESOURCES 100
 
+/**
+ * PARSE TTL: Reads the lifetime requested for a stored value from the `X-TTL` header (in seconds).
+ *
+ * @param request A pointer to the parsed request.
+ * @param ttl_ms Set to the lifetime in milliseconds, 0 if the value does not expire.
+ *
+ * @return false if the header is malformed, true otherwise.
+ */
+static bool parse_ttl(struct request* request, uint64_t* ttl_ms) {
+    *ttl_ms = 0;
+    const string ttl = get_header(request, "X-TTL");
+    if (!ttl) {
+        return true;
+    }
+
+    char* end;
+    errno = 0;
+    unsigned long long seconds = strtoull(ttl, &end, 10);
+    if (end == ttl || *end != '\0' || *ttl == '-' || errno == ERANGE || seconds == 0 || seconds > UINT64_MAX / 1000) {
+        return false;
+    }
+    *ttl_ms = seconds * 1000;
+    return true;
+}
 
-struct tuple resources[MAX_RESOURCES] = {
-    {"/static/foo", "Foo", sizeof "Foo" - 1},
-    {"/static/bar", "Bar", sizeof "Bar" - 1},
-    {"/static/baz", "Baz", sizeof "Baz" - 1}
-};
+/**
+ * STORE VALUE: Stores a value and lets it expire after its TTL, if it has one.
+ *
+ * @param ctx The chord_context of the node, holding the store.
+ * @param key The key of the value.
+ * @param value The value, allocated with `malloc()`, ownership is taken.
+ * @param value_length The length of the value.
+ * @param ttl_ms The lifetime of the value in milliseconds, 0 if it does not expire.
+ *
+ * @return The reply to send to the client.
+ */
+static const char* store_value(struct chord_context* ctx, const string key, char* value, size_t value_length, uint64_t ttl_ms) {
+    near_changed(ctx, key);
+    enum store_result result = set_owned(&ctx->store, key, value, value_length);
+    if (result == STORE_REJECTED) {
+        return "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n";
+    }
 
+    if (ttl_ms > 0) {
+        expire(&ctx->store, key, monotonic_ms(), ttl_ms);
+        schedule_store_sweep(ctx);
+    }
+    if (result == STORE_OVERWRITTEN) {
+        return "HTTP/1.1 204 No Content\r\n\r\n";
+    } else {
+        return "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+    }
+}
+
+/**
+ * Sends a stored resource to the client, honouring `If-None-Match`, `Range` and `Accept-Encoding` headers.
+ *
+ * Only the status line and headers are formatted into a buffer, the (partial) value is sent directly from the store. What
+ * the socket does not take right away is lent from the store until it is sent, not copied, unless it was decompressed.
+ * The entity tag is derived from the digest stored with the value, so a client holding the current value is answered
+ * with 304 (Not Modified) and no payload. A compressed value is sent as stored to clients accepting gzip, and only decompressed
+ * for all others.
+ *
+ * @param state     A pointer to the connection_state of the connection to the client.
+ * @param request   A pointer to the struct containing the parsed request information.
+ * @param store     The store holding the tuple, decompresses its value.
+ * @param tuple     The stored tuple.
+ */
+static void send_resource(struct connection_state* state, struct request* request, struct store* store, const struct tuple* tuple) {
+    char head[HTTP_MAX_HEAD_SIZE];
+    const string range = get_header(request, "Range");
+    const string accept_encoding = get_header(request, "Accept-Encoding");
+    bool gzip = tuple->compressed && !range && accept_encoding && accepts_encoding(accept_encoding, "gzip");
+    const char* vary = tuple->compressed ? "Vary: Accept-Encoding\r\n" : "";
+
+    // Half of the SHA-256 digest is plenty to tell versions of a value apart, the gzip representation has a tag of its own
+    char etag[2 * ETAG_DIGEST_BYTES + sizeof("\"\"-gzip")] = "\"";
+    for (size_t i = 0; i < ETAG_DIGEST_BYTES; i += 1) {
+        snprintf(etag + 1 + 2 * i, 3, "%02x", tuple->digest[i]);
+    }
+    strcat(etag, gzip ? "-gzip\"" : "\"");
+
+    const string if_none_match = get_header(request, "If-None-Match");
+    if (if_none_match && etag_matches(if_none_match, etag)) {
+        int head_length = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n%s\r\n", etag, vary);
+        if (!connection_write(state, head, head_length)) {
+            perror("send");
+        }
+        return;
+    }
+
+    size_t resource_length = tuple->value_length;
+    const char* resource = gzip ? tuple->value : tuple_value(store, tuple, &resource_length);
+    if (!resource) {
+        const string unavailable = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        connection_write(state, unavailable, strlen(unavailable));
+        return;
+    }
+
+    size_t first = 0, last = 0;
+    enum range_result result = range ? parse_range(range, resource_length, &first, &last) : RANGE_NONE;
+
+    struct iovec iov[2] = {
+        { .iov_base = head },
+        { .iov_base = NULL, .iov_len = 0 },
+    };
+    if (result == RANGE_SATISFIABLE) {
+        iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nETag: %s\r\n%sContent-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n\r\n", etag, vary, first, last, resource_length, last - first + 1);
+        iov[1].iov_base = (char*) resource + first;
+        iov[1].iov_len = last - first + 1;
+    } else if (result == RANGE_UNSATISFIABLE) {
+        iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n", resource_length);
+    } else {
+        iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\nETag: %s\r\n%s%sContent-Length: %zu\r\n\r\n", etag, vary, gzip ? "Content-Encoding: gzip\r\n" : "", resource_length);
+        iov[1].iov_base = (char*) resource;
+        iov[1].iov_len = resource_length;
+    }
+
+    if (!connection_send_value(state, iov, 2, store, tuple)) {
+        perror("send");
+    }
+}
 
 /**
  * Sends an HTTP reply to the client based on the received request.
  *
- * @param conn      The file descriptor of the client connection socket.
+ * @param state     A pointer to the connection_state of the connection to the client.
  * @param request   A pointer to the struct containing the parsed request information.
+ * @param ctx       The chord_context of the node, holding the store.
  */
-void send_reply(int conn, struct request* request) {
+void send_reply(struct connection_state* state, struct request* request, struct chord_context* ctx) {
 
-    // Create a buffer to hold the HTTP reply
-    char buffer[HTTP_MAX_SIZE];
-    char *reply = buffer;
+    // Replies other than stored resources are constant
+    const char *reply;
 
 
     if (strcmp(request->method, "GET") == 0) {
-        // Find the resource with the given URI in the 'resources' array.
-        size_t resource_length;
-        const char* resource = get(request->uri, resources, MAX_RESOURCES, &resource_length);
+        // Find the resource with the given URI in the store.
+        const struct tuple* resource = get_tuple(&ctx->store, request->uri);
 
         // check if responsible
 
         if (resource) {
-            sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n%.*s", resource_length, (int) resource_length, resource);
+            near_lend(ctx, request);
+            send_resource(state, request, &ctx->store, resource);
+            return;
+        } else if (balance_awaited(ctx, request->uri)) {
+            // moved over from the successor, which has not handed it over yet
+            reply = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
         } else {
             reply = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
         }
     } else if (strcmp(request->method, "PUT") == 0) {
-        // Try to set the requested resource with the given payload in the 'resources' array.
-        if (set(request->uri, request->payload, request->payload_length, resources, MAX_RESOURCES
-        )) {
-            reply = "HTTP/1.1 204 No Content\r\n\r\n";
+        // Try to set the requested resource with the given payload in the store.
+        uint64_t ttl_ms;
+        if (!parse_ttl(request, &ttl_ms)) {
+            reply = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
         } else {
-            reply = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+            char* value = (char*) malloc(request->payload_length ? request->payload_length : 1);
+            if (!value) {
+                reply = "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n";
+            } else {
+                memcpy(value, request->payload, request->payload_length);
+                reply = store_value(ctx, request->uri, value, request->payload_length, ttl_ms);
+            }
         }
     } else if (strcmp(request->method, "DELETE") == 0) {
-        // Try to delete the requested resource from the 'resources' array
-        if (delete(request->uri, resources, MAX_RESOURCES)) {
+        // Try to delete the requested resource from the store
+        // a key moved over may still be handed over, the delete holds for it as well
+        near_changed(ctx, request->uri);
+        bool awaited = balance_awaited(ctx, request->uri);
+        balance_deleted(ctx, request->uri);
+        if (delete(&ctx->store, request->uri) || awaited) {
             reply = "HTTP/1.1 204 No Content\r\n\r\n";
         } else {
             reply = "HTTP/1.1 404 Not Found\r\n\r\n";
@@ -72,34 +212,277 @@ void send_reply(int conn, struct request* request) {
     }
 
     // Send the reply back to the client
-    if (send(conn, reply, strlen(reply), 0) == -1) {
+    if (!connection_write(state, reply, strlen(reply))) {
         perror("send");
-        close(conn);
     }
 }
 
+/**
+ * FORMAT UNAVAILABLE: Formats the 503 reply to a request whose responsible node is being looked up.
+ *
+ * The client is asked to retry once the lookup is expected to be answered, estimated from the measured round trips of
+ * lookups: in whole seconds in Retry-After, at least 1, and in milliseconds in Retry-After-Ms.
+ *
+ * @param buffer The buffer for the reply.
+ * @param size The size of the buffer.
+ * @param ctx The chord_context of the node, holding the lookups in flight.
+ * @param close Whether the connection is closed after the reply, announced with Connection: close.
+ * @return The length of the reply.
+ */
+int format_unavailable(char* buffer, size_t size, const struct chord_context* ctx, bool close) {
+    uint32_t retry_ms = lookup_estimate_ms(&ctx->pending_lookups);
+    return snprintf(buffer, size, "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %u\r\n%s: %u\r\n%sContent-Length: 0\r\n\r\n",
+                    (retry_ms + 999) / 1000, RETRY_AFTER_MS_HEADER, retry_ms, close ? "Connection: close\r\n" : "");
+}
+
+/**
+ * ROUTE REQUEST: Answers a request locally if this node is responsible for it, otherwise points the client to the
+ * responsible node.
+ *
+ * If the responsible node is neither this node nor its successor, the cached lookup replies are consulted. If no reply is
+ * cached, a lookup is started and the client is asked to retry later. GETs of values in the near cache are answered from it,
+ * and values of hot keys are fetched into it.
+ *
+ * @param state A pointer to the connection_state of the connection to the client.
+ * @param request A pointer to the parsed request.
+ * @param ctx The chord_context of the node: its state in the DHT, the UDP socket and the lookups in flight.
+ */
+static void route_request(struct connection_state* state, struct request* request, struct chord_context* ctx) {
+    struct NetworkNodes node = ctx->own_node;
+
+    // is responsible
+    if (is_responsible_hashed(hash(request->uri), node.self_id, node.pred.id)) {
+        send_reply(state, request, ctx);
+        return;
+    }
+
+    // hot values of other nodes may be cached here
+    bool get = strcmp(request->method, "GET") == 0;
+    const struct tuple* cached = get ? near_get(&ctx->near, request->uri) : NULL;
+    if (cached) {
+        send_resource(state, request, &ctx->near.store, cached);
+        return;
+    }
+
+    char buffer[HTTP_MAX_SIZE];
+    char *reply = buffer; 
+    // is successor responsible
+    if (is_responsible_hashed(hash(request->uri), node.succ.id, node.self_id)) {
+        snprintf(reply, sizeof(buffer), "HTTP/1.1 303 See Other\r\nLocation: http://%s:%d%s\r\nContent-Length: 0\r\n\r\n", inet_ntoa(node.succ.ip), node.succ.port, request->uri);
+        if (get) {
+            struct sockaddr_in owner = { .sin_family = AF_INET, .sin_addr = node.succ.ip, .sin_port = htons(node.succ.port) };
+            near_consider(ctx, request->uri, owner);
+        }
+    } else {
+        // is reply message? iterate in array[10]  if found reply exists --> 303
+        DHTLookupMessage *foundMessage = findDHTreply(ctx->lookupMessages, hash(request->uri), &ctx->nextFreeIndex);
+        // if reply message exists, send 303
+        if (foundMessage != NULL) {
+            snprintf(reply, sizeof(buffer), "HTTP/1.1 303 See Other\r\nLocation: http://%s:%d%s\r\nContent-Length: 0\r\n\r\n", inet_ntoa(foundMessage->originNodeIP), foundMessage->originNodePort, request->uri);
+            if (get) {
+                struct sockaddr_in owner = { .sin_family = AF_INET, .sin_addr = foundMessage->originNodeIP, .sin_port = htons(foundMessage->originNodePort) };
+                near_consider(ctx, request->uri, owner);
+            }
+            // disallocate memory
+            free(foundMessage);
+
+        } else {
+            // else put off till later with 503 
+            format_unavailable(reply, sizeof(buffer), ctx, false);
+
+            // LOOKUP INIT (initial lookup, if other condition are not fulfilled), retransmitted until answered
+            start_lookup(&ctx->pending_lookups, hash(request->uri));
+        }
+    }
+
+    // send reply to client over TCP HTTP
+    if (!connection_write(state, reply, strlen(reply))) {
+        perror("send");
+    }
+}
+
+/**
+ * SEND BAD REQUEST: Tells the client that its request is malformed before the connection is terminated.
+ *
+ * @param state A pointer to the connection_state of the connection to the client.
+ */
+static void send_bad_request(struct connection_state* state) {
+    const string bad_request = "HTTP/1.1 400 Bad Request\r\n\r\n";
+    connection_write(state, bad_request, strlen(bad_request));
+    printf("Received malformed request, terminating connection.\n");
+}
+
+/**
+ * SEND TOO LARGE: Tells the client that the payload of its request is refused before the connection is terminated.
+ *
+ * @param state A pointer to the connection_state of the connection to the client.
+ */
+static void send_too_large(struct connection_state* state) {
+    const string too_large = "HTTP/1.1 413 Content Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    connection_write(state, too_large, strlen(too_large));
+}
+
+/**
+ * BEGIN UPLOAD: Starts streaming the payload of a request whose head is complete, but whose payload is not.
+ *
+ * If this node is responsible for a PUT, the payload is received into storage of the value as it arrives, and stored once
+ * complete. Any other request is answered right away, its payload is read and dropped to keep the connection in sync.
+ *
+ * @param state A pointer to the connection_state of the connection.
+ * @param request A pointer to the request, parsed by `parse_request_head()`.
+ * @param head_length The length of the head of the request.
+ * @param ctx The chord_context of the node.
+ *
+ * @return The length of the head, or -1 if the connection has to be closed.
+ */
+static ssize_t begin_upload(struct connection_state* state, struct request* request, ssize_t head_length, struct chord_context* ctx) {
+    struct NetworkNodes node = ctx->own_node;
+    bool store = strcmp(request->method, "PUT") == 0 && is_responsible_hashed(hash(request->uri), node.self_id, node.pred.id);
+    bool batch = is_batch_request(request);
+    bool bulk = is_bulk_request(request);
+    bool repair = is_repair_request(request);
+    if (!batch && !bulk && !repair) {
+        hotkeys_record(&ctx->hotkeys, request->uri, strlen(request->uri));
+    }
+
+    // A client expecting 100 (Continue) waits for it before sending the payload
+    const string expect = get_header(request, "Expect");
+    if (expect && strcasecmp(expect, "100-continue") != 0) {
+        const string expectation_failed = "HTTP/1.1 417 Expectation Failed\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        connection_write(state, expectation_failed, strlen(expectation_failed));
+        return -1;
+    }
+    if (expect && !store && !batch && !bulk && !repair) {
+        // Answer right away so the payload is not uploaded in vain. Whether the client still sends it is
+        // unknown, so the connection cannot be reused: drain it until the client closes.
+        route_request(state, request, ctx);
+        connection_linger(state);
+        return head_length;
+    }
+
+    uint64_t ttl_ms = 0;
+    if (store && !parse_ttl(request, &ttl_ms)) {
+        send_bad_request(state);
+        return -1;
+    }
+    // Values that can never fit into the memory budget are refused before their payload is received or any storage is
+    // allocated, chunked ones once a chunk goes beyond. Bulk loads are consumed as they arrive, so their size is not limited,
+    // only the pair not received completely is buffered, along with what one receive adds to it.
+    size_t limit = store ? store_max_value(&ctx->store, strlen(request->uri)) : batch ? BATCH_MAX_PAYLOAD : repair ? REPAIR_MAX_REQUEST : SIZE_MAX;
+    bool too_large = !request->chunked && (size_t) request->payload_length > limit;
+    bool started = !too_large && (bulk ? upload_start_streamed(&state->upload, request->uri, request->chunked, request->payload_length)
+                                       : upload_start(&state->upload, request->uri, request->chunked, request->payload_length, !store && !batch && !repair));
+    if (!started || (bulk && !bulk_start(state, request, ctx))) {
+        send_too_large(state);
+        return -1;
+    }
+    if (bulk) {
+        state->upload.limit = bulk_max_pending(ctx) + HTTP_MAX_SIZE;
+    } else if (request->chunked) {
+        state->upload.limit = limit;
+    }
+    const string connection_header = get_header(request, "Connection");
+    state->upload.close_after = connection_header && strcasecmp(connection_header, "close") == 0;
+    state->upload.ttl_ms = ttl_ms;
+    state->upload.batch = batch;
+    state->upload.forwarded = batch && get_header(request, BATCH_FORWARDED_HEADER) != NULL;
+    state->upload.repair = repair;
+
+    if (expect) {
+        const string go_ahead = "HTTP/1.1 100 Continue\r\n\r\n";
+        connection_write(state, go_ahead, strlen(go_ahead));
+    } else if (!store && !batch && !bulk && !repair) {
+        route_request(state, request, ctx);
+    }
+    return head_length;
+}
+
+/**
+ * CONSUME BULK: Hands the pairs of a bulk load received so far to the bulk load.
+ *
+ * A pair that is not received completely stays at the front of the upload's storage.
+ *
+ * @param state A pointer to the connection_state of the connection.
+ *
+ * @return false if a pair is malformed or too large, the upload is `exceeded` then.
+ */
+static bool consume_bulk(struct connection_state* state) {
+    struct upload* upload = &state->upload;
+    if (!state->bulk || !upload->active) {
+        return true;
+    }
+    ssize_t consumed = bulk_consume(state->bulk, upload->value, upload->length);
+    if (consumed == -1) {
+        upload->exceeded = state->bulk->too_large;
+        return false;
+    }
+    memmove(upload->value, upload->value + consumed, upload->length - consumed);
+    upload->length -= consumed;
+    return true;
+}
+
+/**
+ * FINISH UPLOAD: Stores a completely received payload and answers its request.
+ *
+ * The storage of the value is handed over to the store, the payload is not copied again.
+ *
+ * @param state A pointer to the connection_state of the connection.
+ * @param ctx The chord_context of the node, holding the store.
+ *
+ * @return false if the client asked to close the connection after the request, true otherwise.
+ */
+static bool finish_upload(struct connection_state* state, struct chord_context* ctx) {
+    struct upload* upload = &state->upload;
+    bool keep_alive = !upload->close_after;
+
+    if (state->bulk) {
+        // A pair cut off by the end of the payload is malformed
+        bool complete = upload->length == 0;
+        upload_reset(upload);
+        if (!complete) {
+            send_bad_request(state);
+            return false;
+        }
+        return bulk_finish(state->bulk);
+    } else if (upload->frame_op) {
+        if (!upload->discard) {
+            frame_store(state, upload->frame_op, upload->frame_id, upload->key, upload->value, upload->length, ctx);
+            upload->value = NULL;  // owned by the store now
+        }
+    } else if (upload->batch) {
+        keep_alive = batch_start(state, upload->value, upload->length, upload->forwarded, upload->close_after, ctx);
+    } else if (upload->repair) {
+        keep_alive = repair_request(state, upload->key, upload->value, upload->length, upload->close_after, ctx);
+    } else if (!upload->discard) {
+        const char* reply = store_value(ctx, upload->key, upload->value, upload->length, upload->ttl_ms);
+        upload->value = NULL;  // owned by the store now
+
+        if (!connection_write(state, reply, strlen(reply))) {
+            perror("send");
+        }
+    }
+
+    upload_reset(upload);
+    return keep_alive;
+}
+
 /**
  * PROCESS PACKET: Handles and processes an incoming packet from a client connection.
  *
  * This function is responsible for processing incoming packets received on a specified connection. It interprets the packet
  * data, performs necessary actions based on the packet content, and may send replies back to the client. This function also
  * handles DHT-related messages, if applicable. It is capable of managing malformed packets and various error scenarios during
- * processing.
+ * processing. Requests whose payload is chunked or does not fit into the buffer start an upload once their head is complete.
  *
- * @param conn The socket descriptor representing the connection to the client.
+ * @param state A pointer to the connection_state of the connection to the client.
  * @param buffer A pointer to the buffer containing the incoming packet's data.
  * @param n The size of the incoming packet in bytes.
- * @param node A NetworkNodes structure representing the current node's state in the DHT.
- * @param dram_socket The socket descriptor for the DHT's UDP communication.
- * @param lookup_msg A pointer to a DHTLookupMessage structure for handling DHT messages.
- * @param lookupMessages An array of DHTLookupMessage structures for storing DHT lookup messages.
- * @param nextFreeIndex A pointer to an integer tracking the next free index in the lookupMessages array.
+ * @param ctx The chord_context of the node: its state in the DHT, the UDP socket and the lookups in flight.
  *
  * @return The number of bytes processed from the packet. If the packet is successfully processed, the return value
  *         indicates the number of bytes processed. If the packet is malformed or an error occurs, the return value is -1.
  */
-size_t process_packet(int conn, char* buffer, size_t n, struct NetworkNodes node, int dram_socket, DHTLookupMessage *lookup_msg, DHTLookupMessage lookupMessages[], int *nextFreeIndex) {
-    
+ssize_t process_packet(struct connection_state* state, char* buffer, size_t n, struct chord_context* ctx) {
     struct request request = {
         .method = NULL,
         .uri = NULL,
@@ -108,57 +491,60 @@ size_t process_packet(int conn, char* buffer, size_t n, struct NetworkNodes node
     };
     ssize_t bytes_processed = parse_request(buffer, n, &request);
 
-    if (bytes_processed > 0) {
-
-        // is responsible
-        if (is_responsible_hashed(hash(request.uri), node.self_id, node.pred.id)) {
-            send_reply(conn, &request);
-
-
-        } else {
-            char buffer[HTTP_MAX_SIZE];
-            char *reply = buffer; 
-            // is successor responsible
-            if (is_responsible_hashed(hash(request.uri), node.succ.id, node.self_id)) {
-                sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%s:%d%s\r\nContent-Length: 0\r\n\r\n", inet_ntoa(node.succ.ip), node.succ.port, request.uri);//, resource_length, (int) resource_length, resource) 
-            } else {
-            // is reply message? iterate in array[10]  if found reply exists --> 303
-            DHTLookupMessage *foundMessage = findDHTreply(lookupMessages, hash(request.uri), nextFreeIndex);
-            // if reply message exists, send 303
-            if (foundMessage != NULL) {
-                sprintf(reply, "HTTP/1.1 303 See Other\r\nLocation: http://%s:%d%s\r\nContent-Length: 0\r\n\r\n", inet_ntoa(foundMessage->originNodeIP), foundMessage->originNodePort, request.uri);//, resource_length, (int) resource_length, resource)
-                // disallocate memory
-                free(foundMessage);
-
-            } else {
-            // else put off till later with 503 
-            reply = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+    if (bytes_processed == 0) {
+        // Payload is chunked or not received completely: stream it once the head is complete
+        bytes_processed = parse_request_head(buffer, n, &request);
+        if (bytes_processed > 0) {
+            return begin_upload(state, &request, bytes_processed, ctx);
+        }
+    }
 
-            // LOOKUP INIT (initial lookup, if other condition are not fulfilled)
-            lookup_dht(dram_socket, node, hash(request.uri), lookup_msg);
+    if (bytes_processed > 0) {
+        // Check the "Connection" header in the request to determine if the connection should be kept alive or closed.
+        const string connection_header = get_header(&request, "Connection");
+        bool close_after = connection_header && strcasecmp(connection_header, "close") == 0;
+
+        if (is_batch_request(&request)) {
+            // Answered now, or once the other nodes replied; the connection is paused until then
+            bool forwarded = get_header(&request, BATCH_FORWARDED_HEADER) != NULL;
+            return batch_start(state, request.payload, request.payload_length, forwarded, close_after, ctx) ? bytes_processed : -1;
+        }
+        if (is_bulk_request(&request)) {
+            struct bulk* bulk = bulk_start(state, &request, ctx);
+            if (!bulk) {
+                return -1;
             }
+            if (bulk_consume(bulk, request.payload, request.payload_length) != request.payload_length) {
+                send_bad_request(state);
+                return -1;
             }
-
-            // send reply to client over TCP HTTP
-            if (send(conn, reply, strlen(reply), 0) == -1) {
-                perror("send");
-                close(conn);
+            return bulk_finish(bulk) ? bytes_processed : -1;
+        }
+        if (is_repair_request(&request)) {
+            return repair_request(state, request.uri, request.payload, request.payload_length, close_after, ctx) ? bytes_processed : -1;
+        }
+        if (is_ring_request(&request)) {
+            send_ring(state, ctx);
+        } else if (is_metrics_request(&request)) {
+            send_metrics(state, ctx);
+        } else if (is_hotkeys_request(&request)) {
+            send_hotkeys(state, &ctx->hotkeys);
+        } else {
+            hotkeys_record(&ctx->hotkeys, request.uri, strlen(request.uri));
+            if (fetch_applies(&request, ctx) && !get_tuple(&ctx->near.store, request.uri)) {
+                // Answered once the value arrived over UDP; the connection is paused until then
+                return fetch_start(state, request.uri, close_after, ctx) ? bytes_processed : -1;
             }
-
+            route_request(state, &request, ctx);
         }
 
-            // Check the "Connection" header in the request to determine if the connection should be kept alive or closed.
-            const string connection_header = get_header(&request, "Connection");
-            if (connection_header && strcmp(connection_header, "close")) {
-                return -1;
-            } 
+        if (close_after) {
+            return -1;
+        } 
        
     } else if (bytes_processed == -1) {
         // If the request is malformed or an error occurs during processing, send a 400 Bad Request response to the client.
-        const string bad_request = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        send(conn, bad_request, strlen(bad_request), 0);
-        printf("Received malformed request, terminating connection.\n");
-        close(conn);
+        send_bad_request(state);
         return -1;
     }
 
@@ -185,51 +571,219 @@ char* buffer_discard(char* buffer, size_t discard, size_t keep) {
     return buffer + keep;
 }
 
+/**
+ * CONNECTION IDLE: Closes a keep-alive connection on which the client stayed silent for too long.
+ *
+ * @param arg The connection_state of the connection.
+ */
+static void connection_idle(void* arg) {
+    connection_close((struct connection_state*) arg);
+}
+
+/**
+ * REQUEST DEADLINE: Aborts a request that was not received completely in time.
+ *
+ * @param arg The connection_state of the connection.
+ */
+static void request_deadline(void* arg) {
+    struct connection_state* state = arg;
+    const string timeout_reply = "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    connection_write(state, timeout_reply, strlen(timeout_reply));
+    connection_end(state);
+}
+
+/**
+ * CONNECTION TOUCH: Restarts the idle timer of a connection after activity on it.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param wheel The timer wheel of the node.
+ */
+void connection_touch(struct connection_state* state, struct timer_wheel* wheel) {
+    timer_schedule(wheel, &state->idle_timer, CONNECTION_IDLE_TIMEOUT_MS, connection_idle, state);
+}
+
+/**
+ * PROCESS BUFFER: Processes the requests received into the buffer of a connection, up to `window_end`.
+ *
+ * Processing stops at an incomplete request, or once the connection is paused for other nodes. Unprocessed bytes are kept at
+ * the front of the buffer.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param window_end The end of the received bytes in the buffer.
+ * @param ctx The chord_context of the node.
+ *
+ * @return false if the connection has to be closed, true otherwise.
+ */
+static bool process_buffer(struct connection_state* state, char* window_end, struct chord_context* ctx) {
+    char* window_start = state->buffer;
+    int handled = 0;  // requests of this iteration of the event loop, up to the scheduler's budget
+    state->deferred = false;
+
+    while (true) {
+        if (state->upload.active) {
+            // Payload (or chunk framing) of an upload that arrived with other data
+            ssize_t consumed = upload_feed(&state->upload, window_start, window_end - window_start);
+            if (consumed == -1 || !consume_bulk(state)) {
+                state->upload.exceeded ? send_too_large(state) : send_bad_request(state);
+                return false;
+            }
+            window_start += consumed;
+            if (!upload_done(&state->upload)) {
+                break;
+            }
+            if (!finish_upload(state, ctx)) {
+                return false;
+            }
+        } else if (state->lingering) {
+            window_start = window_end;  // drop everything behind the final reply
+            break;
+        } else if (state->paused) {
+            break;  // later requests are answered after the batch or bulk load
+        } else if (connection_pending(state)) {
+            break;  // later requests are answered once the client took the replies so far
+        } else if (window_start < window_end) {
+            // Binary frames of other nodes and HTTP requests may share a connection, told apart by their first byte
+            ssize_t bytes_processed = is_frame(window_start, window_end - window_start)
+                ? process_frame(state, window_start, window_end - window_start, ctx)
+                : process_packet(state, window_start, window_end - window_start, ctx);
+            if (bytes_processed == -1) {
+                return false;
+            } else if (bytes_processed == 0) {
+                break;
+            }
+            window_start += bytes_processed;
+            if (++handled == SCHED_REQUEST_BUDGET && window_start < window_end && !state->paused && !state->lingering) {
+                // Other connections go first, the rest is handled in the next iteration
+                state->deferred = true;
+                ctx->scheduler.deferred += 1;
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+
+    state->end = buffer_discard(state->buffer, window_start - state->buffer, window_end - window_start);
+
+    // Start the deadline with the first bytes of a request, stop it once nothing is left over.
+    // Uploads may take longer, they are only bounded by the idle timer. Batches have a deadline of their own. Requests
+    // waiting for the client to take the replies so far are not late.
+    if (state->end == state->buffer || state->upload.active || state->paused || connection_pending(state)) {
+        timer_cancel(&state->deadline_timer);
+    } else if (!timer_pending(&state->deadline_timer)) {
+        timer_schedule(&ctx->wheel, &state->deadline_timer, REQUEST_DEADLINE_MS, request_deadline, state);
+    }
+    return true;
+}
+
+/**
+ * CONNECTION RESUME: Continues with the requests of a connection that were received while it was paused.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param ctx The chord_context of the node.
+ */
+void connection_resume(struct connection_state* state, struct chord_context* ctx) {
+    connection_touch(state, &ctx->wheel);
+    if (!process_buffer(state, state->end, ctx)) {
+        connection_end(state);
+    }
+}
+
 /**
  * HANDLE CONNECTION: Manages incoming connections and processes data received through the socket.
  *
  * This function is responsible for handling an active connection represented by the connection_state structure. It reads data
  * from the socket, processes the received packets, and performs necessary actions based on the packet contents. The function
- * integrates with DHT functionality, handling DHT-related messages as part of the data processing. In case of an error during
- * data reception or processing, appropriate error handling is performed.
+ * integrates with DHT functionality, handling DHT-related messages as part of the data processing. While a request is only
+ * partially received, its deadline timer is running. At most SCHED_REQUEST_BUDGET requests are handled per call, the rest
+ * is deferred to the next call, before anything more is received.
  *
  * @param state A pointer to the connection_state structure containing the current state of the connection, including the buffer
  *              and the socket descriptor.
- * @param node A NetworkNodes structure representing the current node's state in the DHT.
- * @param dgram_socket The socket descriptor for the DHT's UDP communication.
- * @param lookup_msg A pointer to a DHTLookupMessage structure for handling DHT messages.
- * @param lookupMessages An array of DHTLookupMessage structures for storing DHT lookup messages.
- * @param nextFreeIndex A pointer to an integer tracking the next free index in the lookupMessages array.
+ * @param ctx The chord_context of the node.
  *
  * @return Returns true if the connection and data processing were successful, false if the connection is closed or an error
- *         occurs in data processing. In case of a receive error, the function exits the program.
+ *         occurs in data processing. In this case, the caller closes the connection.
  */
 
-bool handle_connection(struct connection_state* state, struct NetworkNodes node, int dgram_socket, DHTLookupMessage *lookup_msg, DHTLookupMessage lookupMessages[], int *nextFreeIndex) {
+bool handle_connection(struct connection_state* state, struct chord_context* ctx) {
+    if (state->paused) {
+        return true;  // not read from until resumed
+    }
+
+    // After the final reply, input is only drained until the client closes (or the idle timer fires)
+    if (state->lingering) {
+        ssize_t bytes_read = recv(state->sock, state->buffer, HTTP_MAX_SIZE, 0);
+        return bytes_read > 0 || (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    // Requests left over in the last iteration are handled before more is received
+    if (state->deferred) {
+        return process_buffer(state, state->end, ctx);
+    }
+
+    // Payload of an upload is received directly into the storage of its value
+    char* upload_target = NULL;
+    size_t upload_wanted = upload_direct_buffer(&state->upload, &upload_target);
+    if (upload_wanted > 0 && state->end == state->buffer) {
+        ssize_t bytes_read = recv(state->sock, upload_target, upload_wanted, 0);
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;  // the socket is non-blocking, nothing arrived after all
+        } else if (bytes_read == -1) {
+            perror("recv");
+            return false;
+        } else if (bytes_read == 0) {
+            return false;
+        }
+        connection_touch(state, &ctx->wheel);
+
+        upload_received(&state->upload, bytes_read);
+        if (!consume_bulk(state)) {
+            state->upload.exceeded ? send_too_large(state) : send_bad_request(state);
+            return false;
+        }
+        return !upload_done(&state->upload) || finish_upload(state, ctx);
+    }
+
     // Calculate the pointer to the end of the buffer to avoid buffer overflow
     const char* buffer_end = state->buffer + HTTP_MAX_SIZE;
 
     // Check if an error occurred while receiving data from the socket
     ssize_t bytes_read = recv(state->sock, state->end, buffer_end - state->end, 0);
-    if (bytes_read == -1) {
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    } else if (bytes_read == -1) {
         perror("recv");
-        close(state->sock);
-        exit(EXIT_FAILURE);
+        return false;
     } else if (bytes_read == 0) {
         return false;
     }
+    connection_touch(state, &ctx->wheel);
 
-    char* window_start = state->buffer;
-    char* window_end = state->end + bytes_read;
+    return process_buffer(state, state->end + bytes_read, ctx);
+}
 
-    ssize_t bytes_processed = 0;
-    while((bytes_processed = process_packet(state->sock, window_start, window_end - window_start, node, dgram_socket, lookup_msg, lookupMessages, nextFreeIndex)) > 0) {
-        window_start += bytes_processed;
-    }
-    if (bytes_processed == -1) {
+/**
+ * HANDLE WRITABLE: Sends the reply bytes queued on a connection, once its socket is writable again.
+ *
+ * Once all are sent, the requests received meanwhile are handled. A lingering connection shuts down its sending side then.
+ *
+ * @param state A pointer to the connection_state structure of the connection.
+ * @param ctx The chord_context of the node.
+ *
+ * @return false if the connection has to be closed, true otherwise.
+ */
+bool handle_writable(struct connection_state* state, struct chord_context* ctx) {
+    size_t pending = state->out_length - state->out_sent;
+    if (!connection_flush(state)) {
+        perror("send");
         return false;
     }
-
-    state->end = buffer_discard(state->buffer, window_start - state->buffer, window_end - window_start);
-    return true;
+    if (state->out_length - state->out_sent < pending) {
+        connection_touch(state, &ctx->wheel);  // the client is reading
+    }
+    if (connection_pending(state) || state->paused || state->lingering) {
+        return true;
+    }
+    return process_buffer(state, state->end, ctx);
 }
@@ -1,7 +1,25 @@
 #ifndef STREAM_SOCK_H
 #define STREAM_SOCK_H
 
-bool handle_connection(struct connection_state* state, struct NetworkNodes node, int dgram_socket, DHTLookupMessage *lookup_msg, DHTLookupMessage lookupMessages[], int *nextFreeIndex);
+#include <stdbool.h>
 
+#include "chord_processor.h"
+#include "http.h"
 
-#endif
\ No newline at end of file
+#define CONNECTION_IDLE_TIMEOUT_MS 10000 // Keep-alive connections without traffic are closed after this time
+#define REQUEST_DEADLINE_MS 5000 // A started request must be received completely within this time
+#define ETAG_DIGEST_BYTES 16 // Bytes of the SHA-256 digest of a value forming its entity tag
+#define RETRY_AFTER_MS_HEADER "Retry-After-Ms" // Retry-After of a 503 in milliseconds, Retry-After itself only has whole seconds
+
+bool handle_connection(struct connection_state* state, struct chord_context* ctx);
+
+bool handle_writable(struct connection_state* state, struct chord_context* ctx);
+
+void connection_touch(struct connection_state* state, struct timer_wheel* wheel);
+
+void connection_resume(struct connection_state* state, struct chord_context* ctx);
+
+int format_unavailable(char* buffer, size_t size, const struct chord_context* ctx, bool close);
+
+
+#endif
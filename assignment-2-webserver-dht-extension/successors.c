@@ -0,0 +1,227 @@
+#include "successors.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "balance.h"
+#include "chord_processor.h"
+
+
+void node_encode(char* buffer, const struct NodeInfo* node) {
+    uint16_t id = htons(node->id);
+    uint16_t port = htons(node->port);
+    memcpy(buffer, &id, 2);
+    memcpy(buffer + 2, &node->ip, 4);
+    memcpy(buffer + 6, &port, 2);
+}
+
+
+struct NodeInfo node_decode(const char* buffer) {
+    struct NodeInfo node;
+    uint16_t id, port;
+    memcpy(&id, buffer, 2);
+    memcpy(&node.ip, buffer + 2, 4);
+    memcpy(&port, buffer + 6, 2);
+    node.id = ntohs(id);
+    node.port = ntohs(port);
+    return node;
+}
+
+
+bool node_same(const struct NodeInfo* a, const struct NodeInfo* b) {
+    return a->ip.s_addr == b->ip.s_addr && a->port == b->port;
+}
+
+
+struct NodeInfo node_self(const struct chord_context* ctx) {
+    return (struct NodeInfo) { .id = ctx->own_node.self_id, .ip = ctx->addr.sin_addr, .port = ntohs(ctx->addr.sin_port) };
+}
+
+
+void node_send(const struct chord_context* ctx, const struct NodeInfo* node, const char* buffer, size_t length) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = node->ip, .sin_port = htons(node->port) };
+    if (sendto(ctx->datagram_socket, buffer, length, 0, (const struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("sendto");
+    }
+}
+
+
+/**
+ * Make the first successor of the list the successor of the node, for routing and for lookups in flight.
+ */
+static void adopt_successor(struct chord_context* ctx) {
+    ctx->own_node.succ = ctx->successors.nodes[0];
+    ctx->pending_lookups.own_node.succ = ctx->successors.nodes[0];
+}
+
+
+static void send_heartbeat(struct chord_context* ctx) {
+    struct NodeInfo self = node_self(ctx);
+    char heartbeat[1 + SUCCESSOR_ENTRY_SIZE];
+    heartbeat[0] = DHT_HEARTBEAT_TYPE;
+    node_encode(heartbeat + 1, &self);
+    node_send(ctx, &ctx->own_node.succ, heartbeat, sizeof(heartbeat));
+}
+
+
+/**
+ * HEARTBEAT: Drops the successor if it stopped answering, and sends the next heartbeat.
+ *
+ * @param arg The chord_context of the node.
+ */
+static void heartbeat(void* arg) {
+    struct chord_context* ctx = arg;
+    struct successor_list* successors = &ctx->successors;
+    uint64_t now = monotonic_ms();
+
+    if (now - successors->acked_at > HEARTBEAT_TIMEOUT_MS && successors->n_nodes > 1) {
+        struct NodeInfo failed = successors->nodes[0];
+        fprintf(stderr, "Successor %u failed, failing over to %u\n", failed.id, successors->nodes[1].id);
+        successors->n_nodes -= 1;
+        memmove(successors->nodes, successors->nodes + 1, successors->n_nodes * sizeof(struct NodeInfo));
+        successors->failed = failed;
+        successors->failed_at = now;
+        successors->failovers += 1;
+        successors->acked_at = now;
+        adopt_successor(ctx);
+        forgetDHTreplies(ctx->lookupMessages, &ctx->nextFreeIndex, failed.ip, failed.port);
+    }
+    send_heartbeat(ctx);
+    timer_schedule(&ctx->wheel, &successors->heartbeat, HEARTBEAT_INTERVAL_MS, heartbeat, ctx);
+}
+
+
+void successors_init(struct chord_context* ctx, bool enabled) {
+    struct successor_list* successors = &ctx->successors;
+    successors->enabled = enabled;
+    successors->nodes[0] = ctx->own_node.succ;
+    successors->n_nodes = ctx->own_node.succ.port != 0;
+    successors->acked_at = monotonic_ms();
+    successors->pred_heard_at = monotonic_ms();
+    successors->failed = (struct NodeInfo) { 0 };
+    successors->failovers = 0;
+    // a node alone has no successor to watch
+    if (enabled && ctx->own_node.succ.port != 0) {
+        timer_schedule(&ctx->wheel, &successors->heartbeat, HEARTBEAT_INTERVAL_MS, heartbeat, ctx);
+    }
+}
+
+
+bool is_heartbeat_datagram(const char* buffer, size_t length) {
+    return length > 0 && ((uint8_t) buffer[0] == DHT_HEARTBEAT_TYPE || (uint8_t) buffer[0] == DHT_HEARTBEAT_ACK_TYPE);
+}
+
+
+/**
+ * Take the sender of a heartbeat as predecessor if it should be, like notify of Chord.
+ *
+ * Returns true if the range of the node changed.
+ */
+static bool notified(struct chord_context* ctx, const struct NodeInfo* sender) {
+    struct successor_list* successors = &ctx->successors;
+    uint64_t now = monotonic_ms();
+    struct NodeInfo* pred = &ctx->own_node.pred;
+    if (node_same(sender, pred)) {
+        // a predecessor that moved its ID changed the range of this node, the keys it took over are handed to it
+        bool moved = sender->id != pred->id;
+        uint16_t from = pred->id;
+        *pred = *sender;
+        ctx->pending_lookups.own_node.pred = *sender;
+        successors->pred_heard_at = now;
+        if (moved && ctx->balance.enabled) {
+            balance_pred_moved(ctx, from, sender->id);
+        }
+        return moved;
+    }
+    // the sender joined between the predecessor and this node, or the predecessor failed
+    bool between = sender->id != ctx->own_node.self_id && is_responsible_hashed(sender->id, ctx->own_node.self_id, pred->id);
+    if (between || now - successors->pred_heard_at > HEARTBEAT_TIMEOUT_MS) {
+        fprintf(stderr, "Predecessor is now %u\n", sender->id);
+        *pred = *sender;
+        ctx->pending_lookups.own_node.pred = *sender;
+        successors->pred_heard_at = now;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Take the sender of a heartbeat as predecessor if it should be, and answer with the predecessor, this node and its
+ * successors.
+ */
+static bool heartbeat_received(struct chord_context* ctx, const char* buffer, size_t length) {
+    struct successor_list* successors = &ctx->successors;
+    if (length != 1 + SUCCESSOR_ENTRY_SIZE) {
+        return false;
+    }
+    struct NodeInfo sender = node_decode(buffer + 1);
+    bool changed = successors->enabled && notified(ctx, &sender);
+
+    // The predecessor after the update: a node that joined in between the sender and this node is learned by the sender
+    struct NodeInfo self = node_self(ctx);
+    char ack[2 + (2 + SUCCESSOR_LIST_SIZE) * SUCCESSOR_ENTRY_SIZE];
+    ack[0] = DHT_HEARTBEAT_ACK_TYPE;
+    ack[1] = 1 + successors->n_nodes;
+    node_encode(ack + 2, &ctx->own_node.pred);
+    node_encode(ack + 2 + SUCCESSOR_ENTRY_SIZE, &self);
+    for (size_t i = 0; i < successors->n_nodes; i += 1) {
+        node_encode(ack + 2 + (2 + i) * SUCCESSOR_ENTRY_SIZE, &successors->nodes[i]);
+    }
+    node_send(ctx, &sender, ack, 2 + (2 + successors->n_nodes) * SUCCESSOR_ENTRY_SIZE);
+    return changed;
+}
+
+
+/**
+ * Take the successors of the successor answering a heartbeat as the next ones of the list.
+ *
+ * If the predecessor of the successor lies between this node and the successor, it joined there: it becomes the successor,
+ * like stabilize of Chord, and learns of this node by its next heartbeat.
+ */
+static bool heartbeat_acked(struct chord_context* ctx, const char* buffer, size_t length) {
+    struct successor_list* successors = &ctx->successors;
+    size_t count = length >= 2 ? (uint8_t) buffer[1] : 0;
+    if (count == 0 || length != 2 + (1 + count) * SUCCESSOR_ENTRY_SIZE) {
+        return false;
+    }
+    struct NodeInfo joined = node_decode(buffer + 2);
+    struct NodeInfo replier = node_decode(buffer + 2 + SUCCESSOR_ENTRY_SIZE);
+    if (!node_same(&replier, &successors->nodes[0])) {
+        return false;  // late answer of a successor dropped meanwhile
+    }
+
+    uint64_t now = monotonic_ms();
+    successors->acked_at = now;
+    bool moved = replier.id != successors->nodes[0].id;
+    struct NodeInfo self = node_self(ctx);
+    // the replier still names a successor dropped before as predecessor, until it times out there, too
+    bool failed = node_same(&joined, &successors->failed) && now - successors->failed_at <= 2 * HEARTBEAT_TIMEOUT_MS;
+    bool between = joined.port != 0 && !failed && !node_same(&joined, &self) && !node_same(&joined, &replier)
+        && joined.id != replier.id && is_responsible_hashed(joined.id, replier.id, self.id);
+    successors->n_nodes = 0;
+    if (between) {
+        fprintf(stderr, "Successor is now %u\n", joined.id);
+        successors->nodes[successors->n_nodes++] = joined;
+    }
+    for (size_t i = 0; i < count && successors->n_nodes < SUCCESSOR_LIST_SIZE; i += 1) {
+        struct NodeInfo node = node_decode(buffer + 2 + (1 + i) * SUCCESSOR_ENTRY_SIZE);
+        if (i > 0 && node_same(&node, &self)) {
+            break;  // around the ring
+        }
+        successors->nodes[successors->n_nodes++] = node;
+    }
+    adopt_successor(ctx);
+    // a successor that moved its ID or joined changed the ranges
+    return moved || between;
+}
+
+
+bool heartbeat_datagram(struct chord_context* ctx, const char* buffer, size_t length) {
+    if ((uint8_t) buffer[0] == DHT_HEARTBEAT_TYPE) {
+        return heartbeat_received(ctx, buffer, length);
+    }
+    return heartbeat_acked(ctx, buffer, length);
+}
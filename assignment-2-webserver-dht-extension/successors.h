@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "node.h"
+#include "timer_wheel.h"
+
+#define DHT_HEARTBEAT_TYPE 0x30       // first byte of a heartbeat to the successor, followed by the sender
+#define DHT_HEARTBEAT_ACK_TYPE 0x31   // first byte of the answer, followed by the number of nodes, the predecessor and the nodes
+#define SUCCESSOR_ENTRY_SIZE 8        // id, ip and port of a node on the wire
+#define SUCCESSOR_LIST_SIZE 4         // successors known, r
+#define HEARTBEAT_INTERVAL_MS 500
+#define HEARTBEAT_TIMEOUT_MS 1500     // a successor not answering for this long is considered failed, as is a silent predecessor
+
+struct chord_context;
+
+
+/**
+ * The next nodes on the ring, and whether they are alive
+ *
+ * Every `HEARTBEAT_INTERVAL_MS`, a heartbeat is sent to the first successor.
+ * It answers with itself and its own successors, which become the list. If it
+ * stays silent for `HEARTBEAT_TIMEOUT_MS`, it is dropped, and the next one
+ * takes its place right away. A node takes the sender of heartbeats as its
+ * predecessor if it lies between the predecessor and the node, or if the
+ * predecessor stopped sending heartbeats. The answer names the predecessor
+ * after that, too: if it lies between the node and its successor, it joined
+ * there and becomes the successor, as in stabilize and notify of Chord. A
+ * successor just dropped is not taken back that way, the next one still names
+ * it as predecessor until it times out there as well.
+ *
+ * `enabled`: heartbeats are sent and the neighbours are updated; unless NO_STABILIZE is set
+ * `nodes`: the successors, `n_nodes`, the first one is the successor of the node
+ * `acked_at`: when the successor last answered a heartbeat
+ * `pred_heard_at`: when the predecessor last sent a heartbeat
+ * `failed`: the successor dropped last, at `failed_at`
+ * `failovers`: successors dropped, counted for the metrics
+ */
+struct successor_list {
+    bool enabled;
+    struct NodeInfo nodes[SUCCESSOR_LIST_SIZE];
+    size_t n_nodes;
+    uint64_t acked_at;
+    uint64_t pred_heard_at;
+    struct NodeInfo failed;
+    uint64_t failed_at;
+    uint64_t failovers;
+    struct timer heartbeat;
+};
+
+
+/**
+ * Write the id, ip and port of `node` to `buffer`, `SUCCESSOR_ENTRY_SIZE` bytes.
+ */
+void node_encode(char* buffer, const struct NodeInfo* node);
+
+/**
+ * Read a node written by `node_encode()`.
+ */
+struct NodeInfo node_decode(const char* buffer);
+
+/**
+ * Whether `a` and `b` are the same node, i.e. have the same address; their ids may differ.
+ */
+bool node_same(const struct NodeInfo* a, const struct NodeInfo* b);
+
+/**
+ * This node.
+ */
+struct NodeInfo node_self(const struct chord_context* ctx);
+
+/**
+ * Send a datagram to `node` right away.
+ */
+void node_send(const struct chord_context* ctx, const struct NodeInfo* node, const char* buffer, size_t length);
+
+/**
+ * Start with the successor of `ctx`, and send heartbeats if `enabled`.
+ */
+void successors_init(struct chord_context* ctx, bool enabled);
+
+/**
+ * Whether a datagram of `length` bytes is a heartbeat or its answer.
+ */
+bool is_heartbeat_datagram(const char* buffer, size_t length);
+
+/**
+ * Answer or take a heartbeat datagram of another node.
+ *
+ * Returns true if the neighbours of this node changed.
+ */
+bool heartbeat_datagram(struct chord_context* ctx, const char* buffer, size_t length);
@@ -0,0 +1,333 @@
+#include <openssl/sha.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dht_client.h"
+
+/*
+ * Test of the client library against a ring of three nodes
+ *
+ * Run by ctest with the path of the webserver, which is started once per
+ * node. Every node only knows its neighbours, so a client learning the ring
+ * from the first node has to be redirected to the third one.
+ */
+
+#define TEST_HOST "127.0.0.1"
+#define TEST_NODES 3
+#define TEST_RETRIES 40  // attempts while a node is starting or looking a key up, 50 ms apart
+
+struct test_node {
+    uint16_t id;
+    uint16_t port;
+    pid_t pid;
+};
+
+static struct test_node nodes[TEST_NODES] = {
+    { .id = 0x4000, .port = 4731 },
+    { .id = 0x8000, .port = 4732 },
+    { .id = 0xc000, .port = 4733 },
+};
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures += 1; \
+        } \
+    } while (0)
+
+
+static void pause_briefly(void) {
+    nanosleep(&(struct timespec) { .tv_nsec = 50 * 1000 * 1000 }, NULL);
+}
+
+
+/**
+ * Start the nodes as a static ring, with heartbeats disabled.
+ */
+static bool start_nodes(const char* executable) {
+    for (size_t i = 0; i < TEST_NODES; i += 1) {
+        struct test_node* pred = &nodes[(i + TEST_NODES - 1) % TEST_NODES];
+        struct test_node* succ = &nodes[(i + 1) % TEST_NODES];
+        nodes[i].pid = fork();
+        if (nodes[i].pid == -1) {
+            perror("fork");
+            return false;
+        }
+        if (nodes[i].pid == 0) {
+            char id[8], port[8], pred_id[8], pred_port[8], succ_id[8], succ_port[8];
+            snprintf(id, sizeof(id), "%u", nodes[i].id);
+            snprintf(port, sizeof(port), "%u", nodes[i].port);
+            snprintf(pred_id, sizeof(pred_id), "%u", pred->id);
+            snprintf(pred_port, sizeof(pred_port), "%u", pred->port);
+            snprintf(succ_id, sizeof(succ_id), "%u", succ->id);
+            snprintf(succ_port, sizeof(succ_port), "%u", succ->port);
+            setenv("PRED_ID", pred_id, 1);
+            setenv("PRED_IP", TEST_HOST, 1);
+            setenv("PRED_PORT", pred_port, 1);
+            setenv("SUCC_ID", succ_id, 1);
+            setenv("SUCC_IP", TEST_HOST, 1);
+            setenv("SUCC_PORT", succ_port, 1);
+            setenv("NO_STABILIZE", "1", 1);
+            execl(executable, executable, TEST_HOST, port, id, (char*) NULL);
+            perror("execl");
+            _exit(1);
+        }
+    }
+
+    // Wait until every node accepts connections
+    for (size_t i = 0; i < TEST_NODES; i += 1) {
+        struct dht_client client;
+        int attempts = 0;
+        while (!dht_client_connect(&client, TEST_HOST, nodes[i].port)) {
+            if (++attempts == TEST_RETRIES) {
+                fprintf(stderr, "node at port %u did not start\n", nodes[i].port);
+                return false;
+            }
+            pause_briefly();
+        }
+        dht_client_close(&client);
+    }
+    return true;
+}
+
+
+static void stop_nodes(void) {
+    for (size_t i = 0; i < TEST_NODES; i += 1) {
+        if (nodes[i].pid > 0) {
+            kill(nodes[i].pid, SIGTERM);
+            waitpid(nodes[i].pid, NULL, 0);
+        }
+    }
+}
+
+
+/**
+ * Whether `key` is stored by `node`, i.e. its hash lies after the id of the predecessor up to the id of the node.
+ */
+static bool owned_by(const char* key, size_t node) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t*) key, strlen(key), digest);
+    uint16_t key_hash = digest[0] << 8 | digest[1];
+    uint16_t pred_id = nodes[(node + TEST_NODES - 1) % TEST_NODES].id;
+    uint16_t id = nodes[node].id;
+    return pred_id < id ? key_hash > pred_id && key_hash <= id : key_hash > pred_id || key_hash <= id;
+}
+
+
+/**
+ * Write the `skip`th key stored by `node` to `key`.
+ */
+static void key_of(size_t node, int skip, char* key, size_t size) {
+    for (int i = 0; ; i += 1) {
+        snprintf(key, size, "/client/%d", i);
+        if (owned_by(key, node) && skip-- == 0) {
+            return;
+        }
+    }
+}
+
+
+/**
+ * The node of the ring at the port of the `i`th test node, NULL if the ring does not know it.
+ */
+static struct dht_node* ring_find(struct dht_ring* ring, size_t i) {
+    for (size_t j = 0; j < ring->n_nodes; j += 1) {
+        if (ring->nodes[j].port == nodes[i].port) {
+            return &ring->nodes[j];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Whether the ring knows the range of the `i`th test node.
+ */
+static bool ring_knows(struct dht_ring* ring, size_t i) {
+    struct dht_node* node = ring_find(ring, i);
+    return node && node->has_range && node->id == nodes[i].id && node->pred_id == nodes[(i + TEST_NODES - 1) % TEST_NODES].id;
+}
+
+
+/**
+ * Requests sent on the connection to the `i`th test node so far; ids are counted up from 1.
+ */
+static uint32_t ring_sent(struct dht_ring* ring, size_t i) {
+    struct dht_node* node = ring_find(ring, i);
+    return node && node->client.sock != -1 ? node->client.next_id - 1 : 0;
+}
+
+
+/**
+ * Blocking requests on a single connection, and a 303 for a key of another node.
+ */
+static void test_client(void) {
+    char key[32], other[32];
+    key_of(0, 0, key, sizeof(key));
+    key_of(1, 0, other, sizeof(other));
+
+    struct dht_client client;
+    CHECK(dht_client_connect(&client, TEST_HOST, nodes[0].port));
+    char* value = NULL;
+    size_t value_length = 0;
+    CHECK(dht_get(&client, key, &value, &value_length) == 404);
+    CHECK(dht_put(&client, key, "value", 5) == 201);
+    CHECK(dht_put(&client, key, "changed", 7) == 204);
+    CHECK(dht_get(&client, key, &value, &value_length) == 200);
+    CHECK(value && value_length == 7 && memcmp(value, "changed", 7) == 0);
+    free(value);
+    value = NULL;
+    CHECK(dht_delete(&client, key) == 204);
+    CHECK(dht_delete(&client, key) == 404);
+
+    // The successor is known, its keys are redirected right away
+    struct dht_reply reply;
+    char address[32];
+    snprintf(address, sizeof(address), TEST_HOST ":%u", nodes[1].port);
+    CHECK(dht_client_send(&client, FRAME_GET, other, NULL, 0) != 0);
+    CHECK(dht_client_receive(&client, &reply));
+    CHECK(reply.status == 303 && reply.value_length == strlen(address) && memcmp(reply.value, address, reply.value_length) == 0);
+    dht_client_close(&client);
+}
+
+
+/**
+ * Pipelined requests are answered in order, with the ids they were sent with.
+ */
+static void test_pipelining(void) {
+    char first[32], second[32];
+    key_of(0, 1, first, sizeof(first));
+    key_of(0, 2, second, sizeof(second));
+
+    struct dht_client client;
+    CHECK(dht_client_connect(&client, TEST_HOST, nodes[0].port));
+    struct {
+        uint8_t op;
+        const char* key;
+        const char* value;
+        uint16_t status;
+        uint32_t id;
+    } requests[] = {
+        { FRAME_PUT, first, "one", 201, 0 },
+        { FRAME_PUT, second, "two", 201, 0 },
+        { FRAME_GET, first, NULL, 200, 0 },
+        { FRAME_DELETE, second, NULL, 204, 0 },
+        { FRAME_GET, second, NULL, 404, 0 },
+        { FRAME_DELETE, first, NULL, 204, 0 },
+    };
+    size_t n_requests = sizeof(requests) / sizeof(requests[0]);
+    for (size_t i = 0; i < n_requests; i += 1) {
+        const char* value = requests[i].value;
+        requests[i].id = dht_client_send(&client, requests[i].op, requests[i].key, value, value ? strlen(value) : 0);
+        CHECK(requests[i].id != 0);
+    }
+    for (size_t i = 0; i < n_requests; i += 1) {
+        struct dht_reply reply;
+        CHECK(dht_client_receive(&client, &reply));
+        CHECK(reply.id == requests[i].id && reply.op == requests[i].op && reply.status == requests[i].status);
+        if (requests[i].op == FRAME_GET && reply.status == 200) {
+            CHECK(reply.value_length == 3 && memcmp(reply.value, "one", 3) == 0);
+        }
+    }
+    dht_client_close(&client);
+}
+
+
+/**
+ * Put through the ring, retrying while the first node asked looks the key up.
+ */
+static int ring_put_retrying(struct dht_ring* ring, const char* key, const char* value) {
+    int status = 503;
+    for (int attempts = 0; status == 503 && attempts < TEST_RETRIES; attempts += 1) {
+        if (attempts) {
+            pause_briefly();
+        }
+        status = dht_ring_put(ring, key, value, strlen(value));
+    }
+    return status;
+}
+
+
+/**
+ * Routing of a ring: the first node names itself and its successor, the third node is learned from a redirect.
+ */
+static void test_ring(void) {
+    char own[32], next[32], last[32], last_other[32];
+    key_of(0, 3, own, sizeof(own));
+    key_of(1, 0, next, sizeof(next));
+    key_of(2, 0, last, sizeof(last));
+    key_of(2, 1, last_other, sizeof(last_other));
+
+    struct dht_ring ring;
+    CHECK(dht_ring_open(&ring, TEST_HOST, nodes[0].port));
+    CHECK(ring.n_nodes == 2 && ring_knows(&ring, 0) && ring_knows(&ring, 1));
+    CHECK(!ring_find(&ring, 2));
+
+    // Known ranges are asked directly
+    CHECK(dht_ring_put(&ring, own, "own", 3) == 201);
+    CHECK(dht_ring_put(&ring, next, "next", 4) == 201);
+    CHECK(ring_sent(&ring, 0) == 2 && ring_sent(&ring, 1) == 1);
+
+    // The range of the third node is unknown, the first node redirects once it looked the key up
+    CHECK(ring_put_retrying(&ring, last, "last") == 201);
+    CHECK(ring_knows(&ring, 2));
+
+    // After that one refresh, the third node is asked without a detour over the first one
+    uint32_t sent_first = ring_sent(&ring, 0), sent_last = ring_sent(&ring, 2);
+    CHECK(dht_ring_put(&ring, last_other, "other", 5) == 201);
+    char* value = NULL;
+    size_t value_length = 0;
+    CHECK(dht_ring_get(&ring, last, &value, &value_length) == 200);
+    CHECK(value && value_length == 4 && memcmp(value, "last", 4) == 0);
+    free(value);
+    value = NULL;
+    CHECK(ring_sent(&ring, 0) == sent_first && ring_sent(&ring, 2) == sent_last + 2);
+
+    // A stale range overlapping a refreshed one is dropped, its keys are redirected and refreshed again
+    struct dht_node* second = ring_find(&ring, 1);
+    second->pred_id = nodes[0].id;
+    second->id = nodes[2].id - 1;
+    CHECK(dht_ring_refresh(&ring, TEST_HOST, nodes[2].port));
+    CHECK(!second->has_range && ring_knows(&ring, 0) && ring_knows(&ring, 2));
+    CHECK(dht_ring_get(&ring, next, &value, &value_length) == 200);
+    CHECK(value && value_length == 4 && memcmp(value, "next", 4) == 0);
+    free(value);
+    value = NULL;
+    CHECK(ring_knows(&ring, 1));
+
+    CHECK(dht_ring_delete(&ring, own) == 204);
+    CHECK(dht_ring_delete(&ring, next) == 204);
+    CHECK(dht_ring_delete(&ring, last) == 204);
+    CHECK(dht_ring_delete(&ring, last_other) == 204);
+    CHECK(dht_ring_delete(&ring, last) == 404);
+    dht_ring_close(&ring);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <webserver>\n", argv[0]);
+        return 2;
+    }
+    if (!start_nodes(argv[1])) {
+        stop_nodes();
+        return 1;
+    }
+    test_client();
+    test_pipelining();
+    test_ring();
+    stop_nodes();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -1,6 +1,9 @@
 import contextlib
+import gzip
 import re
+import signal
 import socket
+import struct
 import time
 from http.client import HTTPConnection
 
@@ -194,3 +197,547 @@ def test_dynamic_content(webserver, port):
         response = conn.getresponse()
         payload = response.read()
         assert response.status == 404, f"'{path}' should be missing"
+
+
+def test_range_request(webserver, port):
+    """
+    Test partial content of a stored value can be requested
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        path = f'/dynamic/{randbytes(8).hex()}'
+        content = randbytes(2048).hex().encode()
+
+        conn.request('PUT', path, content)
+        response = conn.getresponse()
+        response.read()
+        assert response.status in {200, 201, 202, 204}, f"Creation of '{path}' did not yield '201'"
+
+        for header, expected in {
+            'bytes=0-9': content[:10],
+            'bytes=4000-': content[4000:],
+            'bytes=-16': content[-16:],
+        }.items():
+            conn.request('GET', path, headers={'Range': header})
+            response = conn.getresponse()
+            payload = response.read()
+            assert response.status == 206, f"Range '{header}' should yield '206'"
+            assert payload == expected, f"Range '{header}' returned the wrong bytes"
+
+        conn.request('GET', path, headers={'Range': f'bytes={len(content)}-'})
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 416, "Range behind the value should yield '416'"
+        assert response.headers['Content-Range'] == f'bytes */{len(content)}'
+
+        conn.request('GET', path, headers={'Range': 'bytes=18446744073709551617-'})
+        response = conn.getresponse()
+        payload = response.read()
+        assert response.status == 200, "Range with a position that overflows should be ignored"
+        assert payload == content
+
+
+def test_large_upload(webserver, port):
+    """
+    Test values larger than the request buffer can be stored, with and without chunked encoding
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        for chunked in [False, True]:
+            path = f'/dynamic/{randbytes(8).hex()}'
+            content = randbytes(256 * 1024)
+
+            if chunked:
+                chunks = [content[i:i + 10000] for i in range(0, len(content), 10000)]
+                conn.request('PUT', path, iter(chunks), encode_chunked=True)
+            else:
+                conn.request('PUT', path, content)
+            response = conn.getresponse()
+            response.read()
+            assert response.status in {200, 201, 202, 204}, f"Creation of '{path}' did not yield '201'"
+
+            conn.request('GET', path)
+            response = conn.getresponse()
+            payload = response.read()
+            assert response.status == 200
+            assert payload == content, f"Content of '{path}' does not match what was passed"
+
+
+def test_upload_too_large(webserver, port):
+    """
+    Test values beyond the memory budget are refused before their payload is sent, with and without chunked encoding
+    """
+
+    with webserver('127.0.0.1', f'{port}', env={'STORE_MEMORY_BUDGET': '32768'}):
+        for head in [b'Content-Length: 1000000000\r\n\r\n', b'Transfer-Encoding: chunked\r\n\r\n1000\r\n', b'Transfer-Encoding: chunked\r\n\r\n40000000\r\n']:
+            with contextlib.closing(socket.create_connection(('localhost', port), timeout=2)) as conn:
+                conn.sendall(b'PUT /dynamic/large HTTP/1.1\r\n' + head)
+                if head.endswith(b'1000\r\n'):
+                    # A chunk that fits, followed by one that does not
+                    conn.sendall(bytes(0x1000) + b'\r\n8000\r\n')
+                reply = conn.recv(1024)
+                assert reply.startswith(b'HTTP/1.1 413'), "Payload beyond the memory budget should be refused right away"
+
+        # A pair of a bulk load is refused once its head announces a value beyond the budget
+        key = b'/dynamic/large'
+        for head in [b'Content-Length: 10000000000\r\n\r\n', b'Transfer-Encoding: chunked\r\n\r\n14\r\n']:
+            with contextlib.closing(socket.create_connection(('localhost', port), timeout=2)) as conn:
+                conn.sendall(b'POST /bulk HTTP/1.1\r\n' + head + struct.pack('!HI', len(key), 0xffffffff) + key)
+                reply = conn.recv(1024)
+                assert reply.startswith(b'HTTP/1.1 413'), "Pairs beyond the memory budget should be refused right away"
+
+
+def test_ttl(webserver, port):
+    """
+    Test values stored with an `X-TTL` header expire
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        path = f'/dynamic/{randbytes(8).hex()}'
+        content = randbytes(32)
+
+        conn.request('PUT', path, content, headers={'X-TTL': '1'})
+        response = conn.getresponse()
+        response.read()
+        assert response.status in {200, 201, 202, 204}, f"Creation of '{path}' did not yield '201'"
+
+        conn.request('GET', path)
+        response = conn.getresponse()
+        assert response.status == 200
+        assert response.read() == content
+
+        time.sleep(1.5)
+
+        conn.request('GET', path)
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 404, f"'{path}' did not expire"
+
+
+def test_conditional_get(webserver, port):
+    """
+    Test unchanged values are not sent again to clients holding their entity tag
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        path = f'/dynamic/{randbytes(8).hex()}'
+        conn.request('PUT', path, b'first')
+        response = conn.getresponse()
+        response.read()
+        assert response.status in {200, 201, 202, 204}, f"Creation of '{path}' did not yield '201'"
+
+        conn.request('GET', path)
+        response = conn.getresponse()
+        assert response.read() == b'first'
+        etag = response.headers['ETag']
+        assert etag is not None, "Stored values should carry an 'ETag'"
+
+        conn.request('GET', path, headers={'If-None-Match': f'"other", {etag}'})
+        response = conn.getresponse()
+        assert response.read() == b''
+        assert response.status == 304, "A matching entity tag should yield '304'"
+        assert response.headers['ETag'] == etag
+
+        conn.request('PUT', path, b'second')
+        response = conn.getresponse()
+        response.read()
+
+        conn.request('GET', path, headers={'If-None-Match': etag})
+        response = conn.getresponse()
+        assert response.status == 200, "A changed value should be sent again"
+        assert response.read() == b'second'
+        assert response.headers['ETag'] != etag
+
+
+def test_compressed_content(webserver, port):
+    """
+    Test compressible values are returned intact, with and without gzip accepted
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        path = f'/dynamic/{randbytes(8).hex()}'
+        content = b'{"key": "value", "list": [1, 2, 3]}\n' * 200
+        conn.request('PUT', path, content)
+        response = conn.getresponse()
+        response.read()
+        assert response.status in {200, 201, 202, 204}, f"Creation of '{path}' did not yield '201'"
+
+        conn.request('GET', path)
+        response = conn.getresponse()
+        assert response.read() == content
+        assert response.headers['Content-Encoding'] is None, "Content should not be encoded unless accepted"
+        identity_etag = response.headers['ETag']
+
+        conn.request('GET', path, headers={'Accept-Encoding': 'gzip'})
+        response = conn.getresponse()
+        payload = response.read()
+        if response.headers['Content-Encoding'] == 'gzip':
+            assert len(payload) < len(content)
+            assert response.headers['ETag'] != identity_etag, "Encodings should have distinct entity tags"
+            payload = gzip.decompress(payload)
+        assert payload == content
+
+        conn.request('GET', path, headers={'Accept-Encoding': 'gzip', 'Range': 'bytes=0-9'})
+        response = conn.getresponse()
+        assert response.status == 206
+        assert response.read() == content[:10]
+
+
+def test_deduplication(webserver, port):
+    """
+    Test keys holding the same value share it, so more of them fit into the memory budget
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}', env={'STORE_MEMORY_BUDGET': '32768', 'STORE_DEDUP': '1'}
+    ), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        content = randbytes(1024)
+        paths = [f'/dynamic/{randbytes(8).hex()}' for _ in range(100)]
+        for path in paths:
+            conn.request('PUT', path, content)
+            response = conn.getresponse()
+            response.read()
+            assert response.status in {200, 201, 202, 204}, f"Creation of '{path}' did not yield '201'"
+
+        conn.request('DELETE', paths[0])
+        conn.getresponse().read()
+
+        for path in paths[1:]:
+            conn.request('GET', path)
+            response = conn.getresponse()
+            assert response.status == 200, f"'{path}' should not have been evicted"
+            assert response.read() == content
+
+
+def test_binary_protocol(webserver, port):
+    """
+    Test pipelined binary frames are answered in order, alongside HTTP on the same connection
+    """
+
+    head = struct.Struct('!BBHIHI')
+
+    def frame(op, id_, key=b'', value=b''):
+        return head.pack(0xB1, op, 0, id_, len(key), len(value)) + key + value
+
+    def receive(sock, buffer):
+        while len(buffer) < head.size:
+            buffer += sock.recv(4096)
+        magic, op, status, id_, key_length, value_length = head.unpack(buffer[:head.size])
+        assert magic == 0xB1
+        end = head.size + key_length + value_length
+        while len(buffer) < end:
+            buffer += sock.recv(4096)
+        key, value = buffer[head.size:head.size + key_length], buffer[head.size + key_length:end]
+        return (op, status, id_, key, value), buffer[end:]
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), socket.create_connection(('localhost', port), timeout=2) as sock:
+        large = randbytes(100_000)
+        sock.sendall(
+            frame(2, 1, b'/binary', b'value')
+            + frame(1, 2, b'/binary')
+            + frame(2, 3, b'/large', large)
+            + frame(4, 4, value=b'/binary\n/missing')
+            + frame(3, 5, b'/binary')
+            + frame(1, 6, b'/binary')
+            + frame(0x82, 7, b'/binary', b'value')  # unknown operation
+            + b'GET /large HTTP/1.1\r\n\r\n'
+        )
+
+        buffer = b''
+        for expected in [
+            (2, 201, 1, b'', b''),
+            (1, 200, 2, b'', b'value'),
+            (2, 201, 3, b'', b''),
+            (4, 200, 4, b'/binary', b'value'),
+            (4, 404, 4, b'/missing', b''),
+            (4, 200, 4, b'', b''),
+            (3, 204, 5, b'', b''),
+            (1, 404, 6, b'', b''),
+            (0x82, 501, 7, b'', b''),
+        ]:
+            reply, buffer = receive(sock, buffer)
+            assert reply == expected
+
+        while not buffer.endswith(large):
+            buffer += sock.recv(65536)
+        assert buffer.startswith(b'HTTP/1.1 200 OK'), "HTTP requests should be answered behind frames"
+
+
+def test_key_filter(webserver, port):
+    """
+    Test lookups of missing keys are answered by the key filter and counted in the metrics
+    """
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        paths = [f'/dynamic/{randbytes(8).hex()}' for _ in range(100)]
+        for path in paths:
+            conn.request('PUT', path, b'value')
+            conn.getresponse().read()
+        for path in paths[:50]:
+            conn.request('DELETE', path)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 204
+
+        for path in paths:
+            conn.request('GET', path)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == (404 if path in paths[:50] else 200), f"Filter answered '{path}' wrong"
+
+        conn.request('GET', '/metrics')
+        response = conn.getresponse()
+        assert response.status == 200
+        metrics = dict(line.split(' ') for line in response.read().decode().splitlines())
+
+    assert int(metrics['store_keys']) == 53, "Static and remaining keys should be stored"
+    negatives = int(metrics['store_filter_negatives_total'])
+    false_positives = int(metrics['store_filter_false_positives_total'])
+    assert negatives >= 40, "Most missing keys should be answered by the filter"
+    assert negatives + false_positives == 50, "Only reads of deleted keys should be counted, not the writes of new keys"
+
+
+def test_hotkeys(webserver, port):
+    """
+    Test the most requested keys are reported hottest first
+    """
+
+    with webserver('127.0.0.1', f'{port}'), contextlib.closing(
+        HTTPConnection('localhost', port, timeout=2)
+    ) as conn:
+        conn.connect()
+
+        requests = {'/static/foo': 50, '/static/bar': 20}
+        requests.update({f'/dynamic/{randbytes(8).hex()}': 1 for _ in range(100)})
+        for path, count in requests.items():
+            for _ in range(count):
+                conn.request('GET', path)
+                conn.getresponse().read()
+
+        conn.request('GET', '/hotkeys')
+        response = conn.getresponse()
+        assert response.status == 200
+        ranking = [line.split(' ', 1) for line in response.read().decode().splitlines()]
+
+        conn.request('GET', '/metrics')
+        response = conn.getresponse()
+        assert response.status == 200
+        metrics = dict(line.split(' ') for line in response.read().decode().splitlines())
+
+    assert [key for _, key in ranking[:2]] == ['/static/foo', '/static/bar'], "Most requested keys should be listed first"
+    assert int(ranking[0][0]) >= 50, "Counts should never be underestimated"
+    assert int(metrics['hotkeys_requests_total']) == sum(requests.values()), "Every request on a key should be counted"
+    assert int(metrics['hotkeys_hottest_requests']) == int(ranking[0][0])
+
+
+def test_admission_shedding(webserver, port):
+    """
+    Test new requests are shed with a 503 while they wait longer than the target, and admitted otherwise
+    """
+
+    with webserver('127.0.0.1', f'{port}', env={'ADMISSION_TARGET_MS': '5'}) as server, contextlib.ExitStack() as stack:
+        conns = [stack.enter_context(contextlib.closing(HTTPConnection('localhost', port, timeout=2))) for _ in range(8)]
+        for conn in conns:
+            conn.request('GET', '/static/foo')
+            assert conn.getresponse().read() == b'Foo'
+
+        # Requests queue while the server is stopped, the first round of delays starts the interval, the second exceeds it
+        statuses = []
+        for _ in range(2):
+            server.send_signal(signal.SIGSTOP)
+            for conn in conns:
+                conn.request('GET', '/static/foo')
+            time.sleep(.15)
+            server.send_signal(signal.SIGCONT)
+            responses = [conn.getresponse() for conn in conns]
+            statuses.append([response.status for response in responses])
+            for response in responses:
+                response.read()
+                if response.status == 503:
+                    assert response.headers['Retry-After-Ms'] == '250', "Retry should be estimated like for lookups"
+                    assert response.headers['Connection'] == 'close'
+
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            conn.request('GET', '/metrics')
+            metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+
+    assert statuses[0] == [200] * len(conns), "Requests should not be shed before the delay stays above the target for an interval"
+    assert 503 in statuses[1], "Requests should be shed once the delay stays above the target"
+    assert int(metrics['admission_shed_total']) == statuses[1].count(503)
+    assert metrics['admission_shedding'] == '0', "Shedding should stop once requests are handled within the target"
+
+
+def test_scheduler_budget(webserver, port):
+    """
+    Test pipelined requests beyond a connection's budget are deferred, but all answered in order
+    """
+
+    with webserver('127.0.0.1', f'{port}'), socket.create_connection(('localhost', port), timeout=2) as sock:
+        paths = ['/static/foo', '/static/bar', '/static/baz'] * 10
+        sock.sendall(b''.join(f'GET {path} HTTP/1.1\r\n\r\n'.encode() for path in paths))
+
+        replies = b''
+        while replies.count(b'HTTP/1.1') < len(paths):
+            data = sock.recv(65536)
+            assert data, "Connection closed before all requests were answered"
+            replies += data
+        assert replies.count(b'HTTP/1.1 200 OK') == len(paths)
+        assert re.findall(rb'\r\n\r\n(Foo|Bar|Baz)', replies) == [path[-3:].capitalize().encode() for path in paths], "Replies should keep the order of the requests"
+
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            conn.request('GET', '/metrics')
+            metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+
+    assert int(metrics['scheduler_deferred_total']) >= 1, "Requests beyond the budget should be deferred"
+    assert int(metrics['scheduler_data_us_total']) > 0
+    assert 'scheduler_control_us_total' in metrics
+
+
+def test_slow_reader(webserver, port):
+    """
+    Test a client not reading a large reply does not hold up other clients, and still gets all replies in order
+    """
+
+    content = randbytes(8 * 1024 * 1024)
+    with webserver('127.0.0.1', f'{port}'), socket.socket() as slow:
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            conn.request('PUT', '/dynamic/large', content)
+            assert conn.getresponse().status == 201
+
+        slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        slow.settimeout(2)
+        slow.connect(('localhost', port))
+        slow.sendall(b'GET /dynamic/large HTTP/1.1\r\n\r\nGET /static/foo HTTP/1.1\r\n\r\n')
+        time.sleep(0.2)
+
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            conn.request('GET', '/static/bar')
+            response = conn.getresponse()
+            assert response.status == 200, "Other clients should be served while a reply is queued"
+            assert response.read() == b'Bar'
+
+        replies = b''
+        while not replies.endswith(b'Foo'):
+            data = slow.recv(65536)
+            assert data, "Connection closed before all requests were answered"
+            replies += data
+        head, rest = replies.split(b'\r\n\r\n', 1)
+        assert head.startswith(b'HTTP/1.1 200 OK')
+        assert rest[:len(content)] == content, "The queued reply should be sent completely"
+        assert rest[len(content):].startswith(b'HTTP/1.1 200 OK'), "The next reply should follow it"
+
+
+@pytest.mark.parametrize('env', [{}, {'STORE_DEDUP': '1'}])
+def test_slow_reader_value_changed(webserver, port, env):
+    """
+    Test a value queued for a client not reading is not copied, and still sent as it was when the key is overwritten
+    """
+
+    def memory(conn):
+        conn.request('GET', '/metrics')
+        metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+        return int(metrics['store_memory_bytes'])
+
+    content = randbytes(8 * 1024 * 1024)
+    with webserver('127.0.0.1', f'{port}', env=env), socket.socket() as slow, \
+            contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+        conn.request('PUT', '/dynamic/large', content)
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 201
+
+        slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        slow.settimeout(2)
+        slow.connect(('localhost', port))
+        slow.sendall(b'GET /dynamic/large HTTP/1.1\r\n\r\n')
+        time.sleep(0.2)
+
+        conn.request('PUT', '/dynamic/large', b'New')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 204
+        assert memory(conn) >= len(content), "A value still being sent should stay accounted for"
+        conn.request('DELETE', '/dynamic/large')
+        conn.getresponse().read()
+
+        reply = b''
+        head_length = None
+        while head_length is None or len(reply) < head_length + len(content):
+            data = slow.recv(65536)
+            assert data, "Connection closed before the reply was sent"
+            reply += data
+            if head_length is None and b'\r\n\r\n' in reply:
+                head_length = reply.index(b'\r\n\r\n') + 4
+        assert reply.startswith(b'HTTP/1.1 200 OK')
+        assert reply[head_length:] == content, "The value should be sent as it was when requested"
+
+        time.sleep(0.1)
+        assert memory(conn) < len(content), "The value should be freed once it is sent"
+
+
+def test_hot_restart(webserver, port, tmp_path):
+    """
+    Test a restarted server takes over the listening socket and the store, and the old one exits once drained
+    """
+
+    env = {'HOT_RESTART_SOCKET': str(tmp_path / 'restart.sock')}
+    with webserver('127.0.0.1', f'{port}', env=env) as old:
+        with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+            conn.request('PUT', '/dynamic/kept', body=b'Kept')
+            assert conn.getresponse().status == 201
+
+        # Answered once, so the old server accepted it rather than leaving it in the backlog
+        idle = socket.create_connection(('localhost', port), timeout=2)
+        idle.sendall(b'GET /dynamic/kept HTTP/1.1\r\n\r\n')
+        assert idle.recv(1024).startswith(b'HTTP/1.1 200')
+        with webserver('127.0.0.1', f'{port}', env=env) as new:
+            assert old.wait(timeout=2) == 0, "The old server should exit after the handoff"
+            assert idle.recv(1024) == b'', "Idle connections should be closed by the old server"
+            idle.close()
+
+            with contextlib.closing(HTTPConnection('localhost', port, timeout=2)) as conn:
+                conn.request('GET', '/dynamic/kept')
+                response = conn.getresponse()
+                assert response.status == 200
+                assert response.read() == b'Kept', "The store should be handed over"
+            assert new.poll() is None
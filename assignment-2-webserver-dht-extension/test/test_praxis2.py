@@ -1,4 +1,5 @@
 import contextlib
+import socket
 import struct
 import time
 import urllib.request as req
@@ -30,10 +31,11 @@ def _iter_with_neighbors(xs):
 def static_peer(request):
     """Return a function for spawning DHT peers
     """
-    def runner(peer, predecessor=None, successor=None):
+    def runner(peer, predecessor=None, successor=None, env=None):
         """Spawn a static DHT peer
 
-        The peer is passed its local neighborhood via environment variables.
+        The peer is passed its local neighborhood via environment variables,
+        along with any further variables in `env`.
         """
         return util.KillOnExit(
             [request.config.getoption('executable'), peer.ip, f'{peer.port}'] + ([f'{peer.id}'] if peer.id is not None else []),
@@ -41,6 +43,7 @@ def static_peer(request):
                 **({'PRED_ID': f'{predecessor.id}', 'PRED_IP': predecessor.ip, 'PRED_PORT': f'{predecessor.port}'} if predecessor is not None else {}),
                 **({'SUCC_ID': f'{successor.id}', 'SUCC_IP': successor.ip, 'SUCC_PORT': f'{successor.port}'} if successor is not None else {}),
                 'NO_STABILIZE': '1',  # Forward compatibility with P3.
+                **(env or {}),
             },
         )
 
@@ -201,6 +204,42 @@ def test_lookup_forward(static_peer):
         assert received == lookup, "Received message should be equal to original lookup"
 
 
+def test_lookup_batch(static_peer):
+    """Test whether peer handles lookups batched in one datagram
+
+    Replies for the same node are batched again, a single message keeps the plain format.
+    """
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(
+        predecessor
+    ) as pred_mock, static_peer(
+        self, predecessor, successor
+    ), dht.peer_socket(
+        successor
+    ) as succ_mock:
+        lookups = [dht.Message(dht.Flags.lookup, id_, predecessor) for id_ in (0x0800, 0x1800, 0x2800)]
+        batch = struct.pack("!BB", 0xb2, 1) + bytes([len(lookups)]) + b''.join(dht.serialize(lookup) for lookup in lookups)
+        pred_mock.sendto(batch, (self.ip, self.port))
+
+        time.sleep(.1)
+
+        data = succ_mock.recv(1024)
+        assert len(data) == struct.calcsize(dht.message_format), "Forwarded lookup should be a single message"
+        assert dht.deserialize(data) == lookups[2], "Forwarded lookup should be equal to original lookup"
+
+        data = pred_mock.recv(1024)
+        size = struct.calcsize(dht.message_format)
+        assert data[:3] == bytes([0xb2, 1, 2]), "Replies should be batched in one datagram"
+        assert len(data) == 3 + 2 * size, "Batch has invalid length for two DHT messages"
+        replies = [dht.deserialize(data[3 + i * size:3 + (i + 1) * size]) for i in range(2)]
+        assert replies[0].peer == self and replies[0].id == predecessor.id, "First reply should indicate implementation"
+        assert replies[1].peer == successor and replies[1].id == self.id, "Second reply should indicate successor"
+
+
 @pytest.mark.parametrize("uri", ['a', 'b'])
 def test_lookup_complete(static_peer, uri, timeout):
     """Test for correct lookup use
@@ -322,3 +361,713 @@ def test_dht(static_peer):
             util.urlopen(f'http://{contact.ip}:{contact.port}/dynamic/{datum}')
 
         assert exception_info.value.status == 404, f"'/dynamic/{datum}' should be missing, but GET was not answered with '404'"
+
+
+def test_lookup_retransmit(static_peer, timeout):
+    """Test that an unanswered lookup is retransmitted with backoff
+
+    The successor never replies, so the peer should resend the same lookup
+    with growing intervals and must not send a new one for a repeated request.
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+
+    with dht.peer_socket(successor) as mock, static_peer(
+        self, predecessor, successor
+    ), contextlib.closing(
+        HTTPConnection(self.ip, self.port, timeout)
+    ) as conn:
+        for _ in range(2):
+            conn.request('GET', '/a')
+            response = conn.getresponse()
+            _ = response.read()
+            assert response.status == 503, "Server should reply with 503"
+
+        time.sleep(1)
+
+        lookups = []
+        while util.bytes_available(mock) > 0:
+            lookups.append(dht.deserialize(mock.recv(1024)))
+
+        assert len(lookups) == 3, "Lookup should be sent once and retransmitted after 250ms and 750ms"
+        for msg in lookups:
+            assert msg == dht.Message(dht.Flags.lookup, dht.hash(b'/a'), self), "Retransmit should repeat the lookup"
+
+
+@pytest.mark.parametrize("uri", ['a', 'c'])
+def test_expect_continue(static_peer, uri):
+    """Test that a payload is only requested by the responsible peer
+
+    A PUT with 'Expect: 100-continue' should get '100 Continue' from the
+    responsible peer, and a 303 without any payload being sent otherwise.
+    """
+
+    predecessor = dht.Peer(0xc000, '127.0.0.1', 4712)
+    self = dht.Peer(0x4000, '127.0.0.1', 4711)
+    successor = predecessor
+
+    with dht.peer_socket(successor), static_peer(
+        self, predecessor, successor,
+    ), socket.create_connection((self.ip, self.port), timeout=2) as conn:
+        content = util.randbytes(100000)
+        conn.send(f'PUT /{uri} HTTP/1.1\r\nContent-Length: {len(content)}\r\nExpect: 100-continue\r\n\r\n'.encode())
+        reply = conn.recv(1024)
+
+        uri_hash = dht.hash(f'/{uri}'.encode('latin1'))
+        if not self.id < uri_hash <= successor.id:
+            assert reply.startswith(b'HTTP/1.1 100 '), "Responsible peer should ask for the payload"
+            conn.sendall(content)
+            reply = conn.recv(1024)
+            assert reply.startswith(b'HTTP/1.1 201 '), "Payload should have been stored"
+        else:
+            assert reply.startswith(b'HTTP/1.1 303 '), "Server should've delegated the upload right away"
+            assert f'Location: http://{successor.ip}:{successor.port}/{uri}'.encode() in reply
+
+
+def test_batch(static_peer):
+    """Test a batch GET spanning a complete DHT
+
+    Values are stored on their responsible peers, then fetched with a single
+    batch request to one peer, which has to collect them from all others.
+    """
+
+    dht_ids = [10927, 18804, 40809, 54536, 63901]
+    peers = [
+        dht.Peer(id_, '127.0.0.1', 4710 + i)
+        for i, id_
+        in enumerate(dht_ids)
+    ]
+
+    with contextlib.ExitStack() as contexts:
+        for predecessor, peer, successor in _iter_with_neighbors(peers):
+            contexts.enter_context(static_peer(
+                peer, predecessor, successor
+            ))
+
+        contents = {f'/dynamic/{util.randbytes(8).hex()}': util.randbytes(32) for _ in range(20)}
+        for key, content in contents.items():
+            # Store each value on its responsible peer directly
+            responsible = next(
+                peer for predecessor, peer, _ in _iter_with_neighbors(peers)
+                if dht.hash(key.encode('latin1')) in range(predecessor.id + 1, peer.id + 1)
+                or (predecessor.id > peer.id and not peer.id < dht.hash(key.encode('latin1')) <= predecessor.id)
+            )
+            reply = util.urlopen(req.Request(f'http://{responsible.ip}:{responsible.port}{key}', data=content, method='PUT'))
+            assert reply.status == 201
+
+        keys = list(contents) + ['/dynamic/missing']
+        contact = peers[0]
+        with contextlib.closing(HTTPConnection(contact.ip, contact.port, timeout=5)) as conn:
+            conn.request('POST', '/batch', '\n'.join(keys).encode())
+            response = conn.getresponse()
+            assert response.status == 200
+            payload = response.read()
+
+        for key in keys:
+            line, _, payload = payload.partition(b'\r\n')
+            status, length, frame_key = line.decode().split(' ', 2)
+            assert frame_key == key, "Keys should be answered in request order"
+            value, payload = payload[:int(length)], payload[int(length) + 2:]
+            if key in contents:
+                assert status == '200', f"'{key}' should have been found"
+                assert value == contents[key], f"Content of '{key}' does not match what was passed"
+            else:
+                assert status == '404', f"'{key}' should be missing"
+        assert payload == b''
+
+
+def test_bulk(static_peer):
+    """Test a bulk load spanning a complete DHT
+
+    Pairs are loaded through a single peer, which stores its own and forwards
+    all others to their responsible peers.
+    """
+
+    dht_ids = [10927, 18804, 40809, 54536, 63901]
+    peers = [
+        dht.Peer(id_, '127.0.0.1', 4710 + i)
+        for i, id_
+        in enumerate(dht_ids)
+    ]
+
+    with contextlib.ExitStack() as contexts:
+        for predecessor, peer, successor in _iter_with_neighbors(peers):
+            contexts.enter_context(static_peer(
+                peer, predecessor, successor
+            ))
+
+        contents = {f'/dynamic/{util.randbytes(8).hex()}': util.randbytes(64) for _ in range(200)}
+        payload = b''.join(
+            struct.pack('!HI', len(key), len(content)) + key.encode() + content
+            for key, content in contents.items()
+        )
+
+        contact = peers[0]
+        with contextlib.closing(HTTPConnection(contact.ip, contact.port, timeout=5)) as conn:
+            conn.request('POST', '/bulk', payload, {'X-Bulk-Count': str(len(contents))})
+            response = conn.getresponse()
+            assert response.status == 200
+            report = dict(line.split(' ') for line in response.read().decode().splitlines())
+        assert int(report['failed']) == 0
+        assert int(report['stored']) + int(report['forwarded']) == len(contents)
+
+        for key, content in contents.items():
+            responsible = next(
+                peer for predecessor, peer, _ in _iter_with_neighbors(peers)
+                if dht.hash(key.encode('latin1')) in range(predecessor.id + 1, peer.id + 1)
+                or (predecessor.id > peer.id and not peer.id < dht.hash(key.encode('latin1')) <= predecessor.id)
+            )
+            reply = util.urlopen(f'http://{responsible.ip}:{responsible.port}{key}')
+            assert reply.status == 200
+            assert reply.read() == content, f"Content of '{key}' does not match what was loaded"
+
+
+def test_ring(static_peer):
+    """Test the ring topology known to a peer
+
+    Lists the peer itself and its successor with the ranges they are responsible for.
+    """
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with static_peer(self, predecessor, successor):
+        reply = util.urlopen(f'http://{self.ip}:{self.port}/ring')
+        assert reply.status == 200
+        lines = reply.read().decode().splitlines()
+
+    assert lines == [
+        f'{predecessor.id} {self.id} {self.ip} {self.port}',
+        f'{self.id} {successor.id} {successor.ip} {successor.port}',
+    ], "Topology should list the peer and its successor"
+
+
+def test_owned_keys(static_peer):
+    """Test keys are counted by the range of the ring they lie in
+
+    Keys of other peers are repaired from a replica of the whole ring, only
+    those in the peer's own range wrapping around zero count as owned.
+    """
+
+    predecessor = dht.Peer(0xc000, '127.0.0.1', 4710)
+    self = dht.Peer(0x4000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x8000, '127.0.0.1', 4712)
+    replica = dht.Peer(None, '127.0.0.1', 4713)  # alone, responsible for every key
+
+    keys = ['/static/foo', '/static/bar', '/static/baz'] + [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(300)]
+
+    with static_peer(self, predecessor, successor), static_peer(replica):
+        with contextlib.closing(HTTPConnection(replica.ip, replica.port, timeout=2)) as conn:
+            for key in keys[3:]:
+                conn.request('PUT', key, b'v')
+                conn.getresponse().read()
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=5)) as conn:
+            conn.request('POST', '/repair', f'{replica.ip}:{replica.port} 0 0'.encode())
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 200
+
+        reply = util.urlopen(f'http://{self.ip}:{self.port}/metrics')
+        metrics = dict(line.split(' ') for line in reply.read().decode().splitlines())
+
+    owned = [key for key in keys if not self.id < dht.hash(key.encode()) <= predecessor.id]
+    assert int(metrics['store_keys']) == len(keys)
+    assert int(metrics['store_keys_owned']) == len(owned), "Keys in the peer's range should be counted"
+
+
+def test_repair(static_peer):
+    """Test a peer repairs its range from a replica
+
+    Keys missing or differing are fetched, keys outside the range are not.
+    """
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    replica = dht.Peer(0x1000, '127.0.0.1', 4712)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4713)
+
+    candidates = [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(10_000)]
+    keys = [key for key in candidates if predecessor.id < dht.hash(key.encode()) <= self.id][:60]
+    outside = next(key for key in candidates if dht.hash(key.encode()) > successor.id).encode()
+    contents = {key: util.randbytes(32) for key in keys}
+
+    # The replica's range reaches around to the successor, it holds keys beyond this peer's range
+    with static_peer(self, predecessor, successor), static_peer(replica, successor, successor):
+        with contextlib.closing(HTTPConnection(replica.ip, replica.port, timeout=2)) as conn:
+            for key, content in contents.items():
+                conn.request('PUT', key, content)
+                conn.getresponse().read()
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            for key in keys[:20]:
+                conn.request('PUT', key, contents[key])
+                conn.getresponse().read()
+            for key in keys[20:30]:
+                conn.request('PUT', key, b'stale')
+                conn.getresponse().read()
+
+        # Stored on the replica, but outside the range
+        with contextlib.closing(HTTPConnection(replica.ip, replica.port, timeout=2)) as conn:
+            conn.request('PUT', outside.decode(), b'v')
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 201
+
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=5)) as conn:
+            conn.request('POST', '/repair', f'{replica.ip}:{replica.port}'.encode())
+            response = conn.getresponse()
+            assert response.status == 200
+            report = dict(line.split(' ') for line in response.read().decode().splitlines())
+            assert int(report['repaired']) == 40, "Missing and differing keys should be repaired"
+            assert int(report['failed']) == 0
+
+            for key, content in contents.items():
+                conn.request('GET', key)
+                response = conn.getresponse()
+                assert response.read() == content, f"'{key}' should have been repaired"
+
+            conn.request('GET', '/metrics')
+            metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+            assert int(metrics['store_keys']) == 3 + len(keys), "Keys outside the range should not be repaired"
+
+
+def test_near_cache(static_peer):
+    """Test a peer serves a hot value of its successor and drops it once it changes
+    """
+
+    self = dht.Peer(0x4000, '127.0.0.1', 4710)
+    successor = dht.Peer(0xC000, '127.0.0.1', 4711)
+    key = next(key for key in (f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000))
+               if self.id < dht.hash(key.encode()) <= successor.id)
+
+    with static_peer(self, successor, successor, env={'NEAR_CACHE_BUDGET': '65536'}), static_peer(successor, self, self):
+        with contextlib.closing(HTTPConnection(successor.ip, successor.port, timeout=2)) as conn:
+            conn.request('PUT', key, b'old')
+            conn.getresponse().read()
+
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            for _ in range(20):
+                conn.request('GET', key)
+                conn.getresponse().read()
+            time.sleep(0.2)
+            conn.request('GET', key)
+            response = conn.getresponse()
+            assert response.status == 200, "Hot value of the successor should be cached"
+            assert response.read() == b'old'
+
+        with contextlib.closing(HTTPConnection(successor.ip, successor.port, timeout=2)) as conn:
+            conn.request('PUT', key, b'new')
+            conn.getresponse().read()
+        time.sleep(0.2)
+
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            conn.request('GET', key)
+            response = conn.getresponse()
+            assert response.read() != b'old', "Changed value should not be served from the cache"
+            time.sleep(0.2)
+            conn.request('GET', key)
+            response = conn.getresponse()
+            assert response.status == 200, "Changed value should be fetched again"
+            assert response.read() == b'new'
+
+            conn.request('GET', '/metrics')
+            metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+            assert int(metrics['near_cache_invalidations_total']) == 1
+
+
+def test_near_fetch_timeout(static_peer):
+    """Test fetches of a near cache from an owner that never answers time out and free their slots
+    """
+
+    self = dht.Peer(0x4000, '127.0.0.1', 4710)
+    owner = dht.Peer(0xC000, '127.0.0.1', 4711)
+    candidates = [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000)]
+    keys = [key for key in candidates if self.id < dht.hash(key.encode()) <= owner.id][:9]
+
+    def make_hot(key):
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            for _ in range(20):
+                conn.request('GET', key)
+                conn.getresponse().read()
+
+    with socket.create_server((owner.ip, owner.port)) as silent, \
+            static_peer(self, owner, owner, env={'NEAR_CACHE_BUDGET': '65536'}):
+        silent.settimeout(2)
+        fetches = []
+        for key in keys[:8]:
+            make_hot(key)
+            fetch, _ = silent.accept()
+            fetches.append(fetch)
+            assert fetch.recv(4096).startswith(f'GET {key} '.encode())
+
+        # Every fetch slot is taken by now, until the fetches time out
+        time.sleep(5.5)
+        for fetch in fetches:
+            fetch.settimeout(1)
+            assert fetch.recv(4096) == b'', "Unanswered fetches should be given up"
+            fetch.close()
+
+        make_hot(keys[8])
+        fetch, _ = silent.accept()
+        with fetch:
+            assert fetch.recv(4096).startswith(f'GET {keys[8]} '.encode()), "Slots of given up fetches should be reused"
+
+
+def test_udp_values(static_peer):
+    """Test a peer answers GETs of keys of other peers with the value fetched over UDP
+    """
+
+    udp_values = {'UDP_VALUES': '1'}
+    self = dht.Peer(0x4000, '127.0.0.1', 4710)
+    successor = dht.Peer(0x8000, '127.0.0.1', 4711)
+    owner = dht.Peer(0xC000, '127.0.0.1', 4712)
+    candidates = [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000)]
+    small, large, missing = [key for key in candidates if successor.id < dht.hash(key.encode()) <= owner.id][:3]
+
+    with static_peer(self, owner, successor, env=udp_values), static_peer(successor, self, owner, env=udp_values), \
+            static_peer(owner, successor, self, env=udp_values):
+        with contextlib.closing(HTTPConnection(owner.ip, owner.port, timeout=2)) as conn:
+            conn.request('PUT', small, b'small')
+            conn.getresponse().read()
+            conn.request('PUT', large, b'x' * 2000)
+            conn.getresponse().read()
+
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            conn.request('GET', small)
+            response = conn.getresponse()
+            assert response.status == 200, "Small value should be fetched over UDP"
+            assert response.read() == b'small'
+
+            for headers in [{'Range': 'bytes=0-1'}, {'If-None-Match': '"etag"'}]:
+                conn.request('GET', small, headers=headers)
+                response = conn.getresponse()
+                response.read()
+                # Redirected to the owner, or looked up again once the route was used up
+                assert response.status in (303, 503), "Partial and conditional GETs should be left to the owner"
+
+            conn.request('GET', missing)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 404
+
+            conn.request('GET', large)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 303, "Large value should be fetched from the owner"
+            assert response.getheader('Location') == f'http://{owner.ip}:{owner.port}{large}'
+
+
+def test_fetch_no_amplification(static_peer):
+    """Test a fetch naming an unknown origin is answered with no more bytes than it had
+    """
+
+    self = dht.Peer(None, '127.0.0.1', 4710)  # alone, responsible for every key
+    victim = dht.Peer(None, '127.0.0.1', 4711)
+    key = b'/dynamic/large'
+
+    with static_peer(self, env={'UDP_VALUES': '1'}), dht.peer_socket(victim, timeout=1) as target, \
+            socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as attacker:
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            conn.request('PUT', key.decode(), b'x' * 1000)
+            conn.getresponse().read()
+
+        fetch = struct.pack('!BI4sHBH', 0x20, 1, socket.inet_aton(victim.ip), victim.port, 0, len(key)) + key
+        attacker.sendto(fetch, (self.ip, self.port))
+        reply = target.recv(2048)
+        assert len(reply) <= len(fetch), "Replies to unknown origins should not be larger than the fetch"
+        assert reply[0] == 0x21 and struct.unpack('!H', reply[5:7])[0] == 303, "The value should be left out"
+
+
+def test_successor_failover(static_peer):
+    """Test a peer fails over to the next successor once its successor stops answering heartbeats
+    """
+
+    stabilize = {'NO_STABILIZE': '0'}
+    self = dht.Peer(0x4000, '127.0.0.1', 4710)
+    successor = dht.Peer(0x8000, '127.0.0.1', 4711)
+    next_successor = dht.Peer(0xC000, '127.0.0.1', 4712)
+    key = next(key for key in (f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000))
+               if self.id < dht.hash(key.encode()) <= successor.id)
+
+    with static_peer(self, next_successor, successor, env=stabilize), \
+            static_peer(next_successor, successor, self, env=stabilize):
+        with static_peer(successor, self, next_successor, env=stabilize):
+            time.sleep(1)
+            with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+                conn.request('GET', '/metrics')
+                metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+                assert int(metrics['successor_list_size']) == 2, "Successors of the successor should be learned"
+
+        time.sleep(2.5)
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            conn.request('GET', key)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 303
+            assert response.getheader('Location') == f'http://{next_successor.ip}:{next_successor.port}{key}', \
+                "Failed successor should be replaced by the next one"
+
+            conn.request('GET', '/metrics')
+            metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+            assert int(metrics['successor_failovers_total']) == 1
+
+        with contextlib.closing(HTTPConnection(next_successor.ip, next_successor.port, timeout=2)) as conn:
+            conn.request('GET', key)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 404, "Next successor should take over the range of the failed one"
+
+
+def test_join_stabilize(static_peer):
+    """Test a peer joining between two peers becomes the successor of the one before it
+    """
+
+    stabilize = {'NO_STABILIZE': '0'}
+    self = dht.Peer(0x4000, '127.0.0.1', 4710)
+    joining = dht.Peer(0x8000, '127.0.0.1', 4711)
+    successor = dht.Peer(0xC000, '127.0.0.1', 4712)
+    key = next(key for key in (f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000))
+               if self.id < dht.hash(key.encode()) <= joining.id)
+
+    with static_peer(self, successor, successor, env=stabilize), static_peer(successor, self, self, env=stabilize):
+        time.sleep(.2)
+        with static_peer(joining, self, successor, env=stabilize):
+            time.sleep(1.5)
+            with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+                conn.request('GET', key)
+                response = conn.getresponse()
+                response.read()
+                assert response.status == 303
+                assert response.getheader('Location') == f'http://{joining.ip}:{joining.port}{key}', \
+                    "The joined peer should become the successor"
+
+                conn.request('GET', '/metrics')
+                metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+                assert int(metrics['successor_list_size']) == 2, "The old successor should follow the joined one"
+
+
+def test_load_balance(static_peer):
+    """Test an overloaded peer hands over part of its range to its predecessor
+    """
+
+    stabilize = {'NO_STABILIZE': '0'}
+    predecessor = dht.Peer(0x4000, '127.0.0.1', 4710)
+    self = dht.Peer(0xC000, '127.0.0.1', 4711)
+    candidates = [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000)]
+    keys = [key for key in candidates if predecessor.id < dht.hash(key.encode()) <= self.id][:40]
+
+    with static_peer(predecessor, self, self, env=stabilize), static_peer(self, predecessor, predecessor, env=stabilize):
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            for key in keys:
+                conn.request('PUT', key, key.encode())
+                conn.getresponse().read()
+
+            deadline = time.monotonic() + 4
+            while time.monotonic() < deadline:
+                conn.request('GET', keys[0])
+                conn.getresponse().read()
+            time.sleep(0.5)
+
+            conn.request('GET', '/metrics')
+            metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+            assert int(metrics['balance_migrations_total']) == 1, "Overloaded peer should hand over part of its range"
+            assert int(metrics['balance_keys_migrated_total']) > 0
+
+        with contextlib.closing(HTTPConnection(predecessor.ip, predecessor.port, timeout=2)) as conn:
+            conn.request('GET', '/ring')
+            moved_to = int(conn.getresponse().read().decode().split()[1])
+            assert predecessor.id < moved_to < self.id, "Predecessor should have moved its ID forward"
+
+            moved = [key for key in keys if dht.hash(key.encode()) <= moved_to]
+            assert moved
+            for key in moved:
+                conn.request('GET', key)
+                response = conn.getresponse()
+                assert response.status == 200, f"'{key}' should be served by the predecessor"
+                assert response.read() == key.encode()
+
+        with contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+            for key in set(keys) - set(moved):
+                conn.request('GET', key)
+                response = conn.getresponse()
+                assert response.status == 200, f"'{key}' should still be served by the peer"
+                assert response.read() == key.encode()
+
+
+def test_load_balance_lost_answer(static_peer):
+    """Test a move whose answer is lost is asked again, learned by the heartbeat, and its keys handed over until taken
+    """
+
+    stabilize = {'NO_STABILIZE': '0'}
+    predecessor = dht.Peer(0x4000, '127.0.0.1', 4710)
+    self = dht.Peer(0xC000, '127.0.0.1', 4711)
+    candidates = [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000)]
+    keys = [key for key in candidates if predecessor.id < dht.hash(key.encode()) <= self.id][:40]
+
+    def node(peer, id_):
+        return struct.pack('!H4sH', id_, socket.inet_aton(peer.ip), peer.port)
+
+    with dht.peer_socket(predecessor, timeout=0.1) as mock, \
+            contextlib.closing(socket.socket(socket.AF_INET, socket.SOCK_STREAM)) as listener, \
+            static_peer(self, predecessor, predecessor, env=stabilize), \
+            contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind((predecessor.ip, predecessor.port))
+        listener.listen()
+        listener.settimeout(3)
+        for key in keys:
+            conn.request('PUT', key, key.encode())
+            conn.getresponse().read()
+
+        # An idle predecessor, which loses the answer to every move
+        moves = []
+        deadline = time.monotonic() + 6
+        while len(moves) < 2 and time.monotonic() < deadline:
+            mock.sendto(b'\x40' + node(predecessor, predecessor.id) + bytes(12), (self.ip, self.port))
+            for _ in range(20):
+                conn.request('GET', keys[0])
+                conn.getresponse().read()
+            with contextlib.suppress(socket.timeout):
+                data = mock.recv(1024)
+                if data[0] == 0x41:
+                    moves.append(struct.unpack('!H', data[9:11])[0])
+        assert len(moves) == 2, "A move not answered should be asked again"
+        assert moves[0] == moves[1]
+        moved_to = moves[0]
+        assert predecessor.id < moved_to < self.id
+
+        # The heartbeat shows the new ID, the first handover is not taken
+        mock.sendto(b'\x30' + node(predecessor, moved_to), (self.ip, self.port))
+        linger = struct.pack('ii', 1, 0)  # reset, the port is not left in TIME_WAIT
+        first, _ = listener.accept()
+        first.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, linger)
+        first.close()
+
+        handover, _ = listener.accept()
+        handover.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, linger)
+        with contextlib.closing(handover):
+            request = b''
+            while b'\r\n\r\n' not in request:
+                request += handover.recv(65536)
+            head, body = request.split(b'\r\n\r\n', 1)
+            length = int(next(line.split(b':')[1] for line in head.split(b'\r\n') if line.lower().startswith(b'content-length')))
+            while len(body) < length:
+                body += handover.recv(65536)
+            assert head.startswith(b'POST /bulk '), "Keys should be handed over again"
+            payload = b'stored 0\r\nforwarded 0\r\nfailed 0\r\n'
+            handover.sendall(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s' % (len(payload), payload))
+            time.sleep(0.2)
+
+        moved = [key for key in keys if dht.hash(key.encode()) <= moved_to]
+        for key in moved:
+            assert key.encode() in body
+            conn.request('GET', key)
+            response = conn.getresponse()
+            response.read()
+            assert response.status != 200, f"'{key}' should be handed over to the predecessor"
+
+        conn.request('GET', '/metrics')
+        metrics = dict(line.split(' ') for line in conn.getresponse().read().decode().splitlines())
+        assert int(metrics['balance_migrations_total']) == 1
+        assert int(metrics['balance_keys_migrated_total']) >= len(moved)
+
+
+def test_load_balance_handover_newer(static_peer):
+    """Test keys put or deleted at the predecessor after its move are not replaced by the older ones handed over
+    """
+
+    stabilize = {'NO_STABILIZE': '0'}
+    self = dht.Peer(0x4000, '127.0.0.1', 4710)
+    successor = dht.Peer(0xC000, '127.0.0.1', 4711)
+    moved_to = 0x8000
+    candidates = [f'/dynamic/{util.randbytes(8).hex()}' for _ in range(1000)]
+    put, deleted, kept = [key for key in candidates if self.id < dht.hash(key.encode()) <= moved_to][:3]
+
+    def node(peer, id_):
+        return struct.pack('!H4sH', id_, socket.inet_aton(peer.ip), peer.port)
+
+    def record(key, value):
+        return struct.pack('!HI', len(key), len(value)) + key.encode() + value
+
+    handover = b''.join(record(key, b'old') for key in (put, deleted, kept))
+
+    with dht.peer_socket(successor, timeout=0.1) as mock, \
+            static_peer(self, successor, successor, env=stabilize), \
+            contextlib.closing(HTTPConnection(self.ip, self.port, timeout=2)) as conn:
+        # The overloaded successor asks the peer to move over part of its range
+        mock.sendto(b'\x41' + node(successor, successor.id) + struct.pack('!H', moved_to), (self.ip, self.port))
+        answered = False
+        deadline = time.monotonic() + 2
+        while not answered and time.monotonic() < deadline:
+            with contextlib.suppress(socket.timeout):
+                answered = mock.recv(1024)[0] == 0x42
+        assert answered, "Peer should answer the move"
+
+        conn.request('GET', kept)
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 503, "A key not handed over yet should be retried later"
+
+        conn.request('PUT', put, b'new')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 201
+        conn.request('DELETE', deleted)
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 204
+
+        # Handed over twice, as if the answer to the first handover was lost
+        for _ in range(2):
+            conn.request('POST', '/bulk', handover, {'X-Bulk-Handover': '1'})
+            response = conn.getresponse()
+            assert response.status == 200
+            assert b'failed 0' in response.read()
+
+            conn.request('GET', put)
+            response = conn.getresponse()
+            assert response.status == 200
+            assert response.read() == b'new', "A value put after the move should not be replaced"
+
+            conn.request('GET', deleted)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 404, "A key deleted after the move should not come back"
+
+            conn.request('GET', kept)
+            response = conn.getresponse()
+            assert response.status == 200
+            assert response.read() == b'old', "A key not changed after the move should be handed over"
+
+
+def test_retry_after_estimate(static_peer, timeout):
+    """Test the 503 asks clients to retry once a lookup is expected to be answered, from measured round trips
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+    owner = dht.Peer(dht.hash(b'/a'), '127.0.0.1', 4713)
+
+    with dht.peer_socket(successor) as mock, static_peer(self, predecessor, successor), contextlib.closing(
+        HTTPConnection(self.ip, self.port, timeout)
+    ) as conn:
+        conn.request('GET', '/a')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 503
+        assert response.headers.get('Retry-After') == '1'
+        assert response.headers.get('Retry-After-Ms') == '250', "Retry should be estimated by the initial timeout before any measurement"
+
+        lookup = dht.deserialize(mock.recv(1024))
+        mock.sendto(dht.serialize(dht.Message(dht.Flags.reply, lookup.id - 1, owner)), (self.ip, self.port))
+        time.sleep(.1)
+
+        conn.request('GET', '/b')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 503
+        assert response.headers.get('Retry-After') == '1', "Retry-After should be at least one second"
+        assert 1 <= int(response.headers.get('Retry-After-Ms')) < 250, "Retry should be estimated from the measured round trip"
@@ -0,0 +1,197 @@
+#include "timer_wheel.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_RANGE(level) ((uint64_t) 1 << (TIMER_WHEEL_SLOT_BITS * ((level) + 1)))
+#define SLOT_INDEX(ticks, level) (((ticks) >> (TIMER_WHEEL_SLOT_BITS * (level))) & SLOT_MASK)
+
+
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+        perror("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+uint64_t monotonic_us(void) {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+        perror("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static void list_init(struct timer* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+
+static void list_append(struct timer* head, struct timer* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+static void list_unlink(struct timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+
+/**
+ * Link `timer` into the slot matching its expiry, relative to the current tick.
+ */
+static void wheel_insert(struct timer_wheel* wheel, struct timer* timer) {
+    if (timer->expires < wheel->current) {
+        timer->expires = wheel->current;  // overdue, run with the next tick
+    }
+    uint64_t delta = timer->expires - wheel->current;
+
+    size_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= LEVEL_RANGE(level)) {
+        level += 1;
+    }
+    if (delta >= LEVEL_RANGE(TIMER_WHEEL_LEVELS - 1)) {
+        // Clamp to the range of the wheel
+        timer->expires = wheel->current + LEVEL_RANGE(TIMER_WHEEL_LEVELS - 1) - 1;
+    }
+
+    list_append(&wheel->slots[level][SLOT_INDEX(timer->expires, level)], timer);
+}
+
+
+/**
+ * Move all timers of one slot of `level` down into the lower levels.
+ *
+ * Returns the index of the cascaded slot.
+ */
+static size_t cascade(struct timer_wheel* wheel, size_t level) {
+    size_t index = SLOT_INDEX(wheel->current, level);
+    struct timer* head = &wheel->slots[level][index];
+
+    struct timer pending;
+    list_init(&pending);
+    while (head->next != head) {
+        struct timer* timer = head->next;
+        list_unlink(timer);
+        list_append(&pending, timer);
+    }
+    while (pending.next != &pending) {
+        struct timer* timer = pending.next;
+        list_unlink(timer);
+        wheel_insert(wheel, timer);
+    }
+
+    return index;
+}
+
+
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t now_ms) {
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level += 1) {
+        for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot += 1) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->current = 0;
+    wheel->origin_ms = now_ms;
+    wheel->n_active = 0;
+}
+
+
+void timer_schedule(struct timer_wheel* wheel, struct timer* timer, uint64_t delay_ms, timer_callback callback, void* arg) {
+    timer_cancel(timer);
+
+    // Round up, a timer must never fire early. At least one tick ahead: the current slot may be drained right now, a timer
+    // rescheduling itself without delay would run again and again.
+    uint64_t ticks = (delay_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    timer->expires = wheel->current + (ticks > 0 ? ticks : 1);
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->wheel = wheel;
+
+    wheel_insert(wheel, timer);
+    wheel->n_active += 1;
+}
+
+
+void timer_cancel(struct timer* timer) {
+    if (!timer_pending(timer)) {
+        return;
+    }
+    list_unlink(timer);
+    timer->wheel->n_active -= 1;
+    timer->wheel = NULL;
+}
+
+
+bool timer_pending(const struct timer* timer) {
+    return timer->wheel != NULL;
+}
+
+
+void timer_wheel_advance(struct timer_wheel* wheel, uint64_t now_ms) {
+    uint64_t target = (now_ms - wheel->origin_ms) / TIMER_WHEEL_TICK_MS;
+
+    while (wheel->current <= target) {
+        if (wheel->n_active == 0) {
+            // Nothing to run, skip the idle ticks at once
+            wheel->current = target + 1;
+            break;
+        }
+
+        size_t index = SLOT_INDEX(wheel->current, 0);
+        if (index == 0) {
+            // Level 0 wrapped around, pull down the timers of the next slots
+            for (size_t level = 1; level < TIMER_WHEEL_LEVELS && cascade(wheel, level) == 0; level += 1) {
+            }
+        }
+
+        struct timer* head = &wheel->slots[0][index];
+        while (head->next != head) {
+            struct timer* timer = head->next;
+            list_unlink(timer);
+            timer->wheel = NULL;
+            wheel->n_active -= 1;
+
+            timer->callback(timer->arg);
+        }
+
+        wheel->current += 1;
+    }
+}
+
+
+int timer_wheel_timeout(const struct timer_wheel* wheel, uint64_t now_ms) {
+    if (wheel->n_active == 0) {
+        return -1;
+    }
+
+    // First non-empty slot of level 0 before it wraps, otherwise the wrap
+    // itself, as timers of higher levels are cascaded then.
+    uint64_t ticks = TIMER_WHEEL_SLOTS - SLOT_INDEX(wheel->current, 0);
+    for (uint64_t offset = 0; offset < ticks; offset += 1) {
+        const struct timer* head = &wheel->slots[0][SLOT_INDEX(wheel->current + offset, 0)];
+        if (head->next != head) {
+            ticks = offset;
+            break;
+        }
+    }
+
+    uint64_t deadline_ms = wheel->origin_ms + (wheel->current + ticks) * TIMER_WHEEL_TICK_MS;
+    if (deadline_ms <= now_ms) {
+        return 0;
+    }
+    return (int) (deadline_ms - now_ms);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TIMER_WHEEL_TICK_MS 10  // Resolution of the wheel
+#define TIMER_WHEEL_LEVELS 4    // 64^4 ticks ~ 194 days of range at 10ms per tick
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+
+struct timer;
+struct timer_wheel;
+
+typedef void (*timer_callback)(void* arg);
+
+
+/**
+ * A single timer
+ *
+ * Timers are intrusive: the owner embeds them in its own structures, the wheel
+ * only links them into its slots. A timer is pending while `wheel` is set.
+ */
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    struct timer_wheel* wheel;
+    uint64_t expires;  // in ticks
+    timer_callback callback;
+    void* arg;
+};
+
+
+/**
+ * Hierarchical timer wheel
+ *
+ * Level 0 holds timers expiring within the next `TIMER_WHEEL_SLOTS` ticks,
+ * every further level covers `TIMER_WHEEL_SLOTS` times the range of the one
+ * below. Scheduling and cancelling are O(1); timers of a higher level are
+ * cascaded down once the lower level wraps around.
+ *
+ * `current`: next tick to be processed
+ * `origin_ms`: monotonic time of tick zero
+ * `n_active`: number of pending timers
+ */
+struct timer_wheel {
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+    uint64_t current;
+    uint64_t origin_ms;
+    size_t n_active;
+};
+
+
+/**
+ * Current time of the monotonic clock in milliseconds.
+ */
+uint64_t monotonic_ms(void);
+
+/**
+ * Current time of the monotonic clock in microseconds, for measuring short intervals.
+ */
+uint64_t monotonic_us(void);
+
+/**
+ * Initialize an empty wheel starting at `now_ms`.
+ */
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t now_ms);
+
+/**
+ * (Re-)schedule `timer` to call `callback(arg)` after `delay_ms`.
+ *
+ * A timer that is still pending is cancelled first. It expires one tick ahead
+ * at the earliest, even with a delay of zero, so a callback rescheduling its
+ * own timer does not run again within the same `timer_wheel_advance()`.
+ */
+void timer_schedule(struct timer_wheel* wheel, struct timer* timer, uint64_t delay_ms, timer_callback callback, void* arg);
+
+/**
+ * Cancel `timer` if it is pending, no-op otherwise.
+ */
+void timer_cancel(struct timer* timer);
+
+/**
+ * Whether `timer` is scheduled and has not fired yet.
+ */
+bool timer_pending(const struct timer* timer);
+
+/**
+ * Run the callbacks of all timers expired until `now_ms`.
+ *
+ * Callbacks may (re-)schedule or cancel any timer, including their own.
+ */
+void timer_wheel_advance(struct timer_wheel* wheel, uint64_t now_ms);
+
+/**
+ * Milliseconds until the wheel has to be advanced next, suitable as the
+ * timeout of `poll()`. Returns -1 if no timer is pending.
+ */
+int timer_wheel_timeout(const struct timer_wheel* wheel, uint64_t now_ms);
@@ -0,0 +1,205 @@
+#include "upload.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/**
+ * Grow the storage of an upload to hold at least `needed` bytes, no more than its `limit`.
+ *
+ * Capacity is doubled to keep the number of reallocations logarithmic. Returns false if memory is exhausted, or if
+ * `needed` exceeds the limit, setting `exceeded`.
+ */
+static bool reserve(struct upload* upload, size_t needed) {
+    if (needed <= upload->capacity) {
+        return true;
+    }
+    if (needed > upload->limit) {
+        upload->exceeded = true;
+        return false;
+    }
+    size_t capacity = upload->capacity ? upload->capacity : UPLOAD_MIN_CAPACITY;
+    while (capacity < needed) {
+        capacity = capacity > SIZE_MAX / 2 ? needed : capacity * 2;
+    }
+    capacity = capacity < upload->limit ? capacity : upload->limit;
+
+    char* value = realloc(upload->value, capacity);
+    if (!value) {
+        return false;
+    }
+    upload->value = value;
+    upload->capacity = capacity;
+    return true;
+}
+
+
+/**
+ * Parse the hexadecimal size of a chunk size line, ignoring chunk extensions.
+ *
+ * Returns whether a valid size was parsed.
+ */
+static bool parse_chunk_size(const char* line, const char* line_end, size_t* size) {
+    const char* pos = line;
+    *size = 0;
+    while (pos < line_end && isxdigit((unsigned char) *pos)) {
+        if (*size > SIZE_MAX / 16) {
+            return false;  // overflow
+        }
+        int digit = isdigit((unsigned char) *pos) ? *pos - '0' : tolower((unsigned char) *pos) - 'a' + 10;
+        *size = *size * 16 + digit;
+        pos += 1;
+    }
+    return pos != line && (pos == line_end || *pos == ';' || *pos == ' ' || *pos == '\t');
+}
+
+
+bool upload_start_streamed(struct upload* upload, const string key, bool chunked, size_t content_length) {
+    if (!upload_start(upload, key, true, 0, false)) {
+        return false;
+    }
+    upload->chunked = chunked;
+    upload->remaining = chunked ? 0 : content_length;
+    upload->streamed = true;
+    return reserve(upload, UPLOAD_MIN_CAPACITY);
+}
+
+
+bool upload_start(struct upload* upload, const string key, bool chunked, size_t content_length, bool discard) {
+    *upload = (struct upload) {
+        .active = true,
+        .chunked = chunked,
+        .discard = discard,
+        .chunk_state = CHUNK_SIZE,
+        .remaining = chunked ? 0 : content_length,
+        .limit = chunked ? SIZE_MAX : content_length,
+    };
+
+    upload->key = strdup(key);
+    if (!upload->key) {
+        return false;
+    }
+    if (!discard && !chunked) {
+        size_t initial = content_length < UPLOAD_MAX_RESERVE ? content_length : UPLOAD_MAX_RESERVE;
+        upload->value = malloc(initial ? initial : 1);
+        if (!upload->value) {
+            return false;
+        }
+        upload->capacity = initial;
+    }
+    return true;
+}
+
+
+ssize_t upload_feed(struct upload* upload, const char* data, size_t n) {
+    const char* line_separator = "\r\n";
+    const char* end = data + n;
+    const char* pos = data;
+
+    while (pos < end && !upload_done(upload)) {
+        if (!upload->chunked || upload->chunk_state == CHUNK_DATA) {
+            size_t available = end - pos;
+            size_t take = available < upload->remaining ? available : upload->remaining;
+            if (!upload->discard && !reserve(upload, upload->length + take)) {
+                return -1;
+            }
+            if (!upload->discard) {
+                memcpy(upload->value + upload->length, pos, take);
+            }
+            upload_received(upload, take);
+            pos += take;
+            continue;
+        }
+
+        const char* line_end = memstr((char*) pos, end - pos, (string) line_separator);
+        if (!line_end) {
+            if (end - pos > UPLOAD_MAX_LINE) {
+                return -1;
+            }
+            break;  // line not received completely yet
+        }
+
+        size_t chunk_size = 0;
+        switch (upload->chunk_state) {
+        case CHUNK_SIZE:
+            if (!parse_chunk_size(pos, line_end, &chunk_size)) {
+                return -1;
+            }
+            if (chunk_size == 0) {
+                upload->chunk_state = CHUNK_TRAILER;
+            } else {
+                // Storage grows with the data received, a chunk announced is not allocated up front
+                if (!upload->discard && (upload->length > upload->limit || chunk_size > upload->limit - upload->length)) {
+                    upload->exceeded = true;
+                    return -1;
+                }
+                upload->remaining = chunk_size;
+                upload->chunk_state = CHUNK_DATA;
+            }
+            break;
+        case CHUNK_DATA_END:
+            if (line_end != pos) {
+                return -1;  // chunk longer than announced
+            }
+            upload->chunk_state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER:
+            if (line_end == pos) {
+                upload->chunk_state = CHUNK_DONE;
+            }  // trailer fields are ignored
+            break;
+        default:
+            return -1;
+        }
+        pos = line_end + strlen(line_separator);
+    }
+
+    return pos - data;
+}
+
+
+size_t upload_direct_buffer(struct upload* upload, char** target) {
+    if (!upload->active || upload->discard || upload_done(upload)) {
+        return 0;
+    }
+    if (upload->chunked && upload->chunk_state != CHUNK_DATA) {
+        return 0;
+    }
+    if (!upload->streamed && upload->capacity == upload->length) {
+        size_t ahead = upload->remaining < UPLOAD_MAX_RESERVE ? upload->remaining : UPLOAD_MAX_RESERVE;
+        if (!reserve(upload, upload->length + ahead)) {
+            return 0;  // received through `upload_feed()`, which fails then
+        }
+    }
+    // Only the free part of the storage; streamed storage grows through `upload_feed()` if needed
+    *target = upload->value + upload->length;
+    size_t window = upload->capacity - upload->length;
+    return window < upload->remaining ? window : upload->remaining;
+}
+
+
+void upload_received(struct upload* upload, size_t n) {
+    if (!upload->discard) {
+        upload->length += n;
+    }
+    upload->remaining -= n;
+    if (upload->chunked && upload->remaining == 0) {
+        upload->chunk_state = CHUNK_DATA_END;
+    }
+}
+
+
+bool upload_done(const struct upload* upload) {
+    if (!upload->active) {
+        return false;
+    }
+    return upload->chunked ? upload->chunk_state == CHUNK_DONE : upload->remaining == 0;
+}
+
+
+void upload_reset(struct upload* upload) {
+    free(upload->key);
+    free(upload->value);
+    *upload = (struct upload) {0};
+}
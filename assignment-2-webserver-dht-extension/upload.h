@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+#define UPLOAD_MIN_CAPACITY 4096  // initial storage of chunked payloads
+#define UPLOAD_MAX_RESERVE (1024 * 1024)  // storage allocated ahead of the payload received
+#define UPLOAD_MAX_LINE 1024      // longest chunk size or trailer line accepted
+
+
+/**
+ * Position of the decoder within a chunked payload
+ */
+enum chunk_state {
+    CHUNK_SIZE,      // expecting a chunk size line
+    CHUNK_DATA,      // inside the data of a chunk
+    CHUNK_DATA_END,  // expecting the line separator behind the data
+    CHUNK_TRAILER,   // behind the last chunk, expecting trailer fields or the empty line
+    CHUNK_DONE,
+};
+
+
+/**
+ * A request payload streamed into value storage as it arrives
+ *
+ * `key`: copy of the request URI the value is stored under
+ * `value`: storage of the value, `length` of `capacity` bytes are received
+ * `remaining`: bytes missing of the payload, or of the current chunk if chunked
+ * `limit`: the longest payload accepted, or the most bytes held if `streamed`;
+ *          `exceeded` once a chunk or the storage goes beyond it
+ * `discard`: the payload is only read to keep the connection in sync
+ * `streamed`: the payload is consumed by the caller as it arrives, the storage
+ *             only holds what is not consumed yet
+ * `close_after`: the client asked to close the connection after the request
+ * `ttl_ms`: lifetime of the stored value, 0 if it does not expire
+ * `batch`: the payload lists the keys of a batch request instead of a value
+ * `forwarded`: the batch request was forwarded by another node
+ * `repair`: the payload belongs to a repair request, `key` holds its URI
+ * `frame_op`: op of the binary frame carrying the value, 0 for HTTP requests
+ * `frame_id`: id of that frame
+ */
+struct upload {
+    bool active;
+    bool chunked;
+    bool discard;
+    bool streamed;
+    bool close_after;
+    enum chunk_state chunk_state;
+    string key;
+    char* value;
+    size_t length;
+    size_t capacity;
+    size_t remaining;
+    size_t limit;
+    bool exceeded;
+    uint64_t ttl_ms;
+    bool batch;
+    bool forwarded;
+    bool repair;
+    uint8_t frame_op;
+    uint32_t frame_id;
+};
+
+
+/**
+ * Start streaming a payload for `key`.
+ *
+ * Storage grows as the payload arrives, at most `UPLOAD_MAX_RESERVE` bytes
+ * ahead of it, so a large `content_length` announced is not allocated before
+ * it is sent. It never grows beyond `content_length`, the `limit` of chunked
+ * payloads is unbounded unless set by the caller. Returns false if the
+ * storage could not be allocated.
+ */
+bool upload_start(struct upload* upload, const string key, bool chunked, size_t content_length, bool discard);
+
+/**
+ * Start streaming a payload that is consumed as it arrives.
+ *
+ * Like `upload_start()`, but the storage starts small and only grows as far
+ * as received bytes are not consumed. The caller consumes bytes from the
+ * front of `value` and reduces `length` accordingly.
+ */
+bool upload_start_streamed(struct upload* upload, const string key, bool chunked, size_t content_length);
+
+/**
+ * Feed received bytes to the upload.
+ *
+ * Returns the number of bytes consumed, which is less than `n` only once the
+ * payload is complete or a chunk size line is incomplete. Returns -1 on
+ * malformed chunked encoding, if a chunk exceeds the `limit` of the upload,
+ * or if storage could not be allocated.
+ */
+ssize_t upload_feed(struct upload* upload, const char* data, size_t n);
+
+/**
+ * Get the storage payload bytes can be received into directly.
+ *
+ * Returns the number of bytes that may be written to `target`, or zero if the
+ * next bytes are not value data and must be passed to `upload_feed()`.
+ */
+size_t upload_direct_buffer(struct upload* upload, char** target);
+
+/**
+ * Account for `n` bytes of value data written to the storage.
+ */
+void upload_received(struct upload* upload, size_t n);
+
+/**
+ * Whether the complete payload has been received.
+ */
+bool upload_done(const struct upload* upload);
+
+/**
+ * Release the key and all storage not taken over, and deactivate the upload.
+ */
+void upload_reset(struct upload* upload);
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 
 char* memstr(char* haystack, size_t n, string needle) {
@@ -11,9 +12,13 @@ char* memstr(char* haystack, size_t n, string needle) {
 
     // Iterate through the memory (haystack)
     while ((haystack = memchr(haystack, needle[0], end - haystack)) != NULL) {
+        if ((size_t) (end - haystack) < strlen(needle)) {
+            break;  // needle would exceed the haystack
+        }
         if (strncmp(haystack, needle, strlen(needle)) == 0) {
             return haystack;
         }
+        haystack += 1;
     }
 
     return NULL;
@@ -30,3 +35,33 @@ uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int bas
     }
     return result;
 }
+
+
+bool send_iov(int sock, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr message = {
+            .msg_iov = iov,
+            .msg_iovlen = iovcnt,
+        };
+        ssize_t sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        // Skip what has been sent completely, and the sent part of the next buffer
+        while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 
 typedef char* string; // differentiate null-terminated C-string from bytes
@@ -18,3 +20,12 @@ char* memstr(char* haystack, size_t n, string needle);
  * In that case, the given message will be printed before exiting the program.
  */
 uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr, int base, const string message);
+
+/**
+ * Send all buffers of `iov` over a connected socket.
+ *
+ * Partial sends are continued until everything is sent. Modifies `iov`.
+ * Returns false if the connection failed.
+ */
+bool send_iov(int sock, struct iovec* iov, int iovcnt);
+
@@ -1,5 +1,8 @@
 
+#include <unistd.h>
+
 #include "node.h"
+#include "restart.h"
 #include "sockets_setup.h"
 #include "chord_processor.h"
 
@@ -17,6 +20,9 @@
 *
 *  Call as with CHORD DHT Node functionality:
 *  ./build/webserver self.ip self.port self.nodeid
+*
+*  With HOT_RESTART_SOCKET=path, a node started with the same path takes over the sockets, the place on the ring and
+*  the store of the node running there, which exits once it is drained.
 */
 int main(int argc, char** argv) {
     if (argc < 3) {
@@ -28,11 +34,23 @@ int main(int argc, char** argv) {
     // derive server socket addresses
     struct sockaddr_in addr = derive_sockaddr(argv[1], argv[2]);
 
-    // Set up a TCP socket.
-    int stream_socket = setup_stream_socket(addr);
+    // Take over the sockets of the node running before a hot restart, if any
+    int stream_socket, datagram_socket;
+    struct NetworkNodes adopted;
+    const char* restart_path = getenv("HOT_RESTART_SOCKET");
+    int restart_conn = restart_path ? restart_connect(restart_path) : -1;
+    if (restart_conn != -1 && !restart_adopt(restart_conn, &stream_socket, &datagram_socket, &adopted)) {
+        close(restart_conn);
+        restart_conn = -1;
+    }
 
-    // Set up an UDP socket:
-    int datagram_socket = setup_datagram_socket(addr);
+    if (restart_conn == -1) {
+        // Set up a TCP socket.
+        stream_socket = setup_stream_socket(addr);
+
+        // Set up an UDP socket:
+        datagram_socket = setup_datagram_socket(addr);
+    }
 
     //Check, if simple webserver must be started
     if (argc == 3){
@@ -41,14 +59,16 @@ int main(int argc, char** argv) {
         node_data.self_id = 0;
         memset(&node_data.succ, 0, sizeof(node_data.succ));
         memset(&node_data.pred, 0, sizeof(node_data.pred));
-        
-        //Start chord_processor
-        chord_processor(addr, stream_socket, datagram_socket, node_data);
+    } else {
+        node_data = derive_nodes_data(argv[3]);
+    }
+    // The restarted node may have moved on the ring since it was started
+    if (restart_conn != -1) {
+        node_data = adopted;
     }
-   
+
     //Start chord server
-    node_data = derive_nodes_data(argv[3]);
-    chord_processor(addr, stream_socket, datagram_socket, node_data);
+    chord_processor(addr, stream_socket, datagram_socket, node_data, restart_conn);
     
     return EXIT_SUCCESS;
 }